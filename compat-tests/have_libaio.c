@@ -0,0 +1,13 @@
+#include <libaio.h>
+
+int main(void)
+{
+	io_context_t ctx = 0;
+	struct iocb iocb;
+
+	io_prep_preadv(&iocb, 0, NULL, 0, 0);
+	io_set_eventfd(&iocb, 0);
+	io_setup(1, &ctx);
+
+	return 0;
+}
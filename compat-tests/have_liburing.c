@@ -0,0 +1,10 @@
+#include <liburing.h>
+
+int main(void)
+{
+	struct io_uring_sqe sqe;
+
+	io_uring_prep_poll_multishot(&sqe, 0, 0);
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+#include <lz4.h>
+
+int main(void)
+{
+	char state[LZ4_STREAMSIZE];
+
+	return LZ4_compress_fast_extState(state, "", state, 0, 0, 1);
+}
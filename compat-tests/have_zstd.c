@@ -0,0 +1,10 @@
+#include <zstd.h>
+
+int main(void)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+	ZSTD_freeCCtx(cctx);
+
+	return 0;
+}
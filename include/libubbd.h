@@ -38,6 +38,7 @@ enum ubbd_dev_type {
 	UBBD_DEV_TYPE_CACHE,
 	UBBD_DEV_TYPE_S3,
 	UBBD_DEV_TYPE_MEM,
+	UBBD_DEV_TYPE_ZRAM,
 	UBBD_DEV_TYPE_MAX,
 };
 
@@ -58,6 +59,7 @@ struct __ubbd_dev_info {
 	union {
 		struct {
 			char path[UBBD_PATH_MAX];
+			uint32_t io_engine;
 		} file;
 		struct {
 			uint64_t  flags;
@@ -86,10 +88,100 @@ struct __ubbd_dev_info {
 			char bucket_name[UBBD_NAME_MAX];
 		} s3;
 		struct {
+			uint32_t block_size;
+			/* MiB of memory of blocks, 0 is no limit */
+			uint32_t limit_mb;
+			uint32_t backing;
+			/* node of memory of shm and hugetlb backing, -1 for any */
+			int32_t numa_node;
+			/* set at map, a new device never sees shm of a removed one */
+			uint64_t shm_id;
 		} mem;
+		struct {
+			uint32_t comp;
+		} zram;
 	};
 };
 
+enum ubbd_file_io_engine {
+	UBBD_FILE_IO_ENGINE_IO_URING = 0,	/* io_uring of queue if it has one, sync otherwise */
+	UBBD_FILE_IO_ENGINE_SYNC,		/* preadv() and pwritev() */
+	UBBD_FILE_IO_ENGINE_LIBAIO,		/* linux aio reaped by queue thread */
+};
+
+enum ubbd_mem_backing {
+	UBBD_MEM_BACKING_HEAP = 0,	/* a calloc() for each block */
+	UBBD_MEM_BACKING_SHM,		/* file in /dev/shm, kept over backend restart */
+	UBBD_MEM_BACKING_HUGETLB,	/* memfd of 2MiB huge pages */
+};
+
+enum ubbd_zram_comp {
+	UBBD_ZRAM_COMP_LZ4 = 0,
+	UBBD_ZRAM_COMP_ZSTD,
+};
+
+enum ubbd_poll_mode {
+	UBBD_POLL_MODE_INTERRUPT = 0,	/* sleep in poll() on uio fd when ring is empty */
+	UBBD_POLL_MODE_BUSY,		/* keep spinning on cmd_head, never sleep */
+	UBBD_POLL_MODE_HYBRID,		/* spin for poll_spin_us, then sleep */
+};
+
+enum ubbd_queue_engine {
+	UBBD_QUEUE_ENGINE_POLL = 0,	/* poll(), read() and write() on uio fd */
+	UBBD_QUEUE_ENGINE_IO_URING,	/* multishot poll and doorbell on a per-queue io_uring */
+};
+
+enum ubbd_steal_policy {
+	UBBD_STEAL_POLICY_NONE = 0,	/* each queue dispatches its own requests */
+	UBBD_STEAL_POLICY_IDLE,		/* queues with nothing to do dispatch requests of siblings */
+	UBBD_STEAL_POLICY_ALWAYS,	/* queues also help siblings after each pass over own ring */
+};
+
+enum ubbd_qos_limit {
+	UBBD_QOS_IOPS = 0,
+	UBBD_QOS_BPS,
+	UBBD_QOS_READ_IOPS,
+	UBBD_QOS_READ_BPS,
+	UBBD_QOS_WRITE_IOPS,
+	UBBD_QOS_WRITE_BPS,
+	UBBD_QOS_MAX,
+};
+
+struct ubbd_qos_opts {
+	/* per second, 0 means no limit */
+	uint64_t limits[UBBD_QOS_MAX];
+	/* tokens can be saved up for burst_ms of each limit */
+	uint32_t burst_ms;
+};
+
+struct ubbd_queue_opts {
+	int poll_mode;
+	uint32_t poll_spin_us;
+	/* completions are published with one doorbell per batch */
+	uint32_t ce_batch;
+	uint32_t ce_batch_us;
+	/* worker pool for blocking backends, 0 means ios run in queue thread */
+	uint32_t worker_threads;
+	char worker_cpus[UBBD_NAME_MAX];
+	/* max size of a backend io merged from contiguous requests, 0 disables merge */
+	uint32_t merge_max_kb;
+	int engine;
+	/* queues of the device dispatch requests of each other */
+	int steal_policy;
+	/* memory of the read cache in backend, 0 disables it */
+	uint32_t read_cache_mb;
+	/* memory of the write-back buffer in backend, 0 disables it */
+	uint32_t write_back_mb;
+	/* max age of buffered data before destage, 0 is default */
+	uint32_t write_back_age_ms;
+	/* journal of buffered writes, empty for none */
+	char write_back_journal[UBBD_PATH_MAX];
+	/* zero blocks of writes go to backend as write-zeros */
+	bool zero_detect;
+	/* limits of the whole device, shared by all queues */
+	struct ubbd_qos_opts qos;
+};
+
 struct ubbd_dev_info {
 	enum ubbd_dev_type type;
 	uint32_t num_queues;
@@ -105,16 +197,106 @@ struct ubbd_dev_info {
 			struct __ubbd_dev_info cache_info;
 		} cache_dev;
 	};
+	struct ubbd_queue_opts queue_opts;
 };
 
-struct ubbd_req_stats {
+/* in the order of enum ubbd_backend_io_type */
+enum ubbd_req_stats_op {
+	UBBD_REQ_STATS_OP_WRITE = 0,
+	UBBD_REQ_STATS_OP_READ,
+	UBBD_REQ_STATS_OP_FLUSH,
+	UBBD_REQ_STATS_OP_DISCARD,
+	UBBD_REQ_STATS_OP_WRITE_ZEROS,
+	UBBD_REQ_STATS_OP_MAX,
+};
+
+/* latency in ns from request picked up from cmd ring to its ce published */
+struct ubbd_req_lat_stats {
 	uint64_t reqs;
-	uint64_t handle_time;
+	uint64_t total_ns;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+struct ubbd_req_stats {
+	struct ubbd_req_lat_stats lat[UBBD_REQ_STATS_OP_MAX];
+
+	/* polling stats, poll_spin_time is the cpu time burned in spinning */
+	uint64_t poll_spin_time;
+	uint64_t poll_spin_hits;
+	uint64_t poll_sleeps;
+
+	/* completion stats, ce_batched / ce_batches is the average batch size */
+	uint64_t ce_batches;
+	uint64_t ce_batched;
+
+	/* times queue ran out of compr ring credits, and the time waited */
+	uint64_t ce_ring_full;
+	uint64_t ce_ring_full_time;
+
+	/* requests allocated from heap as request pool is empty */
+	uint64_t req_pool_miss;
+
+	/* calls of backend submit_batch and ios submitted by them */
+	uint64_t submit_batches;
+	uint64_t submit_batched;
+
+	/* backend ios merged from more than one request, and those requests */
+	uint64_t merged_ios;
+	uint64_t merged_reqs;
+
+	/* times queue was throttled by qos limits, and the time throttled */
+	uint64_t qos_throttled;
+	uint64_t qos_throttle_time;
+
+	/* time queue thread spent handling requests and sleeping for new ones */
+	uint64_t busy_time;
+	uint64_t idle_time;
+	/* ios of sibling queues dispatched by this queue */
+	uint64_t stolen_ios;
+
+	/* ios split to fit in backend limits, and the child ios of them */
+	uint64_t split_ios;
+	uint64_t split_children;
+
+	/* block aligned reads served by read cache, and those missed it */
+	uint64_t rcache_hits;
+	uint64_t rcache_misses;
+
+	/* writes completed in write-back buffer, those waited for room, and reads served by it */
+	uint64_t wbuf_writes;
+	uint64_t wbuf_throttled;
+	uint64_t wbuf_read_hits;
+
+	/* writes with zero blocks sent as write-zeros, and bytes of those blocks */
+	uint64_t zero_writes;
+	uint64_t zero_bytes;
+};
+
+/* runtime stats of backend, valid if backend reports them */
+struct ubbd_backend_stats {
+	bool valid;
+	union {
+		struct {
+			uint64_t nr_blocks;
+			uint64_t resident_bytes;
+		} mem;
+		struct {
+			uint64_t compr_pages;
+			uint64_t huge_pages;
+			uint64_t same_pages;
+			uint64_t orig_bytes;
+			uint64_t compr_bytes;
+			uint64_t mem_used;
+		} zram;
+	};
 };
 
 struct ubbdd_mgmt_rsp_dev_info {
 	int devid;
 	struct ubbd_dev_info dev_info;
+	struct ubbd_backend_stats backend_stats;
 };
 
 struct ubbdd_mgmt_rsp {
@@ -128,9 +310,10 @@ struct ubbdd_mgmt_rsp {
 			int dev_num;
 			int dev_list[UBBD_DEV_MAX];
 		} list;
+		/* stats of one queue, num_queues tells the caller how many to ask for */
 		struct {
 			int num_queues;
-			struct ubbd_req_stats req_stats[UBBD_QUEUE_MAX];
+			struct ubbd_req_stats req_stats;
 		} req_stats;
 		struct ubbdd_mgmt_rsp_dev_info dev_info;
 	};
@@ -143,6 +326,7 @@ struct __ubbd_map_opts {
 	union {
 		struct {
 			const char *filepath;
+			const char *io_engine;
 		} file;
 		struct {
 			const char *pool;
@@ -172,7 +356,14 @@ struct __ubbd_map_opts {
 			const char *bucket_name;
 		} s3;
 		struct {
+			uint32_t block_size;
+			uint32_t limit_mb;
+			const char *backing;
+			const char *numa_node;
 		} mem;
+		struct {
+			const char *comp;
+		} zram;
 
 	};
 };
@@ -182,6 +373,21 @@ struct ubbd_map_options {
 	int num_queues;
 	uint32_t dev_share_memory_size;
 	bool read_only;
+	const char *poll_mode;
+	uint32_t poll_spin_us;
+	uint32_t ce_batch;
+	uint32_t ce_batch_us;
+	uint32_t worker_threads;
+	const char *worker_cpus;
+	uint32_t merge_max_kb;
+	const char *queue_engine;
+	const char *steal_policy;
+	uint32_t read_cache_mb;
+	uint32_t write_back_mb;
+	uint32_t write_back_age_ms;
+	const char *write_back_journal;
+	bool zero_detect;
+	struct ubbd_qos_opts qos;
 	union {
 		struct {
 			struct __ubbd_map_opts opts;
@@ -217,6 +423,7 @@ struct ubbd_list_options {
 
 struct ubbd_req_stats_options {
 	int ubbdid;
+	int queue_id;
 };
 
 struct ubbd_req_stats_reset_options {
@@ -227,7 +434,22 @@ struct ubbd_info_options {
 	int ubbdid;
 };
 
+struct ubbd_set_qos_options {
+	int ubbdid;
+	struct ubbd_qos_opts qos;
+};
+
 const char* ubbd_cache_mode_to_str(int cache_mode);
+const char* ubbd_poll_mode_to_str(int poll_mode);
+const char* ubbd_queue_engine_to_str(int engine);
+int str_to_file_io_engine(const char *str);
+const char* ubbd_file_io_engine_to_str(int io_engine);
+int str_to_mem_backing(const char *str);
+const char* ubbd_mem_backing_to_str(int backing);
+int str_to_zram_comp(const char *str);
+const char* ubbd_zram_comp_to_str(int comp);
+const char* ubbd_steal_policy_to_str(int steal_policy);
+const char* ubbd_req_stats_op_to_str(int op);
 
 int ubbd_map(struct ubbd_map_options *opts, struct ubbdd_mgmt_rsp *rsp);
 int ubbd_unmap(struct ubbd_unmap_options *opts, struct ubbdd_mgmt_rsp *rsp);
@@ -237,4 +459,5 @@ int ubbd_req_stats(struct ubbd_req_stats_options *opts, struct ubbdd_mgmt_rsp *r
 int ubbd_req_stats_reset(struct ubbd_req_stats_reset_options *opts, struct ubbdd_mgmt_rsp *rsp);
 int ubbd_device_restart(struct ubbd_dev_restart_options *opts, struct ubbdd_mgmt_rsp *rsp);
 int ubbd_device_info(struct ubbd_info_options *opts, struct ubbdd_mgmt_rsp *rsp);
+int ubbd_set_qos(struct ubbd_set_qos_options *opts, struct ubbdd_mgmt_rsp *rsp);
 #endif /*LIBUBBD_H*/
@@ -6,6 +6,15 @@
 #include "ubbd_queue.h"
 #include "ubbd_config.h"
 #include "ubbd_rbd.h"
+#include "ubbd_worker.h"
+#include "ubbd_qos.h"
+#include "ubbd_flush.h"
+#include "ubbd_split.h"
+#include "ubbd_rcache.h"
+#include "ubbd_wbuf.h"
+#include "ubbd_zero.h"
+#include "ubbd_blkmap.h"
+#include "ubbd_zram.h"
 
 #include "libubbd.h"
 
@@ -19,6 +28,9 @@ enum ubbd_backend_io_type {
 
 struct ubbd_backend_io {
 	struct context *ctx;
+	struct list_head node;
+	/* completion of io submitted by backend to io_uring of queue */
+	struct ubbd_uring_cb uring_cb;
 	enum ubbd_backend_io_type io_type;
 	uint64_t offset;
 	uint32_t len;
@@ -51,6 +63,16 @@ struct ubbd_backend_ops {
 	int (*flush) (struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
 	int (*discard) (struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
 	int (*write_zeros) (struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
+	/* optional, fill runtime stats for ubbdadm info */
+	int (*get_stats) (struct ubbd_backend *ubbd_b, struct ubbd_backend_stats *stats);
+	/*
+	 * optional, submit nr ios in one call, return the number of ios taken
+	 * from the head of ios, the rest go to the per-op callbacks. Flushes
+	 * never come here, they are sent to flush by the write epoch tracker.
+	 */
+	int (*submit_batch) (struct ubbd_backend *ubbd_b, struct ubbd_backend_io **ios, int nr);
+	/* ops block the caller until io done, run them in worker pool */
+	bool blocking;
 };
 
 enum ubbd_backend_status {
@@ -71,6 +93,30 @@ struct ubbd_backend {
 	int				status;
 	struct ubbd_backend_ops		*backend_ops;
 	uint64_t			dev_size;
+
+	/* NULL if worker pool is disabled or backend is not blocking */
+	struct ubbd_worker_pool		*workers;
+
+	/* qos limits of the device, enforced by queues before handle_cmd() */
+	struct ubbd_qos			qos;
+
+	/* flush of all queues, see ubbd_backend_flush_start() */
+	struct ubbd_flush_tracker	flush;
+	/* runs backend flush of blocking backend without worker pool */
+	struct ubbd_worker_pool		*flush_worker;
+
+	/* set by backend before start, ios not fitting in are split */
+	struct ubbd_io_limits		limits;
+
+	/* NULL if read cache is disabled, used by queues only */
+	struct ubbd_rcache		*rcache;
+
+	/* NULL if write-back is disabled, destaged by destage_thread */
+	struct ubbd_wbuf		*wbuf;
+	pthread_t			destage_thread;
+
+	/* zero blocks of writes go to backend as write-zeros, 0 if disabled */
+	uint32_t			zero_block;
 };
 
 struct ubbd_null_backend {
@@ -79,12 +125,40 @@ struct ubbd_null_backend {
 
 struct ubbd_mem_backend {
 	struct ubbd_backend ubbd_b;
+	uint32_t block_size;
+	uint32_t block_shift;
+	struct ubbd_blkmap map;
+	/* blocks allocated, and the most allowed by limit_mb */
+	uint64_t nr_blocks;
+	uint64_t max_blocks;
+	uint32_t backing;
+	int32_t numa_node;
+	uint64_t shm_id;
+	/* shm and hugetlb backing, block n is at base + n * block_size of fd */
+	int fd;
+	char *base;
+	uint64_t map_size;
+};
+
+struct ubbd_zram_backend {
+	struct ubbd_backend ubbd_b;
+	uint32_t comp;
+	struct ubbd_zram zram;
+	/* compression context of each thread doing io, freed at release */
+	pthread_key_t ctx_key;
+	pthread_mutex_t ctx_lock;
+	struct list_head ctx_list;
 };
 
 struct ubbd_file_backend {
 	struct ubbd_backend ubbd_b;
 	char filepath[UBBD_PATH_MAX];
 	int fd;
+	uint32_t io_engine;
+	/* aio context of each queue thread, see file_aio_ctx_get() */
+	pthread_key_t aio_key;
+	pthread_mutex_t aio_lock;
+	struct list_head aio_list;
 };
 
 struct ubbd_rbd_backend {
@@ -119,12 +193,47 @@ struct ubbd_s3_backend {
 	char bucket_name[UBBD_NAME_MAX];
 };
 
+/*
+ * backend module
+ *
+ * Backends without extra dependencies are built in libubbd-backend,
+ * the others are built as ubbd-backend-<name>.so and dlopen()ed when a
+ * device of that type is created, so a backend process only maps the
+ * libraries of the backend it runs. A module exports its descriptor as
+ * <name>_backend_module.
+ */
+#define UBBD_BACKEND_MODULE_VERSION	1
+#define UBBD_BACKEND_MODULE_DIR		"/usr/lib/ubbd/backends"
+/* overrides UBBD_BACKEND_MODULE_DIR, for running from the source tree */
+#define UBBD_BACKEND_MODULE_DIR_ENV	"UBBD_BACKEND_MODULE_DIR"
+
+struct ubbd_backend_module {
+	uint32_t			version;
+	const char			*name;
+	enum ubbd_dev_type		dev_type;
+	struct ubbd_backend_ops		*ops;
+	/* optional, create backend from the whole conf instead of ops->create */
+	struct ubbd_backend* (*create_conf) (struct ubbd_backend_conf *conf);
+};
+
+struct ubbd_backend *backend_create(struct __ubbd_dev_info *info);
 struct ubbd_backend *ubbd_backend_create(struct ubbd_backend_conf *backend_conf);
 void ubbd_backend_release(struct ubbd_backend *ubbd_b);
+int ubbd_backend_dispatch_io(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
+void ubbd_backend_submit_io(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
+bool ubbd_backend_io_need_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io);
+int ubbd_backend_io_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io,
+		struct list_head *children);
+int ubbd_backend_io_zero_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io,
+		uint32_t block, bool split_mixed, struct list_head *children,
+		uint64_t *zero_bytes);
 int ubbd_backend_start(struct ubbd_backend *ubbd_b, bool start_queues);
 void ubbd_backend_stop(struct ubbd_backend *ubbd_b);
 int ubbd_backend_open(struct ubbd_backend *ubbd_b);
 int ubbd_backend_set_opts(struct ubbd_backend *ubbd_b, struct ubbd_backend_opts *opts);
+int ubbd_backend_set_qos(struct ubbd_backend *ubbd_b, struct ubbd_qos_opts *opts);
+int ubbd_backend_get_stats(struct ubbd_backend *ubbd_b, struct ubbd_backend_stats *stats);
+void ubbd_backend_flush_start(struct ubbd_backend *ubbd_b);
 void ubbd_backend_close(struct ubbd_backend *ubbd_b);
 void ubbd_backend_wait_stopped(struct ubbd_backend *ubbd_b);
 int ubbd_backend_stop_queue(struct ubbd_backend *ubbd_b, int queue_id);
@@ -27,6 +27,8 @@ enum ubbd_backend_mgmt_cmd {
 	UBBD_BACKEND_MGMT_CMD_REQ_STATS,
 	UBBD_BACKEND_MGMT_CMD_REQ_STATS_RESET,
 	UBBD_BACKEND_MGMT_CMD_SET_OPTS,
+	UBBD_BACKEND_MGMT_CMD_SET_QOS,
+	UBBD_BACKEND_MGMT_CMD_GET_STATS,
 };
 
 struct ubbd_backend_mgmt_request {
@@ -43,7 +45,11 @@ struct ubbd_backend_mgmt_request {
 		struct {
 			int queue_id;
 		} get_queue_status;
+		struct {
+			int queue_id;
+		} req_stats;
 		struct ubbd_backend_opts set_opts;
+		struct ubbd_qos_opts set_qos;
 	} u;
 };
 
@@ -57,10 +63,12 @@ struct ubbd_backend_mgmt_rsp {
 		struct {
 			int status;
 		} get_queue_status;
+		/* stats of one queue, num_queues tells the caller how many to ask for */
 		struct {
 			int num_queues;
-			struct ubbd_req_stats req_stats[UBBD_QUEUE_MAX];
+			struct ubbd_req_stats req_stats;
 		} req_stats;
+		struct ubbd_backend_stats get_stats;
 	} u;
 };
 
@@ -0,0 +1,58 @@
+#ifndef UBBD_BLKMAP_H
+#define UBBD_BLKMAP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Sparse block map
+ *
+ * Maps block number of a device to an entry, e.g. the memory of a block
+ * in mem backend. Two levels: a directory allocated at init points to
+ * leaves of UBBD_BLKMAP_LEAF_SIZE entries, allocated when the first
+ * entry in them is inserted. Entries and leaves are published by atomic
+ * stores, so lookup of an existing entry takes no lock. Insertion and
+ * removal of an entry are serialized by the lock of its shard, so
+ * writers of different blocks do not contend.
+ *
+ * If entries are removed, users look them up and use them between
+ * ubbd_blkmap_read_lock() and ubbd_blkmap_read_unlock(), and a removed
+ * entry is freed after ubbd_blkmap_synchronize(), which waits for the
+ * readers that may still see it. Readers only bump a counter of their
+ * thread slot, and never wait.
+ */
+#define UBBD_BLKMAP_LEAF_SHIFT		10
+#define UBBD_BLKMAP_LEAF_SIZE		(1 << UBBD_BLKMAP_LEAF_SHIFT)
+#define UBBD_BLKMAP_SHARDS		64
+#define UBBD_BLKMAP_READER_SLOTS	16
+
+/* readers in each phase, a cache line for each slot */
+struct ubbd_blkmap_readers {
+	uint64_t		nr[2];
+} __attribute__((aligned(64)));
+
+struct ubbd_blkmap {
+	uint64_t		nr_blocks;
+	uint64_t		nr_leaves;
+	void			***leaves;
+	pthread_mutex_t		locks[UBBD_BLKMAP_SHARDS];
+	/* new readers go to phase, synchronize flips it and waits for the old */
+	uint32_t		phase;
+	pthread_mutex_t		sync_lock;
+	struct ubbd_blkmap_readers	readers[UBBD_BLKMAP_READER_SLOTS];
+};
+
+typedef void *(*ubbd_blkmap_alloc_fn)(void *arg);
+typedef void (*ubbd_blkmap_free_fn)(void *entry, void *arg);
+
+int ubbd_blkmap_init(struct ubbd_blkmap *map, uint64_t nr_blocks);
+void ubbd_blkmap_exit(struct ubbd_blkmap *map, ubbd_blkmap_free_fn free_fn, void *arg);
+void *ubbd_blkmap_lookup(struct ubbd_blkmap *map, uint64_t blk);
+void *ubbd_blkmap_get(struct ubbd_blkmap *map, uint64_t blk,
+		ubbd_blkmap_alloc_fn alloc_fn, void *arg);
+void *ubbd_blkmap_remove(struct ubbd_blkmap *map, uint64_t blk);
+void **ubbd_blkmap_slot(struct ubbd_blkmap *map, uint64_t blk, bool alloc);
+int ubbd_blkmap_read_lock(struct ubbd_blkmap *map);
+void ubbd_blkmap_read_unlock(struct ubbd_blkmap *map, int token);
+void ubbd_blkmap_synchronize(struct ubbd_blkmap *map);
+#endif /* UBBD_BLKMAP_H */
@@ -6,6 +6,13 @@
 
 #define UBBD_CONFIG_MAGIC	0x9a6c65b05efaULL
 
+/*
+ * Version of conf layout, older confs are migrated when they are read.
+ * 0: struct ubbd_dev_info without queue_opts
+ * 1: queue_opts appended to struct ubbd_dev_info
+ */
+#define UBBD_CONF_VERSION	1
+
 struct ubbd_conf_header {
 	__u64		magic;
 	__u32		version;
@@ -47,7 +54,7 @@ struct ubbd_backend_conf {
 static inline void ubbd_conf_header_init(struct ubbd_conf_header *header, int conf_type)
 {
 	header->magic = UBBD_CONFIG_MAGIC;
-	header->version = 0;
+	header->version = UBBD_CONF_VERSION;
 	header->conf_type = conf_type;
 }
 
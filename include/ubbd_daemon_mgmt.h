@@ -18,6 +18,7 @@ enum ubbdd_mgmt_cmd {
 	UBBDD_MGMT_CMD_REQ_STATS_RESET,
 	UBBDD_MGMT_CMD_DEV_RESTART,
 	UBBDD_MGMT_CMD_DEV_INFO,
+	UBBDD_MGMT_CMD_SET_QOS,
 };
 
 struct ubbdd_mgmt_request_header {
@@ -46,6 +47,7 @@ struct ubbdd_mgmt_request {
 		} list;
 		struct {
 			int dev_id;
+			int queue_id;
 		} req_stats;
 		struct {
 			int dev_id;
@@ -57,6 +59,10 @@ struct ubbdd_mgmt_request {
 		struct {
 			int dev_id;
 		} dev_info;
+		struct {
+			int dev_id;
+			struct ubbd_qos_opts qos;
+		} set_qos;
 	} u;
 };
 
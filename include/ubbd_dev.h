@@ -16,10 +16,14 @@
 #define UBBD_DEV_RESTART_MODE_DEV	1
 #define UBBD_DEV_RESTART_MODE_QUEUE	2
 
+/* default and range of mem backend block, power of 2 */
 #define	UBBD_MEM_BLK_SIZE	(1024 * 1024)
-#define	UBBD_MEM_BLK_SHIFT	20
-#define	UBBD_MEM_BLK_MASK	0xFFFFF
-#define	UBBD_MEM_BLK_COUNT	(100 * 1024)
+#define	UBBD_MEM_BLK_SIZE_MIN	4096
+#define	UBBD_MEM_BLK_SIZE_MAX	(2 * 1024 * 1024)
+/* block size of hugetlb backing */
+#define	UBBD_MEM_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define	UBBD_MEM_NUMA_NODE_MAX	1024
+#define	UBBD_MEM_SHM_DIR	"/dev/shm/"
 
 #define UBBD_DEV_LINK_DIR	"/dev/ubbd/"
 
@@ -106,6 +110,12 @@ struct ubbd_null_device {
 
 struct ubbd_mem_device {
 	struct ubbd_device ubbd_dev;
+	uint32_t backing;
+	uint64_t shm_id;
+};
+
+struct ubbd_zram_device {
+	struct ubbd_device ubbd_dev;
 };
 
 struct ubbd_ssh_device {
@@ -137,6 +147,7 @@ int ubbd_dev_restart(struct ubbd_device *ubbd_dev, int restart_mode);
 int ubbd_dev_add(struct ubbd_device *ubbd_dev, struct context *ctx);
 int ubbd_dev_remove(struct ubbd_device *ubbd_dev, bool force, bool detach, struct context *ctx);
 int ubbd_dev_config(struct ubbd_device *ubbd_dev, int data_pages_reserve_percnt, struct context *ctx);
+int ubbd_dev_set_qos(struct ubbd_device *ubbd_dev, struct ubbd_qos_opts *qos);
 
 struct ubbd_nl_dev_status;
 int ubbd_dev_init_from_dev_status(struct ubbd_device *ubbd_dev, struct ubbd_nl_dev_status *dev_status);
@@ -147,4 +158,6 @@ void ubbd_dev_release(struct ubbd_device *ubbd_dev);
 int ubbd_dev_checker_start_thread();
 void ubbd_dev_checker_stop_thread(void);
 int ubbd_dev_checker_wait_thread(void);
+char *get_mem_shm_path(int dev_id, uint64_t shm_id);
+
 #endif	/* UBBD_DEV_H */
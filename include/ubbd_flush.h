@@ -0,0 +1,55 @@
+#ifndef UBBD_FLUSH_H
+#define UBBD_FLUSH_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "list.h"
+
+/*
+ * Write epoch tracker for flush
+ *
+ * A flush only has to persist writes completed before it arrived. Every
+ * completed write bumps write_seq, a flush arriving at write_seq S is
+ * done once a backend flush started at or after S finishes. So a flush
+ * with no new writes since the last finished backend flush is done at
+ * once, and flushes arriving during a backend flush wait for one more
+ * backend flush covering all of them. Reads and writes never wait for
+ * flush.
+ *
+ * write_seq starts at 1, writes before backend started are unknown, the
+ * first flush always goes to backend.
+ */
+struct ubbd_flush_req {
+	struct list_head	node;
+	uint64_t		seq;
+	void			(*done) (struct ubbd_flush_req *req, int ret);
+};
+
+struct ubbd_flush_tracker {
+	pthread_mutex_t		lock;
+	uint64_t		write_seq;	/* writes completed, lock-free */
+	uint64_t		stable_seq;	/* writes persisted by backend */
+	uint64_t		flushing_seq;	/* writes covered by backend flush in flight */
+	bool			flushing;
+	struct list_head	waiters;
+};
+
+enum ubbd_flush_action {
+	UBBD_FLUSH_DONE = 0,	/* already persisted, complete req now */
+	UBBD_FLUSH_WAIT,	/* req will be done by ubbd_flush_end() */
+	UBBD_FLUSH_ISSUE,	/* caller issues a backend flush, then calls ubbd_flush_end() */
+};
+
+static inline void ubbd_flush_write_done(struct ubbd_flush_tracker *tracker)
+{
+	/* ordered before the ce of write is published */
+	__atomic_fetch_add(&tracker->write_seq, 1, __ATOMIC_RELEASE);
+}
+
+void ubbd_flush_tracker_init(struct ubbd_flush_tracker *tracker);
+enum ubbd_flush_action ubbd_flush_begin(struct ubbd_flush_tracker *tracker,
+		struct ubbd_flush_req *req);
+bool ubbd_flush_end(struct ubbd_flush_tracker *tracker, int ret,
+		struct list_head *done);
+#endif /* UBBD_FLUSH_H */
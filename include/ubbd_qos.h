@@ -0,0 +1,41 @@
+#ifndef UBBD_QOS_H
+#define UBBD_QOS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libubbd.h"
+
+/*
+ * Token bucket QoS of a device
+ *
+ * Each limit in ubbd_qos_opts is a bucket refilled at its rate per second,
+ * holding at most burst_ms of tokens. A request is admitted when none of
+ * its buckets is in debt, then it takes 1 token from iops buckets and its
+ * length from bps buckets, so a request larger than the burst still goes
+ * and the debt delays the following ones.
+ *
+ * Buckets are shared by all queues of the device, protected by lock.
+ */
+struct ubbd_qos_bucket {
+	uint64_t	rate;		/* 0 means no limit */
+	int64_t		burst;
+	int64_t		tokens;
+	uint64_t	last_ns;	/* time tokens are refilled to */
+};
+
+struct ubbd_qos {
+	pthread_spinlock_t	lock;
+	bool			enabled;
+	struct ubbd_qos_bucket	buckets[UBBD_QOS_MAX];
+};
+
+static inline bool ubbd_qos_enabled(struct ubbd_qos *qos)
+{
+	return __atomic_load_n(&qos->enabled, __ATOMIC_RELAXED);
+}
+
+int ubbd_qos_init(struct ubbd_qos *qos, struct ubbd_qos_opts *opts, uint64_t now);
+void ubbd_qos_set(struct ubbd_qos *qos, struct ubbd_qos_opts *opts, uint64_t now);
+uint64_t ubbd_qos_throttle(struct ubbd_qos *qos, bool write, uint64_t bytes, uint64_t now);
+#endif /* UBBD_QOS_H */
@@ -6,6 +6,9 @@
 #include "ubbd_log.h"
 #include "ubbd.h"
 #include "libubbd.h"
+#include "ubbd_stats.h"
+#include "ubbd_uring.h"
+#include "list.h"
 
 enum ubbd_queue_ustatus {
 	UBBD_QUEUE_USTATUS_INIT	= 0,
@@ -22,6 +25,51 @@ struct ubbd_queue_info {
 };
 
 struct ubbd_backend;
+/* max se merged into one backend io */
+#define UBBD_QUEUE_MERGE_MAX		16
+
+/* max ios handed to backend_ops->submit_batch() in one call */
+#define UBBD_QUEUE_SUBMIT_BATCH		64
+
+/* max ios a queue offers to be stolen by sibling queues */
+#define UBBD_QUEUE_STEAL_MAX		256
+
+/* ios taken from a sibling queue at a time */
+#define UBBD_QUEUE_STEAL_BATCH		16
+
+struct ubbd_queue_steal {
+	pthread_spinlock_t		lock;
+	struct ubbd_backend_io		*ios[UBBD_QUEUE_STEAL_MAX];
+	uint32_t			head;
+	uint32_t			tail;
+};
+
+/*
+ * Backend poller
+ *
+ * A backend completing io by a context of its own, e.g. linux aio, adds
+ * a poller to the queue thread submitting the io, and has the context
+ * signal wakeup_fd of the queue on completion. cmdproc_thread calls
+ * poll() of pollers with io in flight after each wait and in spinning,
+ * so completions are reaped in the queue thread with either engine.
+ */
+struct ubbd_queue_poller {
+	struct list_head		node;
+	/* reap completions without blocking */
+	void (*poll) (struct ubbd_queue_poller *poller);
+	/* io submitted and not reaped, the queue does not exit before it is 0 */
+	uint32_t			inflight;
+};
+
+struct ubbd_queue_req_pool {
+	pthread_spinlock_t		lock;
+	void				*objs;
+	void				**free_objs;
+	uint32_t			nr_objs;
+	uint32_t			nr_free;
+	size_t				obj_size;
+};
+
 struct ubbd_queue {
 	struct ubbd_backend		*ubbd_b;
 	struct ubbd_uio_info		uio_info;
@@ -29,28 +77,74 @@ struct ubbd_queue {
 	int				status;
 	uint32_t			se_to_handle;
 	pthread_t			cmdproc_thread;
-	pthread_mutex_t			req_lock;
 	pthread_mutex_t			lock;
 	pid_t				backend_pid;
 	int				index;
 
-	pthread_mutex_t			req_stats_lock;
-	struct ubbd_req_stats		req_stats;
-};
+	int				poll_mode;
+	uint64_t			poll_spin_ns;
+
+	/* queue engine asked by user, uring is NULL when it is not io_uring */
+	int				engine;
+	struct ubbd_uring		*uring;
+
+	/* eventfd to wake up cmdproc_thread */
+	int				wakeup_fd;
+	/* pollers of backends, only used by cmdproc_thread */
+	struct list_head		pollers;
+
+	/* completion ring, see ubbd_queue_add_ce() */
+	uint64_t			*ce_ready;	/* seq + 1 once ce of seq is filled */
+	uint32_t			ce_nr;
+	uint32_t			ce_capacity;
+	uint64_t			ce_reserve_seq;	/* next seq to reserve */
+	uint64_t			ce_publish_seq;	/* ce before it are in compr_head */
+	uint64_t			ce_kick_seq;	/* ce before it are doorbelled */
+	int				ce_publishing;
+
+	/* credits for in-flight requests, only used by cmdproc_thread */
+	uint64_t			ce_credit_seq;
+	uint64_t			ce_credit_limit;
+	int				ce_credit_waiting;
 
-static inline struct ubbd_ce *
-compr_head(struct ubbd_queue *ubbd_q)
-{
-	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	/* ce between ce_kick_seq and ce_publish_seq are in the pending batch */
+	uint32_t			ce_batch_max;
+	uint64_t			ce_batch_ns;
+	uint64_t			ce_pending_since;
 
-	ubbd_dbg("comp: head: %u\n", sb->compr_head);
+	/* preallocated requests, see q_req_alloc() */
+	struct ubbd_queue_req_pool	req_pool;
+	uint64_t			reqs_inflight;
 
-	return (struct ubbd_ce *) ((char *) sb + sb->compr_off + sb->compr_head);
-}
+	/* ios collected in drain pass for backend_ops->submit_batch() */
+	struct ubbd_backend_io		*submit_ios[UBBD_QUEUE_SUBMIT_BATCH];
+	int				submit_nr;
+
+	/* read or write io open for merging, 0 merge_max_bytes disables merge */
+	struct ubbd_backend_io		*merge_io;
+	uint32_t			merge_max_bytes;
+
+	/* ios offered to sibling queues, see q_steal_offer() */
+	int				steal_policy;
+	struct ubbd_queue_steal		steal;
+	/* set while cmdproc_thread sleeps, a sibling with ios to steal wakes it */
+	int				steal_idle;
+
+	/* lock-free stats, lat is filled by ubbd_queue_get_stats() */
+	struct ubbd_req_stats		req_stats;
+	struct ubbd_lat_hist		lat_hist[UBBD_REQ_STATS_OP_MAX];
+	/* time se in current drain pass are picked up */
+	uint64_t			pickup_ns;
+	/* time queue started to be throttled by qos, 0 if it is not */
+	uint64_t			qos_throttle_since;
+};
 
-struct ubbd_ce *get_available_ce(struct ubbd_queue *ubbd_q);
+int ubbd_queue_ce_init(struct ubbd_queue *ubbd_q);
+void ubbd_queue_ce_exit(struct ubbd_queue *ubbd_q);
 void ubbd_queue_add_ce(struct ubbd_queue *ubbd_q, uint64_t priv_data,
 		int result);
+int ubbd_queue_req_pool_init(struct ubbd_queue *ubbd_q);
+void ubbd_queue_req_pool_exit(struct ubbd_queue *ubbd_q);
 
 #define UBBD_UPDATE_CMDR_TAIL(queue, sb, se) \
 do { \
@@ -70,7 +164,13 @@ do { \
 } while (0)
 
 
+int ubbd_queue_drain(struct ubbd_queue *ubbd_q, uint64_t *throttle_ns);
 void ubbd_queue_stop(struct ubbd_queue *ubbd_q);
+void ubbd_queue_wakeup(struct ubbd_queue *ubbd_q);
 int ubbd_queue_setup(struct ubbd_queue *ubbd_q);
 int ubbd_queue_wait_stopped(struct ubbd_queue *ubbd_q);
+void ubbd_queue_get_stats(struct ubbd_queue *ubbd_q, struct ubbd_req_stats *stats);
+void ubbd_queue_reset_stats(struct ubbd_queue *ubbd_q);
+/* return the eventfd to signal, -ENODEV if caller is not a cmdproc_thread */
+int ubbd_queue_add_poller(struct ubbd_queue_poller *poller);
 #endif /* UBBD_QUEUE_H */
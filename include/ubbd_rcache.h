@@ -0,0 +1,62 @@
+#ifndef UBBD_RCACHE_H
+#define UBBD_RCACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Read cache of a device
+ *
+ * Fixed size blocks of data read from backend are kept in memory, so
+ * hot reads of remote backends are served without a round trip. Blocks
+ * are spread over shards by hash, each shard has its own lock, a hash
+ * table and a CLOCK of slots for eviction.
+ *
+ * Writes go through to backend and invalidate the blocks they touch,
+ * when they are submitted and again when they complete. Every
+ * invalidation bumps inval_seq, a read fills the cache only if no
+ * invalidation happened since it was submitted, so data read before a
+ * write is never cached after it.
+ */
+#define UBBD_RCACHE_BLOCK_SHIFT	12
+#define UBBD_RCACHE_BLOCK_SIZE	(1 << UBBD_RCACHE_BLOCK_SHIFT)
+#define UBBD_RCACHE_SHARDS	16
+
+struct ubbd_rcache_slot {
+	uint64_t	blk;
+	/* next slot in hash chain */
+	uint32_t	next;
+	bool		used;
+	/* CLOCK reference bit, set by hit */
+	bool		ref;
+};
+
+struct ubbd_rcache_shard {
+	pthread_mutex_t		lock;
+	uint32_t		nr_slots;
+	uint32_t		hand;
+	uint32_t		nr_buckets;
+	uint32_t		*buckets;
+	struct ubbd_rcache_slot	*slots;
+	char			*data;
+} __attribute__((aligned(64)));
+
+struct ubbd_rcache {
+	struct ubbd_rcache_shard	shards[UBBD_RCACHE_SHARDS];
+	uint64_t			inval_seq;
+};
+
+static inline uint64_t ubbd_rcache_seq(struct ubbd_rcache *rc)
+{
+	return __atomic_load_n(&rc->inval_seq, __ATOMIC_ACQUIRE);
+}
+
+int ubbd_rcache_init(struct ubbd_rcache *rc, uint64_t budget);
+void ubbd_rcache_exit(struct ubbd_rcache *rc);
+bool ubbd_rcache_read(struct ubbd_rcache *rc, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt);
+void ubbd_rcache_fill(struct ubbd_rcache *rc, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, uint64_t seq);
+void ubbd_rcache_invalidate(struct ubbd_rcache *rc, uint64_t off, uint32_t len);
+#endif /* UBBD_RCACHE_H */
@@ -0,0 +1,41 @@
+#ifndef UBBD_SPLIT_H
+#define UBBD_SPLIT_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * I/O limits of backend
+ *
+ * A backend sets the limits it has in ubbd_b->limits before it starts,
+ * 0 means no limit. Framework splits ios not fitting in them into child
+ * ios and bounces the data of ios not aligned to dma_align, so backends
+ * only see ios they can handle as is.
+ */
+struct ubbd_io_limits {
+	/* bytes of a read or write */
+	uint32_t	max_io_size;
+	/* iovs of a read or write */
+	uint32_t	max_iov_cnt;
+	/* no io crosses a multiple of it, e.g. object size of s3 */
+	uint32_t	io_boundary;
+	/* iov_base and iov_len alignment of a read or write, e.g. O_DIRECT */
+	uint32_t	dma_align;
+	/* discard is trimmed to multiples of it */
+	uint32_t	discard_granularity;
+	/* write-zeros frees space in multiples of it, the block of zero detect */
+	uint32_t	zero_granularity;
+};
+
+uint32_t ubbd_split_len(const struct ubbd_io_limits *limits, uint64_t off, uint32_t len);
+uint32_t ubbd_iov_span(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, uint32_t max_iov);
+int ubbd_iov_slice(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, struct iovec *dst);
+bool ubbd_iov_aligned(const struct iovec *iov, int iov_cnt, uint32_t align);
+void ubbd_iov_to_buf(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		void *buf, uint32_t len);
+void ubbd_buf_to_iov(const void *buf, uint32_t len, const struct iovec *iov,
+		int iov_cnt, uint64_t skip);
+void ubbd_discard_align(const struct ubbd_io_limits *limits, uint64_t *off, uint32_t *len);
+#endif /* UBBD_SPLIT_H */
@@ -0,0 +1,55 @@
+#ifndef UBBD_STATS_H
+#define UBBD_STATS_H
+#include <stdint.h>
+
+#include "libubbd.h"
+
+/*
+ * Log-linear latency histogram
+ *
+ * Values below 8 have their own buckets, each power of two above is split
+ * into 8 linear sub buckets, so a bucket is at most 12.5% wide relative to
+ * its value. Values over 2^UBBD_LAT_HIST_MAX_SHIFT ns (~68s) go to the
+ * last bucket.
+ *
+ * Writers only do relaxed atomic adds, readers take a snapshot, count is
+ * only valid in snapshot.
+ */
+#define UBBD_LAT_HIST_SUB_SHIFT		3
+#define UBBD_LAT_HIST_SUB		(1 << UBBD_LAT_HIST_SUB_SHIFT)
+#define UBBD_LAT_HIST_MAX_SHIFT		36
+#define UBBD_LAT_HIST_BUCKETS		((UBBD_LAT_HIST_MAX_SHIFT - UBBD_LAT_HIST_SUB_SHIFT + 2) * UBBD_LAT_HIST_SUB)
+
+struct ubbd_lat_hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t buckets[UBBD_LAT_HIST_BUCKETS];
+};
+
+static inline int ubbd_lat_hist_index(uint64_t ns)
+{
+	int shift;
+
+	if (ns < UBBD_LAT_HIST_SUB)
+		return ns;
+
+	shift = 63 - __builtin_clzll(ns);
+	if (shift > UBBD_LAT_HIST_MAX_SHIFT)
+		return UBBD_LAT_HIST_BUCKETS - 1;
+
+	return (shift - UBBD_LAT_HIST_SUB_SHIFT + 1) * UBBD_LAT_HIST_SUB +
+		((ns >> (shift - UBBD_LAT_HIST_SUB_SHIFT)) & (UBBD_LAT_HIST_SUB - 1));
+}
+
+static inline void ubbd_lat_hist_add(struct ubbd_lat_hist *hist, uint64_t ns)
+{
+	__atomic_fetch_add(&hist->buckets[ubbd_lat_hist_index(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+}
+
+uint64_t ubbd_lat_hist_bucket_min(int index);
+void ubbd_lat_hist_snapshot(struct ubbd_lat_hist *hist, struct ubbd_lat_hist *snap);
+void ubbd_lat_hist_reset(struct ubbd_lat_hist *hist);
+uint64_t ubbd_lat_hist_percentile(struct ubbd_lat_hist *hist, uint32_t permille);
+void ubbd_lat_hist_to_stats(struct ubbd_lat_hist *hist, struct ubbd_req_lat_stats *stats);
+#endif /* UBBD_STATS_H */
@@ -0,0 +1,65 @@
+#ifndef UBBD_URING_H
+#define UBBD_URING_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ubbd_compat.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+struct ubbd_queue;
+struct io_uring_sqe;
+
+/*
+ * io_uring queue engine
+ *
+ * cmdproc_thread waits on the uio fd and wakeup_fd with multishot polls
+ * on a per-queue ring, and rings the completion doorbell with a write on
+ * the same ring. Backends running in cmdproc_thread can put their own
+ * sqe on it by ubbd_uring_get_sqe(), cb->complete() is called in
+ * cmdproc_thread when the cqe is reaped.
+ *
+ * The uio map of the queue is registered as fixed buffer 0 if kernel
+ * can pin it, and a backend can register one fd as fixed file 0 of each
+ * ring, so io on them skips page and file lookup for each sqe.
+ */
+struct ubbd_uring_cb {
+	void (*complete) (struct ubbd_uring_cb *cb, int res);
+};
+
+#ifdef HAVE_LIBURING
+struct ubbd_uring {
+	struct io_uring		ring;
+	bool			multishot;
+	bool			uio_armed;
+	bool			wakeup_armed;
+	/* uio fd fired since last ubbd_uring_wait() */
+	bool			uio_event;
+	/* sqe of backends not completed yet */
+	uint32_t		inflight;
+	/* uio map is fixed buffer 0 */
+	bool			fixed_buf;
+	char			*buf_base;
+	uint64_t		buf_size;
+	/* fd of fixed file 0, -1 if none, fixed_file_failed if kernel refused */
+	int			fixed_fd;
+	bool			fixed_file_failed;
+};
+#endif
+
+int ubbd_uring_init(struct ubbd_queue *ubbd_q);
+void ubbd_uring_exit(struct ubbd_queue *ubbd_q);
+void ubbd_uring_doorbell(struct ubbd_queue *ubbd_q);
+void ubbd_uring_submit(struct ubbd_queue *ubbd_q);
+int ubbd_uring_reap(struct ubbd_queue *ubbd_q);
+int ubbd_uring_wait(struct ubbd_queue *ubbd_q, int64_t timeout_ns, bool *uio_event);
+bool ubbd_uring_idle(struct ubbd_queue *ubbd_q);
+
+/* NULL if the calling thread has no ring, caller falls back to syscalls */
+struct io_uring_sqe *ubbd_uring_get_sqe(struct ubbd_uring_cb *cb);
+/* index of fixed file or buffer in ring of the calling thread, negative if none */
+int ubbd_uring_fixed_file(int fd);
+int ubbd_uring_fixed_buf(const void *buf, uint32_t len);
+#endif /* UBBD_URING_H */
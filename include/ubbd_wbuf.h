@@ -0,0 +1,147 @@
+#ifndef UBBD_WBUF_H
+#define UBBD_WBUF_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "list.h"
+
+/*
+ * Write-back buffer of a device
+ *
+ * Writes are copied into memory and completed at once, a destager
+ * thread writes them to backend later. Dirty data is kept as extents
+ * sorted by offset and never overlapping, a newer write trims or drops
+ * the extents it covers. Data of an extent is never changed once
+ * written, only the range of it is, so an extent can be trimmed while
+ * it is being destaged.
+ *
+ * Destage goes in passes, each pass takes all dirty extents, merges
+ * adjacent ones into ios and waits for all of them, so two passes never
+ * write the same range to backend at the same time. Extents stay
+ * readable until their pass finishes.
+ *
+ * Writes not fitting in dirty_limit wait in pending list and are
+ * admitted in order by destager. Discard and write-zeros overlapping
+ * dirty data go through pending too, they drop the dirty data they
+ * cover before going to backend. A flush waits until the extents
+ * written before it are destaged.
+ *
+ * With a journal file, every admitted write is appended to it before it
+ * is completed, and replayed into the buffer when the device starts
+ * again, so dirty data survives a crash of backend process. The journal
+ * is truncated when the buffer is empty.
+ */
+#define UBBD_WBUF_DESTAGE_MAX		(1 << 20)
+#define UBBD_WBUF_DESTAGE_IOV		64
+#define UBBD_WBUF_AGE_MS_DEFAULT	1000
+/* journal size in times of dirty_limit, writes wait for empty buffer beyond it */
+#define UBBD_WBUF_JOURNAL_RATIO		4
+
+enum ubbd_wbuf_req_type {
+	UBBD_WBUF_REQ_WRITE = 0,
+	UBBD_WBUF_REQ_BARRIER,	/* discard and write-zeros */
+	UBBD_WBUF_REQ_FLUSH,
+};
+
+struct ubbd_wbuf_req {
+	struct list_head	node;
+	int			type;
+	uint64_t		off;
+	uint32_t		len;
+	const struct iovec	*iov;
+	int			iov_cnt;
+	/* flush point of flush req */
+	uint64_t		seq;
+	int			ret;
+	void			(*done) (struct ubbd_wbuf_req *req, int ret);
+};
+
+struct ubbd_wbuf_extent {
+	struct list_head	node;		/* in index, sorted by off */
+	struct list_head	pass_node;
+	uint64_t		off;
+	uint32_t		len;
+	char			*data;		/* data at off, inside buf */
+	char			*buf;
+	uint32_t		buf_len;
+	/* oldest write merged in, flushes after it wait for this extent */
+	uint64_t		seq;
+	bool			destaging;
+	/* dropped from index while destaging, freed when pass finishes */
+	bool			orphan;
+};
+
+/* one backend io of a pass */
+struct ubbd_wbuf_destage {
+	struct list_head	node;
+	uint64_t		off;
+	uint32_t		len;
+	int			iov_cnt;
+	struct iovec		iov[UBBD_WBUF_DESTAGE_IOV];
+};
+
+struct ubbd_wbuf_pass {
+	struct list_head	extents;
+	struct list_head	destages;
+};
+
+/* dirty pieces of a read partly in buffer, applied after backend read */
+struct ubbd_wbuf_overlay_piece {
+	uint64_t		off;
+	uint32_t		len;
+	char			*data;
+};
+
+struct ubbd_wbuf_overlay {
+	int				nr;
+	struct ubbd_wbuf_overlay_piece	pieces[];
+};
+
+enum ubbd_wbuf_read_result {
+	UBBD_WBUF_READ_MISS = 0,	/* nothing in buffer, read from backend */
+	UBBD_WBUF_READ_HIT,		/* all copied from buffer */
+	UBBD_WBUF_READ_PARTIAL,		/* read from backend, then apply overlay */
+};
+
+struct ubbd_wbuf {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	index;
+	struct list_head	pending;
+	struct list_head	flush_waiters;
+	uint64_t		dirty_limit;
+	/* buffers of extents in index and orphans */
+	uint64_t		dirty_bytes;
+	/* extents not destaging, and since when there are some */
+	uint32_t		nr_dirty;
+	uint64_t		dirty_since_ns;
+	uint64_t		max_age_ns;
+	uint64_t		seq;
+	/* pass in flight, barriers overlapping it wait in pending */
+	struct ubbd_wbuf_pass	*pass;
+	bool			stopping;
+	int			journal_fd;
+	uint64_t		journal_off;
+	uint64_t		journal_max;
+};
+
+int ubbd_wbuf_init(struct ubbd_wbuf *wb, uint64_t dirty_limit, uint64_t max_age_ns);
+void ubbd_wbuf_exit(struct ubbd_wbuf *wb);
+int ubbd_wbuf_journal_open(struct ubbd_wbuf *wb, const char *path);
+
+int ubbd_wbuf_write(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req);
+int ubbd_wbuf_barrier(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req);
+int ubbd_wbuf_flush(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req);
+int ubbd_wbuf_read(struct ubbd_wbuf *wb, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, struct ubbd_wbuf_overlay **overlay);
+void ubbd_wbuf_overlay_apply(struct ubbd_wbuf_overlay *overlay, uint64_t off,
+		const struct iovec *iov, int iov_cnt);
+
+bool ubbd_wbuf_need_destage(struct ubbd_wbuf *wb, uint64_t now_ns);
+bool ubbd_wbuf_wait_work(struct ubbd_wbuf *wb);
+int ubbd_wbuf_destage_prepare(struct ubbd_wbuf *wb, struct ubbd_wbuf_pass *pass);
+void ubbd_wbuf_destage_done(struct ubbd_wbuf *wb, struct ubbd_wbuf_pass *pass, int ret);
+void ubbd_wbuf_stop(struct ubbd_wbuf *wb);
+#endif /* UBBD_WBUF_H */
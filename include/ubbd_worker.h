@@ -0,0 +1,33 @@
+#ifndef UBBD_WORKER_H
+#define UBBD_WORKER_H
+#include <pthread.h>
+#include <sched.h>
+
+#include "list.h"
+
+struct ubbd_backend;
+struct ubbd_backend_io;
+
+/*
+ * Worker pool of a backend process, runs ios of blocking backends out of
+ * cmdproc_thread. ios are completed by workers via ubbd_backend_io_finish().
+ */
+struct ubbd_worker_pool {
+	struct ubbd_backend	*ubbd_b;
+	int			nr_workers;
+	pthread_t		*threads;
+	cpu_set_t		cpuset;
+	bool			has_cpuset;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	ios;
+	bool			stopping;
+};
+
+struct ubbd_worker_pool *ubbd_worker_pool_create(struct ubbd_backend *ubbd_b,
+		int nr_workers, const char *cpulist);
+void ubbd_worker_pool_destroy(struct ubbd_worker_pool *pool);
+void ubbd_worker_pool_queue(struct ubbd_worker_pool *pool,
+		struct ubbd_backend_io **ios, int nr);
+#endif /* UBBD_WORKER_H */
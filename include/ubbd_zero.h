@@ -0,0 +1,30 @@
+#ifndef UBBD_ZERO_H
+#define UBBD_ZERO_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Zero detection
+ *
+ * Scan write payload for all-zero blocks, so they can go to backend as
+ * write-zeros. The scan uses AVX2 or SSE2 when cpu has them, scalar
+ * code otherwise, and stops at the first non-zero word.
+ */
+#define UBBD_ZERO_BLOCK		4096
+
+enum ubbd_zero_impl {
+	UBBD_ZERO_IMPL_SCALAR = 0,
+	UBBD_ZERO_IMPL_SSE2,
+	UBBD_ZERO_IMPL_AVX2,
+	UBBD_ZERO_IMPL_MAX,
+};
+
+bool ubbd_zero_impl_supported(int impl);
+const char *ubbd_zero_impl_name(int impl);
+bool ubbd_buf_is_zero_impl(int impl, const void *buf, size_t len);
+bool ubbd_buf_is_zero(const void *buf, size_t len);
+uint32_t ubbd_iov_zero_span(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, uint64_t off, uint32_t block, bool *zero);
+#endif /* UBBD_ZERO_H */
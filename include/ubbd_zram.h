@@ -0,0 +1,113 @@
+#ifndef UBBD_ZRAM_H
+#define UBBD_ZRAM_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "list.h"
+#include "ubbd_blkmap.h"
+
+/*
+ * Compressed page store
+ *
+ * Data of a device is kept in pages of UBBD_ZRAM_PAGE_SIZE, each one
+ * compressed into a chunk of a slab pool. A page filled with one
+ * repeated 32-bit word, zeros included, keeps only the word in its map
+ * entry. A page not compressing below UBBD_ZRAM_MAX_COMPR is stored as
+ * is. Pages are locked by shard of page number, a write of part of a
+ * page reads, modifies and writes the whole page under the lock.
+ *
+ * Compression is done by callbacks of the user, with a context of the
+ * calling thread, so the store does not depend on any compressor.
+ */
+#define UBBD_ZRAM_PAGE_SHIFT	12
+#define UBBD_ZRAM_PAGE_SIZE	(1 << UBBD_ZRAM_PAGE_SHIFT)
+/* compressed pages larger than this are stored as is */
+#define UBBD_ZRAM_MAX_COMPR	(UBBD_ZRAM_PAGE_SIZE * 3 / 4)
+#define UBBD_ZRAM_SHARDS	256
+
+/*
+ * Slab pool
+ *
+ * Chunks of a size class are cut from aligned slabs of UBBD_ZPOOL_SLAB_SIZE,
+ * a chunk finds its slab by address. Slabs with free chunks are on the
+ * partial list of their class, a slab with no chunk used is freed, except
+ * one kept for each class.
+ */
+#define UBBD_ZPOOL_SLAB_SHIFT	16
+#define UBBD_ZPOOL_SLAB_SIZE	(1 << UBBD_ZPOOL_SLAB_SHIFT)
+#define UBBD_ZPOOL_ALIGN	32
+/* classes up to UBBD_ZRAM_MAX_COMPR, and one for pages stored as is */
+#define UBBD_ZPOOL_CLASSES	(UBBD_ZRAM_MAX_COMPR / UBBD_ZPOOL_ALIGN + 1)
+
+/* UBBD_ZPOOL_ALIGN bytes, chunks follow it */
+struct ubbd_zpool_slab {
+	struct list_head	node;
+	void			*free;
+	uint32_t		nr_free;
+	uint32_t		class;
+};
+
+struct ubbd_zpool_class {
+	pthread_mutex_t		lock;
+	uint32_t		size;
+	uint32_t		nr_chunks;
+	struct list_head	partial;
+	struct list_head	full;
+	struct ubbd_zpool_slab	*empty;
+} __attribute__((aligned(64)));
+
+struct ubbd_zpool {
+	struct ubbd_zpool_class	classes[UBBD_ZPOOL_CLASSES];
+	uint64_t		nr_slabs;
+};
+
+int ubbd_zpool_init(struct ubbd_zpool *pool);
+void ubbd_zpool_exit(struct ubbd_zpool *pool);
+void *ubbd_zpool_alloc(struct ubbd_zpool *pool, uint32_t size);
+void ubbd_zpool_free(struct ubbd_zpool *pool, void *chunk);
+
+struct ubbd_zram_compressor {
+	/* return length of src compressed in dst, 0 if it needs more than dst_len */
+	int (*compress) (void *ctx, const void *src, void *dst, int dst_len);
+	/* return 0 if src is decompressed to a whole page in dst */
+	int (*decompress) (void *ctx, const void *src, int src_len, void *dst);
+};
+
+struct ubbd_zram_stats {
+	/* pages compressed, stored as is, and same filled */
+	uint64_t	compr_pages;
+	uint64_t	huge_pages;
+	uint64_t	same_pages;
+	/* data written by user in pages stored */
+	uint64_t	orig_bytes;
+	/* data in chunks, and memory of slabs holding them */
+	uint64_t	compr_bytes;
+	uint64_t	mem_used;
+};
+
+struct ubbd_zram {
+	const struct ubbd_zram_compressor	*comp;
+	uint64_t			size;
+	/* entry of each page, chunk or same filled word */
+	struct ubbd_blkmap		map;
+	struct ubbd_zpool		pool;
+	pthread_mutex_t			locks[UBBD_ZRAM_SHARDS];
+
+	uint64_t			compr_pages;
+	uint64_t			huge_pages;
+	uint64_t			same_pages;
+	uint64_t			compr_bytes;
+};
+
+int ubbd_zram_init(struct ubbd_zram *zram, uint64_t size, const struct ubbd_zram_compressor *comp);
+void ubbd_zram_exit(struct ubbd_zram *zram);
+bool ubbd_zram_page_same(const void *page, uint32_t *word);
+int ubbd_zram_read(struct ubbd_zram *zram, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, void *comp_ctx);
+int ubbd_zram_write(struct ubbd_zram *zram, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, void *comp_ctx);
+int ubbd_zram_discard(struct ubbd_zram *zram, uint64_t off, uint32_t len, void *comp_ctx);
+void ubbd_zram_get_stats(struct ubbd_zram *zram, struct ubbd_zram_stats *stats);
+#endif /* UBBD_ZRAM_H */
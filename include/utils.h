@@ -1,5 +1,6 @@
 #ifndef UTILS_H
 #define UTILS_H
+#include <sched.h>
 #include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,6 +34,8 @@
 #define round_up(x, y) ((((x)-1) | __round_mask(x, y))+1)
 #define round_down(x, y) ((x) & ~__round_mask(x, y))
 
+#define UBBD_CACHELINE_SIZE	64
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 #define container_of(ptr, type, member) ({                      \
@@ -58,6 +61,8 @@ static inline uint64_t get_ns()
 struct context {
 	struct context *parent;
 	int (*finish)(struct context *ctx, int ret);
+	/* called instead of context_free() when ctx finishes, if set */
+	void (*release)(struct context *ctx);
 	char data[];
 };
 
@@ -88,7 +93,10 @@ static inline int context_finish(struct context *ctx, int ret)
 	if (ctx->parent)
 		context_finish(ctx->parent, ret);
 
-	context_free(ctx);
+	if (ctx->release)
+		ctx->release(ctx);
+	else
+		context_free(ctx);
 	return ret;
 }
 
@@ -108,6 +116,27 @@ static inline int wait_condition(int wait_count, uint64_t wait_interval_us, bool
 	return -ETIMEDOUT;
 }
 
+/* Barriers */
+
+#define ubbd_barrier()		__asm__ __volatile__("" ::: "memory")
+#define ubbd_smp_mb()		__sync_synchronize()
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ubbd_smp_rmb()		ubbd_barrier()
+#define ubbd_smp_wmb()		ubbd_barrier()
+#define ubbd_cpu_relax()	__asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define ubbd_smp_rmb()		__asm__ __volatile__("dmb ishld" ::: "memory")
+#define ubbd_smp_wmb()		__asm__ __volatile__("dmb ishst" ::: "memory")
+#define ubbd_cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define ubbd_smp_rmb()		ubbd_smp_mb()
+#define ubbd_smp_wmb()		ubbd_smp_mb()
+#define ubbd_cpu_relax()	ubbd_barrier()
+#endif
+
+#define ubbd_prefetch(addr)	__builtin_prefetch(addr)
+
 /* Atomic  */
 
 typedef int ubbd_atomic;
@@ -274,4 +303,5 @@ static inline long ubbd_atomic64_cmpxchg(ubbd_atomic64 *a, long old, long new)
 int ubbd_mkdirs(const char *pathname);
 int ubbd_mkdir(const char *path);
 int ubbd_rmdirs(const char *pathname, const char *remain);
+int ubbd_parse_cpulist(const char *cpulist, cpu_set_t *cpuset);
 #endif /* UTILS_H */
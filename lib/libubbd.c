@@ -12,6 +12,14 @@
 /* 32M */
 #define DEFAULT_SHMEM_SIZE	(32 * 1024 *1024)
 #define DEFAULT_NUM_QUEUES	1
+#define DEFAULT_POLL_SPIN_US	50
+#define UBBD_MAX_WORKER_THREADS	256
+#define UBBD_MAX_MERGE_KB	4096
+#define DEFAULT_QOS_BURST_MS	1000
+#define UBBD_MAX_QOS_BURST_MS	60000
+#define DEFAULT_CE_BATCH	32
+#define DEFAULT_CE_BATCH_US	20
+#define DEFAULT_WRITE_BACK_AGE_MS	1000
 
 #define DEFAULT_CEPH_CONF	"/etc/ceph/ceph.conf"
 #define DEFAULT_CEPH_USER	"client.admin"
@@ -39,6 +47,10 @@ char *cmd_to_str(enum ubbdd_mgmt_cmd cmd)
 		return "req-stats-reset";
 	else if (cmd == UBBDD_MGMT_CMD_DEV_RESTART)
 		return "dev-restart";
+	else if (cmd == UBBDD_MGMT_CMD_DEV_INFO)
+		return "info";
+	else if (cmd == UBBDD_MGMT_CMD_SET_QOS)
+		return "set-qos";
 	else
 		return "UNKNOWN";
 }
@@ -61,6 +73,8 @@ static enum ubbd_dev_type str_to_type(const char *str)
 		type = UBBD_DEV_TYPE_S3;
 	else if (!strcmp("mem", str))
 		type = UBBD_DEV_TYPE_MEM;
+	else if (!strcmp("zram", str))
+		type = UBBD_DEV_TYPE_ZRAM;
 	else
 		type = -1;
 
@@ -92,6 +106,182 @@ const char* ubbd_cache_mode_to_str(int cache_mode)
 		return NULL;
 }
 
+int str_to_poll_mode(const char *str)
+{
+	int poll_mode;
+
+	if (!strcmp("interrupt", str))
+		poll_mode = UBBD_POLL_MODE_INTERRUPT;
+	else if (!strcmp("busy", str))
+		poll_mode = UBBD_POLL_MODE_BUSY;
+	else if (!strcmp("hybrid", str))
+		poll_mode = UBBD_POLL_MODE_HYBRID;
+	else
+		poll_mode = -1;
+
+	return poll_mode;
+}
+
+int str_to_queue_engine(const char *str)
+{
+	int engine;
+
+	if (!strcmp("poll", str))
+		engine = UBBD_QUEUE_ENGINE_POLL;
+	else if (!strcmp("io_uring", str))
+		engine = UBBD_QUEUE_ENGINE_IO_URING;
+	else
+		engine = -1;
+
+	return engine;
+}
+
+const char* ubbd_queue_engine_to_str(int engine)
+{
+	if (engine == UBBD_QUEUE_ENGINE_POLL)
+		return "poll";
+	else if (engine == UBBD_QUEUE_ENGINE_IO_URING)
+		return "io_uring";
+	else
+		return NULL;
+}
+
+int str_to_file_io_engine(const char *str)
+{
+	int io_engine;
+
+	if (!strcmp("io_uring", str))
+		io_engine = UBBD_FILE_IO_ENGINE_IO_URING;
+	else if (!strcmp("sync", str))
+		io_engine = UBBD_FILE_IO_ENGINE_SYNC;
+	else if (!strcmp("libaio", str))
+		io_engine = UBBD_FILE_IO_ENGINE_LIBAIO;
+	else
+		io_engine = -1;
+
+	return io_engine;
+}
+
+const char* ubbd_file_io_engine_to_str(int io_engine)
+{
+	if (io_engine == UBBD_FILE_IO_ENGINE_IO_URING)
+		return "io_uring";
+	else if (io_engine == UBBD_FILE_IO_ENGINE_SYNC)
+		return "sync";
+	else if (io_engine == UBBD_FILE_IO_ENGINE_LIBAIO)
+		return "libaio";
+	else
+		return NULL;
+}
+
+int str_to_mem_backing(const char *str)
+{
+	int backing;
+
+	if (!strcmp("heap", str))
+		backing = UBBD_MEM_BACKING_HEAP;
+	else if (!strcmp("shm", str))
+		backing = UBBD_MEM_BACKING_SHM;
+	else if (!strcmp("hugetlb", str))
+		backing = UBBD_MEM_BACKING_HUGETLB;
+	else
+		backing = -1;
+
+	return backing;
+}
+
+const char* ubbd_mem_backing_to_str(int backing)
+{
+	if (backing == UBBD_MEM_BACKING_HEAP)
+		return "heap";
+	else if (backing == UBBD_MEM_BACKING_SHM)
+		return "shm";
+	else if (backing == UBBD_MEM_BACKING_HUGETLB)
+		return "hugetlb";
+	else
+		return NULL;
+}
+
+int str_to_zram_comp(const char *str)
+{
+	int comp;
+
+	if (!strcmp("lz4", str))
+		comp = UBBD_ZRAM_COMP_LZ4;
+	else if (!strcmp("zstd", str))
+		comp = UBBD_ZRAM_COMP_ZSTD;
+	else
+		comp = -1;
+
+	return comp;
+}
+
+const char* ubbd_zram_comp_to_str(int comp)
+{
+	if (comp == UBBD_ZRAM_COMP_LZ4)
+		return "lz4";
+	else if (comp == UBBD_ZRAM_COMP_ZSTD)
+		return "zstd";
+	else
+		return NULL;
+}
+
+int str_to_steal_policy(const char *str)
+{
+	int steal_policy;
+
+	if (!strcmp("none", str))
+		steal_policy = UBBD_STEAL_POLICY_NONE;
+	else if (!strcmp("idle", str))
+		steal_policy = UBBD_STEAL_POLICY_IDLE;
+	else if (!strcmp("always", str))
+		steal_policy = UBBD_STEAL_POLICY_ALWAYS;
+	else
+		steal_policy = -1;
+
+	return steal_policy;
+}
+
+const char* ubbd_steal_policy_to_str(int steal_policy)
+{
+	if (steal_policy == UBBD_STEAL_POLICY_NONE)
+		return "none";
+	else if (steal_policy == UBBD_STEAL_POLICY_IDLE)
+		return "idle";
+	else if (steal_policy == UBBD_STEAL_POLICY_ALWAYS)
+		return "always";
+	else
+		return NULL;
+}
+
+const char* ubbd_req_stats_op_to_str(int op)
+{
+	if (op == UBBD_REQ_STATS_OP_WRITE)
+		return "write";
+	else if (op == UBBD_REQ_STATS_OP_READ)
+		return "read";
+	else if (op == UBBD_REQ_STATS_OP_FLUSH)
+		return "flush";
+	else if (op == UBBD_REQ_STATS_OP_DISCARD)
+		return "discard";
+	else if (op == UBBD_REQ_STATS_OP_WRITE_ZEROS)
+		return "write_zeros";
+
+	return "unknown";
+}
+
+const char* ubbd_poll_mode_to_str(int poll_mode)
+{
+	if (poll_mode == UBBD_POLL_MODE_INTERRUPT)
+		return "interrupt";
+	else if (poll_mode == UBBD_POLL_MODE_BUSY)
+		return "busy";
+	else if (poll_mode == UBBD_POLL_MODE_HYBRID)
+		return "hybrid";
+	else
+		return NULL;
+}
+
 int str_to_restart_mode(const char *str)
 {
 	int restart_mode;
@@ -141,6 +331,8 @@ void file_dev_info_setup(struct __ubbd_dev_info *info,
 		struct __ubbd_map_opts *opts)
 {
 	strcpy(info->file.path, opts->file.filepath);
+	if (opts->file.io_engine)
+		info->file.io_engine = str_to_file_io_engine(opts->file.io_engine);
 }
 
 void rbd_dev_info_setup(struct __ubbd_dev_info *info,
@@ -200,7 +392,35 @@ void null_dev_info_setup(struct __ubbd_dev_info *info,
 void mem_dev_info_setup(struct __ubbd_dev_info *info,
 		struct __ubbd_map_opts *opts)
 {
-	return;
+	info->mem.backing = opts->mem.backing ? str_to_mem_backing(opts->mem.backing) :
+		UBBD_MEM_BACKING_HEAP;
+	info->mem.numa_node = opts->mem.numa_node ? atoi(opts->mem.numa_node) : -1;
+	if (info->mem.backing == UBBD_MEM_BACKING_SHM) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		info->mem.shm_id = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	/* block of hugetlb backing is a huge page */
+	if (info->mem.backing == UBBD_MEM_BACKING_HUGETLB)
+		info->mem.block_size = UBBD_MEM_HUGE_PAGE_SIZE;
+	else
+		info->mem.block_size = opts->mem.block_size ? : UBBD_MEM_BLK_SIZE;
+	info->mem.limit_mb = opts->mem.limit_mb;
+}
+
+void zram_dev_info_setup(struct __ubbd_dev_info *info,
+		struct __ubbd_map_opts *opts)
+{
+	if (opts->zram.comp)
+		info->zram.comp = str_to_zram_comp(opts->zram.comp);
+	else
+#ifdef HAVE_LZ4
+		info->zram.comp = UBBD_ZRAM_COMP_LZ4;
+#else
+		info->zram.comp = UBBD_ZRAM_COMP_ZSTD;
+#endif
 }
 
 void s3_dev_info_setup(struct __ubbd_dev_info *info,
@@ -237,6 +457,8 @@ int generic_dev_info_setup(enum ubbd_dev_type dev_type,
 		s3_dev_info_setup(info, opts);
 	} else if (dev_type == UBBD_DEV_TYPE_MEM) {
 		mem_dev_info_setup(info, opts);
+	} else if (dev_type == UBBD_DEV_TYPE_ZRAM) {
+		zram_dev_info_setup(info, opts);
 	} else {
 		ubbd_err("error dev_type: %d\n", dev_type);
 		return -EINVAL;
@@ -283,11 +505,35 @@ int dev_info_setup(struct ubbd_dev_info *dev_info,
 	dev_info->sh_mem_size = opts->dev_share_memory_size;
 	dev_info->read_only = opts->read_only;
 
+	dev_info->queue_opts.poll_mode = str_to_poll_mode(opts->poll_mode);
+	dev_info->queue_opts.poll_spin_us = opts->poll_spin_us;
+	dev_info->queue_opts.ce_batch = opts->ce_batch;
+	dev_info->queue_opts.ce_batch_us = opts->ce_batch_us;
+	dev_info->queue_opts.worker_threads = opts->worker_threads;
+	dev_info->queue_opts.merge_max_kb = opts->merge_max_kb;
+	dev_info->queue_opts.engine = str_to_queue_engine(opts->queue_engine);
+	dev_info->queue_opts.steal_policy = str_to_steal_policy(opts->steal_policy);
+	dev_info->queue_opts.read_cache_mb = opts->read_cache_mb;
+	dev_info->queue_opts.write_back_mb = opts->write_back_mb;
+	dev_info->queue_opts.write_back_age_ms = opts->write_back_age_ms;
+	if (opts->write_back_journal)
+		strcpy(dev_info->queue_opts.write_back_journal, opts->write_back_journal);
+	dev_info->queue_opts.zero_detect = opts->zero_detect;
+	memcpy(&dev_info->queue_opts.qos, &opts->qos, sizeof(struct ubbd_qos_opts));
+	if (opts->worker_cpus)
+		strcpy(dev_info->queue_opts.worker_cpus, opts->worker_cpus);
+
 	return 0;
 }
 
 static int validate_generic_map_opts(struct __ubbd_map_opts *opts)
 {
+	int backing = UBBD_MEM_BACKING_HEAP;
+	uint32_t block_size;
+	int node;
+	int io_engine;
+	int comp;
+
 	if (!opts->type) {
 		fprintf(stderr, "type is required in __ubbd_map_opts.\n");
 		return -EINVAL;
@@ -298,6 +544,21 @@ static int validate_generic_map_opts(struct __ubbd_map_opts *opts)
 			fprintf(stderr, "filepath is required for file mapping.\n");
 			return -EINVAL;
 		}
+
+		if (opts->file.io_engine) {
+			io_engine = str_to_file_io_engine(opts->file.io_engine);
+			if (io_engine < 0) {
+				fprintf(stderr, "invalid file io engine: %s, should be io_uring, sync or libaio.\n",
+						opts->file.io_engine);
+				return -EINVAL;
+			}
+#ifndef HAVE_LIBAIO
+			if (io_engine == UBBD_FILE_IO_ENGINE_LIBAIO) {
+				fprintf(stderr, "file io engine libaio is not supported, ubbd is built without libaio.\n");
+				return -EINVAL;
+			}
+#endif
+		}
 	} else if (!strcmp("rbd", opts->type)) {
 		if (!opts->rbd.image) {
 			fprintf(stderr, "image is required for rbd mapping.\n");
@@ -328,6 +589,90 @@ static int validate_generic_map_opts(struct __ubbd_map_opts *opts)
 					volume_name, bucket_name are required for ssh mapping.\n");
 			return -EINVAL;
 		}
+	} else if (!strcmp("mem", opts->type)) {
+		if (opts->mem.block_size &&
+				(opts->mem.block_size < UBBD_MEM_BLK_SIZE_MIN ||
+				 opts->mem.block_size > UBBD_MEM_BLK_SIZE_MAX ||
+				 (opts->mem.block_size & (opts->mem.block_size - 1)))) {
+			fprintf(stderr, "invalid mem block size: %u, should be power of 2 in [%d, %d].\n",
+					opts->mem.block_size, UBBD_MEM_BLK_SIZE_MIN, UBBD_MEM_BLK_SIZE_MAX);
+			return -EINVAL;
+		}
+
+		if (opts->mem.backing) {
+			backing = str_to_mem_backing(opts->mem.backing);
+			if (backing < 0) {
+				fprintf(stderr, "invalid mem backing: %s, should be heap, shm or hugetlb.\n",
+						opts->mem.backing);
+				return -EINVAL;
+			}
+		}
+
+		if (backing == UBBD_MEM_BACKING_HUGETLB && opts->mem.block_size &&
+				opts->mem.block_size != UBBD_MEM_HUGE_PAGE_SIZE) {
+			fprintf(stderr, "block size of hugetlb mem backing is %d.\n", UBBD_MEM_HUGE_PAGE_SIZE);
+			return -EINVAL;
+		}
+
+		if (opts->mem.numa_node) {
+			if (backing == UBBD_MEM_BACKING_HEAP) {
+				fprintf(stderr, "numa node is for shm or hugetlb mem backing.\n");
+				return -EINVAL;
+			}
+
+			node = atoi(opts->mem.numa_node);
+			if (node < 0 || node >= UBBD_MEM_NUMA_NODE_MAX) {
+				fprintf(stderr, "invalid numa node: %s, should be in [0, %d).\n",
+						opts->mem.numa_node, UBBD_MEM_NUMA_NODE_MAX);
+				return -EINVAL;
+			}
+		}
+
+		block_size = opts->mem.block_size ? : UBBD_MEM_BLK_SIZE;
+		if (backing == UBBD_MEM_BACKING_HUGETLB)
+			block_size = UBBD_MEM_HUGE_PAGE_SIZE;
+		if (opts->mem.limit_mb && ((uint64_t)opts->mem.limit_mb << 20) < block_size) {
+			fprintf(stderr, "mem limit: %u MiB is smaller than a block.\n", opts->mem.limit_mb);
+			return -EINVAL;
+		}
+	} else if (!strcmp("zram", opts->type)) {
+#if !defined(HAVE_LZ4) && !defined(HAVE_ZSTD)
+		fprintf(stderr, "zram needs lz4 or zstd, ubbd is built without both of them.\n");
+		return -EINVAL;
+#endif
+		if (opts->zram.comp) {
+			comp = str_to_zram_comp(opts->zram.comp);
+			if (comp < 0) {
+				fprintf(stderr, "invalid zram comp: %s, should be lz4 or zstd.\n",
+						opts->zram.comp);
+				return -EINVAL;
+			}
+#ifndef HAVE_LZ4
+			if (comp == UBBD_ZRAM_COMP_LZ4) {
+				fprintf(stderr, "zram comp lz4 is not supported, ubbd is built without liblz4.\n");
+				return -EINVAL;
+			}
+#endif
+#ifndef HAVE_ZSTD
+			if (comp == UBBD_ZRAM_COMP_ZSTD) {
+				fprintf(stderr, "zram comp zstd is not supported, ubbd is built without libzstd.\n");
+				return -EINVAL;
+			}
+#endif
+		}
+	}
+
+	return 0;
+}
+
+static int validate_qos_opts(struct ubbd_qos_opts *qos)
+{
+	if (!qos->burst_ms)
+		qos->burst_ms = DEFAULT_QOS_BURST_MS;
+
+	if (qos->burst_ms > UBBD_MAX_QOS_BURST_MS) {
+		fprintf(stderr, "qos burst ms should not be larger than %d.\n", UBBD_MAX_QOS_BURST_MS);
+		return -EINVAL;
 	}
 
 	return 0;
@@ -355,6 +700,80 @@ static int validate_map_opts(struct ubbd_map_options *opts)
 	if (!opts->dev_share_memory_size)
 		opts->dev_share_memory_size = DEFAULT_SHMEM_SIZE;
 
+	if (!opts->poll_mode)
+		opts->poll_mode = "interrupt";
+
+	if (str_to_poll_mode(opts->poll_mode) < 0) {
+		fprintf(stderr, "invalid poll mode: %s, should be interrupt, busy or hybrid.\n", opts->poll_mode);
+		return -EINVAL;
+	}
+
+	if (!opts->poll_spin_us)
+		opts->poll_spin_us = DEFAULT_POLL_SPIN_US;
+
+	if (!opts->ce_batch)
+		opts->ce_batch = DEFAULT_CE_BATCH;
+
+	if (!opts->ce_batch_us)
+		opts->ce_batch_us = DEFAULT_CE_BATCH_US;
+
+	if (opts->worker_threads > UBBD_MAX_WORKER_THREADS) {
+		fprintf(stderr, "worker threads should not be larger than %d.\n", UBBD_MAX_WORKER_THREADS);
+		return -EINVAL;
+	}
+
+	if (opts->worker_cpus) {
+		cpu_set_t cpuset;
+
+		if (strlen(opts->worker_cpus) >= UBBD_NAME_MAX ||
+				ubbd_parse_cpulist(opts->worker_cpus, &cpuset)) {
+			fprintf(stderr, "invalid worker cpus: %s.\n", opts->worker_cpus);
+			return -EINVAL;
+		}
+	}
+
+	if (!opts->queue_engine)
+		opts->queue_engine = "poll";
+
+	if (str_to_queue_engine(opts->queue_engine) < 0) {
+		fprintf(stderr, "invalid queue engine: %s, should be poll or io_uring.\n", opts->queue_engine);
+		return -EINVAL;
+	}
+
+	if (!opts->steal_policy)
+		opts->steal_policy = "none";
+
+	if (str_to_steal_policy(opts->steal_policy) < 0) {
+		fprintf(stderr, "invalid steal policy: %s, should be none, idle or always.\n", opts->steal_policy);
+		return -EINVAL;
+	}
+
+	ret = validate_qos_opts(&opts->qos);
+	if (ret)
+		return ret;
+
+	if (opts->merge_max_kb > UBBD_MAX_MERGE_KB) {
+		fprintf(stderr, "merge max kb should not be larger than %d.\n", UBBD_MAX_MERGE_KB);
+		return -EINVAL;
+	}
+
+	if (opts->write_back_mb && !opts->write_back_age_ms)
+		opts->write_back_age_ms = DEFAULT_WRITE_BACK_AGE_MS;
+
+	if (opts->write_back_journal) {
+		if (!opts->write_back_mb) {
+			fprintf(stderr, "write back journal needs write back mb.\n");
+			return -EINVAL;
+		}
+
+		if (opts->write_back_journal[0] != '/' ||
+				strlen(opts->write_back_journal) >= UBBD_PATH_MAX) {
+			fprintf(stderr, "invalid write back journal: %s, should be an absolute path.\n",
+					opts->write_back_journal);
+			return -EINVAL;
+		}
+	}
+
 	if (!strcmp("cache", opts->type)) {
 		if (!opts->cache_dev.cache_mode) {
 			fprintf(stderr, "cache_mode is required for cache mapping.\n");
@@ -372,6 +791,15 @@ static int validate_map_opts(struct ubbd_map_options *opts)
 			fprintf(stderr, "backing options is invalid\n");
 			return ret;
 		}
+
+		/* backing file is named by dev id, only one for a device */
+		if ((opts->cache_dev.cache_opts.mem.backing &&
+		     str_to_mem_backing(opts->cache_dev.cache_opts.mem.backing) != UBBD_MEM_BACKING_HEAP) ||
+		    (opts->cache_dev.backing_opts.mem.backing &&
+		     str_to_mem_backing(opts->cache_dev.backing_opts.mem.backing) != UBBD_MEM_BACKING_HEAP)) {
+			fprintf(stderr, "mem backing of cache devices can only be heap.\n");
+			return -EINVAL;
+		}
 	} else {
 		opts->generic_dev.opts.type = opts->type;
 		return validate_generic_map_opts(&opts->generic_dev.opts);
@@ -503,6 +931,7 @@ int ubbd_req_stats(struct ubbd_req_stats_options *opts, struct ubbdd_mgmt_rsp *r
 	ubbd_request_header_init(&req.header);
 	req.cmd = UBBDD_MGMT_CMD_REQ_STATS;
 	req.u.req_stats.dev_id = opts->ubbdid;
+	req.u.req_stats.queue_id = opts->queue_id;
 
 	return generic_request_and_wait(&req, rsp);
 }
@@ -581,3 +1010,30 @@ int ubbd_device_info(struct ubbd_info_options *opts, struct ubbdd_mgmt_rsp *rsp)
 
 	return generic_request_and_wait(&req, rsp);
 }
+
+static int validate_set_qos_opts(struct ubbd_set_qos_options *opts) {
+	int ret;
+
+	ret = validate_ubbdid(opts->ubbdid);
+	if (ret)
+		return ret;
+
+	return validate_qos_opts(&opts->qos);
+}
+
+int ubbd_set_qos(struct ubbd_set_qos_options *opts, struct ubbdd_mgmt_rsp *rsp)
+{
+	struct ubbdd_mgmt_request req = { 0 };
+	int ret;
+
+	ret = validate_set_qos_opts(opts);
+	if (ret)
+		return ret;
+
+	ubbd_request_header_init(&req.header);
+	req.cmd = UBBDD_MGMT_CMD_SET_QOS;
+	req.u.set_qos.dev_id = opts->ubbdid;
+	memcpy(&req.u.set_qos.qos, &opts->qos, sizeof(struct ubbd_qos_opts));
+
+	return generic_request_and_wait(&req, rsp);
+}
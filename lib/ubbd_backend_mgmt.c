@@ -147,32 +147,34 @@ static void *mgmt_thread_fn(void* args)
 				ret = 0;
 				break;
 			case UBBD_BACKEND_MGMT_CMD_REQ_STATS:
-				mgmt_rsp.u.req_stats.num_queues = ubbd_backend->num_queues;
-				if (true) {
-					int i;
-					for (i = 0; i < ubbd_backend->num_queues; i++) {
-						memcpy(&mgmt_rsp.u.req_stats.req_stats[i],
-								&ubbd_backend->queues[i].req_stats,
-								sizeof(struct ubbd_req_stats));
-					}
+				queue_id = mgmt_req.u.req_stats.queue_id;
+				if (queue_id < 0 || queue_id >= ubbd_backend->num_queues) {
+					ubbd_err("invalid queue_id for req-stats: %d\n", queue_id);
+					ret = -EINVAL;
+					break;
 				}
+				mgmt_rsp.u.req_stats.num_queues = ubbd_backend->num_queues;
+				ubbd_queue_get_stats(&ubbd_backend->queues[queue_id],
+						&mgmt_rsp.u.req_stats.req_stats);
 				ret = 0;
 				break;
 			case UBBD_BACKEND_MGMT_CMD_REQ_STATS_RESET:
 				if (true) {
 					int i;
-					for (i = 0; i < ubbd_backend->num_queues; i++) {
-						pthread_mutex_lock(&ubbd_backend->queues[i].req_stats_lock);
-						ubbd_backend->queues[i].req_stats.reqs = 0;
-						ubbd_backend->queues[i].req_stats.handle_time = 0;
-						pthread_mutex_unlock(&ubbd_backend->queues[i].req_stats_lock);
-					}
+					for (i = 0; i < ubbd_backend->num_queues; i++)
+						ubbd_queue_reset_stats(&ubbd_backend->queues[i]);
 				}
 				ret = 0;
 				break;
 			case UBBD_BACKEND_MGMT_CMD_SET_OPTS:
 				ret = ubbd_backend_set_opts(ubbd_backend, &mgmt_req.u.set_opts);
 				break;
+			case UBBD_BACKEND_MGMT_CMD_SET_QOS:
+				ret = ubbd_backend_set_qos(ubbd_backend, &mgmt_req.u.set_qos);
+				break;
+			case UBBD_BACKEND_MGMT_CMD_GET_STATS:
+				ret = ubbd_backend_get_stats(ubbd_backend, &mgmt_rsp.u.get_stats);
+				break;
 			default:
 				ubbd_err("unrecognized command: %d\n", mgmt_req.cmd);
 				ret = -EINVAL;
@@ -1,7 +1,10 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
+#include <dlfcn.h>
+#include <limits.h>
 
 #include "utils.h"
 #include "list.h"
@@ -10,13 +13,96 @@
 #include "ubbd_netlink.h"
 #include "ubbd_queue.h"
 
-extern struct ubbd_backend_ops rbd_backend_ops;
-extern struct ubbd_backend_ops file_backend_ops;
-extern struct ubbd_backend_ops null_backend_ops;
-extern struct ubbd_backend_ops ssh_backend_ops;
-extern struct ubbd_backend_ops cache_backend_ops;
-extern struct ubbd_backend_ops s3_backend_ops;
-extern struct ubbd_backend_ops mem_backend_ops;
+extern struct ubbd_backend_module file_backend_module;
+extern struct ubbd_backend_module null_backend_module;
+extern struct ubbd_backend_module mem_backend_module;
+
+static struct ubbd_backend_module *backend_modules[UBBD_DEV_TYPE_MAX] = {
+	[UBBD_DEV_TYPE_FILE] = &file_backend_module,
+	[UBBD_DEV_TYPE_NULL] = &null_backend_module,
+	[UBBD_DEV_TYPE_MEM] = &mem_backend_module,
+};
+
+/* backends built as modules, loaded by backend_module_get() */
+static const char *backend_module_names[UBBD_DEV_TYPE_MAX] = {
+	[UBBD_DEV_TYPE_RBD] = "rbd",
+	[UBBD_DEV_TYPE_SSH] = "ssh",
+	[UBBD_DEV_TYPE_CACHE] = "cache",
+	[UBBD_DEV_TYPE_S3] = "s3",
+	[UBBD_DEV_TYPE_ZRAM] = "zram",
+};
+
+static pthread_mutex_t backend_modules_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* modules are never unloaded, backends may be created again later */
+static struct ubbd_backend_module *backend_module_load(enum ubbd_dev_type type)
+{
+	const char *name = backend_module_names[type];
+	struct ubbd_backend_module *module;
+	char path[PATH_MAX];
+	char sym[UBBD_NAME_MAX];
+	const char *dir;
+	void *handle;
+
+	dir = getenv(UBBD_BACKEND_MODULE_DIR_ENV);
+	if (!dir)
+		dir = UBBD_BACKEND_MODULE_DIR;
+
+	snprintf(path, sizeof(path), "%s/ubbd-backend-%s.so", dir, name);
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		ubbd_err("failed to load backend module %s: %s\n", path, dlerror());
+		return NULL;
+	}
+
+	snprintf(sym, sizeof(sym), "%s_backend_module", name);
+	module = dlsym(handle, sym);
+	if (!module) {
+		ubbd_err("no %s in backend module %s\n", sym, path);
+		goto close;
+	}
+
+	if (module->version != UBBD_BACKEND_MODULE_VERSION) {
+		ubbd_err("backend module %s version %u, expected %u\n",
+				path, module->version, UBBD_BACKEND_MODULE_VERSION);
+		goto close;
+	}
+
+	if (module->dev_type != type || !module->ops) {
+		ubbd_err("backend module %s is not a %s backend\n", path, name);
+		goto close;
+	}
+
+	ubbd_info("loaded backend module %s\n", path);
+
+	return module;
+close:
+	dlclose(handle);
+	return NULL;
+}
+
+static struct ubbd_backend_module *backend_module_get(enum ubbd_dev_type type)
+{
+	struct ubbd_backend_module *module;
+
+	if (type < 0 || type >= UBBD_DEV_TYPE_MAX) {
+		ubbd_err("Unknown dev type: %d\n", type);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&backend_modules_lock);
+	module = backend_modules[type];
+	if (!module && backend_module_names[type]) {
+		module = backend_module_load(type);
+		backend_modules[type] = module;
+	}
+	pthread_mutex_unlock(&backend_modules_lock);
+
+	if (!module)
+		ubbd_err("no backend for dev type: %d\n", type);
+
+	return module;
+}
 
 static int ubbd_backend_init(struct ubbd_backend *ubbd_b, struct ubbd_backend_conf *conf)
 {
@@ -27,6 +113,14 @@ static int ubbd_backend_init(struct ubbd_backend *ubbd_b, struct ubbd_backend_co
 	ubbd_b->num_queues = conf->num_queues;
 	ubbd_b->status = UBBD_BACKEND_STATUS_INIT;
 
+	ret = ubbd_qos_init(&ubbd_b->qos, &conf->dev_info.queue_opts.qos, get_ns());
+	if (ret) {
+		ubbd_err("failed to init qos: %d\n", ret);
+		goto out;
+	}
+
+	ubbd_flush_tracker_init(&ubbd_b->flush);
+
 	ubbd_b->queues = calloc(ubbd_b->num_queues, sizeof(struct ubbd_queue));
 	if (!ubbd_b->queues) {
 		ubbd_err("failed to alloc queues\n");
@@ -44,108 +138,98 @@ static int ubbd_backend_init(struct ubbd_backend *ubbd_b, struct ubbd_backend_co
 		ubbd_q->status = conf->queue_infos[i].status;
 		memcpy(&ubbd_q->cpuset, &conf->queue_infos[i].cpuset, sizeof(cpu_set_t));
 		ubbd_q->index = i;
+		ubbd_q->poll_mode = conf->dev_info.queue_opts.poll_mode;
+		ubbd_q->poll_spin_ns = (uint64_t)conf->dev_info.queue_opts.poll_spin_us * 1000;
+		ubbd_q->ce_batch_max = conf->dev_info.queue_opts.ce_batch;
+		ubbd_q->ce_batch_ns = (uint64_t)conf->dev_info.queue_opts.ce_batch_us * 1000;
+		ubbd_q->merge_max_bytes = conf->dev_info.queue_opts.merge_max_kb * 1024;
+		ubbd_q->engine = conf->dev_info.queue_opts.engine;
+		ubbd_q->steal_policy = conf->dev_info.queue_opts.steal_policy;
+		pthread_spin_init(&ubbd_q->steal.lock, PTHREAD_PROCESS_PRIVATE);
+
+		ubbd_q->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ubbd_q->wakeup_fd < 0) {
+			ubbd_err("failed to create wakeup eventfd for queue%d\n", i);
+			ret = -errno;
+			pthread_spin_destroy(&ubbd_q->steal.lock);
+			goto close_wakeup_fds;
+		}
 	}
 
 	return 0;
 
+close_wakeup_fds:
+	while (--i >= 0) {
+		close(ubbd_b->queues[i].wakeup_fd);
+		pthread_spin_destroy(&ubbd_b->queues[i].steal.lock);
+	}
+	free(ubbd_b->queues);
+	ubbd_b->queues = NULL;
 out:
 	return ret;
 }
 
-struct ubbd_backend *backend_create(struct __ubbd_dev_info *info)
+static void ubbd_backend_exit(struct ubbd_backend *ubbd_b)
 {
-	struct ubbd_backend *ubbd_b;
-	struct ubbd_backend_ops *backend_ops = NULL;
-
-	if (info->header.magic != UBBD_DEV_INFO_MAGIC) {
-		ubbd_err("bad magic in ubbd_dev_info: %llx.\n", info->header.magic);
-		return NULL;
-	}
+	int i;
 
-	if (info->type == UBBD_DEV_TYPE_FILE) {
-		backend_ops = &file_backend_ops;
-	} else if (info->type == UBBD_DEV_TYPE_RBD) {
-		backend_ops = &rbd_backend_ops;
-	} else if (info->type == UBBD_DEV_TYPE_NULL) {
-		backend_ops = &null_backend_ops;
-	} else if (info->type == UBBD_DEV_TYPE_SSH) {
-		backend_ops = &ssh_backend_ops;
-	} else if (info->type == UBBD_DEV_TYPE_S3) {
-		backend_ops = &s3_backend_ops;
-	} else if (info->type == UBBD_DEV_TYPE_MEM) {
-		backend_ops = &mem_backend_ops;
-	}
-	
-	if (backend_ops == NULL) {
-		ubbd_err("Unknown dev type: %d\n", info->type);
+	if (!ubbd_b->queues)
+		return;
 
-		return NULL;
-	} else {
-		if (!backend_ops->create) {
-			ubbd_err("no create function support for this backend.\n");
-			return NULL;
-		}
-
-		ubbd_b = backend_ops->create(info);
-		if (ubbd_b == NULL) {
-			return NULL;
-		}
-		ubbd_b->dev_size = info->size;
+	for (i = 0; i < ubbd_b->num_queues; i++) {
+		close(ubbd_b->queues[i].wakeup_fd);
+		pthread_spin_destroy(&ubbd_b->queues[i].steal.lock);
 	}
-
-	return ubbd_b;
 }
 
-struct ubbd_backend *cache_backend_create(struct ubbd_backend_conf *conf)
+struct ubbd_backend *backend_create(struct __ubbd_dev_info *info)
 {
-	struct ubbd_cache_backend *cache_b;
+	struct ubbd_backend_module *module;
 	struct ubbd_backend *ubbd_b;
-	struct ubbd_dev_info *dev_info = &conf->dev_info;
 
-	cache_b = calloc(1, sizeof(struct ubbd_cache_backend));
-	if (!cache_b) {
-		ubbd_err("failed to alloc cache_b.\n");
+	if (info->header.magic != UBBD_DEV_INFO_MAGIC) {
+		ubbd_err("bad magic in ubbd_dev_info: %llx.\n", info->header.magic);
 		return NULL;
 	}
 
-	cache_b->cache_backend = backend_create(&dev_info->cache_dev.cache_info);
-	if (!cache_b->cache_backend) {
-		goto free_cache_b;
-	}
+	module = backend_module_get(info->type);
+	if (!module)
+		return NULL;
 
-	cache_b->backing_backend = backend_create(&dev_info->cache_dev.backing_info);
-	if (!cache_b->backing_backend) {
-		goto free_cache_backend;
+	if (!module->ops->create) {
+		ubbd_err("no create function support for this backend.\n");
+		return NULL;
 	}
 
-	cache_b->cache_mode = conf->cache_mode;
-
-	ubbd_b = &cache_b->ubbd_b;
-	ubbd_b->dev_type = UBBD_DEV_TYPE_CACHE;
-	ubbd_b->backend_ops = &cache_backend_ops;
-
-	return &cache_b->ubbd_b;
-
-free_cache_backend:
-	free(cache_b->cache_backend);
-free_cache_b:
-	free(cache_b);
+	ubbd_b = module->ops->create(info);
+	if (ubbd_b == NULL) {
+		return NULL;
+	}
+	ubbd_b->dev_size = info->size;
 
-	return NULL;
+	return ubbd_b;
 }
 
 struct ubbd_backend *ubbd_backend_create(struct ubbd_backend_conf *conf)
 {
+	struct ubbd_backend_module *module;
 	struct ubbd_backend *ubbd_b;
 	struct ubbd_dev_info *dev_info = &conf->dev_info;
 	int ret;
 
-	if (conf->dev_type == UBBD_DEV_TYPE_CACHE) {
-		ubbd_b = cache_backend_create(conf);
+	module = backend_module_get(conf->dev_type);
+	if (!module)
+		return NULL;
+
+	if (module->create_conf) {
+		ubbd_b = module->create_conf(conf);
 	} else {
 		ubbd_b = backend_create(&dev_info->generic_dev.info);
 	}
 
+	if (!ubbd_b)
+		return NULL;
+
 	ubbd_b->dev_id = conf->dev_id;
 	ubbd_b->dev_size = conf->dev_size;
 	memcpy(&ubbd_b->dev_info, dev_info, sizeof(struct ubbd_dev_info));
@@ -169,28 +253,675 @@ int ubbd_backend_open(struct ubbd_backend *ubbd_b)
 	return ubbd_b->backend_ops->open(ubbd_b);
 }
 
+static void backend_wbuf_stop(struct ubbd_backend *ubbd_b);
+
 void ubbd_backend_close(struct ubbd_backend *ubbd_b)
 {
+	/* destage ios may go to workers */
+	backend_wbuf_stop(ubbd_b);
+
+	/* queues are stopped, workers finish the queued ios and exit */
+	ubbd_worker_pool_destroy(ubbd_b->workers);
+	ubbd_b->workers = NULL;
+	ubbd_worker_pool_destroy(ubbd_b->flush_worker);
+	ubbd_b->flush_worker = NULL;
+
+	if (ubbd_b->rcache) {
+		ubbd_rcache_exit(ubbd_b->rcache);
+		free(ubbd_b->rcache);
+		ubbd_b->rcache = NULL;
+	}
+
 	ubbd_b->backend_ops->close(ubbd_b);
 }
 
+static int backend_dispatch_io(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	switch (io->io_type) {
+	case UBBD_BACKEND_IO_WRITE:
+		return ubbd_b->backend_ops->writev(ubbd_b, io);
+	case UBBD_BACKEND_IO_READ:
+		return ubbd_b->backend_ops->readv(ubbd_b, io);
+	case UBBD_BACKEND_IO_FLUSH:
+		return ubbd_b->backend_ops->flush(ubbd_b, io);
+	case UBBD_BACKEND_IO_DISCARD:
+		return ubbd_b->backend_ops->discard(ubbd_b, io);
+	case UBBD_BACKEND_IO_WRITEZEROS:
+		return ubbd_b->backend_ops->write_zeros(ubbd_b, io);
+	default:
+		ubbd_err("unknown io type: %d\n", io->io_type);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Split
+ *
+ * An io not fitting in ubbd_b->limits is split into child ios, each of
+ * them holds a slice of the parent iov, or a bounce buffer if the parent
+ * iov is not aligned to dma_align. The parent io is finished with the
+ * first error of children when the last child finishes.
+ */
+struct backend_split {
+	struct ubbd_backend_io *io;
+	int pending;
+	int ret;
+};
+
+struct backend_split_io_data {
+	struct backend_split *split;
+	/* data of child at skip in parent iov, copied back for read */
+	void *bounce;
+	uint64_t skip;
+	struct ubbd_backend_io io;
+};
+
+static bool io_has_data(struct ubbd_backend_io *io)
+{
+	return (io->io_type == UBBD_BACKEND_IO_WRITE ||
+		io->io_type == UBBD_BACKEND_IO_READ);
+}
+
+bool ubbd_backend_io_need_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	struct ubbd_io_limits *limits = &ubbd_b->limits;
+	uint32_t gran = limits->discard_granularity;
+
+	switch (io->io_type) {
+	case UBBD_BACKEND_IO_WRITE:
+	case UBBD_BACKEND_IO_READ:
+		if (limits->max_iov_cnt && io->iov_cnt > limits->max_iov_cnt)
+			return true;
+		if (!ubbd_iov_aligned(io->iov, io->iov_cnt, limits->dma_align))
+			return true;
+		break;
+	case UBBD_BACKEND_IO_DISCARD:
+		if (gran && (io->offset % gran || io->len % gran))
+			return true;
+		break;
+	case UBBD_BACKEND_IO_WRITEZEROS:
+		break;
+	default:
+		return false;
+	}
+
+	return (ubbd_split_len(limits, io->offset, io->len) < io->len);
+}
+
+static int backend_split_io_finish(struct context *ctx, int ret)
+{
+	struct backend_split_io_data *data = (struct backend_split_io_data *)ctx->data;
+	struct backend_split *split = data->split;
+	struct ubbd_backend_io *parent = split->io;
+
+	if (data->bounce) {
+		if (!ret && parent->io_type == UBBD_BACKEND_IO_READ)
+			ubbd_buf_to_iov(data->bounce, data->io.len, parent->iov,
+					parent->iov_cnt, data->skip);
+		free(data->bounce);
+	}
+
+	if (ret)
+		__atomic_compare_exchange_n(&split->ret, &(int){ 0 }, ret, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	if (__atomic_sub_fetch(&split->pending, 1, __ATOMIC_ACQ_REL))
+		return 0;
+
+	ubbd_backend_io_finish(parent, __atomic_load_n(&split->ret, __ATOMIC_RELAXED));
+	free(split);
+
+	return 0;
+}
+
+static struct ubbd_backend_io *backend_split_io_alloc(struct ubbd_backend *ubbd_b,
+		struct backend_split *split, enum ubbd_backend_io_type type,
+		uint64_t skip, uint32_t len, bool bounce)
+{
+	struct ubbd_backend_io *parent = split->io;
+	struct backend_split_io_data *data;
+	struct ubbd_backend_io *io;
+	struct context *ctx;
+	int iov_cnt = 0;
+
+	/* write-zeros child of a write has no data */
+	if (type == parent->io_type && io_has_data(parent))
+		iov_cnt = (bounce ? 1 : ubbd_iov_slice(parent->iov, parent->iov_cnt, skip, len, NULL));
+
+	ctx = context_alloc(sizeof(struct backend_split_io_data) + sizeof(struct iovec) * iov_cnt);
+	if (!ctx)
+		return NULL;
+
+	data = (struct backend_split_io_data *)ctx->data;
+	data->split = split;
+	data->skip = skip;
+	io = &data->io;
+
+	if (bounce) {
+		if (posix_memalign(&data->bounce, ubbd_b->limits.dma_align, len)) {
+			context_free(ctx);
+			return NULL;
+		}
+
+		if (parent->io_type == UBBD_BACKEND_IO_WRITE)
+			ubbd_iov_to_buf(parent->iov, parent->iov_cnt, skip, data->bounce, len);
+		io->iov[0].iov_base = data->bounce;
+		io->iov[0].iov_len = len;
+	} else if (iov_cnt) {
+		ubbd_iov_slice(parent->iov, parent->iov_cnt, skip, len, io->iov);
+	}
+
+	ctx->finish = backend_split_io_finish;
+
+	io->ctx = ctx;
+	io->io_type = type;
+	io->offset = parent->offset + skip;
+	io->len = len;
+	io->iov_cnt = iov_cnt;
+	INIT_LIST_HEAD(&io->node);
+
+	return io;
+}
+
+static void backend_split_io_free(struct ubbd_backend_io *io)
+{
+	struct backend_split_io_data *data = (struct backend_split_io_data *)io->ctx->data;
+
+	free(data->bounce);
+	context_free(io->ctx);
+}
+
+/*
+ * Split io into child ios on children list, return the number of them,
+ * caller dispatches them instead of io. A discard smaller than granule
+ * has nothing left to do, io is finished and 0 is returned.
+ */
+int ubbd_backend_io_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io,
+		struct list_head *children)
+{
+	struct ubbd_io_limits *limits = &ubbd_b->limits;
+	struct ubbd_backend_io *child, *tmp;
+	struct backend_split *split;
+	uint64_t off = io->offset;
+	uint32_t total = io->len;
+	uint64_t skip;
+	uint32_t len;
+	bool bounce = false;
+	int nr = 0;
+
+	if (io->io_type == UBBD_BACKEND_IO_DISCARD) {
+		ubbd_discard_align(limits, &off, &total);
+		if (!total) {
+			ubbd_backend_io_finish(io, 0);
+			return 0;
+		}
+	}
+
+	if (io_has_data(io))
+		bounce = !ubbd_iov_aligned(io->iov, io->iov_cnt, limits->dma_align);
+
+	split = calloc(1, sizeof(*split));
+	if (!split)
+		return -ENOMEM;
+	split->io = io;
+
+	for (skip = off - io->offset; total; skip += len, total -= len) {
+		len = ubbd_split_len(limits, io->offset + skip, total);
+		if (io_has_data(io) && !bounce && limits->max_iov_cnt)
+			len = ubbd_iov_span(io->iov, io->iov_cnt, skip, len, limits->max_iov_cnt);
+
+		child = backend_split_io_alloc(ubbd_b, split, io->io_type, skip, len, bounce);
+		if (!child)
+			goto err;
+
+		list_add_tail(&child->node, children);
+		nr++;
+	}
+	split->pending = nr;
+
+	return nr;
+err:
+	list_for_each_entry_safe(child, tmp, children, node) {
+		list_del_init(&child->node);
+		backend_split_io_free(child);
+	}
+	free(split);
+
+	return -ENOMEM;
+}
+
+/*
+ * Split a write into write and write-zeros children by the runs of zero
+ * blocks in it, see ubbd_iov_zero_span(). Return the number of children,
+ * caller submits them instead of io. 0 is returned if io is left to
+ * caller: it has no zero block, it is all zero and turned into a
+ * write-zeros, or it is mixed and split_mixed is false. *zero_bytes is
+ * set to the bytes going to backend as write-zeros.
+ */
+int ubbd_backend_io_zero_split(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io,
+		uint32_t block, bool split_mixed, struct list_head *children,
+		uint64_t *zero_bytes)
+{
+	struct ubbd_backend_io *child, *tmp;
+	struct backend_split *split;
+	uint64_t skip;
+	uint32_t len;
+	bool zero;
+	int nr = 0;
+
+	*zero_bytes = 0;
+
+	len = ubbd_iov_zero_span(io->iov, io->iov_cnt, 0, io->len, io->offset, block, &zero);
+	if (len == io->len) {
+		if (zero) {
+			io->io_type = UBBD_BACKEND_IO_WRITEZEROS;
+			*zero_bytes = io->len;
+		}
+		return 0;
+	}
+
+	if (!split_mixed)
+		return 0;
+
+	split = calloc(1, sizeof(*split));
+	if (!split)
+		return -ENOMEM;
+	split->io = io;
+
+	for (skip = 0; skip < io->len; skip += len) {
+		/* the first run is found above */
+		if (skip)
+			len = ubbd_iov_zero_span(io->iov, io->iov_cnt, skip, io->len - skip,
+					io->offset + skip, block, &zero);
+
+		child = backend_split_io_alloc(ubbd_b, split,
+				(zero ? UBBD_BACKEND_IO_WRITEZEROS : UBBD_BACKEND_IO_WRITE),
+				skip, len, false);
+		if (!child)
+			goto err;
+
+		list_add_tail(&child->node, children);
+		nr++;
+		if (zero)
+			*zero_bytes += len;
+	}
+	split->pending = nr;
+
+	return nr;
+err:
+	list_for_each_entry_safe(child, tmp, children, node) {
+		list_del_init(&child->node);
+		backend_split_io_free(child);
+	}
+	free(split);
+	*zero_bytes = 0;
+
+	return -ENOMEM;
+}
+
+static int backend_split_dispatch(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	struct ubbd_backend_io *child, *tmp;
+	LIST_HEAD(children);
+	int ret;
+
+	ret = ubbd_backend_io_split(ubbd_b, io, &children);
+	if (ret < 0)
+		return ret;
+
+	list_for_each_entry_safe(child, tmp, &children, node) {
+		list_del_init(&child->node);
+		ret = backend_dispatch_io(ubbd_b, child);
+		if (ret) {
+			ubbd_err("ret of split io: %lu:%u: %d\n", child->offset, child->len, ret);
+			ubbd_backend_io_finish(child, ret);
+		}
+	}
+
+	return 0;
+}
+
+int ubbd_backend_dispatch_io(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	if (ubbd_backend_io_need_split(ubbd_b, io))
+		return backend_split_dispatch(ubbd_b, io);
+
+	return backend_dispatch_io(ubbd_b, io);
+}
+
+/*
+ * Dispatch io from a thread other than queue threads, it goes to
+ * workers if there are.
+ */
+void ubbd_backend_submit_io(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	int ret;
+
+	if (ubbd_b->workers) {
+		ubbd_worker_pool_queue(ubbd_b->workers, &io, 1);
+		return;
+	}
+
+	ret = ubbd_backend_dispatch_io(ubbd_b, io);
+	if (ret)
+		ubbd_backend_io_finish(io, ret);
+}
+
+struct backend_flush_io_data {
+	struct ubbd_backend *ubbd_b;
+	struct ubbd_backend_io io;
+};
+
+static void backend_flush_end(struct ubbd_backend *ubbd_b, int ret)
+{
+	struct ubbd_flush_req *req, *tmp;
+	LIST_HEAD(done);
+	bool reissue;
+
+	if (ret)
+		ubbd_err("backend flush failed: %d\n", ret);
+
+	reissue = ubbd_flush_end(&ubbd_b->flush, ret, &done);
+	list_for_each_entry_safe(req, tmp, &done, node) {
+		list_del_init(&req->node);
+		req->done(req, ret);
+	}
+
+	if (reissue)
+		ubbd_backend_flush_start(ubbd_b);
+}
+
+static int backend_flush_io_finish(struct context *ctx, int ret)
+{
+	struct backend_flush_io_data *data = (struct backend_flush_io_data *)ctx->data;
+
+	backend_flush_end(data->ubbd_b, ret);
+
+	return 0;
+}
+
+/*
+ * Issue a backend flush for the waiters in ubbd_b->flush, its completion
+ * finishes the flush requests covered by it.
+ */
+void ubbd_backend_flush_start(struct ubbd_backend *ubbd_b)
+{
+	struct backend_flush_io_data *data;
+	struct ubbd_backend_io *io;
+	struct context *ctx;
+	int ret;
+
+	ctx = context_alloc(sizeof(struct backend_flush_io_data));
+	if (!ctx) {
+		ubbd_err("failed to alloc backend flush io\n");
+		backend_flush_end(ubbd_b, -ENOMEM);
+		return;
+	}
+
+	data = (struct backend_flush_io_data *)ctx->data;
+	data->ubbd_b = ubbd_b;
+	ctx->finish = backend_flush_io_finish;
+
+	io = &data->io;
+	io->ctx = ctx;
+	io->io_type = UBBD_BACKEND_IO_FLUSH;
+
+	if (ubbd_b->workers) {
+		ubbd_worker_pool_queue(ubbd_b->workers, &io, 1);
+		return;
+	}
+
+	if (ubbd_b->flush_worker) {
+		ubbd_worker_pool_queue(ubbd_b->flush_worker, &io, 1);
+		return;
+	}
+
+	ret = ubbd_backend_dispatch_io(ubbd_b, io);
+	if (ret)
+		ubbd_backend_io_finish(io, ret);
+}
+
 void ubbd_backend_release(struct ubbd_backend *ubbd_b)
 {
+	ubbd_backend_exit(ubbd_b);
 	ubbd_b->backend_ops->release(ubbd_b);
 }
 
+/*
+ * Write-back
+ *
+ * Destager of ubbd_b->wbuf writes the dirty data to backend pass by
+ * pass, a pass waits for all of its ios, see ubbd_wbuf.h. A failed pass
+ * leaves the data in buffer and is retried a second later.
+ */
+struct backend_destage_pass {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+	int ret;
+};
+
+struct backend_destage_io_data {
+	struct ubbd_backend *ubbd_b;
+	struct backend_destage_pass *pass;
+	struct ubbd_backend_io io;
+};
+
+static int backend_destage_io_finish(struct context *ctx, int ret)
+{
+	struct backend_destage_io_data *data = (struct backend_destage_io_data *)ctx->data;
+	struct backend_destage_pass *pass = data->pass;
+
+	if (ret)
+		ubbd_err("destage io %lu:%u failed: %d\n", data->io.offset, data->io.len, ret);
+	else
+		ubbd_flush_write_done(&data->ubbd_b->flush);
+
+	pthread_mutex_lock(&pass->lock);
+	if (ret && !pass->ret)
+		pass->ret = ret;
+	if (!--pass->pending)
+		pthread_cond_signal(&pass->cond);
+	pthread_mutex_unlock(&pass->lock);
+
+	return 0;
+}
+
+static void backend_destage_submit(struct ubbd_backend *ubbd_b, struct ubbd_wbuf_pass *wpass,
+		struct backend_destage_pass *pass)
+{
+	struct backend_destage_io_data *data;
+	struct ubbd_wbuf_destage *d;
+	struct ubbd_backend_io *io;
+	struct context *ctx;
+
+	list_for_each_entry(d, &wpass->destages, node) {
+		ctx = context_alloc(sizeof(struct backend_destage_io_data) +
+				sizeof(struct iovec) * d->iov_cnt);
+		if (!ctx) {
+			pthread_mutex_lock(&pass->lock);
+			pass->ret = -ENOMEM;
+			pass->pending--;
+			pthread_mutex_unlock(&pass->lock);
+			continue;
+		}
+
+		data = (struct backend_destage_io_data *)ctx->data;
+		data->ubbd_b = ubbd_b;
+		data->pass = pass;
+		ctx->finish = backend_destage_io_finish;
+
+		io = &data->io;
+		io->ctx = ctx;
+		io->io_type = UBBD_BACKEND_IO_WRITE;
+		io->offset = d->off;
+		io->len = d->len;
+		io->iov_cnt = d->iov_cnt;
+		memcpy(io->iov, d->iov, sizeof(struct iovec) * d->iov_cnt);
+		INIT_LIST_HEAD(&io->node);
+
+		ubbd_backend_submit_io(ubbd_b, io);
+	}
+}
+
+static void *backend_destage_fn(void *arg)
+{
+	struct ubbd_backend *ubbd_b = arg;
+	struct ubbd_wbuf *wb = ubbd_b->wbuf;
+	struct backend_destage_pass pass;
+	struct ubbd_wbuf_pass wpass;
+
+	pthread_mutex_init(&pass.lock, NULL);
+	pthread_cond_init(&pass.cond, NULL);
+
+	while (ubbd_wbuf_wait_work(wb)) {
+		pass.ret = 0;
+		pass.pending = ubbd_wbuf_destage_prepare(wb, &wpass);
+		backend_destage_submit(ubbd_b, &wpass, &pass);
+
+		pthread_mutex_lock(&pass.lock);
+		while (pass.pending)
+			pthread_cond_wait(&pass.cond, &pass.lock);
+		pthread_mutex_unlock(&pass.lock);
+
+		ubbd_wbuf_destage_done(wb, &wpass, pass.ret);
+		if (!pass.ret)
+			continue;
+
+		if (__atomic_load_n(&wb->stopping, __ATOMIC_RELAXED)) {
+			ubbd_err("stop destage with data not written to backend: %d\n", pass.ret);
+			break;
+		}
+		sleep(1);
+	}
+
+	pthread_cond_destroy(&pass.cond);
+	pthread_mutex_destroy(&pass.lock);
+
+	return NULL;
+}
+
+static int backend_wbuf_start(struct ubbd_backend *ubbd_b)
+{
+	struct ubbd_queue_opts *queue_opts = &ubbd_b->dev_info.queue_opts;
+	uint32_t age_ms = queue_opts->write_back_age_ms;
+	struct ubbd_wbuf *wb;
+	int ret;
+
+	if (!age_ms)
+		age_ms = UBBD_WBUF_AGE_MS_DEFAULT;
+
+	wb = calloc(1, sizeof(struct ubbd_wbuf));
+	if (!wb)
+		return -ENOMEM;
+
+	ret = ubbd_wbuf_init(wb, (uint64_t)queue_opts->write_back_mb << 20,
+			(uint64_t)age_ms * 1000 * 1000);
+	if (ret)
+		goto free;
+
+	if (queue_opts->write_back_journal[0] != '\0') {
+		ret = ubbd_wbuf_journal_open(wb, queue_opts->write_back_journal);
+		if (ret < 0) {
+			ubbd_err("failed to open write back journal %s: %d\n",
+					queue_opts->write_back_journal, ret);
+			goto exit;
+		}
+
+		if (ret)
+			ubbd_info("replayed %d records of write back journal %s\n",
+					ret, queue_opts->write_back_journal);
+	}
+
+	ubbd_b->wbuf = wb;
+	ret = pthread_create(&ubbd_b->destage_thread, NULL, backend_destage_fn, ubbd_b);
+	if (ret) {
+		ubbd_err("failed to create destage thread: %d\n", ret);
+		ubbd_b->wbuf = NULL;
+		ret = -ret;
+		goto exit;
+	}
+
+	return 0;
+exit:
+	ubbd_wbuf_exit(wb);
+free:
+	free(wb);
+	return ret;
+}
+
+/* queues are stopped, destager writes all buffered data before exit */
+static void backend_wbuf_stop(struct ubbd_backend *ubbd_b)
+{
+	if (!ubbd_b->wbuf)
+		return;
+
+	ubbd_wbuf_stop(ubbd_b->wbuf);
+	pthread_join(ubbd_b->destage_thread, NULL);
+	ubbd_wbuf_exit(ubbd_b->wbuf);
+	free(ubbd_b->wbuf);
+	ubbd_b->wbuf = NULL;
+}
+
 int ubbd_backend_start(struct ubbd_backend *ubbd_b, bool start_queues)
 {
 	struct ubbd_queue *ubbd_q;
+	struct ubbd_queue_opts *queue_opts = &ubbd_b->dev_info.queue_opts;
 	int ret = 0;
 	int i;
 
+	if (ubbd_b->backend_ops->blocking && queue_opts->worker_threads && !ubbd_b->workers) {
+		ubbd_b->workers = ubbd_worker_pool_create(ubbd_b, queue_opts->worker_threads,
+				queue_opts->worker_cpus);
+		if (!ubbd_b->workers) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* dont block queue thread in backend flush */
+	if (ubbd_b->backend_ops->blocking && !ubbd_b->workers && !ubbd_b->flush_worker) {
+		ubbd_b->flush_worker = ubbd_worker_pool_create(ubbd_b, 1, NULL);
+		if (!ubbd_b->flush_worker) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (queue_opts->read_cache_mb && !ubbd_b->rcache) {
+		ubbd_b->rcache = calloc(1, sizeof(struct ubbd_rcache));
+		if (!ubbd_b->rcache) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = ubbd_rcache_init(ubbd_b->rcache, (uint64_t)queue_opts->read_cache_mb << 20);
+		if (ret) {
+			ubbd_err("failed to init read cache of %u MiB: %d\n", queue_opts->read_cache_mb, ret);
+			free(ubbd_b->rcache);
+			ubbd_b->rcache = NULL;
+			goto out;
+		}
+	}
+
+	if (queue_opts->zero_detect) {
+		if (ubbd_b->backend_ops->write_zeros)
+			ubbd_b->zero_block = (ubbd_b->limits.zero_granularity ? : UBBD_ZERO_BLOCK);
+		else
+			ubbd_info("zero detect is ignored, backend does not support write_zeros\n");
+	}
+
+	if (queue_opts->write_back_mb && !ubbd_b->wbuf) {
+		ret = backend_wbuf_start(ubbd_b);
+		if (ret)
+			goto out;
+	}
+
 	if (start_queues) {
 		for (i = 0; i < ubbd_b->num_queues; i++) {
 			ubbd_q = &ubbd_b->queues[i];
 			ubbd_q->ubbd_b = ubbd_b;
-			pthread_mutex_init(&ubbd_q->req_lock, NULL);
-			pthread_mutex_init(&ubbd_q->req_stats_lock, NULL);
 			ret = ubbd_queue_setup(ubbd_q);
 			if (ret)
 				goto out;
@@ -263,6 +994,29 @@ int ubbd_backend_set_opts(struct ubbd_backend *ubbd_b, struct ubbd_backend_opts
 	return ubbd_b->backend_ops->set_opts(ubbd_b, opts);
 }
 
+int ubbd_backend_set_qos(struct ubbd_backend *ubbd_b, struct ubbd_qos_opts *opts)
+{
+	int i;
+
+	ubbd_qos_set(&ubbd_b->qos, opts, get_ns());
+	memcpy(&ubbd_b->dev_info.queue_opts.qos, opts, sizeof(*opts));
+
+	/* throttled queues recheck with new limits */
+	for (i = 0; i < ubbd_b->num_queues; i++)
+		ubbd_queue_wakeup(&ubbd_b->queues[i]);
+
+	return 0;
+}
+
+int ubbd_backend_get_stats(struct ubbd_backend *ubbd_b, struct ubbd_backend_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!ubbd_b->backend_ops->get_stats)
+		return 0;
+
+	return ubbd_b->backend_ops->get_stats(ubbd_b, stats);
+}
+
 static char *get_backend_lock_path(int dev_id, int backend_id)
 {
 	char *path;
@@ -781,12 +781,15 @@ static void volume_submit_io(struct ocf_io *io)
 
 	if (io->dir == OCF_WRITE) {
 		ubbd_dbg("%s write %lu %u\n", ocf_uuid_to_str(uuid), io->addr, io->bytes);
-		ubbd_b->backend_ops->writev(ubbd_b, backend_io);
+		backend_io->io_type = UBBD_BACKEND_IO_WRITE;
 	} else {
 		ubbd_dbg("%s read %lu %u\n", ocf_uuid_to_str(uuid), io->addr, io->bytes);
-		ubbd_b->backend_ops->readv(ubbd_b, backend_io);
+		backend_io->io_type = UBBD_BACKEND_IO_READ;
 	}
 
+	/* split by limits of the cache or backing backend */
+	ubbd_backend_dispatch_io(ubbd_b, backend_io);
+
 	return;
 }
 
@@ -806,7 +809,8 @@ static void volume_submit_flush(struct ocf_io *io)
 		return;
 	}
 
-	ubbd_b->backend_ops->flush(ubbd_b, backend_io);
+	backend_io->io_type = UBBD_BACKEND_IO_FLUSH;
+	ubbd_backend_dispatch_io(ubbd_b, backend_io);
 
 	return;
 }
@@ -831,7 +835,8 @@ static void volume_submit_discard(struct ocf_io *io)
 		return;
 	}
 
-	ubbd_b->backend_ops->discard(ubbd_b, backend_io);
+	backend_io->io_type = UBBD_BACKEND_IO_DISCARD;
+	ubbd_backend_dispatch_io(ubbd_b, backend_io);
 
 	return;
 }
@@ -1447,3 +1452,49 @@ struct ubbd_backend_ops cache_backend_ops = {
 	.flush = cache_backend_flush,
 	.set_opts = cache_backend_set_opts,
 };
+
+static struct ubbd_backend *cache_backend_create(struct ubbd_backend_conf *conf)
+{
+	struct ubbd_cache_backend *cache_b;
+	struct ubbd_backend *ubbd_b;
+	struct ubbd_dev_info *dev_info = &conf->dev_info;
+
+	cache_b = calloc(1, sizeof(struct ubbd_cache_backend));
+	if (!cache_b) {
+		ubbd_err("failed to alloc cache_b.\n");
+		return NULL;
+	}
+
+	cache_b->cache_backend = backend_create(&dev_info->cache_dev.cache_info);
+	if (!cache_b->cache_backend) {
+		goto free_cache_b;
+	}
+
+	cache_b->backing_backend = backend_create(&dev_info->cache_dev.backing_info);
+	if (!cache_b->backing_backend) {
+		goto free_cache_backend;
+	}
+
+	cache_b->cache_mode = conf->cache_mode;
+
+	ubbd_b = &cache_b->ubbd_b;
+	ubbd_b->dev_type = UBBD_DEV_TYPE_CACHE;
+	ubbd_b->backend_ops = &cache_backend_ops;
+
+	return &cache_b->ubbd_b;
+
+free_cache_backend:
+	free(cache_b->cache_backend);
+free_cache_b:
+	free(cache_b);
+
+	return NULL;
+}
+
+struct ubbd_backend_module cache_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "cache",
+	.dev_type = UBBD_DEV_TYPE_CACHE,
+	.ops = &cache_backend_ops,
+	.create_conf = cache_backend_create,
+};
@@ -2,10 +2,325 @@
 #include "ubbd_uio.h"
 #include "ubbd_backend.h"
 
+#ifdef HAVE_LIBAIO
+#include <libaio.h>
+#endif
+
 #define FILE_BACKEND(ubbd_b) ((struct ubbd_file_backend *)container_of(ubbd_b, struct ubbd_file_backend, ubbd_b))
 
 struct ubbd_backend_ops file_backend_ops;
 
+static void file_backend_sync_rw(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	ssize_t ret;
+
+	if (io->io_type == UBBD_BACKEND_IO_WRITE) {
+		ret = pwritev(file_b->fd, io->iov, io->iov_cnt, io->offset);
+		if (ret < 0)
+			ubbd_err("result of pwritev: %ld\n", ret);
+	} else {
+		ret = preadv(file_b->fd, io->iov, io->iov_cnt, io->offset);
+		if (ret < 0)
+			ubbd_err("result of preadv: %ld\n", ret);
+	}
+	ubbd_backend_io_finish(io, (ret == io->len? 0 : ret));
+}
+
+/* finish io with result of an async engine, a short read or write is an error */
+static inline void file_async_complete(struct ubbd_backend_io *io, long res,
+		const char *engine)
+{
+	if (res < 0)
+		ubbd_err("result of file %s %s: %ld\n", engine,
+				io->io_type == UBBD_BACKEND_IO_WRITE ? "write" : "read", res);
+	else if (res != io->len)
+		res = -EIO;
+	else
+		res = 0;
+
+	ubbd_backend_io_finish(io, res);
+}
+
+#ifdef HAVE_LIBURING
+static void file_uring_complete(struct ubbd_uring_cb *cb, int res)
+{
+	struct ubbd_backend_io *io = container_of(cb, struct ubbd_backend_io, uring_cb);
+
+	file_async_complete(io, res, "io_uring");
+}
+
+/*
+ * Read or write io on the io_uring of queue running this backend, the
+ * queue thread reaps its completion. Return false if the thread has no
+ * ring, io is done by syscall then, e.g. in workers.
+ */
+static bool file_backend_uring_rw(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int flags = 0;
+	int fd = file_b->fd;
+	int buf;
+
+	sqe = ubbd_uring_get_sqe(&io->uring_cb);
+	if (!sqe)
+		return false;
+
+	io->uring_cb.complete = file_uring_complete;
+	if (!ubbd_uring_fixed_file(file_b->fd)) {
+		fd = 0;
+		flags |= IOSQE_FIXED_FILE;
+	}
+
+	/* data in the uio map goes by its registered pages */
+	buf = io->iov_cnt == 1 ? ubbd_uring_fixed_buf(io->iov[0].iov_base, io->iov[0].iov_len) : -1;
+	if (io->io_type == UBBD_BACKEND_IO_WRITE) {
+		if (buf >= 0)
+			io_uring_prep_write_fixed(sqe, fd, io->iov[0].iov_base, io->len, io->offset, buf);
+		else
+			io_uring_prep_writev(sqe, fd, io->iov, io->iov_cnt, io->offset);
+	} else {
+		if (buf >= 0)
+			io_uring_prep_read_fixed(sqe, fd, io->iov[0].iov_base, io->len, io->offset, buf);
+		else
+			io_uring_prep_readv(sqe, fd, io->iov, io->iov_cnt, io->offset);
+	}
+	io_uring_sqe_set_flags(sqe, flags);
+	io_uring_sqe_set_data(sqe, &io->uring_cb);
+
+	return true;
+}
+#else
+static bool file_backend_uring_rw(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	return false;
+}
+#endif
+
+#ifdef HAVE_LIBAIO
+/* events of io_setup(), io_submit() beyond it goes by syscall */
+#define FILE_AIO_DEPTH		256
+#define FILE_AIO_REAP		64
+
+/*
+ * Linux aio context of a queue thread. Completions signal wakeup_fd of
+ * the queue, which reaps them by the poller, so iocbs are only touched
+ * by the queue thread and need no lock.
+ */
+struct file_aio_ctx {
+	struct list_head		node;
+	struct ubbd_queue_poller	poller;
+	io_context_t			ctx;
+	int				efd;
+	struct iocb			iocbs[FILE_AIO_DEPTH];
+	struct iocb			*free_iocbs[FILE_AIO_DEPTH];
+	int				nr_free;
+	/* iocbs prepared in this batch, see file_aio_submit() */
+	struct iocb			*pending[FILE_AIO_DEPTH];
+	int				nr_pending;
+};
+
+/* marks a thread with no aio context, e.g. a worker */
+static char file_aio_none;
+
+static void file_aio_poll(struct ubbd_queue_poller *poller)
+{
+	struct file_aio_ctx *ctx = container_of(poller, struct file_aio_ctx, poller);
+	struct io_event events[FILE_AIO_REAP];
+	struct timespec ts = { 0, 0 };
+	struct ubbd_backend_io *io;
+	int nr;
+	int i;
+
+	do {
+		nr = io_getevents(ctx->ctx, 0, FILE_AIO_REAP, events, &ts);
+		if (nr < 0) {
+			if (nr != -EINTR)
+				ubbd_err("failed to get aio events: %d\n", nr);
+			return;
+		}
+
+		for (i = 0; i < nr; i++) {
+			io = events[i].data;
+			ctx->free_iocbs[ctx->nr_free++] = events[i].obj;
+			ctx->poller.inflight--;
+			file_async_complete(io, (long)events[i].res, "aio");
+		}
+	} while (nr == FILE_AIO_REAP);
+}
+
+static void file_aio_ctx_free(struct file_aio_ctx *ctx)
+{
+	/* io_destroy() waits for io still in flight */
+	io_destroy(ctx->ctx);
+	free(ctx);
+}
+
+/*
+ * Contexts are created by the first io of each queue thread, and stay
+ * until backend is released. NULL if the thread is not a queue thread
+ * or aio is not available, io is done by syscall then.
+ */
+static struct file_aio_ctx *file_aio_ctx_get(struct ubbd_file_backend *file_b)
+{
+	struct file_aio_ctx *ctx;
+	int ret;
+
+	ctx = pthread_getspecific(file_b->aio_key);
+	if (ctx)
+		return ctx == (void *)&file_aio_none ? NULL : ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ret = io_setup(FILE_AIO_DEPTH, &ctx->ctx);
+	if (ret) {
+		ubbd_err("failed to setup aio context: %d, fall back to sync io\n", ret);
+		goto free_ctx;
+	}
+
+	for (ctx->nr_free = 0; ctx->nr_free < FILE_AIO_DEPTH; ctx->nr_free++)
+		ctx->free_iocbs[ctx->nr_free] = &ctx->iocbs[ctx->nr_free];
+
+	ctx->poller.poll = file_aio_poll;
+	ctx->efd = ubbd_queue_add_poller(&ctx->poller);
+	if (ctx->efd < 0)
+		goto destroy_ctx;
+
+	pthread_setspecific(file_b->aio_key, ctx);
+
+	pthread_mutex_lock(&file_b->aio_lock);
+	list_add_tail(&ctx->node, &file_b->aio_list);
+	pthread_mutex_unlock(&file_b->aio_lock);
+
+	return ctx;
+
+destroy_ctx:
+	io_destroy(ctx->ctx);
+free_ctx:
+	free(ctx);
+	pthread_setspecific(file_b->aio_key, &file_aio_none);
+	return NULL;
+}
+
+/*
+ * Prepare io for the next file_aio_submit(), return false if it has to
+ * go by syscall: not in a queue thread, all iocbs in use, or io not
+ * aligned for O_DIRECT, which aio fails with -EINVAL.
+ */
+static bool file_aio_prep(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	uint32_t align = file_b->ubbd_b.limits.dma_align;
+	struct file_aio_ctx *ctx;
+	struct iocb *iocb;
+
+	if (io->offset % align || io->len % align ||
+			!ubbd_iov_aligned(io->iov, io->iov_cnt, align))
+		return false;
+
+	ctx = file_aio_ctx_get(file_b);
+	if (!ctx || !ctx->nr_free)
+		return false;
+
+	iocb = ctx->free_iocbs[--ctx->nr_free];
+	if (io->io_type == UBBD_BACKEND_IO_WRITE)
+		io_prep_pwritev(iocb, file_b->fd, io->iov, io->iov_cnt, io->offset);
+	else
+		io_prep_preadv(iocb, file_b->fd, io->iov, io->iov_cnt, io->offset);
+	io_set_eventfd(iocb, ctx->efd);
+	iocb->data = io;
+	ctx->pending[ctx->nr_pending++] = iocb;
+
+	return true;
+}
+
+/* submit prepared iocbs in one call, the ones kernel refused go by syscall */
+static void file_aio_submit(struct ubbd_file_backend *file_b)
+{
+	struct file_aio_ctx *ctx = pthread_getspecific(file_b->aio_key);
+	struct iocb *iocb;
+	int done = 0;
+	int ret = 0;
+
+	/* nothing prepared, and dont create a context here */
+	if (!ctx || ctx == (void *)&file_aio_none || !ctx->nr_pending)
+		return;
+
+	while (done < ctx->nr_pending) {
+		ret = io_submit(ctx->ctx, ctx->nr_pending - done, ctx->pending + done);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	ctx->poller.inflight += done;
+
+	if (done < ctx->nr_pending && ret != -EAGAIN)
+		ubbd_err("failed to submit aio: %d, fall back to sync io\n", ret);
+
+	for (; done < ctx->nr_pending; done++) {
+		iocb = ctx->pending[done];
+		ctx->free_iocbs[ctx->nr_free++] = iocb;
+		file_backend_sync_rw(file_b, iocb->data);
+	}
+	ctx->nr_pending = 0;
+}
+
+static int file_aio_init(struct ubbd_file_backend *file_b)
+{
+	INIT_LIST_HEAD(&file_b->aio_list);
+	pthread_mutex_init(&file_b->aio_lock, NULL);
+
+	return pthread_key_create(&file_b->aio_key, NULL);
+}
+
+static void file_aio_exit(struct ubbd_file_backend *file_b)
+{
+	struct file_aio_ctx *ctx, *next;
+
+	list_for_each_entry_safe(ctx, next, &file_b->aio_list, node) {
+		list_del(&ctx->node);
+		file_aio_ctx_free(ctx);
+	}
+	pthread_key_delete(file_b->aio_key);
+	pthread_mutex_destroy(&file_b->aio_lock);
+}
+#else
+static bool file_aio_prep(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	return false;
+}
+
+static void file_aio_submit(struct ubbd_file_backend *file_b)
+{
+}
+
+static int file_aio_init(struct ubbd_file_backend *file_b)
+{
+	return 0;
+}
+
+static void file_aio_exit(struct ubbd_file_backend *file_b)
+{
+}
+#endif
+
+/*
+ * Put read or write io on the engine asked at map, return false if it
+ * has to be done by syscall. libaio io is prepared only, caller submits
+ * it by file_aio_submit().
+ */
+static bool file_backend_async_rw(struct ubbd_file_backend *file_b, struct ubbd_backend_io *io)
+{
+	switch (file_b->io_engine) {
+	case UBBD_FILE_IO_ENGINE_IO_URING:
+		return file_backend_uring_rw(file_b, io);
+	case UBBD_FILE_IO_ENGINE_LIBAIO:
+		return file_aio_prep(file_b, io);
+	default:
+		return false;
+	}
+}
+
 static struct ubbd_backend *file_backend_create(struct __ubbd_dev_info *info)
 {
 	struct ubbd_backend *ubbd_b;
@@ -19,6 +334,14 @@ static struct ubbd_backend *file_backend_create(struct __ubbd_dev_info *info)
 	ubbd_b->dev_type = UBBD_DEV_TYPE_FILE;
 	ubbd_b->backend_ops = &file_backend_ops;
 	strcpy(file_backend->filepath, info->file.path);
+	file_backend->io_engine = info->file.io_engine;
+	/* opened with O_DIRECT */
+	ubbd_b->limits.dma_align = 512;
+
+	if (file_aio_init(file_backend)) {
+		free(file_backend);
+		return NULL;
+	}
 
 	return ubbd_b;
 }
@@ -50,45 +373,61 @@ static void file_backend_close(struct ubbd_backend *ubbd_b)
 static void file_backend_release(struct ubbd_backend *ubbd_b)
 {
 	struct ubbd_file_backend *file_b = FILE_BACKEND(ubbd_b);
-	if (file_b)
+	if (file_b) {
+		file_aio_exit(file_b);
 		free(file_b);
+	}
 }
 
-static int file_backend_writev(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+static int file_backend_rw(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
 	struct ubbd_file_backend *file_b = FILE_BACKEND(ubbd_b);
-	ssize_t ret;
 
-	ret = pwritev(file_b->fd, io->iov, io->iov_cnt, io->offset);
-	if (ret < 0)
-		ubbd_err("result of pwritev: %ld\n", ret);
-	ubbd_backend_io_finish(io, (ret == io->len? 0 : ret));
+	if (file_backend_async_rw(file_b, io))
+		file_aio_submit(file_b);
+	else
+		file_backend_sync_rw(file_b, io);
 
 	return 0;
 }
 
-static int file_backend_readv(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+static int file_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
 	struct ubbd_file_backend *file_b = FILE_BACKEND(ubbd_b);
-	ssize_t ret;
+	int ret;
+
+	ret = fsync(file_b->fd);
+	ubbd_backend_io_finish(io, ret);
 
-	ret = preadv(file_b->fd, io->iov, io->iov_cnt, io->offset);
-	if (ret < 0)
-		ubbd_err("result of preadv: %ld\n", ret);
-	ubbd_backend_io_finish(io, (ret == io->len? 0 : ret));
-	
 	return 0;
 }
 
-static int file_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+/* aio of the batch goes in one io_submit() */
+static int file_backend_submit_batch(struct ubbd_backend *ubbd_b,
+		struct ubbd_backend_io **ios, int nr)
 {
 	struct ubbd_file_backend *file_b = FILE_BACKEND(ubbd_b);
-	int ret;
+	struct ubbd_backend_io *io;
+	int i;
 
-	ret = fsync(file_b->fd);
-	ubbd_backend_io_finish(io, ret);
+	for (i = 0; i < nr; i++) {
+		io = ios[i];
 
-	return 0;
+		switch (io->io_type) {
+		case UBBD_BACKEND_IO_WRITE:
+		case UBBD_BACKEND_IO_READ:
+			if (!file_backend_async_rw(file_b, io))
+				file_backend_sync_rw(file_b, io);
+			break;
+		default:
+			ubbd_err("io type %d is not supported\n", io->io_type);
+			ubbd_backend_io_finish(io, -EOPNOTSUPP);
+		}
+	}
+
+	file_aio_submit(file_b);
+
+	return nr;
 }
 
 struct ubbd_backend_ops file_backend_ops = {
@@ -96,7 +435,16 @@ struct ubbd_backend_ops file_backend_ops = {
 	.open = file_backend_open,
 	.close = file_backend_close,
 	.release = file_backend_release,
-	.writev = file_backend_writev,
-	.readv = file_backend_readv,
+	.writev = file_backend_rw,
+	.readv = file_backend_rw,
 	.flush = file_backend_flush,
+	.submit_batch = file_backend_submit_batch,
+	.blocking = true,
+};
+
+struct ubbd_backend_module file_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "file",
+	.dev_type = UBBD_DEV_TYPE_FILE,
+	.ops = &file_backend_ops,
 };
@@ -1,54 +1,232 @@
 #define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <linux/mempolicy.h>
+
 #include "ubbd_backend.h"
 
 #define MEM_BACKEND(ubbd_b) ((struct ubbd_mem_backend *)container_of(ubbd_b, struct ubbd_mem_backend, ubbd_b))
 
-pthread_mutex_t mem_backend_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct ubbd_backend_ops mem_backend_ops;
+
+/* blocks freed by discard wait one synchronize of block map for each batch */
+#define MEM_RELEASE_BATCH	64
 
-struct mem_block {
-	char addr[UBBD_MEM_BLK_SIZE];
+struct mem_alloc_ctx {
+	struct ubbd_mem_backend *mem_b;
+	uint64_t blk;
+	int ret;
 };
 
-static struct mem_block *mem_blocks[UBBD_MEM_BLK_COUNT] = { 0 };
+/*
+ * Block is counted before it is allocated, so concurrent writers never
+ * allocate more than max_blocks. Pages of a mapped block are allocated
+ * by fallocate(), hugetlb is out of pages with ENOSPC there instead of
+ * SIGBUS in memcpy().
+ */
+static void *mem_block_alloc(void *arg)
+{
+	struct mem_alloc_ctx *ctx = arg;
+	struct ubbd_mem_backend *mem_b = ctx->mem_b;
+	uint64_t off = ctx->blk << mem_b->block_shift;
+	void *block;
+
+	if (__atomic_add_fetch(&mem_b->nr_blocks, 1, __ATOMIC_RELAXED) > mem_b->max_blocks) {
+		ctx->ret = -ENOSPC;
+		goto uncount;
+	}
 
-struct mem_block *mem_block_alloc(uint64_t blkid) {
-	struct mem_block *block = NULL;
+	if (mem_b->base) {
+		if (fallocate(mem_b->fd, 0, off, mem_b->block_size)) {
+			ctx->ret = -errno;
+			goto uncount;
+		}
+		return mem_b->base + off;
+	}
 
-	block = calloc(1, sizeof(*block));
-	if (!block)
-		return NULL;
+	block = calloc(1, mem_b->block_size);
+	if (!block) {
+		ctx->ret = -ENOMEM;
+		goto uncount;
+	}
 
 	return block;
+
+uncount:
+	__atomic_sub_fetch(&mem_b->nr_blocks, 1, __ATOMIC_RELAXED);
+	return NULL;
 }
 
-int get_mem_block(uint64_t offset, struct mem_block **block_ret, bool alloc) {
-	struct mem_block *block = NULL;
-	uint64_t blkid = offset >> UBBD_MEM_BLK_SHIFT;
-	int ret = 0;
+static void mem_block_free(void *block, void *arg)
+{
+	free(block);
+}
+
+static void mem_block_unmap(void *block, void *arg)
+{
+	return;
+}
 
-	pthread_mutex_lock(&mem_backend_mutex);
-	block = mem_blocks[blkid];
-	if (block) {
-		*block_ret = block;
+/* blocks were removed from map, not called in a read section */
+static void mem_blocks_release(struct ubbd_mem_backend *mem_b, void **blocks, int nr)
+{
+	int i;
+
+	if (!nr)
+		return;
+
+	ubbd_blkmap_synchronize(&mem_b->map);
+	for (i = 0; i < nr; i++) {
+		if (!mem_b->base) {
+			free(blocks[i]);
+			continue;
+		}
+
+		if (fallocate(mem_b->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(char *)blocks[i] - mem_b->base, mem_b->block_size))
+			ubbd_err("failed to punch mem block at %lu: %d.\n",
+					(char *)blocks[i] - mem_b->base, -errno);
+	}
+	__atomic_sub_fetch(&mem_b->nr_blocks, nr, __ATOMIC_RELAXED);
+}
+
+static int mem_backend_mbind(struct ubbd_mem_backend *mem_b)
+{
+	unsigned long nodemask[UBBD_MEM_NUMA_NODE_MAX / (8 * sizeof(unsigned long))] = { 0 };
+	int node = mem_b->numa_node;
+
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+	/* shared policy of the file, pages allocated by fallocate() follow it */
+	if (syscall(SYS_mbind, mem_b->base, mem_b->map_size, MPOL_BIND,
+				nodemask, UBBD_MEM_NUMA_NODE_MAX + 1, 0)) {
+		ubbd_err("failed to bind mem to numa node %d: %d.\n", node, -errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* blocks having data in shm written by the backend before restart */
+static int mem_backend_restore(struct ubbd_mem_backend *mem_b)
+{
+	struct mem_alloc_ctx ctx = { .mem_b = mem_b, .ret = -ENOMEM };
+	off_t data, hole = 0;
+
+	while ((data = lseek(mem_b->fd, hole, SEEK_DATA)) >= 0) {
+		hole = lseek(mem_b->fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -errno;
+
+		for (ctx.blk = data >> mem_b->block_shift;
+				ctx.blk < (hole + mem_b->block_size - 1) >> mem_b->block_shift;
+				ctx.blk++) {
+			if (!ubbd_blkmap_get(&mem_b->map, ctx.blk, mem_block_alloc, &ctx))
+				return ctx.ret;
+		}
+	}
+
+	/* no data after hole */
+	if (errno != ENXIO)
+		return -errno;
+
+	return 0;
+}
+
+/* file of shm mem backing, kept until device is removed */
+char *get_mem_shm_path(int dev_id, uint64_t shm_id)
+{
+	char *path;
+
+	if (asprintf(&path, "%subbd%d_mem_%lx", UBBD_MEM_SHM_DIR, dev_id, shm_id) == -1) {
+		ubbd_err("failed to init mem shm path.\n");
+		return NULL;
+	}
+
+	return path;
+}
+
+/*
+ * Map the whole device from a file, shm in /dev/shm is kept when backend
+ * restarts, hugetlb memfd is gone with this backend.
+ */
+static int mem_backend_map(struct ubbd_mem_backend *mem_b)
+{
+	char *path = NULL;
+	int ret;
+
+	if (mem_b->backing == UBBD_MEM_BACKING_SHM) {
+		path = get_mem_shm_path(mem_b->ubbd_b.dev_id, mem_b->shm_id);
+		if (!path)
+			return -ENOMEM;
+
+		mem_b->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
 	} else {
-		block = mem_block_alloc(blkid);
-		if (!block) {
-			ret = -ENOMEM;
-			goto out;
+		mem_b->fd = memfd_create("ubbd_mem", MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+	}
+
+	if (mem_b->fd < 0) {
+		ret = -errno;
+		ubbd_err("failed to open %s for mem: %d.\n", path ? : "hugetlb memfd", ret);
+		goto free_path;
+	}
+
+	mem_b->map_size = mem_b->map.nr_blocks << mem_b->block_shift;
+	if (ftruncate(mem_b->fd, mem_b->map_size)) {
+		ret = -errno;
+		ubbd_err("failed to truncate mem to %lu: %d.\n", mem_b->map_size, ret);
+		goto close_fd;
+	}
+
+	mem_b->base = mmap(NULL, mem_b->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, mem_b->fd, 0);
+	if (mem_b->base == MAP_FAILED) {
+		ret = -errno;
+		mem_b->base = NULL;
+		ubbd_err("failed to mmap mem of %lu: %d.\n", mem_b->map_size, ret);
+		goto close_fd;
+	}
+
+	if (mem_b->numa_node >= 0) {
+		ret = mem_backend_mbind(mem_b);
+		if (ret)
+			goto unmap;
+	}
+
+	if (mem_b->backing == UBBD_MEM_BACKING_SHM) {
+		/* used if shmem_enabled of transparent hugepage is advise */
+		madvise(mem_b->base, mem_b->map_size, MADV_HUGEPAGE);
+
+		ret = mem_backend_restore(mem_b);
+		if (ret) {
+			ubbd_err("failed to restore mem blocks from %s: %d.\n", path, ret);
+			goto unmap;
 		}
-		*block_ret = mem_blocks[blkid] = block;
+		ubbd_info("restored %lu mem blocks from %s.\n", mem_b->nr_blocks, path);
 	}
-out:
-	pthread_mutex_unlock(&mem_backend_mutex);
+
+	free(path);
+
+	return 0;
+
+unmap:
+	munmap(mem_b->base, mem_b->map_size);
+	mem_b->base = NULL;
+close_fd:
+	close(mem_b->fd);
+	mem_b->fd = -1;
+free_path:
+	free(path);
+
 	return ret;
 }
 
-struct ubbd_backend_ops mem_backend_ops;
-
 static struct ubbd_backend* mem_backend_create(struct __ubbd_dev_info *info)
 {
 	struct ubbd_mem_backend *mem_backend;
 	struct ubbd_backend *ubbd_b;
+	uint32_t block_size;
 
 	mem_backend = calloc(1, sizeof(*mem_backend));
 	if (!mem_backend)
@@ -59,12 +237,36 @@ static struct ubbd_backend* mem_backend_create(struct __ubbd_dev_info *info)
 	ubbd_b->backend_ops = &mem_backend_ops;
 	ubbd_b->dev_size = info->size;
 
+	/* devices mapped before block size is configurable have 0 */
+	block_size = info->mem.block_size ? : UBBD_MEM_BLK_SIZE;
+	mem_backend->block_size = block_size;
+	mem_backend->block_shift = __builtin_ctz(block_size);
+	if (info->mem.limit_mb)
+		mem_backend->max_blocks = ((uint64_t)info->mem.limit_mb << 20) >> mem_backend->block_shift;
+	else
+		mem_backend->max_blocks = UINT64_MAX;
+	mem_backend->backing = info->mem.backing;
+	mem_backend->numa_node = info->mem.numa_node;
+	mem_backend->shm_id = info->mem.shm_id;
+	mem_backend->fd = -1;
+
+	if (ubbd_blkmap_init(&mem_backend->map,
+				(info->size + block_size - 1) >> mem_backend->block_shift)) {
+		free(mem_backend);
+		return NULL;
+	}
+
 	return ubbd_b;
 }
 
 static int mem_backend_open(struct ubbd_backend *ubbd_b)
 {
-	return 0;
+	struct ubbd_mem_backend *mem_b = MEM_BACKEND(ubbd_b);
+
+	if (mem_b->backing == UBBD_MEM_BACKING_HEAP)
+		return 0;
+
+	return mem_backend_map(mem_b);
 }
 
 static void mem_backend_close(struct ubbd_backend *ubbd_b)
@@ -75,109 +277,163 @@ static void mem_backend_close(struct ubbd_backend *ubbd_b)
 static void mem_backend_release(struct ubbd_backend *ubbd_b)
 {
 	struct ubbd_mem_backend *mem_backend = MEM_BACKEND(ubbd_b);
-	int i = 0;
 
-	pthread_mutex_lock(&mem_backend_mutex);
-	for (i = 0; i < UBBD_MEM_BLK_COUNT; i++) {
-		free(mem_blocks[i]);
-		mem_blocks[i] = NULL;
+	if (!mem_backend)
+		return;
+
+	/* mapped blocks go with the mapping, shm keeps them for the next backend */
+	ubbd_blkmap_exit(&mem_backend->map,
+			mem_backend->backing == UBBD_MEM_BACKING_HEAP ? mem_block_free : mem_block_unmap,
+			mem_backend);
+	if (mem_backend->base) {
+		munmap(mem_backend->base, mem_backend->map_size);
+		close(mem_backend->fd);
 	}
-	pthread_mutex_unlock(&mem_backend_mutex);
-
-	if (mem_backend)
-		free(mem_backend);
+	free(mem_backend);
 }
 
-static int mem_backend_writev(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+/*
+ * Copy data of io from or to blocks, a block is allocated by the first
+ * write to it, read of a block not allocated returns zeros. Write fails
+ * with -ENOSPC if a new block is over limit_mb.
+ */
+static int mem_backend_rw(struct ubbd_mem_backend *mem_b, struct ubbd_backend_io *io,
+		bool write)
 {
-	struct mem_block *block = NULL;
-	int off_in_blk;
-	ssize_t count = 0;
+	struct mem_alloc_ctx ctx = { .mem_b = mem_b, .ret = -ENOMEM };
+	uint64_t off = io->offset;
+	uint64_t off_in_iov;
+	uint32_t off_in_blk;
+	uint32_t len;
+	char *block;
+	void *base;
+	int token;
 	int ret = 0;
 	int i;
-	ssize_t len, off_in_iov = 0;
-	void *base;
 
+	token = ubbd_blkmap_read_lock(&mem_b->map);
 	for (i = 0; i < io->iov_cnt; i++) {
-		off_in_iov = 0;
-again:
-		off_in_blk = (io->offset + count) & UBBD_MEM_BLK_MASK;
-		ret = get_mem_block(io->offset + count, &block, true);
-		if (ret) {
-			ubbd_err("failed to get mem block.\n");
-			goto out;
+		for (off_in_iov = 0; off_in_iov < io->iov[i].iov_len; off_in_iov += len, off += len) {
+			off_in_blk = off & (mem_b->block_size - 1);
+			len = MIN(io->iov[i].iov_len - off_in_iov, mem_b->block_size - off_in_blk);
+			base = io->iov[i].iov_base + off_in_iov;
+
+			if (write) {
+				ctx.blk = off >> mem_b->block_shift;
+				block = ubbd_blkmap_get(&mem_b->map, ctx.blk, mem_block_alloc, &ctx);
+				if (!block) {
+					ret = ctx.ret;
+					if (ret != -ENOSPC)
+						ubbd_err("failed to get mem block of %lu.\n", off);
+					goto out;
+				}
+				memcpy(block + off_in_blk, base, len);
+			} else {
+				block = ubbd_blkmap_lookup(&mem_b->map, off >> mem_b->block_shift);
+				if (block)
+					memcpy(base, block + off_in_blk, len);
+				else
+					memset(base, 0, len);
+			}
 		}
+	}
+out:
+	ubbd_blkmap_read_unlock(&mem_b->map, token);
 
-		base = io->iov[i].iov_base + off_in_iov;
-		len = MIN(io->iov[i].iov_len - off_in_iov, UBBD_MEM_BLK_SIZE - off_in_blk);
-		memcpy(block->addr + off_in_blk, base, len);
+	return ret;
+}
 
-		count += len;
-		off_in_iov += len;
-		if (off_in_iov < io->iov[i].iov_len) {
-			/* iov not finished, goto next block */
-			goto again;
+/*
+ * Blocks in range of io are freed, head and tail not covering a whole
+ * block are zeroed, so reads of the range return zeros after both
+ * discard and write-zeros.
+ */
+static void mem_backend_zero_range(struct ubbd_mem_backend *mem_b, struct ubbd_backend_io *io)
+{
+	void *removed[MEM_RELEASE_BATCH];
+	uint64_t off = io->offset;
+	uint64_t end = io->offset + io->len;
+	uint32_t off_in_blk;
+	uint32_t len;
+	char *block;
+	int nr = 0;
+	int token;
+
+	token = ubbd_blkmap_read_lock(&mem_b->map);
+	for (; off < end; off += len) {
+		off_in_blk = off & (mem_b->block_size - 1);
+		len = MIN(end - off, mem_b->block_size - off_in_blk);
+
+		if (len < mem_b->block_size) {
+			block = ubbd_blkmap_lookup(&mem_b->map, off >> mem_b->block_shift);
+			if (block)
+				memset(block + off_in_blk, 0, len);
+			continue;
 		}
+
+		removed[nr] = ubbd_blkmap_remove(&mem_b->map, off >> mem_b->block_shift);
+		if (!removed[nr] || ++nr < MEM_RELEASE_BATCH)
+			continue;
+
+		ubbd_blkmap_read_unlock(&mem_b->map, token);
+		mem_blocks_release(mem_b, removed, nr);
+		nr = 0;
+		token = ubbd_blkmap_read_lock(&mem_b->map);
 	}
+	ubbd_blkmap_read_unlock(&mem_b->map, token);
 
-	ret = count == io->len? 0 : -5;
-	ubbd_backend_io_finish(io, ret);
+	mem_blocks_release(mem_b, removed, nr);
+}
 
-out:
-	return ret;
+static int mem_backend_writev(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	ubbd_backend_io_finish(io, mem_backend_rw(MEM_BACKEND(ubbd_b), io, true));
+
+	return 0;
 }
 
 static int mem_backend_readv(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
-	struct mem_block *block = NULL;
-	int off_in_blk;
-	ssize_t count = 0;
-	int ret = 0;
-	int i;
-	ssize_t len, off_in_iov = 0;
-	void *base;
+	ubbd_backend_io_finish(io, mem_backend_rw(MEM_BACKEND(ubbd_b), io, false));
 
-	for (i = 0; i < io->iov_cnt; i++) {
-		off_in_iov = 0;
-again:
-		off_in_blk = (io->offset + count) & UBBD_MEM_BLK_MASK;
-		ret = get_mem_block(io->offset + count, &block, false);
-		if (ret) {
-			ubbd_err("failed to get mem block for read.\n");
-			goto out;
-		}
+	return 0;
+}
 
-		base = io->iov[i].iov_base + off_in_iov;
-		if (block) {
-			len = MIN(io->iov[i].iov_len - off_in_iov, UBBD_MEM_BLK_SIZE - off_in_blk);
-			memcpy(base, block->addr + off_in_blk, len);
-		} else {
-			len = io->iov[i].iov_len;
-			memset(base, 0, len);
-		}
+static int mem_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	ubbd_backend_io_finish(io, 0);
 
-		count += len;
-		off_in_iov += len;
-		if (off_in_iov < io->iov[i].iov_len) {
-			/* iov not finished, goto next block */
-			goto again;
-		}
-	}
+	return 0;
+}
 
-	ret = count == io->len? 0 : -5;
-	ubbd_backend_io_finish(io, ret);
+static int mem_backend_discard(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	mem_backend_zero_range(MEM_BACKEND(ubbd_b), io);
+	ubbd_backend_io_finish(io, 0);
 
-out:
-	return ret;
+	return 0;
 }
 
-static int mem_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+static int mem_backend_write_zeros(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
+	mem_backend_zero_range(MEM_BACKEND(ubbd_b), io);
 	ubbd_backend_io_finish(io, 0);
 
 	return 0;
 }
 
+static int mem_backend_get_stats(struct ubbd_backend *ubbd_b, struct ubbd_backend_stats *stats)
+{
+	struct ubbd_mem_backend *mem_b = MEM_BACKEND(ubbd_b);
+	uint64_t nr_blocks = __atomic_load_n(&mem_b->nr_blocks, __ATOMIC_RELAXED);
+
+	stats->valid = true;
+	stats->mem.nr_blocks = nr_blocks;
+	stats->mem.resident_bytes = nr_blocks * mem_b->block_size;
+
+	return 0;
+}
+
 struct ubbd_backend_ops mem_backend_ops = {
 	.create = mem_backend_create,
 	.open = mem_backend_open,
@@ -186,4 +442,14 @@ struct ubbd_backend_ops mem_backend_ops = {
 	.writev = mem_backend_writev,
 	.readv = mem_backend_readv,
 	.flush = mem_backend_flush,
+	.discard = mem_backend_discard,
+	.write_zeros = mem_backend_write_zeros,
+	.get_stats = mem_backend_get_stats,
+};
+
+struct ubbd_backend_module mem_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "mem",
+	.dev_type = UBBD_DEV_TYPE_MEM,
+	.ops = &mem_backend_ops,
 };
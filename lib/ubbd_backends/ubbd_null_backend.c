@@ -64,6 +64,17 @@ static int null_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_i
 	return 0;
 }
 
+static int null_backend_submit_batch(struct ubbd_backend *ubbd_b,
+		struct ubbd_backend_io **ios, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		ubbd_backend_io_finish(ios[i], 0);
+
+	return nr;
+}
+
 struct ubbd_backend_ops null_backend_ops = {
 	.create = null_backend_create,
 	.open = null_backend_open,
@@ -72,4 +83,12 @@ struct ubbd_backend_ops null_backend_ops = {
 	.writev = null_backend_writev,
 	.readv = null_backend_readv,
 	.flush = null_backend_flush,
+	.submit_batch = null_backend_submit_batch,
+};
+
+struct ubbd_backend_module null_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "null",
+	.dev_type = UBBD_DEV_TYPE_NULL,
+	.ops = &null_backend_ops,
 };
@@ -278,14 +278,61 @@ static int rbd_backend_write_zeros(struct ubbd_backend *ubbd_b, struct ubbd_back
 
 	return ret;
 }
-#else
-static int rbd_backend_write_zeros(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+#endif
+
+/*
+ * Queue all ios to librbd before returning, so they are dispatched by
+ * librbd threads together. A failed io is finished here with its error.
+ */
+static int rbd_backend_submit_batch(struct ubbd_backend *ubbd_b,
+		struct ubbd_backend_io **ios, int nr)
 {
-	ubbd_err("write_zeros is not supported\n");
+	struct ubbd_rbd_backend *rbd_b = RBD_BACKEND(ubbd_b);
+	struct ubbd_rbd_conn *rbd_conn = &rbd_b->rbd_conn;
+	rbd_completion_t completion;
+	struct ubbd_backend_io *io;
+	int ret;
+	int i;
 
-	return -1;
-}
+	for (i = 0; i < nr; i++) {
+		io = ios[i];
+
+		ret = rbd_aio_create_completion
+			(io, (rbd_callback_t) rbd_finish_aio_generic, &completion);
+		if (ret < 0) {
+			ubbd_err("create completion failed\n");
+			ubbd_backend_io_finish(io, ret);
+			continue;
+		}
+
+		switch (io->io_type) {
+		case UBBD_BACKEND_IO_WRITE:
+			ret = rbd_aio_writev(rbd_conn->image, io->iov, io->iov_cnt, io->offset, completion);
+			break;
+		case UBBD_BACKEND_IO_READ:
+			ret = rbd_aio_readv(rbd_conn->image, io->iov, io->iov_cnt, io->offset, completion);
+			break;
+		case UBBD_BACKEND_IO_DISCARD:
+			ret = rbd_aio_discard(rbd_conn->image, io->offset, io->len, completion);
+			break;
+		case UBBD_BACKEND_IO_WRITEZEROS:
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+			ret = rbd_aio_write_zeroes(rbd_conn->image, io->offset, io->len, completion, 0, 0);
+			break;
 #endif
+		default:
+			ret = -EOPNOTSUPP;
+		}
+
+		if (ret < 0) {
+			ubbd_err("failed to submit rbd io type %d: %d\n", io->io_type, ret);
+			rbd_aio_release(completion);
+			ubbd_backend_io_finish(io, ret);
+		}
+	}
+
+	return nr;
+}
 
 struct ubbd_backend_ops rbd_backend_ops = {
 	.create = rbd_backend_create,
@@ -296,5 +343,15 @@ struct ubbd_backend_ops rbd_backend_ops = {
 	.readv = rbd_backend_readv,
 	.flush = rbd_backend_flush,
 	.discard = rbd_backend_discard,
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
 	.write_zeros = rbd_backend_write_zeros,
+#endif
+	.submit_batch = rbd_backend_submit_batch,
+};
+
+struct ubbd_backend_module rbd_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "rbd",
+	.dev_type = UBBD_DEV_TYPE_RBD,
+	.ops = &rbd_backend_ops,
 };
@@ -18,7 +18,7 @@
 
 static S3Protocol s3_protocal = S3ProtocolHTTP;
 static S3UriStyle s3_uri_style = S3UriStylePath;
-static int retry_count = 5;
+static const int retry_count = 5;
 static const char *s3_region = NULL;
 static uint32_t s3_block_size;
 
@@ -31,18 +31,19 @@ static char *s3_volume_name;
 static char *s3_bucket_name;
 
 
-// Request results, saved as globals -----------------------------------------
-
-static int s3_status = 0;
-static char err_details[4096] = { 0 };
-
-
 // Other globals -------------------------------------------------------------
 
 extern int s3_port;
+
+/* writes to one object are serialized, as partial write is read-modify-write */
+#define S3_OBJ_LOCK_NR	64
+static pthread_mutex_t s3_obj_locks[S3_OBJ_LOCK_NR];
+
 static int S3_init(struct ubbd_s3_backend *s3_b)
 {
 	S3Status status;
+	int i;
+
 	s3_port = s3_b->port;
 	s3_accessid = s3_b->accessid;
 	s3_accesskey = s3_b->accesskey;
@@ -50,6 +51,9 @@ static int S3_init(struct ubbd_s3_backend *s3_b)
 	s3_block_size = s3_b->block_size;
 	s3_bucket_name = s3_b->bucket_name;
 
+	for (i = 0; i < S3_OBJ_LOCK_NR; i++)
+		pthread_mutex_init(&s3_obj_locks[i], NULL);
+
 	if ((status = S3_initialize("s3", S3_INIT_ALL, s3_b->hostname))
 		!= S3StatusOK) {
 		ubbd_info("Failed to initialize libs3: %s\n",
@@ -60,6 +64,33 @@ static int S3_init(struct ubbd_s3_backend *s3_b)
 	return 0;
 }
 
+enum io_ctx_type {
+	IO_CTX_TYPE_IOV,
+	IO_CTX_TYPE_BUFF,
+};
+
+struct obj_io_ctx {
+	enum io_ctx_type type;
+	union {
+		struct {
+			struct iovec *iov;
+			int iov_cnt;
+		} iovec;
+		struct {
+			void *buff;
+		} buffer;
+	};
+	uint32_t off;
+	uint32_t len;
+	uint32_t done;
+
+	/* request result, ctx is per request so ios can run concurrently */
+	S3Status status;
+	int retries;
+	int retry_interval;
+	char err_details[4096];
+};
+
 static S3Status rsp_prop_cb(const S3ResponseProperties *properties,
 			void *cb_data)
 {
@@ -72,37 +103,39 @@ static S3Status rsp_prop_cb(const S3ResponseProperties *properties,
 // response complete callback ------------------------------------------------
 
 // This callback does the same thing for every request type: saves the status
-// and error stuff in global variables
+// and error stuff in the request ctx
 static void rsp_comp_cb(S3Status status,
 			 const S3ErrorDetails *error,
 			 void *cb_data)
 {
-	(void) cb_data;
+	struct obj_io_ctx *ctx = (struct obj_io_ctx *)cb_data;
+	char *err_details = ctx->err_details;
+	size_t err_size = sizeof(ctx->err_details);
 
-	s3_status = status;
+	ctx->status = status;
 	// Compose the error details message now, although we might not use it.
 	// Can't just save a pointer to [error] since it's not guaranteed to last
 	// beyond this callback
 	int len = 0;
 	if (error && error->message) {
-		len += snprintf(&(err_details[len]), sizeof(err_details) - len,
+		len += snprintf(&(err_details[len]), err_size - len,
 				        "  Message: %s\n", error->message);
 	}
 	if (error && error->resource) {
-		len += snprintf(&(err_details[len]), sizeof(err_details) - len,
+		len += snprintf(&(err_details[len]), err_size - len,
 				        "  Resource: %s\n", error->resource);
 	}
 	if (error && error->furtherDetails) {
-		len += snprintf(&(err_details[len]), sizeof(err_details) - len,
+		len += snprintf(&(err_details[len]), err_size - len,
 				        "  Further Details: %s\n", error->furtherDetails);
 	}
 	if (error && error->extraDetailsCount) {
-		len += snprintf(&(err_details[len]), sizeof(err_details) - len,
+		len += snprintf(&(err_details[len]), err_size - len,
 				        "%s", "  Extra Details:\n");
 		int i;
 		for (i = 0; i < error->extraDetailsCount; i++) {
 			len += snprintf(&(err_details[len]),
-				            sizeof(err_details) - len, "    %s: %s\n",
+				            err_size - len, "    %s: %s\n",
 				            error->extraDetails[i].name,
 				            error->extraDetails[i].value);
 		}
@@ -110,51 +143,36 @@ static void rsp_comp_cb(S3Status status,
 }
 
 
-static int should_retry()
+static void init_retry(struct obj_io_ctx *ctx)
+{
+	ctx->retries = retry_count;
+	ctx->retry_interval = 1;
+	ctx->err_details[0] = '\0';
+}
+
+static int should_retry(struct obj_io_ctx *ctx)
 {
-	if (retry_count--) {
-		static int retry_interval = 1;
-		sleep(retry_interval);
+	if (ctx->retries-- > 0) {
+		sleep(ctx->retry_interval);
 		// Next sleep 1 second longer
-		retry_interval++;
+		ctx->retry_interval++;
 		return 1;
 	}
 
 	return 0;
 }
 
-static void printError()
+static void printError(struct obj_io_ctx *ctx)
 {
-	if (s3_status < S3StatusErrorAccessDenied) {
-		ubbd_info("\nERROR: %s\n", S3_get_status_name(s3_status));
+	if (ctx->status < S3StatusErrorAccessDenied) {
+		ubbd_info("\nERROR: %s\n", S3_get_status_name(ctx->status));
 	}
 	else {
-		ubbd_info("\nERROR: %s\n", S3_get_status_name(s3_status));
-		ubbd_info("%s\n", err_details);
+		ubbd_info("\nERROR: %s\n", S3_get_status_name(ctx->status));
+		ubbd_info("%s\n", ctx->err_details);
 	}
 }
 
-enum io_ctx_type {
-	IO_CTX_TYPE_IOV,
-	IO_CTX_TYPE_BUFF,
-};
-
-struct obj_io_ctx {
-	enum io_ctx_type type;
-	union {
-		struct {
-			struct iovec *iov;
-			int iov_cnt;
-		} iovec;
-		struct {
-			void *buff;
-		} buffer;
-	};
-	uint32_t off;
-	uint32_t len;
-	uint32_t done;
-};
-
 static size_t
 buf_to_iovec(const void *buf, size_t size, struct iovec *iov, size_t iovcnt, size_t offset)
 {
@@ -311,25 +329,26 @@ static int read_object(char *oid, uint64_t off, uint64_t len, struct obj_io_ctx
 		&get_obj_data_cb
 	};
 
+	init_retry(ctx);
 	do {
 		S3_get_object(&bucketContext, oid, &getConditions, off,
 				      len, 0, 0, &getObjectHandler, ctx);
-	} while (S3_status_is_retryable(s3_status) && should_retry());
+	} while (S3_status_is_retryable(ctx->status) && should_retry(ctx));
 
-	if (s3_status == S3StatusErrorNoSuchKey) {
+	if (ctx->status == S3StatusErrorNoSuchKey) {
 		if (ctx->type == IO_CTX_TYPE_IOV) {
 			iovset(ctx->iovec.iov, ctx->iovec.iov_cnt, 0, ctx->len, ctx->off);
 		} else {
 			memset(ctx->buffer.buff + ctx->off, 0, ctx->len);
 		}
-		s3_status = S3StatusOK;
+		ctx->status = S3StatusOK;
 	}
 
-	if (s3_status != S3StatusOK) {
-		printError();
+	if (ctx->status != S3StatusOK) {
+		printError(ctx);
 	}
 
-	return s3_status;
+	return ctx->status;
 }
 
 typedef int (obj_func_t)(char *oid, uint64_t off, uint64_t len, struct obj_io_ctx *ctx);
@@ -346,6 +365,7 @@ static int write_object(char *oid, uint64_t off, uint64_t len, struct obj_io_ctx
 	struct obj_io_ctx internal_ctx;
 	struct obj_io_ctx *write_ctx;
 	void *obj_buf = NULL;
+	int ret;
 
 	ubbd_dbg("write_object: %s, off: %lu, len: %lu\n", oid, off, len);
 
@@ -405,20 +425,87 @@ static int write_object(char *oid, uint64_t off, uint64_t len, struct obj_io_ctx
 		&put_obj_data_cb
 	};
 
+	init_retry(write_ctx);
 	do {
 		S3_put_object(&bucketContext, oid, s3_block_size, &putProperties, 0,
 				  0, &putObjectHandler, write_ctx);
-	} while (S3_status_is_retryable(s3_status) && should_retry());
-
+	} while (S3_status_is_retryable(write_ctx->status) && should_retry(write_ctx));
 
-	if (s3_status != S3StatusOK) {
-		printError();
+	ret = write_ctx->status;
+	if (ret != S3StatusOK) {
+		printError(write_ctx);
 	}
 
 	if (obj_buf)
 		free(obj_buf);
 
-	return s3_status;
+	return ret;
+}
+
+static int delete_object(char *oid, struct obj_io_ctx *ctx)
+{
+	ubbd_dbg("delete_object: %s\n", oid);
+
+	S3BucketContext bucketContext =
+	{
+		0,
+		s3_bucket_name,
+		s3_protocal,
+		s3_uri_style,
+		s3_accessid,
+		s3_accesskey,
+		0,
+		s3_region
+	};
+
+	S3ResponseHandler responseHandler =
+	{
+		&rsp_prop_cb, &rsp_comp_cb
+	};
+
+	init_retry(ctx);
+	do {
+		S3_delete_object(&bucketContext, oid, 0, 0, &responseHandler, ctx);
+	} while (S3_status_is_retryable(ctx->status) && should_retry(ctx));
+
+	/* read of a missing object returns zeros */
+	if (ctx->status == S3StatusErrorNoSuchKey)
+		ctx->status = S3StatusOK;
+
+	if (ctx->status != S3StatusOK) {
+		printError(ctx);
+	}
+
+	return ctx->status;
+}
+
+/* a whole object of zeros is deleted, part of object is written with zeros */
+static int zero_object(char *oid, uint64_t off, uint64_t len, struct obj_io_ctx *ctx)
+{
+	struct iovec iov;
+	void *zero_buf;
+	int ret;
+
+	ubbd_dbg("zero_object: %s, off: %lu, len: %lu\n", oid, off, len);
+
+	if (!off && len == s3_block_size)
+		return delete_object(oid, ctx);
+
+	zero_buf = calloc(1, len);
+	if (!zero_buf)
+		return -ENOMEM;
+
+	iov.iov_base = zero_buf;
+	iov.iov_len = len;
+	ctx->type = IO_CTX_TYPE_IOV;
+	ctx->iovec.iov = &iov;
+	ctx->iovec.iov_cnt = 1;
+	ctx->off = 0;
+
+	ret = write_object(oid, off, len, ctx);
+	free(zero_buf);
+
+	return ret;
 }
 
 #define S3_BACKEND(ubbd_b) ((struct ubbd_s3_backend *)container_of(ubbd_b, struct ubbd_s3_backend, ubbd_b))
@@ -446,6 +533,8 @@ static struct ubbd_backend* s3_backend_create(struct __ubbd_dev_info *info)
 	s3_backend->port = info->s3.port;
 	s3_backend->block_size = info->s3.block_size;
 	ubbd_b->dev_size = info->size;
+	ubbd_b->limits.io_boundary = s3_backend->block_size;
+	ubbd_b->limits.zero_granularity = s3_backend->block_size;
 
 	return ubbd_b;
 }
@@ -477,37 +566,33 @@ enum submit_io_type {
 	SUBMIT_IO_TYPE_READ,
 };
 
+/* io never crosses an object, see limits.io_boundary */
 static int submit_io(struct ubbd_backend_io *io, obj_func_t obj_func)
 {
+	pthread_mutex_t *obj_lock;
 	struct obj_io_ctx ctx;
 	char *oid;
-	int start_obj = io->offset / s3_block_size;
-	int end_obj = round_up((io->offset + io->len), s3_block_size) / s3_block_size;
+	int obj = io->offset / s3_block_size;
 	int offset = io->offset % s3_block_size;
-	uint64_t remain = io->len;
-	uint32_t done = 0;
-	int ret = 0;
-	int i;
+	int ret;
 
 	ctx.type = IO_CTX_TYPE_IOV;
 	ctx.iovec.iov = io->iov;
 	ctx.iovec.iov_cnt = io->iov_cnt;
-
-	for (i = start_obj; i < end_obj; i++) {
-		asprintf(&oid, "%s_%d", s3_volume_name, i);
-		ctx.off = done;
-		ctx.len = MIN(s3_block_size - offset, remain);
-		ctx.done = 0;
+	ctx.off = 0;
+	ctx.len = io->len;
+	ctx.done = 0;
+
+	asprintf(&oid, "%s_%d", s3_volume_name, obj);
+	if (obj_func != read_object) {
+		obj_lock = &s3_obj_locks[obj % S3_OBJ_LOCK_NR];
+		pthread_mutex_lock(obj_lock);
+		ret = obj_func(oid, offset, ctx.len, &ctx);
+		pthread_mutex_unlock(obj_lock);
+	} else {
 		ret = obj_func(oid, offset, ctx.len, &ctx);
-		free(oid);
-
-		done += ctx.len;
-		remain -= ctx.len;
-		offset = 0;
-
-		if (ret)
-			break;
 	}
+	free(oid);
 
 	ubbd_backend_io_finish(io, ret);
 
@@ -529,6 +614,13 @@ static int s3_backend_readv(struct ubbd_backend *ubbd_b, struct ubbd_backend_io
 	return submit_io(io, read_object);
 }
 
+static int s3_backend_write_zeros(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	ubbd_dbg("write zeros off: %lu, len: %u\n", io->offset, io->len);
+
+	return submit_io(io, zero_object);
+}
+
 static int s3_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
 	ubbd_backend_io_finish(io, 0);
@@ -544,4 +636,13 @@ struct ubbd_backend_ops s3_backend_ops = {
 	.writev = s3_backend_writev,
 	.readv = s3_backend_readv,
 	.flush = s3_backend_flush,
+	.write_zeros = s3_backend_write_zeros,
+	.blocking = true,
+};
+
+struct ubbd_backend_module s3_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "s3",
+	.dev_type = UBBD_DEV_TYPE_S3,
+	.ops = &s3_backend_ops,
 };
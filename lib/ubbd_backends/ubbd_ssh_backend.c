@@ -210,7 +210,9 @@ static int ssh_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io
 #ifdef HAVE_SFTP_FSYNC
 	struct ubbd_ssh_backend *ssh_b = SSH_BACKEND(ubbd_b);
 
+	pthread_mutex_lock(&ssh_b->lock);
 	ret = sftp_fsync(ssh_b->sftp_file);
+	pthread_mutex_unlock(&ssh_b->lock);
 #else
 	ret = 0;
 #endif
@@ -228,4 +230,12 @@ struct ubbd_backend_ops ssh_backend_ops = {
 	.writev = ssh_backend_writev,
 	.readv = ssh_backend_readv,
 	.flush = ssh_backend_flush,
+	.blocking = true,
+};
+
+struct ubbd_backend_module ssh_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "ssh",
+	.dev_type = UBBD_DEV_TYPE_SSH,
+	.ops = &ssh_backend_ops,
 };
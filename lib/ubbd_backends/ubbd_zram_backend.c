@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include "ubbd_backend.h"
+#include "ubbd_compat.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZRAM_BACKEND(ubbd_b) ((struct ubbd_zram_backend *)container_of(ubbd_b, struct ubbd_zram_backend, ubbd_b))
+
+/* zstd level of the fastest regular compression */
+#define ZRAM_ZSTD_LEVEL		1
+
+struct ubbd_backend_ops zram_backend_ops;
+
+struct zram_comp_ctx {
+	struct list_head node;
+#ifdef HAVE_LZ4
+	void *lz4_state;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+#endif
+};
+
+#ifdef HAVE_LZ4
+static int zram_lz4_compress(void *ctx, const void *src, void *dst, int dst_len)
+{
+	struct zram_comp_ctx *comp_ctx = ctx;
+
+	return LZ4_compress_fast_extState(comp_ctx->lz4_state, src, dst,
+			UBBD_ZRAM_PAGE_SIZE, dst_len, 1);
+}
+
+static int zram_lz4_decompress(void *ctx, const void *src, int src_len, void *dst)
+{
+	if (LZ4_decompress_safe(src, dst, src_len, UBBD_ZRAM_PAGE_SIZE) != UBBD_ZRAM_PAGE_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+static const struct ubbd_zram_compressor zram_lz4_comp = {
+	.compress = zram_lz4_compress,
+	.decompress = zram_lz4_decompress,
+};
+#endif
+
+#ifdef HAVE_ZSTD
+static int zram_zstd_compress(void *ctx, const void *src, void *dst, int dst_len)
+{
+	struct zram_comp_ctx *comp_ctx = ctx;
+	size_t len;
+
+	/* dst too small is an error of zstd */
+	len = ZSTD_compressCCtx(comp_ctx->cctx, dst, dst_len, src,
+			UBBD_ZRAM_PAGE_SIZE, ZRAM_ZSTD_LEVEL);
+	if (ZSTD_isError(len))
+		return 0;
+
+	return len;
+}
+
+static int zram_zstd_decompress(void *ctx, const void *src, int src_len, void *dst)
+{
+	struct zram_comp_ctx *comp_ctx = ctx;
+	size_t len;
+
+	len = ZSTD_decompressDCtx(comp_ctx->dctx, dst, UBBD_ZRAM_PAGE_SIZE, src, src_len);
+	if (ZSTD_isError(len) || len != UBBD_ZRAM_PAGE_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+static const struct ubbd_zram_compressor zram_zstd_comp = {
+	.compress = zram_zstd_compress,
+	.decompress = zram_zstd_decompress,
+};
+#endif
+
+static void zram_comp_ctx_free(struct zram_comp_ctx *ctx)
+{
+#ifdef HAVE_LZ4
+	free(ctx->lz4_state);
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+#endif
+	free(ctx);
+}
+
+static struct zram_comp_ctx *zram_comp_ctx_alloc(uint32_t comp)
+{
+	struct zram_comp_ctx *ctx;
+	bool failed = false;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+#ifdef HAVE_LZ4
+	if (comp == UBBD_ZRAM_COMP_LZ4) {
+		ctx->lz4_state = malloc(LZ4_sizeofState());
+		failed = !ctx->lz4_state;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (comp == UBBD_ZRAM_COMP_ZSTD) {
+		ctx->cctx = ZSTD_createCCtx();
+		ctx->dctx = ZSTD_createDCtx();
+		failed = !ctx->cctx || !ctx->dctx;
+	}
+#endif
+	if (failed) {
+		zram_comp_ctx_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/*
+ * Contexts are created by the first io of each queue thread, and stay
+ * until backend is released, so compression needs no lock of its own.
+ */
+static struct zram_comp_ctx *zram_comp_ctx_get(struct ubbd_zram_backend *zram_b)
+{
+	struct zram_comp_ctx *ctx;
+
+	ctx = pthread_getspecific(zram_b->ctx_key);
+	if (ctx)
+		return ctx;
+
+	ctx = zram_comp_ctx_alloc(zram_b->comp);
+	if (!ctx)
+		return NULL;
+
+	if (pthread_setspecific(zram_b->ctx_key, ctx)) {
+		zram_comp_ctx_free(ctx);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&zram_b->ctx_lock);
+	list_add_tail(&ctx->node, &zram_b->ctx_list);
+	pthread_mutex_unlock(&zram_b->ctx_lock);
+
+	return ctx;
+}
+
+static struct ubbd_backend* zram_backend_create(struct __ubbd_dev_info *info)
+{
+	const struct ubbd_zram_compressor *comp = NULL;
+	struct ubbd_zram_backend *zram_backend;
+	struct ubbd_backend *ubbd_b;
+
+#ifdef HAVE_LZ4
+	if (info->zram.comp == UBBD_ZRAM_COMP_LZ4)
+		comp = &zram_lz4_comp;
+#endif
+#ifdef HAVE_ZSTD
+	if (info->zram.comp == UBBD_ZRAM_COMP_ZSTD)
+		comp = &zram_zstd_comp;
+#endif
+	if (!comp) {
+		ubbd_err("zram comp %s is not supported.\n",
+				ubbd_zram_comp_to_str(info->zram.comp) ? : "unknown");
+		return NULL;
+	}
+
+	zram_backend = calloc(1, sizeof(*zram_backend));
+	if (!zram_backend)
+		return NULL;
+
+	ubbd_b = &zram_backend->ubbd_b;
+	ubbd_b->dev_type = UBBD_DEV_TYPE_ZRAM;
+	ubbd_b->backend_ops = &zram_backend_ops;
+	ubbd_b->dev_size = info->size;
+	zram_backend->comp = info->zram.comp;
+
+	if (pthread_key_create(&zram_backend->ctx_key, NULL))
+		goto free_backend;
+
+	if (ubbd_zram_init(&zram_backend->zram, info->size, comp))
+		goto delete_key;
+
+	pthread_mutex_init(&zram_backend->ctx_lock, NULL);
+	INIT_LIST_HEAD(&zram_backend->ctx_list);
+
+	return ubbd_b;
+
+delete_key:
+	pthread_key_delete(zram_backend->ctx_key);
+free_backend:
+	free(zram_backend);
+	return NULL;
+}
+
+static int zram_backend_open(struct ubbd_backend *ubbd_b)
+{
+	return 0;
+}
+
+static void zram_backend_close(struct ubbd_backend *ubbd_b)
+{
+	return;
+}
+
+static void zram_backend_release(struct ubbd_backend *ubbd_b)
+{
+	struct ubbd_zram_backend *zram_backend = ZRAM_BACKEND(ubbd_b);
+	struct zram_comp_ctx *ctx, *next;
+
+	if (!zram_backend)
+		return;
+
+	list_for_each_entry_safe(ctx, next, &zram_backend->ctx_list, node) {
+		list_del(&ctx->node);
+		zram_comp_ctx_free(ctx);
+	}
+	pthread_key_delete(zram_backend->ctx_key);
+	pthread_mutex_destroy(&zram_backend->ctx_lock);
+
+	ubbd_zram_exit(&zram_backend->zram);
+	free(zram_backend);
+}
+
+/* pages are compressed and decompressed on the queue thread of io */
+static int zram_backend_writev(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	struct ubbd_zram_backend *zram_b = ZRAM_BACKEND(ubbd_b);
+	struct zram_comp_ctx *ctx;
+	int ret = -ENOMEM;
+
+	ctx = zram_comp_ctx_get(zram_b);
+	if (ctx)
+		ret = ubbd_zram_write(&zram_b->zram, io->offset, io->len, io->iov, io->iov_cnt, ctx);
+	if (ret)
+		ubbd_err("failed to write zram at %lu: %d.\n", io->offset, ret);
+	ubbd_backend_io_finish(io, ret);
+
+	return 0;
+}
+
+static int zram_backend_readv(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	struct ubbd_zram_backend *zram_b = ZRAM_BACKEND(ubbd_b);
+	struct zram_comp_ctx *ctx;
+	int ret = -ENOMEM;
+
+	ctx = zram_comp_ctx_get(zram_b);
+	if (ctx)
+		ret = ubbd_zram_read(&zram_b->zram, io->offset, io->len, io->iov, io->iov_cnt, ctx);
+	if (ret)
+		ubbd_err("failed to read zram at %lu: %d.\n", io->offset, ret);
+	ubbd_backend_io_finish(io, ret);
+
+	return 0;
+}
+
+static int zram_backend_flush(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	ubbd_backend_io_finish(io, 0);
+
+	return 0;
+}
+
+/* whole pages are dropped, so discard and write-zeros both read zeros later */
+static int zram_backend_discard(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
+{
+	struct ubbd_zram_backend *zram_b = ZRAM_BACKEND(ubbd_b);
+	struct zram_comp_ctx *ctx;
+	int ret = -ENOMEM;
+
+	ctx = zram_comp_ctx_get(zram_b);
+	if (ctx)
+		ret = ubbd_zram_discard(&zram_b->zram, io->offset, io->len, ctx);
+	ubbd_backend_io_finish(io, ret);
+
+	return 0;
+}
+
+static int zram_backend_get_stats(struct ubbd_backend *ubbd_b, struct ubbd_backend_stats *stats)
+{
+	struct ubbd_zram_backend *zram_b = ZRAM_BACKEND(ubbd_b);
+	struct ubbd_zram_stats zram_stats;
+
+	ubbd_zram_get_stats(&zram_b->zram, &zram_stats);
+
+	stats->valid = true;
+	stats->zram.compr_pages = zram_stats.compr_pages;
+	stats->zram.huge_pages = zram_stats.huge_pages;
+	stats->zram.same_pages = zram_stats.same_pages;
+	stats->zram.orig_bytes = zram_stats.orig_bytes;
+	stats->zram.compr_bytes = zram_stats.compr_bytes;
+	stats->zram.mem_used = zram_stats.mem_used;
+
+	return 0;
+}
+
+struct ubbd_backend_ops zram_backend_ops = {
+	.create = zram_backend_create,
+	.open = zram_backend_open,
+	.close = zram_backend_close,
+	.release = zram_backend_release,
+	.writev = zram_backend_writev,
+	.readv = zram_backend_readv,
+	.flush = zram_backend_flush,
+	.discard = zram_backend_discard,
+	.write_zeros = zram_backend_discard,
+	.get_stats = zram_backend_get_stats,
+};
+
+struct ubbd_backend_module zram_backend_module = {
+	.version = UBBD_BACKEND_MODULE_VERSION,
+	.name = "zram",
+	.dev_type = UBBD_DEV_TYPE_ZRAM,
+	.ops = &zram_backend_ops,
+};
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "ubbd_blkmap.h"
+
+int ubbd_blkmap_init(struct ubbd_blkmap *map, uint64_t nr_blocks)
+{
+	int i;
+
+	map->nr_blocks = nr_blocks;
+	map->nr_leaves = (nr_blocks + UBBD_BLKMAP_LEAF_SIZE - 1) >> UBBD_BLKMAP_LEAF_SHIFT;
+	map->leaves = calloc(map->nr_leaves ? : 1, sizeof(void **));
+	if (!map->leaves)
+		return -ENOMEM;
+
+	for (i = 0; i < UBBD_BLKMAP_SHARDS; i++)
+		pthread_mutex_init(&map->locks[i], NULL);
+	pthread_mutex_init(&map->sync_lock, NULL);
+
+	map->phase = 0;
+	for (i = 0; i < UBBD_BLKMAP_READER_SLOTS; i++)
+		map->readers[i].nr[0] = map->readers[i].nr[1] = 0;
+
+	return 0;
+}
+
+/* no lookup or insertion is running */
+void ubbd_blkmap_exit(struct ubbd_blkmap *map, ubbd_blkmap_free_fn free_fn, void *arg)
+{
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < map->nr_leaves; i++) {
+		if (!map->leaves[i])
+			continue;
+
+		for (j = 0; j < UBBD_BLKMAP_LEAF_SIZE; j++) {
+			if (map->leaves[i][j])
+				free_fn(map->leaves[i][j], arg);
+		}
+		free(map->leaves[i]);
+	}
+	free(map->leaves);
+	map->leaves = NULL;
+
+	for (j = 0; j < UBBD_BLKMAP_SHARDS; j++)
+		pthread_mutex_destroy(&map->locks[j]);
+	pthread_mutex_destroy(&map->sync_lock);
+}
+
+static void **blkmap_leaf(struct ubbd_blkmap *map, uint64_t blk, bool alloc)
+{
+	void ***slot = &map->leaves[blk >> UBBD_BLKMAP_LEAF_SHIFT];
+	void **leaf, **expected = NULL;
+
+	leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (leaf || !alloc)
+		return leaf;
+
+	leaf = calloc(UBBD_BLKMAP_LEAF_SIZE, sizeof(void *));
+	if (!leaf)
+		return NULL;
+
+	/* lost the race to another inserter in this leaf, use its one */
+	if (!__atomic_compare_exchange_n(slot, &expected, leaf, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(leaf);
+		leaf = expected;
+	}
+
+	return leaf;
+}
+
+/* return the entry of blk, NULL if it is not inserted */
+void *ubbd_blkmap_lookup(struct ubbd_blkmap *map, uint64_t blk)
+{
+	void **leaf;
+
+	if (blk >= map->nr_blocks)
+		return NULL;
+
+	leaf = blkmap_leaf(map, blk, false);
+	if (!leaf)
+		return NULL;
+
+	return __atomic_load_n(&leaf[blk & (UBBD_BLKMAP_LEAF_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return the entry of blk, insert the one returned by alloc_fn if there
+ * is none. NULL if blk is out of map or allocation failed.
+ */
+void *ubbd_blkmap_get(struct ubbd_blkmap *map, uint64_t blk,
+		ubbd_blkmap_alloc_fn alloc_fn, void *arg)
+{
+	pthread_mutex_t *lock;
+	void **leaf, **slot;
+	void *entry;
+
+	entry = ubbd_blkmap_lookup(map, blk);
+	if (entry || blk >= map->nr_blocks)
+		return entry;
+
+	leaf = blkmap_leaf(map, blk, true);
+	if (!leaf)
+		return NULL;
+	slot = &leaf[blk & (UBBD_BLKMAP_LEAF_SIZE - 1)];
+
+	lock = &map->locks[blk % UBBD_BLKMAP_SHARDS];
+	pthread_mutex_lock(lock);
+	entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if (!entry) {
+		entry = alloc_fn(arg);
+		if (entry)
+			__atomic_store_n(slot, entry, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(lock);
+
+	return entry;
+}
+
+/* return the entry of blk removed from map, caller frees it after synchronize */
+void *ubbd_blkmap_remove(struct ubbd_blkmap *map, uint64_t blk)
+{
+	pthread_mutex_t *lock;
+	void **leaf, **slot;
+	void *entry;
+
+	if (blk >= map->nr_blocks)
+		return NULL;
+
+	leaf = blkmap_leaf(map, blk, false);
+	if (!leaf)
+		return NULL;
+	slot = &leaf[blk & (UBBD_BLKMAP_LEAF_SIZE - 1)];
+
+	lock = &map->locks[blk % UBBD_BLKMAP_SHARDS];
+	pthread_mutex_lock(lock);
+	entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if (entry)
+		__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(lock);
+
+	return entry;
+}
+
+/*
+ * Return the slot of blk, for users updating entries under their own
+ * locks instead of get and remove. NULL if blk is out of map, or its
+ * leaf is not allocated and alloc is false or allocation failed.
+ */
+void **ubbd_blkmap_slot(struct ubbd_blkmap *map, uint64_t blk, bool alloc)
+{
+	void **leaf;
+
+	if (blk >= map->nr_blocks)
+		return NULL;
+
+	leaf = blkmap_leaf(map, blk, alloc);
+	if (!leaf)
+		return NULL;
+
+	return &leaf[blk & (UBBD_BLKMAP_LEAF_SIZE - 1)];
+}
+
+static int blkmap_next_slot;
+static __thread int blkmap_slot = -1;
+
+/*
+ * Enter a read section, return the token for ubbd_blkmap_read_unlock().
+ * Counter is bumped before phase is checked again, so synchronize either
+ * sees this reader, or this reader sees the new phase and the removals
+ * before it.
+ */
+int ubbd_blkmap_read_lock(struct ubbd_blkmap *map)
+{
+	struct ubbd_blkmap_readers *readers;
+	uint32_t phase;
+
+	if (blkmap_slot < 0)
+		blkmap_slot = __atomic_fetch_add(&blkmap_next_slot, 1, __ATOMIC_RELAXED) %
+			UBBD_BLKMAP_READER_SLOTS;
+	readers = &map->readers[blkmap_slot];
+
+	while (true) {
+		phase = __atomic_load_n(&map->phase, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&readers->nr[phase], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&map->phase, __ATOMIC_SEQ_CST) == phase)
+			break;
+		__atomic_sub_fetch(&readers->nr[phase], 1, __ATOMIC_RELEASE);
+	}
+
+	return (blkmap_slot << 1) | phase;
+}
+
+void ubbd_blkmap_read_unlock(struct ubbd_blkmap *map, int token)
+{
+	__atomic_sub_fetch(&map->readers[token >> 1].nr[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until no reader can see the entries removed before, not called in
+ * a read section.
+ */
+void ubbd_blkmap_synchronize(struct ubbd_blkmap *map)
+{
+	uint32_t old;
+	uint64_t nr;
+	int i;
+
+	pthread_mutex_lock(&map->sync_lock);
+	old = map->phase;
+	__atomic_store_n(&map->phase, old ^ 1, __ATOMIC_SEQ_CST);
+
+	do {
+		nr = 0;
+		for (i = 0; i < UBBD_BLKMAP_READER_SLOTS; i++)
+			nr += __atomic_load_n(&map->readers[i].nr[old], __ATOMIC_ACQUIRE);
+		if (nr)
+			sched_yield();
+	} while (nr);
+	pthread_mutex_unlock(&map->sync_lock);
+}
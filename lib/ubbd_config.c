@@ -31,8 +31,91 @@ static char *get_dev_conf_path(int dev_id)
 	return path;
 }
 
+/*
+ * Layout of version 0, struct ubbd_dev_info ended before queue_opts.
+ * Zeroed queue_opts are what a device got before queue_opts existed:
+ * interrupt poll, poll engine, one doorbell per ce, no buffering.
+ */
+#define UBBD_DEV_INFO_V0_SIZE	__builtin_offsetof(struct ubbd_dev_info, queue_opts)
+
+struct ubbd_dev_conf_v0 {
+	struct ubbd_conf_header conf_header;
+	enum ubbd_dev_type dev_type;
+	int dev_id;
+	int num_queues;
+	char dev_info[UBBD_DEV_INFO_V0_SIZE] __attribute__((aligned(__alignof__(struct ubbd_dev_info))));
+	int current_backend_id;
+	int new_backend_id;
+	int cache_mode;
+};
+
+struct ubbd_backend_conf_v0 {
+	struct ubbd_conf_header conf_header;
+	enum ubbd_dev_type dev_type;
+	uint64_t dev_size;
+	int dev_id;
+	char dev_info[UBBD_DEV_INFO_V0_SIZE] __attribute__((aligned(__alignof__(struct ubbd_dev_info))));
+	int num_queues;
+	struct ubbd_queue_info queue_infos[UBBD_QUEUE_MAX];
+	int cache_mode;
+};
+
+static void *conf_migrate_v0(void *data, int conf_type)
+{
+	struct ubbd_backend_conf_v0 *old_b = data;
+	struct ubbd_dev_conf_v0 *old_d = data;
+	struct ubbd_backend_conf *b_conf;
+	struct ubbd_dev_conf *d_conf;
+
+	if (conf_type == UBBD_CONF_TYPE_BACKEND) {
+		b_conf = calloc(1, sizeof(*b_conf));
+		if (!b_conf)
+			return NULL;
+
+		b_conf->conf_header = old_b->conf_header;
+		b_conf->dev_type = old_b->dev_type;
+		b_conf->dev_size = old_b->dev_size;
+		b_conf->dev_id = old_b->dev_id;
+		memcpy(&b_conf->dev_info, old_b->dev_info, UBBD_DEV_INFO_V0_SIZE);
+		b_conf->num_queues = old_b->num_queues;
+		memcpy(b_conf->queue_infos, old_b->queue_infos, sizeof(b_conf->queue_infos));
+		b_conf->cache_mode = old_b->cache_mode;
+		b_conf->conf_header.version = UBBD_CONF_VERSION;
+
+		return b_conf;
+	}
+
+	d_conf = calloc(1, sizeof(*d_conf));
+	if (!d_conf)
+		return NULL;
+
+	d_conf->conf_header = old_d->conf_header;
+	d_conf->dev_type = old_d->dev_type;
+	d_conf->dev_id = old_d->dev_id;
+	d_conf->num_queues = old_d->num_queues;
+	memcpy(&d_conf->dev_info, old_d->dev_info, UBBD_DEV_INFO_V0_SIZE);
+	d_conf->current_backend_id = old_d->current_backend_id;
+	d_conf->new_backend_id = old_d->new_backend_id;
+	d_conf->cache_mode = old_d->cache_mode;
+	d_conf->conf_header.version = UBBD_CONF_VERSION;
+
+	return d_conf;
+}
+
 static size_t get_conf_size(struct ubbd_conf_header *conf_header)
 {
+	if (conf_header->version > UBBD_CONF_VERSION) {
+		ubbd_err("unsupported config version: %u\n", conf_header->version);
+		return 0;
+	}
+
+	if (conf_header->version == 0) {
+		if (conf_header->conf_type == UBBD_CONF_TYPE_BACKEND)
+			return sizeof(struct ubbd_backend_conf_v0);
+		else if (conf_header->conf_type == UBBD_CONF_TYPE_DEVICE)
+			return sizeof(struct ubbd_dev_conf_v0);
+	}
+
 	if (conf_header->conf_type == UBBD_CONF_TYPE_BACKEND) {
 		ubbd_err("backend size: %lu\n", sizeof(struct ubbd_backend_conf));
 		return sizeof(struct ubbd_backend_conf);
@@ -118,6 +201,7 @@ static void *ubbd_conf_read(char *conf_path, int conf_type)
 	struct ubbd_conf_header *conf_header;
 	size_t conf_size;
 	void *data = NULL;
+	void *old;
 
 	conf_header = conf_get_header(conf_path);
 	if (!conf_header) {
@@ -131,6 +215,8 @@ static void *ubbd_conf_read(char *conf_path, int conf_type)
 	}
 
 	conf_size = get_conf_size(conf_header);
+	if (!conf_size)
+		goto free_header;
 
 	data = calloc(1, conf_size);
 	if (!data) {
@@ -142,6 +228,16 @@ static void *ubbd_conf_read(char *conf_path, int conf_type)
 		ubbd_err("failed to read config data\n");
 		free(data);
 		data = NULL;
+		goto free_header;
+	}
+
+	/* written back in the new layout when conf is written next time */
+	if (conf_header->version == 0) {
+		old = data;
+		data = conf_migrate_v0(old, conf_type);
+		free(old);
+		if (!data)
+			ubbd_err("failed to migrate config of version 0.\n");
 	}
 
 free_header:
@@ -218,6 +218,13 @@ static void *mgmt_thread_fn(void* args)
 					ret = -EINVAL;
 					break;
 				}
+				if (mgmt_req.u.req_stats.queue_id < 0 ||
+				    mgmt_req.u.req_stats.queue_id >= ubbd_dev->num_queues) {
+					ubbd_err("invalid queue_id for req-stats: %d\n",
+						 mgmt_req.u.req_stats.queue_id);
+					ret = -EINVAL;
+					break;
+				}
 				mgmt_rsp.req_stats.num_queues = ubbd_dev->num_queues;
 				if (true) {
 					struct ubbd_backend_mgmt_rsp backend_rsp;
@@ -227,6 +234,7 @@ static void *mgmt_thread_fn(void* args)
 					backend_request.dev_id = ubbd_dev->dev_id;
 					backend_request.backend_id = ubbd_dev->current_backend_id;
 					backend_request.cmd = UBBD_BACKEND_MGMT_CMD_REQ_STATS;
+					backend_request.u.req_stats.queue_id = mgmt_req.u.req_stats.queue_id;
 
 					ret = ubbd_backend_request(&fd, &backend_request);
 					if (ret)
@@ -237,7 +245,7 @@ static void *mgmt_thread_fn(void* args)
 						break;
 					memcpy(&mgmt_rsp.req_stats.req_stats,
 					       &backend_rsp.u.req_stats.req_stats,
-					       sizeof(struct ubbd_req_stats) * UBBD_QUEUE_MAX);
+					       sizeof(struct ubbd_req_stats));
 				}
 
 				ret = 0;
@@ -293,8 +301,33 @@ static void *mgmt_thread_fn(void* args)
 				mgmt_rsp.dev_info.devid = ubbd_dev->dev_id;
 				memcpy(&mgmt_rsp.dev_info.dev_info, &ubbd_dev->dev_info, sizeof(struct ubbd_dev_info));
 
+				/* runtime stats are optional, info is still returned without backend */
+				if (true) {
+					struct ubbd_backend_mgmt_rsp backend_rsp;
+					struct ubbd_backend_mgmt_request backend_request = { 0 };
+					int fd;
+
+					backend_request.dev_id = ubbd_dev->dev_id;
+					backend_request.backend_id = ubbd_dev->current_backend_id;
+					backend_request.cmd = UBBD_BACKEND_MGMT_CMD_GET_STATS;
+
+					if (!ubbd_backend_request(&fd, &backend_request) &&
+							!ubbd_backend_response(fd, &backend_rsp, 5))
+						memcpy(&mgmt_rsp.dev_info.backend_stats, &backend_rsp.u.get_stats,
+						       sizeof(struct ubbd_backend_stats));
+				}
+
 				ret = 0;
 				break;
+			case UBBDD_MGMT_CMD_SET_QOS:
+				ubbd_dev = find_ubbd_dev(mgmt_req.u.set_qos.dev_id);
+				if (!ubbd_dev) {
+					ubbd_err("cant find ubbddev for set qos\n");
+					ret = -EINVAL;
+					break;
+				}
+				ret = ubbd_dev_set_qos(ubbd_dev, &mgmt_req.u.set_qos.qos);
+				break;
 			default:
 				ubbd_err("unrecognized command: %d\n", mgmt_req.cmd);
 				ret = -EINVAL;
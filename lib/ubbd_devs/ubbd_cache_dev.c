@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "ubbd_dev.h"
 #include "ubbd_uio.h"
 
@@ -22,6 +22,7 @@ extern struct ubbd_dev_ops ssh_dev_ops;
 extern struct ubbd_dev_ops cache_dev_ops;
 extern struct ubbd_dev_ops s3_dev_ops;
 extern struct ubbd_dev_ops mem_dev_ops;
+extern struct ubbd_dev_ops zram_dev_ops;
 
 LIST_HEAD(ubbd_dev_list);
 pthread_mutex_t ubbd_dev_list_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -69,6 +70,8 @@ struct ubbd_device *__dev_create(struct __ubbd_dev_info *info, bool force)
 		dev_ops = &s3_dev_ops;
 	} else if (info->type == UBBD_DEV_TYPE_MEM) {
 		dev_ops = &mem_dev_ops;
+	} else if (info->type == UBBD_DEV_TYPE_ZRAM) {
+		dev_ops = &zram_dev_ops;
 	}
 	
 	if (dev_ops == NULL) {
@@ -178,6 +181,14 @@ int ubbd_dev_init(struct ubbd_device *ubbd_dev, bool reopen)
 	if (ret)
 		goto out;
 
+	/*
+	 * write-back completes writes before they reach backend, tell kernel
+	 * the cache is volatile so it sends flushes, which wait for destage.
+	 * fua stays off, kernel turns a fua write into write and flush.
+	 */
+	if (ubbd_dev->dev_info.queue_opts.write_back_mb)
+		ubbd_dev->dev_features.write_cache = true;
+
 	ubbd_dev->status = UBBD_DEV_USTATUS_OPENED;
 
 out:
@@ -850,6 +861,47 @@ int ubbd_dev_config(struct ubbd_device *ubbd_dev, int data_pages_reserve_percnt,
 	return ret;
 }
 
+/* apply qos to the running backend, and save it for backend restart */
+int ubbd_dev_set_qos(struct ubbd_device *ubbd_dev, struct ubbd_qos_opts *qos)
+{
+	struct ubbd_backend_mgmt_rsp backend_rsp;
+	struct ubbd_backend_mgmt_request backend_request = { 0 };
+	int fd;
+	int ret;
+
+	pthread_mutex_lock(&ubbd_dev->lock);
+	backend_request.dev_id = ubbd_dev->dev_id;
+	backend_request.backend_id = ubbd_dev->current_backend_id;
+	backend_request.cmd = UBBD_BACKEND_MGMT_CMD_SET_QOS;
+	memcpy(&backend_request.u.set_qos, qos, sizeof(*qos));
+
+	ret = ubbd_backend_request(&fd, &backend_request);
+	if (ret) {
+		ubbd_dev_err(ubbd_dev, "failed to send set-qos to backend: %d\n", ret);
+		goto out;
+	}
+
+	ret = ubbd_backend_response(fd, &backend_rsp, 5);
+	if (ret) {
+		ubbd_dev_err(ubbd_dev, "failed to wait set-qos response from backend: %d\n", ret);
+		goto out;
+	}
+
+	memcpy(&ubbd_dev->dev_info.queue_opts.qos, qos, sizeof(*qos));
+
+	ret = dev_conf_write(ubbd_dev);
+	if (ret) {
+		ubbd_dev_err(ubbd_dev, "failed to write dev_conf after set-qos.\n");
+		goto out;
+	}
+
+	ret = backend_conf_setup(ubbd_dev);
+out:
+	pthread_mutex_unlock(&ubbd_dev->lock);
+
+	return ret;
+}
+
 static int get_backend_status(struct ubbd_device *ubbd_dev, int backend_id)
 {
 	struct ubbd_backend_mgmt_rsp backend_rsp;
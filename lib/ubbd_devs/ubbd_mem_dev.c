@@ -18,22 +18,43 @@ static struct ubbd_device *mem_dev_create(struct __ubbd_dev_info *info)
 	ubbd_dev = &mem_dev->ubbd_dev;
 	ubbd_dev->dev_type = UBBD_DEV_TYPE_MEM;
 	ubbd_dev->dev_ops = &mem_dev_ops;
+	mem_dev->backing = info->mem.backing;
+	mem_dev->shm_id = info->mem.shm_id;
 
 	return ubbd_dev;
 }
 
-static int mem_dev_init(struct ubbd_device *ubbd_dev, bool reopen)
+/* data in shm is kept over restart of backend, until device is removed */
+static void mem_dev_shm_unlink(struct ubbd_device *ubbd_dev)
 {
-	if (ubbd_dev->dev_size > ((uint64_t)UBBD_MEM_BLK_SIZE * UBBD_MEM_BLK_COUNT)) {
-		ubbd_err("dev size for mem type is too large: %lu (max %lu)\n",
-				ubbd_dev->dev_size, ((uint64_t)UBBD_MEM_BLK_SIZE * UBBD_MEM_BLK_COUNT));
-		return -E2BIG;
-	}
+	struct ubbd_mem_device *mem_dev = MEM_DEV(ubbd_dev);
+	char *path;
+
+	if (mem_dev->backing != UBBD_MEM_BACKING_SHM)
+		return;
+
+	path = get_mem_shm_path(ubbd_dev->dev_id, mem_dev->shm_id);
+	if (!path)
+		return;
 
+	if (unlink(path) && errno != ENOENT)
+		ubbd_dev_err(ubbd_dev, "failed to unlink %s: %d\n", path, -errno);
+	free(path);
+}
+
+static int mem_dev_init(struct ubbd_device *ubbd_dev, bool reopen)
+{
 	ubbd_dev->dev_features.write_cache = false;
 	ubbd_dev->dev_features.fua = false;
-	ubbd_dev->dev_features.discard = false;
-	ubbd_dev->dev_features.write_zeros = false;
+	ubbd_dev->dev_features.discard = true;
+	ubbd_dev->dev_features.write_zeros = true;
+
+	return 0;
+}
+
+static int mem_dev_before_dev_remove(struct ubbd_device *ubbd_dev)
+{
+	mem_dev_shm_unlink(ubbd_dev);
 
 	return 0;
 }
@@ -49,4 +70,5 @@ struct ubbd_dev_ops mem_dev_ops = {
 	.create = mem_dev_create,
 	.init = mem_dev_init,
 	.release = mem_dev_release,
+	.before_dev_remove = mem_dev_before_dev_remove,
 };
@@ -0,0 +1,46 @@
+#define _GNU_SOURCE
+#include "ubbd_uio.h"
+#include "ubbd_dev.h"
+
+#define ZRAM_DEV(ubbd_dev) ((struct ubbd_zram_device *)container_of(ubbd_dev, struct ubbd_zram_device, ubbd_dev))
+
+struct ubbd_dev_ops zram_dev_ops;
+
+static struct ubbd_device *zram_dev_create(struct __ubbd_dev_info *info)
+{
+	struct ubbd_zram_device *zram_dev;
+	struct ubbd_device *ubbd_dev;
+
+	zram_dev = calloc(1, sizeof(*zram_dev));
+	if (!zram_dev)
+		return NULL;
+
+	ubbd_dev = &zram_dev->ubbd_dev;
+	ubbd_dev->dev_type = UBBD_DEV_TYPE_ZRAM;
+	ubbd_dev->dev_ops = &zram_dev_ops;
+
+	return ubbd_dev;
+}
+
+static int zram_dev_init(struct ubbd_device *ubbd_dev, bool reopen)
+{
+	ubbd_dev->dev_features.write_cache = false;
+	ubbd_dev->dev_features.fua = false;
+	ubbd_dev->dev_features.discard = true;
+	ubbd_dev->dev_features.write_zeros = true;
+
+	return 0;
+}
+
+static void zram_dev_release(struct ubbd_device *ubbd_dev)
+{
+	struct ubbd_zram_device *zram_dev = ZRAM_DEV(ubbd_dev);
+
+	free(zram_dev);
+}
+
+struct ubbd_dev_ops zram_dev_ops = {
+	.create = zram_dev_create,
+	.init = zram_dev_init,
+	.release = zram_dev_release,
+};
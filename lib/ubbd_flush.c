@@ -0,0 +1,70 @@
+#include "ubbd_flush.h"
+
+void ubbd_flush_tracker_init(struct ubbd_flush_tracker *tracker)
+{
+	pthread_mutex_init(&tracker->lock, NULL);
+	tracker->write_seq = 1;
+	tracker->stable_seq = 0;
+	tracker->flushing_seq = 0;
+	tracker->flushing = false;
+	INIT_LIST_HEAD(&tracker->waiters);
+}
+
+enum ubbd_flush_action ubbd_flush_begin(struct ubbd_flush_tracker *tracker,
+		struct ubbd_flush_req *req)
+{
+	enum ubbd_flush_action action;
+
+	req->seq = __atomic_load_n(&tracker->write_seq, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&tracker->lock);
+	if (req->seq <= tracker->stable_seq) {
+		action = UBBD_FLUSH_DONE;
+		goto out;
+	}
+
+	list_add_tail(&req->node, &tracker->waiters);
+	if (tracker->flushing) {
+		action = UBBD_FLUSH_WAIT;
+		goto out;
+	}
+
+	tracker->flushing = true;
+	tracker->flushing_seq = __atomic_load_n(&tracker->write_seq, __ATOMIC_ACQUIRE);
+	action = UBBD_FLUSH_ISSUE;
+out:
+	pthread_mutex_unlock(&tracker->lock);
+
+	return action;
+}
+
+/*
+ * Backend flush issued for flushing_seq finished with ret, move the
+ * waiters covered by it to done, caller calls done() of them. Return true
+ * if there are waiters left, then caller issues another backend flush.
+ */
+bool ubbd_flush_end(struct ubbd_flush_tracker *tracker, int ret,
+		struct list_head *done)
+{
+	struct ubbd_flush_req *req, *tmp;
+	bool reissue = false;
+
+	pthread_mutex_lock(&tracker->lock);
+	if (!ret && tracker->flushing_seq > tracker->stable_seq)
+		tracker->stable_seq = tracker->flushing_seq;
+
+	list_for_each_entry_safe(req, tmp, &tracker->waiters, node) {
+		if (req->seq <= tracker->flushing_seq)
+			list_move_tail(&req->node, done);
+	}
+
+	if (list_empty(&tracker->waiters)) {
+		tracker->flushing = false;
+	} else {
+		tracker->flushing_seq = __atomic_load_n(&tracker->write_seq, __ATOMIC_ACQUIRE);
+		reissue = true;
+	}
+	pthread_mutex_unlock(&tracker->lock);
+
+	return reissue;
+}
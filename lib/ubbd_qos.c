@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <string.h>
+
+#include "ubbd_qos.h"
+
+#define UBBD_QOS_NS_PER_SEC	1000000000ULL
+/* dont spin on tiny waits, let tokens of a few requests pile up */
+#define UBBD_QOS_MIN_WAIT_NS	(10 * 1000)
+
+static void qos_bucket_setup(struct ubbd_qos_bucket *bucket, uint64_t rate,
+		uint32_t burst_ms, uint64_t now)
+{
+	bucket->rate = rate;
+	bucket->burst = rate * burst_ms / 1000;
+	if (bucket->burst < 1)
+		bucket->burst = 1;
+	bucket->tokens = bucket->burst;
+	bucket->last_ns = now;
+}
+
+static void qos_bucket_refill(struct ubbd_qos_bucket *bucket, uint64_t now)
+{
+	uint64_t tokens;
+
+	if (now <= bucket->last_ns)
+		return;
+
+	tokens = (unsigned __int128)(now - bucket->last_ns) * bucket->rate / UBBD_QOS_NS_PER_SEC;
+	if (!tokens)
+		return;
+
+	if (tokens >= bucket->burst - bucket->tokens) {
+		bucket->tokens = bucket->burst;
+		bucket->last_ns = now;
+		return;
+	}
+
+	/* keep the fraction of a token for next refill */
+	bucket->tokens += tokens;
+	bucket->last_ns += (unsigned __int128)tokens * UBBD_QOS_NS_PER_SEC / bucket->rate;
+}
+
+/* ns until bucket is out of debt, 0 if it is */
+static uint64_t qos_bucket_wait(struct ubbd_qos_bucket *bucket, uint64_t now)
+{
+	uint64_t wait_ns;
+
+	if (bucket->tokens > 0)
+		return 0;
+
+	wait_ns = ((unsigned __int128)(1 - bucket->tokens) * UBBD_QOS_NS_PER_SEC +
+			bucket->rate - 1) / bucket->rate;
+	wait_ns -= (now - bucket->last_ns);
+
+	return (wait_ns > UBBD_QOS_MIN_WAIT_NS ? wait_ns : UBBD_QOS_MIN_WAIT_NS);
+}
+
+void ubbd_qos_set(struct ubbd_qos *qos, struct ubbd_qos_opts *opts, uint64_t now)
+{
+	bool enabled = false;
+	int i;
+
+	pthread_spin_lock(&qos->lock);
+	for (i = 0; i < UBBD_QOS_MAX; i++) {
+		qos_bucket_setup(&qos->buckets[i], opts->limits[i], opts->burst_ms, now);
+		if (opts->limits[i])
+			enabled = true;
+	}
+	__atomic_store_n(&qos->enabled, enabled, __ATOMIC_RELAXED);
+	pthread_spin_unlock(&qos->lock);
+}
+
+int ubbd_qos_init(struct ubbd_qos *qos, struct ubbd_qos_opts *opts, uint64_t now)
+{
+	int ret;
+
+	memset(qos, 0, sizeof(*qos));
+	ret = pthread_spin_init(&qos->lock, PTHREAD_PROCESS_PRIVATE);
+	if (ret)
+		return -ret;
+
+	ubbd_qos_set(qos, opts, now);
+
+	return 0;
+}
+
+/*
+ * Take tokens of a request at now, return 0 if it is admitted, otherwise
+ * nothing is taken and return ns to wait before trying again.
+ */
+uint64_t ubbd_qos_throttle(struct ubbd_qos *qos, bool write, uint64_t bytes, uint64_t now)
+{
+	int types[4] = { UBBD_QOS_IOPS, UBBD_QOS_BPS,
+		write ? UBBD_QOS_WRITE_IOPS : UBBD_QOS_READ_IOPS,
+		write ? UBBD_QOS_WRITE_BPS : UBBD_QOS_READ_BPS };
+	struct ubbd_qos_bucket *bucket;
+	uint64_t wait_ns = 0, ns;
+	int i;
+
+	pthread_spin_lock(&qos->lock);
+	for (i = 0; i < 4; i++) {
+		bucket = &qos->buckets[types[i]];
+		if (!bucket->rate)
+			continue;
+
+		qos_bucket_refill(bucket, now);
+		ns = qos_bucket_wait(bucket, now);
+		if (ns > wait_ns)
+			wait_ns = ns;
+	}
+
+	if (wait_ns)
+		goto out;
+
+	for (i = 0; i < 4; i++) {
+		bucket = &qos->buckets[types[i]];
+		if (!bucket->rate)
+			continue;
+
+		if (types[i] == UBBD_QOS_IOPS ||
+				types[i] == UBBD_QOS_READ_IOPS ||
+				types[i] == UBBD_QOS_WRITE_IOPS)
+			bucket->tokens--;
+		else
+			bucket->tokens -= bytes;
+	}
+out:
+	pthread_spin_unlock(&qos->lock);
+
+	return wait_ns;
+}
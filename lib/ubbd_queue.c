@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 
 #include "utils.h"
@@ -10,241 +11,1574 @@
 #include "ubbd_netlink.h"
 #include "ubbd_backend.h"
 
-static bool compr_space_enough(struct ubbd_queue *ubbd_q, uint32_t required)
+/* max time to wait for kernel consuming ce when there is no credit */
+#define UBBD_QUEUE_CREDIT_WAIT_NS	(100 * 1000)
+
+/* queue handled by the current cmdproc_thread */
+static __thread struct ubbd_queue *current_queue;
+
+/*
+ * Completion ring
+ *
+ * ce slots are addressed by a 64bit sequence, slot of seq is (seq % ce_nr)
+ * in compr ring. A completer reserves a seq by fetch-add on ce_reserve_seq,
+ * fills the ce and marks it ready in ce_ready[]. Then ce_publish() moves
+ * sb->compr_head over all consecutive ready ce in order.
+ */
+static inline uint32_t ce_seq_to_off(struct ubbd_queue *ubbd_q, uint64_t seq)
+{
+	return (seq % ubbd_q->ce_nr) * sizeof(struct ubbd_ce);
+}
+
+static inline struct ubbd_ce *ce_seq_to_ce(struct ubbd_queue *ubbd_q, uint64_t seq)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+
+	return (struct ubbd_ce *) ((char *) sb + sb->compr_off + ce_seq_to_off(ubbd_q, seq));
+}
+
+/* seq of the oldest ce not yet consumed by kernel */
+static uint64_t ce_tail_seq(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	uint64_t publish_seq;
+	uint32_t head, tail;
+
+	publish_seq = __atomic_load_n(&ubbd_q->ce_publish_seq, __ATOMIC_ACQUIRE);
+	head = ce_seq_to_off(ubbd_q, publish_seq);
+	tail = atomic_read(&sb->compr_tail);
+
+	return publish_seq - ((head + sb->compr_size - tail) % sb->compr_size) / sizeof(struct ubbd_ce);
+}
+
+/* slot of seq is free when the kernel consumed the ce used it last round */
+static bool ce_slot_free(struct ubbd_queue *ubbd_q, uint64_t seq)
+{
+	return (seq - ce_tail_seq(ubbd_q) < ubbd_q->ce_capacity);
+}
+
+/*
+ * Credit based flow control
+ *
+ * Every se which will be completed by a ce takes one credit before it is
+ * handled, so in-flight requests plus ce in compr ring never exceed the
+ * ring capacity, and completers never wait for ring space. When there is
+ * no credit left, cmd_process stops pulling se until kernel consumes ce.
+ */
+static bool ce_credit_get(struct ubbd_queue *ubbd_q)
+{
+	if (ubbd_q->ce_credit_seq >= ubbd_q->ce_credit_limit) {
+		ubbd_q->ce_credit_limit = ce_tail_seq(ubbd_q) + ubbd_q->ce_capacity;
+		if (ubbd_q->ce_credit_seq >= ubbd_q->ce_credit_limit)
+			return false;
+	}
+
+	ubbd_q->ce_credit_seq++;
+
+	return true;
+}
+
+/* the ring of io_uring engine is only used by cmdproc_thread */
+static void queue_doorbell(struct ubbd_queue *ubbd_q)
+{
+	if (ubbd_q->uring && current_queue == ubbd_q)
+		ubbd_uring_doorbell(ubbd_q);
+	else
+		ubbd_processing_complete(&ubbd_q->uio_info);
+}
+
+/* ring the doorbell for all published ce, this closes the current batch */
+static void ce_kick(struct ubbd_queue *ubbd_q)
+{
+	uint64_t publish_seq, kick_seq;
+
+	publish_seq = __atomic_load_n(&ubbd_q->ce_publish_seq, __ATOMIC_ACQUIRE);
+	kick_seq = __atomic_load_n(&ubbd_q->ce_kick_seq, __ATOMIC_RELAXED);
+	do {
+		if (kick_seq >= publish_seq)
+			return;
+	} while (!__atomic_compare_exchange_n(&ubbd_q->ce_kick_seq, &kick_seq, publish_seq,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	atomic_add(&ubbd_q->req_stats.ce_batches, 1);
+	atomic_add(&ubbd_q->req_stats.ce_batched, publish_seq - kick_seq);
+
+	queue_doorbell(ubbd_q);
+}
+
+/*
+ * Move compr_head over all consecutive ready ce. Only one thread publishes
+ * at a time, the others just leave their ce ready. The publisher rechecks
+ * after it is done, so no ready ce is left behind.
+ *
+ * Return true if this opened a new batch.
+ */
+static bool ce_publish(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	uint64_t seq, old_seq;
+	bool opened = false;
+
+again:
+	if (__atomic_exchange_n(&ubbd_q->ce_publishing, 1, __ATOMIC_SEQ_CST))
+		return opened;
+
+	seq = old_seq = ubbd_q->ce_publish_seq;
+	while (__atomic_load_n(&ubbd_q->ce_ready[seq % ubbd_q->ce_nr], __ATOMIC_ACQUIRE) == seq + 1)
+		seq++;
+
+	if (seq != old_seq) {
+		/* ce must be visible before compr_head moves */
+		ubbd_smp_wmb();
+		atomic_set(&sb->compr_head, ce_seq_to_off(ubbd_q, seq));
+		__atomic_store_n(&ubbd_q->ce_publish_seq, seq, __ATOMIC_RELEASE);
+
+		if (ubbd_q->ce_batch_max > 1 &&
+				__atomic_load_n(&ubbd_q->ce_kick_seq, __ATOMIC_RELAXED) == old_seq) {
+			ubbd_q->ce_pending_since = get_ns();
+			opened = true;
+		}
+	}
+
+	__atomic_store_n(&ubbd_q->ce_publishing, 0, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ubbd_q->ce_ready[seq % ubbd_q->ce_nr], __ATOMIC_SEQ_CST) == seq + 1)
+		goto again;
+
+	return opened;
+}
+
+static bool ce_batch_full(struct ubbd_queue *ubbd_q)
+{
+	uint64_t pending;
+
+	pending = __atomic_load_n(&ubbd_q->ce_publish_seq, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&ubbd_q->ce_kick_seq, __ATOMIC_RELAXED);
+	if (!pending)
+		return false;
+
+	return (pending >= ubbd_q->ce_batch_max ||
+			get_ns() - ubbd_q->ce_pending_since >= ubbd_q->ce_batch_ns);
+}
+
+static void queue_flush_ce(struct ubbd_queue *ubbd_q)
+{
+	ce_kick(ubbd_q);
+}
+
+/*
+ * Return the time in ns before the pending batch expires, -1 means there
+ * is no pending batch. The batch is closed here if it is already expired.
+ */
+static int64_t queue_ce_batch_timeout(struct ubbd_queue *ubbd_q)
+{
+	uint64_t waited;
+
+	if (__atomic_load_n(&ubbd_q->ce_publish_seq, __ATOMIC_ACQUIRE) ==
+			__atomic_load_n(&ubbd_q->ce_kick_seq, __ATOMIC_RELAXED))
+		return -1;
+
+	waited = get_ns() - ubbd_q->ce_pending_since;
+	if (waited >= ubbd_q->ce_batch_ns) {
+		ce_kick(ubbd_q);
+		return -1;
+	}
+
+	return ubbd_q->ce_batch_ns - waited;
+}
+
+void ubbd_queue_wakeup(struct ubbd_queue *ubbd_q)
+{
+	if (eventfd_write(ubbd_q->wakeup_fd, 1))
+		ubbd_err("failed to wakeup queue%d: %d\n", ubbd_q->index, -errno);
+}
+
+static void queue_run_pollers(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_queue_poller *poller;
+
+	list_for_each_entry(poller, &ubbd_q->pollers, node) {
+		if (poller->inflight)
+			poller->poll(poller);
+	}
+}
+
+static bool queue_pollers_idle(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_queue_poller *poller;
+
+	list_for_each_entry(poller, &ubbd_q->pollers, node) {
+		if (poller->inflight)
+			return false;
+	}
+
+	return true;
+}
+
+int ubbd_queue_add_poller(struct ubbd_queue_poller *poller)
+{
+	if (!current_queue)
+		return -ENODEV;
+
+	list_add_tail(&poller->node, &current_queue->pollers);
+
+	return current_queue->wakeup_fd;
+}
+
+/*
+ * Wait until a credit is available. Kernel frees ring space when it
+ * consumes ce after a doorbell, completers kick and wake us up when they
+ * publish ce during the wait, the timeout covers consumption by kernel.
+ */
+static int queue_wait_ce_credit(struct ubbd_queue *ubbd_q)
+{
+	struct timespec ts = { 0, UBBD_QUEUE_CREDIT_WAIT_NS };
+	struct pollfd pollfd;
+	uint64_t start_ns = get_ns();
+	eventfd_t cnt;
+	int ret = 0;
+
+	atomic_add(&ubbd_q->req_stats.ce_ring_full, 1);
+
+	__atomic_store_n(&ubbd_q->ce_credit_waiting, 1, __ATOMIC_SEQ_CST);
+	while (!ce_credit_get(ubbd_q)) {
+		if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
+			ret = -ESHUTDOWN;
+			break;
+		}
+
+		ce_kick(ubbd_q);
+
+		/* completions of backend sqe come from the ring */
+		if (ubbd_q->uring) {
+			ret = ubbd_uring_wait(ubbd_q, UBBD_QUEUE_CREDIT_WAIT_NS, NULL);
+			if (ret)
+				break;
+			queue_run_pollers(ubbd_q);
+			continue;
+		}
+
+		pollfd.fd = ubbd_q->wakeup_fd;
+		pollfd.events = POLLIN;
+		pollfd.revents = 0;
+		if (ppoll(&pollfd, 1, &ts, NULL) > 0)
+			eventfd_read(ubbd_q->wakeup_fd, &cnt);
+		queue_run_pollers(ubbd_q);
+	}
+	__atomic_store_n(&ubbd_q->ce_credit_waiting, 0, __ATOMIC_RELEASE);
+
+	atomic_add(&ubbd_q->req_stats.ce_ring_full_time, get_ns() - start_ns);
+
+	return ret;
+}
+
+int ubbd_queue_ce_init(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	uint64_t seq;
+
+	/* There is a CMPR_RESERVED we dont use to prevent the ring to be used up */
+	ubbd_q->ce_nr = sb->compr_size / sizeof(struct ubbd_ce);
+	ubbd_q->ce_capacity = (sb->compr_size - CMPR_RESERVED) / sizeof(struct ubbd_ce);
+
+	ubbd_q->ce_ready = calloc(ubbd_q->ce_nr, sizeof(uint64_t));
+	if (!ubbd_q->ce_ready) {
+		ubbd_err("failed to alloc ce_ready for queue%d\n", ubbd_q->index);
+		return -ENOMEM;
+	}
+
+	seq = sb->compr_head / sizeof(struct ubbd_ce);
+	ubbd_q->ce_reserve_seq = seq;
+	ubbd_q->ce_publish_seq = seq;
+	ubbd_q->ce_kick_seq = seq;
+	ubbd_q->ce_publishing = 0;
+	ubbd_q->ce_credit_seq = seq;
+	ubbd_q->ce_credit_limit = 0;
+	ubbd_q->ce_credit_waiting = 0;
+
+	return 0;
+}
+
+void ubbd_queue_ce_exit(struct ubbd_queue *ubbd_q)
+{
+	free(ubbd_q->ce_ready);
+	ubbd_q->ce_ready = NULL;
+}
+
+static void wait_for_compr_empty(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+ 
+         ubbd_info("waiting for ring to clear\n");
+         while (sb->compr_head != sb->compr_tail) {
+		 ubbd_info("head: %u, tail: %u\n", sb->compr_head, sb->compr_tail);
+                 usleep(50000);
+		 ubbd_processing_complete(&ubbd_q->uio_info);
+		 if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
+			 ubbd_err("ubbd device is stopping\n");
+			 break;
+		 }
+	 }
+         ubbd_info("ring clear\n");
+}
+
+/* se which will be completed by a ce */
+static inline bool se_need_ce(struct ubbd_se *se)
+{
+	return (ubbd_se_hdr_get_op(se->header.len_op) != UBBD_OP_PAD &&
+			!ubbd_se_hdr_flags_test(se, UBBD_SE_HDR_DONE));
+}
+
+/* spin slice in busy poll mode, poll stats are updated once per slice */
+#define UBBD_QUEUE_BUSY_POLL_SLICE_NS	(1000 * 1000)
+
+static inline bool cmd_pending(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+
+	return (atomic_read(&sb->cmd_head) != ubbd_q->se_to_handle);
+}
+
+/*
+ * Spin on sb->cmd_head for at most budget_ns, return true if
+ * there is new se to handle.
+ */
+static bool queue_spin_for_cmd(struct ubbd_queue *ubbd_q, uint64_t budget_ns)
+{
+	uint64_t start_ns = get_ns();
+	uint64_t spin_ns;
+	unsigned int loops = 0;
+	bool found = false;
+
+	while (1) {
+		if (cmd_pending(ubbd_q)) {
+			ubbd_smp_rmb();
+			found = true;
+			break;
+		}
+
+		if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING)
+			break;
+
+		ubbd_cpu_relax();
+
+		/* dont read clock in every loop */
+		if (++loops % 64)
+			continue;
+
+		queue_ce_batch_timeout(ubbd_q);
+
+		if (ubbd_q->uring) {
+			ubbd_uring_reap(ubbd_q);
+			ubbd_uring_submit(ubbd_q);
+		}
+		queue_run_pollers(ubbd_q);
+
+		if (get_ns() - start_ns >= budget_ns)
+			break;
+	}
+
+	spin_ns = get_ns() - start_ns;
+
+	atomic_add(&ubbd_q->req_stats.poll_spin_time, spin_ns);
+	if (found)
+		atomic_add(&ubbd_q->req_stats.poll_spin_hits, 1);
+
+	return found;
+}
+
+struct q_backend_io_ctx_data {
+	struct ubbd_queue *ubbd_q;
+	struct ubbd_backend_io *io;
+	struct ubbd_se *se;
+	uint64_t start_ns;
+	/* io type of the se, io->io_type may be changed by zero detect */
+	enum ubbd_backend_io_type op_type;
+	bool pooled;
+	/* iovs io can hold */
+	uint32_t iov_max;
+	/* se merged into io, one ce per priv_data when io finishes */
+	uint32_t nr_priv;
+	uint64_t priv_data[UBBD_QUEUE_MERGE_MAX];
+	/* ubbd_rcache_seq() when read was prepared, see ubbd_rcache_fill() */
+	uint64_t rcache_seq;
+	/* io in ubbd_b->wbuf, and buffered data applied to a read */
+	struct ubbd_wbuf_req wbuf_req;
+	struct ubbd_wbuf_overlay *overlay;
+	/* waiter in ubbd_b->flush for UBBD_OP_FLUSH */
+	struct ubbd_flush_req flush_req;
+};
+
+/*
+ * Request pool
+ *
+ * A request is one object holding the context, its q_backend_io_ctx_data,
+ * the ubbd_backend_io and UBBD_QUEUE_REQ_IOV iovecs:
+ *
+ *	| context | ctx_data | ubbd_backend_io | iov[] |
+ *
+ * Each queue preallocates as many cache line aligned requests as it can
+ * have in flight, so steady state io path does no malloc/free. When the
+ * pool is empty or se has more iov than embedded, the request is
+ * allocated from heap with the same layout.
+ */
+#define UBBD_QUEUE_REQ_IOV		16
+#define UBBD_QUEUE_REQ_POOL_MAX		4096
+
+#define Q_REQ_IO_OFF	round_up(sizeof(struct context) + sizeof(struct q_backend_io_ctx_data), 8)
+
+static inline size_t q_req_size(uint32_t iov_cnt)
+{
+	return Q_REQ_IO_OFF + sizeof(struct ubbd_backend_io) + sizeof(struct iovec) * iov_cnt;
+}
+
+static void q_req_release(struct context *ctx)
+{
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)ctx->data;
+	struct ubbd_queue *ubbd_q = data->ubbd_q;
+	struct ubbd_queue_req_pool *pool = &ubbd_q->req_pool;
+
+	if (data->pooled) {
+		pthread_spin_lock(&pool->lock);
+		pool->free_objs[pool->nr_free++] = ctx;
+		pthread_spin_unlock(&pool->lock);
+	} else {
+		free(ctx);
+	}
+
+	__atomic_sub_fetch(&ubbd_q->reqs_inflight, 1, __ATOMIC_RELEASE);
+}
+
+static struct context *q_req_alloc(struct ubbd_queue *ubbd_q, uint32_t iov_cnt)
+{
+	struct ubbd_queue_req_pool *pool = &ubbd_q->req_pool;
+	struct q_backend_io_ctx_data *data;
+	struct context *ctx = NULL;
+	bool pooled = false;
+
+	if (iov_cnt <= UBBD_QUEUE_REQ_IOV) {
+		pthread_spin_lock(&pool->lock);
+		if (pool->nr_free)
+			ctx = pool->free_objs[--pool->nr_free];
+		pthread_spin_unlock(&pool->lock);
+	}
+
+	if (ctx) {
+		pooled = true;
+	} else {
+		atomic_add(&ubbd_q->req_stats.req_pool_miss, 1);
+		ctx = malloc(q_req_size(iov_cnt));
+		if (!ctx)
+			return NULL;
+	}
+
+	ctx->parent = NULL;
+	ctx->finish = NULL;
+	ctx->release = q_req_release;
+
+	data = (struct q_backend_io_ctx_data *)ctx->data;
+	data->ubbd_q = ubbd_q;
+	data->io = (struct ubbd_backend_io *)((char *)ctx + Q_REQ_IO_OFF);
+	data->pooled = pooled;
+	data->iov_max = (pooled ? UBBD_QUEUE_REQ_IOV : iov_cnt);
+
+	__atomic_add_fetch(&ubbd_q->reqs_inflight, 1, __ATOMIC_RELAXED);
+
+	return ctx;
+}
+
+int ubbd_queue_req_pool_init(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_queue_req_pool *pool = &ubbd_q->req_pool;
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	uint32_t nr;
+	int i;
+	int ret;
+
+	/* in-flight requests are limited by both ce credits and cmd ring */
+	nr = MIN(ubbd_q->ce_capacity, sb->cmdr_size / sizeof(struct ubbd_se));
+	nr = MIN(nr, UBBD_QUEUE_REQ_POOL_MAX);
+
+	pool->obj_size = round_up(q_req_size(UBBD_QUEUE_REQ_IOV), UBBD_CACHELINE_SIZE);
+	pool->objs = aligned_alloc(UBBD_CACHELINE_SIZE, pool->obj_size * nr);
+	if (!pool->objs) {
+		ubbd_err("failed to alloc req pool for queue%d\n", ubbd_q->index);
+		return -ENOMEM;
+	}
+
+	pool->free_objs = calloc(nr, sizeof(void *));
+	if (!pool->free_objs) {
+		ubbd_err("failed to alloc req pool for queue%d\n", ubbd_q->index);
+		ret = -ENOMEM;
+		goto free_objs;
+	}
+
+	ret = pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE);
+	if (ret) {
+		ret = -ret;
+		goto free_free_objs;
+	}
+
+	for (i = 0; i < nr; i++)
+		pool->free_objs[i] = (char *)pool->objs + pool->obj_size * i;
+	pool->nr_objs = nr;
+	pool->nr_free = nr;
+	ubbd_q->reqs_inflight = 0;
+
+	return 0;
+
+free_free_objs:
+	free(pool->free_objs);
+	pool->free_objs = NULL;
+free_objs:
+	free(pool->objs);
+	pool->objs = NULL;
+	return ret;
+}
+
+static bool q_reqs_drained(void *data)
+{
+	struct ubbd_queue *ubbd_q = data;
+
+	if (ubbd_q->uring) {
+		ubbd_uring_reap(ubbd_q);
+		ubbd_uring_submit(ubbd_q);
+	}
+	queue_run_pollers(ubbd_q);
+
+	return (__atomic_load_n(&ubbd_q->reqs_inflight, __ATOMIC_ACQUIRE) == 0 &&
+			ubbd_uring_idle(ubbd_q) && queue_pollers_idle(ubbd_q));
+}
+
+/* wait for in-flight requests, they still reference pool and uio map */
+static int q_wait_reqs_drained(struct ubbd_queue *ubbd_q)
+{
+	int ret;
+
+	if (!ubbd_q->req_pool.objs)
+		return 0;
+
+	ret = wait_condition(10000, 1000, q_reqs_drained, ubbd_q);
+	if (ret)
+		ubbd_err("queue%d: %lu requests are still in flight\n",
+				ubbd_q->index, ubbd_q->reqs_inflight);
+
+	return ret;
+}
+
+void ubbd_queue_req_pool_exit(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_queue_req_pool *pool = &ubbd_q->req_pool;
+
+	if (!pool->objs)
+		return;
+
+	pthread_spin_destroy(&pool->lock);
+	free(pool->free_objs);
+	pool->free_objs = NULL;
+	free(pool->objs);
+	pool->objs = NULL;
+}
+
+/*
+ * QoS
+ *
+ * Take tokens of se from device qos, return ns to wait if it is throttled.
+ * A throttled se stays in cmd ring, cmd_process stops the drain pass and
+ * retries it after the wait. Flush is never throttled.
+ */
+static uint64_t q_qos_throttle(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
+{
+	struct ubbd_qos *qos = &ubbd_q->ubbd_b->qos;
+	uint64_t now, wait_ns;
+	uint64_t bytes = 0;
+	bool write = true;
+
+	if (!ubbd_qos_enabled(qos) ||
+			ubbd_se_hdr_flags_test(se, UBBD_SE_HDR_DONE))
+		goto admitted;
+
+	switch (ubbd_se_hdr_get_op(se->header.len_op)) {
+	case UBBD_OP_READ:
+		write = false;
+		bytes = se->len;
+		break;
+	case UBBD_OP_WRITE:
+		bytes = se->len;
+		break;
+	case UBBD_OP_DISCARD:
+	case UBBD_OP_WRITE_ZEROS:
+		break;
+	default:
+		goto admitted;
+	}
+
+	now = get_ns();
+	wait_ns = ubbd_qos_throttle(qos, write, bytes, now);
+	if (wait_ns) {
+		if (!ubbd_q->qos_throttle_since) {
+			ubbd_q->qos_throttle_since = now;
+			atomic_add(&ubbd_q->req_stats.qos_throttled, 1);
+		}
+		return wait_ns;
+	}
+
+admitted:
+	if (ubbd_q->qos_throttle_since) {
+		atomic_add(&ubbd_q->req_stats.qos_throttle_time, get_ns() - ubbd_q->qos_throttle_since);
+		ubbd_q->qos_throttle_since = 0;
+	}
+
+	return 0;
+}
+
+static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se);
+static void q_merge_flush(struct ubbd_queue *ubbd_q);
+static void q_submit_batch(struct ubbd_queue *ubbd_q);
+static void q_steal_drain(struct ubbd_queue *ubbd_q);
+static int q_steal_from_siblings(struct ubbd_queue *ubbd_q);
+
+/* header and first iovs of se, the rest of iovs is rarely used */
+static inline void q_prefetch_se(struct ubbd_se *se)
+{
+	ubbd_prefetch(se);
+	ubbd_prefetch((char *)se + UBBD_CACHELINE_SIZE);
+}
+
+/*
+ * Drain pass
+ *
+ * Handle se from se_to_handle to cmd_head, return the number of se
+ * handled, or negative if the queue is stopping. The uio event is
+ * cleared and cmd_head is read once per pass instead of once per se, se
+ * queued after that are picked up by the recheck at the end of pass or
+ * by the next poll. The next se is prefetched while the current one is
+ * dispatched.
+ */
+int ubbd_queue_drain(struct ubbd_queue *ubbd_q, uint64_t *throttle_ns)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	char *cmdr = (char *)sb + sb->cmdr_off;
+	uint32_t cmdr_size = sb->cmdr_size;
+	uint32_t head, next;
+	struct ubbd_se *se;
+	uint32_t op_len;
+	int handled = 0;
+	int ret;
+
+	*throttle_ns = 0;
+
+	/* multishot poll of io_uring dont need the uio event cleared */
+	if (!ubbd_q->uring && ubbd_processing_start(&ubbd_q->uio_info)) {
+		ubbd_err("failed to start processing\n");
+		return -EIO;
+	}
+
+	head = atomic_read(&sb->cmd_head);
+	ubbd_smp_rmb();
+	while (1) {
+		if (ubbd_q->se_to_handle == head) {
+			head = atomic_read(&sb->cmd_head);
+			ubbd_smp_rmb();
+			if (ubbd_q->se_to_handle == head)
+				break;
+		}
+
+		se = (struct ubbd_se *)(cmdr + ubbd_q->se_to_handle);
+		op_len = ubbd_se_hdr_get_len(se->header.len_op);
+		next = (ubbd_q->se_to_handle + op_len) % cmdr_size;
+		if (next != head)
+			q_prefetch_se((struct ubbd_se *)(cmdr + next));
+
+		/* one timestamp for all se picked up in a drain pass */
+		if (!handled)
+			ubbd_q->pickup_ns = get_ns();
+
+		*throttle_ns = q_qos_throttle(ubbd_q, se);
+		if (*throttle_ns)
+			break;
+
+		if (se_need_ce(se) && !ce_credit_get(ubbd_q)) {
+			/* collected ios hold credits, submit them before waiting */
+			q_merge_flush(ubbd_q);
+			q_submit_batch(ubbd_q);
+			q_steal_drain(ubbd_q);
+			/* se is not handled without a credit */
+			ret = queue_wait_ce_credit(ubbd_q);
+			if (ret) {
+				ubbd_err("queue%d exit cmd_process: %d\n", ubbd_q->index, ret);
+				return ret;
+			}
+		}
+
+		ubbd_dbg("se id: %llu, len_op: %x\n", se->priv_data, se->header.len_op);
+		handle_cmd(ubbd_q, se);
+		ubbd_q->se_to_handle = next;
+		handled++;
+	}
+
+	/* close the completion batch at the end of each drain pass */
+	if (handled) {
+		q_merge_flush(ubbd_q);
+		q_submit_batch(ubbd_q);
+		q_steal_drain(ubbd_q);
+		queue_flush_ce(ubbd_q);
+		/* backend sqe and doorbell go to kernel in one submit */
+		if (ubbd_q->uring)
+			ubbd_uring_submit(ubbd_q);
+
+		atomic_add(&ubbd_q->req_stats.busy_time, get_ns() - ubbd_q->pickup_ns);
+	}
+
+	return handled;
+}
+
+void *cmd_process(void *arg)
+{
+	struct ubbd_queue *ubbd_q = arg;
+	struct ubbd_sb *sb;
+	struct pollfd pollfds[128];
+	struct timespec poll_ts;
+	int64_t batch_timeout;
+	eventfd_t wakeup_cnt;
+	uint64_t throttle_ns;
+	uint64_t sleep_ns;
+	bool cmd_event;
+	int handled;
+	int ret;
+
+	current_queue = ubbd_q;
+	INIT_LIST_HEAD(&ubbd_q->pollers);
+
+	ret = ubbd_open_uio(&ubbd_q->uio_info);
+	if (ret) {
+		ubbd_err("failed to open shm: %d\n", ret);
+		return NULL;
+	}
+
+	sb = ubbd_q->uio_info.map;
+
+	if (ubbd_processing_complete(&ubbd_q->uio_info))
+		goto out;
+
+	wait_for_compr_empty(ubbd_q);
+
+	if (ubbd_queue_ce_init(ubbd_q))
+		goto out;
+
+	if (ubbd_queue_req_pool_init(ubbd_q))
+		goto out;
+
+	if (ubbd_q->engine == UBBD_QUEUE_ENGINE_IO_URING) {
+		ret = ubbd_uring_init(ubbd_q);
+		if (ret)
+			ubbd_err("queue%d: failed to init io_uring: %d, fall back to poll\n",
+					ubbd_q->index, ret);
+	}
+
+	ubbd_q->se_to_handle = sb->cmd_tail;
+	ubbd_dbg("cmd_tail: %u, cmd_head: %u\n", sb->cmd_tail, sb->cmd_head);
+
+	pthread_mutex_lock(&ubbd_q->lock);
+	if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
+		pthread_mutex_unlock(&ubbd_q->lock);
+		goto out;
+	}
+	ubbd_q->status = UBBD_QUEUE_USTATUS_RUNNING;
+	pthread_mutex_unlock(&ubbd_q->lock);
+
+	while (1) {
+		handled = ubbd_queue_drain(ubbd_q, &throttle_ns);
+		if (handled < 0)
+			goto out;
+
+		if ((ubbd_q->steal_policy == UBBD_STEAL_POLICY_IDLE && !handled) ||
+				ubbd_q->steal_policy == UBBD_STEAL_POLICY_ALWAYS) {
+			if (q_steal_from_siblings(ubbd_q))
+				continue;
+		}
+
+		/* nothing to do until tokens are refilled */
+		if (throttle_ns)
+			goto poll;
+
+		if (ubbd_q->poll_mode == UBBD_POLL_MODE_BUSY) {
+			if (queue_spin_for_cmd(ubbd_q, UBBD_QUEUE_BUSY_POLL_SLICE_NS))
+				continue;
+
+			if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
+				ubbd_err("queue%d exit cmd_process\n", ubbd_q->index);
+				goto out;
+			}
+			continue;
+		} else if (ubbd_q->poll_mode == UBBD_POLL_MODE_HYBRID) {
+			if (queue_spin_for_cmd(ubbd_q, ubbd_q->poll_spin_ns))
+				continue;
+		}
+
+poll:
+		/* check cmd_head directly before going to sleep */
+		if (!throttle_ns && cmd_pending(ubbd_q))
+			continue;
+
+		/* woken up by a sibling offering ios */
+		if (q_steal_from_siblings(ubbd_q))
+			continue;
+
+		atomic_add(&ubbd_q->req_stats.poll_sleeps, 1);
+
+		/* dont sleep longer than the deadline of pending completion batch */
+		batch_timeout = queue_ce_batch_timeout(ubbd_q);
+		if (batch_timeout < 0)
+			batch_timeout = 60 * 1000 * 1000;
+		if (throttle_ns && throttle_ns < batch_timeout)
+			batch_timeout = throttle_ns;
+
+		if (ubbd_q->steal_policy != UBBD_STEAL_POLICY_NONE)
+			__atomic_store_n(&ubbd_q->steal_idle, 1, __ATOMIC_RELEASE);
+		sleep_ns = get_ns();
+
+		if (ubbd_q->uring) {
+			ret = ubbd_uring_wait(ubbd_q, batch_timeout, &cmd_event);
+			if (ret)
+				goto out;
+		} else {
+			poll_ts.tv_sec = batch_timeout / 1000000000;
+			poll_ts.tv_nsec = batch_timeout % 1000000000;
+
+			pollfds[0].fd = ubbd_q->uio_info.fd;
+			pollfds[0].events = POLLIN;
+			pollfds[0].revents = 0;
+
+			pollfds[1].fd = ubbd_q->wakeup_fd;
+			pollfds[1].events = POLLIN;
+			pollfds[1].revents = 0;
+
+			ret = ppoll(pollfds, 2, &poll_ts, NULL);
+			if (ret == -1) {
+				ubbd_err("poll() returned %d, exiting\n", ret);
+				goto out;
+			}
+
+			if (pollfds[1].revents)
+				eventfd_read(ubbd_q->wakeup_fd, &wakeup_cnt);
+			cmd_event = pollfds[0].revents;
+		}
+
+		atomic_add(&ubbd_q->req_stats.idle_time, get_ns() - sleep_ns);
+		__atomic_store_n(&ubbd_q->steal_idle, 0, __ATOMIC_RELEASE);
+
+		/* completions of pollers signal wakeup_fd */
+		queue_run_pollers(ubbd_q);
+
+		if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
+			ubbd_err("queue%d exit cmd_process\n", ubbd_q->index);
+			goto out;
+		}
+
+		ubbd_dbg("poll cmd: %d\n", ret);
+		if (!cmd_event && !throttle_ns) {
+			goto poll;
+		}
+
+	}
+
+out:
+	q_merge_flush(ubbd_q);
+	q_submit_batch(ubbd_q);
+	q_steal_drain(ubbd_q);
+
+	/* leak the pool and ring state if backend never completes requests */
+	if (q_wait_reqs_drained(ubbd_q))
+		return NULL;
+
+	ubbd_uring_exit(ubbd_q);
+	ubbd_close_uio(&ubbd_q->uio_info);
+	ubbd_queue_req_pool_exit(ubbd_q);
+	ubbd_queue_ce_exit(ubbd_q);
+	return NULL;
+}
+
+void ubbd_queue_stop(struct ubbd_queue *ubbd_q)
+{
+	if (!ubbd_q)
+		return;
+
+	pthread_mutex_lock(&ubbd_q->lock);
+	ubbd_q->status = UBBD_QUEUE_USTATUS_STOPPING;
+	pthread_mutex_unlock(&ubbd_q->lock);
+}
+
+static int q_backend_io_finish(struct context *ctx, int ret)
+{
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)ctx->data;
+	struct ubbd_queue *ubbd_q = data->ubbd_q;
+	struct ubbd_backend_io *io = data->io;
+	uint64_t lat_ns;
+	int i;
+
+	if (ret) {
+		ubbd_err("ret of backend_io: %lu(type %d, %lu:%u): %s\n",
+				data->priv_data[0], io->io_type, io->offset, io->len, strerror(-ret));
+	}
+
+	/* write is completed before its ce, so a flush after the ce covers it */
+	if (io->io_type == UBBD_BACKEND_IO_WRITE ||
+			io->io_type == UBBD_BACKEND_IO_DISCARD ||
+			io->io_type == UBBD_BACKEND_IO_WRITEZEROS) {
+		/* drop blocks filled by reads racing with this write */
+		if (ubbd_q->ubbd_b->rcache)
+			ubbd_rcache_invalidate(ubbd_q->ubbd_b->rcache, io->offset, io->len);
+		ubbd_flush_write_done(&ubbd_q->ubbd_b->flush);
+	} else if (io->io_type == UBBD_BACKEND_IO_READ) {
+		if (data->overlay) {
+			if (!ret)
+				ubbd_wbuf_overlay_apply(data->overlay, io->offset, io->iov, io->iov_cnt);
+			free(data->overlay);
+			data->overlay = NULL;
+		}
+
+		if (!ret && ubbd_q->ubbd_b->rcache)
+			ubbd_rcache_fill(ubbd_q->ubbd_b->rcache, io->offset, io->len,
+					io->iov, io->iov_cnt, data->rcache_seq);
+	}
+
+	for (i = 0; i < data->nr_priv; i++)
+		ubbd_queue_add_ce(ubbd_q, data->priv_data[i], ret);
+
+	lat_ns = get_ns() - data->start_ns;
+	for (i = 0; i < data->nr_priv; i++)
+		ubbd_lat_hist_add(&ubbd_q->lat_hist[data->op_type], lat_ns);
+
+	return 0;
+}
+
+static struct ubbd_backend_io *q_prepare_backend_io(struct ubbd_queue *ubbd_q,
+		struct ubbd_se *se,  enum ubbd_backend_io_type type)
+{
+	struct ubbd_backend_io *io;
+	struct context *ctx;
+	struct q_backend_io_ctx_data *data;
+	int i;
+
+	ctx = q_req_alloc(ubbd_q, se->iov_cnt);
+	if (!ctx) {
+		ubbd_err("failed to alloc for backend io\n");
+		return NULL;
+	}
+
+	data = (struct q_backend_io_ctx_data *)ctx->data;
+	data->se = se;
+	data->start_ns = ubbd_q->pickup_ns;
+	data->op_type = type;
+	data->priv_data[0] = se->priv_data;
+	data->nr_priv = 1;
+	data->overlay = NULL;
+	if (ubbd_q->ubbd_b->rcache)
+		data->rcache_seq = ubbd_rcache_seq(ubbd_q->ubbd_b->rcache);
+	io = data->io;
+
+	ctx->finish = q_backend_io_finish;
+
+	io->ctx = ctx;
+	io->io_type = type;
+	io->offset = se->offset;
+	io->len = se->len;
+	io->iov_cnt = se->iov_cnt;
+	for (i = 0; i < se->iov_cnt; i++) {
+		ubbd_dbg("iov_base: %lu\n", (size_t)se->iov[i].iov_base);
+		io->iov[i].iov_base = (void*)ubbd_q->uio_info.map + (size_t)se->iov[i].iov_base;
+		io->iov[i].iov_len = se->iov[i].iov_len;
+	}
+
+	return io;
+}
+
+/* dispatch ios by backend_ops->submit_batch(), ios not taken go to the per-op path */
+static void q_dispatch_ios(struct ubbd_queue *ubbd_q, struct ubbd_backend_io **ios, int nr)
+{
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	struct ubbd_backend_io *io;
+	int submitted = 0;
+	int i;
+	int ret;
+
+	if (ubbd_b->backend_ops->submit_batch) {
+		submitted = ubbd_b->backend_ops->submit_batch(ubbd_b, ios, nr);
+		if (submitted < 0) {
+			ubbd_err("failed to submit batch: %d\n", submitted);
+			submitted = 0;
+		}
+	}
+
+	for (i = submitted; i < nr; i++) {
+		io = ios[i];
+		ret = ubbd_backend_dispatch_io(ubbd_b, io);
+		if (ret) {
+			ubbd_err("ret of backend_io: %lu:%u: %d\n", io->offset, io->len, ret);
+			ubbd_backend_io_finish(io, ret);
+		}
+	}
+}
+
+/*
+ * Work stealing
+ *
+ * Without a worker pool, ios are dispatched by the queue thread parsed
+ * them, so one hot queue keeps one thread busy while its siblings sleep.
+ * With a steal policy, a queue offers its collected ios in ubbd_q->steal
+ * and dispatches what is left there at the end of drain pass, siblings
+ * with nothing to do take batches from it and dispatch them in parallel.
+ * The io still belongs to its queue, ce goes to the compr ring of it.
+ */
+static int q_steal_offer(struct ubbd_queue *ubbd_q, struct ubbd_backend_io **ios, int nr)
+{
+	struct ubbd_queue_steal *steal = &ubbd_q->steal;
+	int offered = 0;
+
+	pthread_spin_lock(&steal->lock);
+	while (offered < nr && steal->tail - steal->head < UBBD_QUEUE_STEAL_MAX)
+		steal->ios[steal->tail++ % UBBD_QUEUE_STEAL_MAX] = ios[offered++];
+	pthread_spin_unlock(&steal->lock);
+
+	return offered;
+}
+
+static int q_steal_take(struct ubbd_queue *ubbd_q, struct ubbd_backend_io **ios, int max)
+{
+	struct ubbd_queue_steal *steal = &ubbd_q->steal;
+	int taken = 0;
+
+	if (atomic_read(&steal->head) == atomic_read(&steal->tail))
+		return 0;
+
+	pthread_spin_lock(&steal->lock);
+	while (taken < max && steal->head != steal->tail)
+		ios[taken++] = steal->ios[steal->head++ % UBBD_QUEUE_STEAL_MAX];
+	pthread_spin_unlock(&steal->lock);
+
+	return taken;
+}
+
+/* wake up one sleeping sibling to help with the offered ios */
+static void q_steal_kick(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	struct ubbd_queue *sibling;
+	int i;
+
+	for (i = 1; i < ubbd_b->num_queues; i++) {
+		sibling = &ubbd_b->queues[(ubbd_q->index + i) % ubbd_b->num_queues];
+		if (__atomic_load_n(&sibling->steal_idle, __ATOMIC_RELAXED) &&
+				__atomic_exchange_n(&sibling->steal_idle, 0, __ATOMIC_ACQ_REL)) {
+			ubbd_queue_wakeup(sibling);
+			return;
+		}
+	}
+}
+
+/* dispatch the ios no sibling took */
+static void q_steal_drain(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_backend_io *ios[UBBD_QUEUE_STEAL_BATCH];
+	int nr;
+
+	while ((nr = q_steal_take(ubbd_q, ios, UBBD_QUEUE_STEAL_BATCH)))
+		q_dispatch_ios(ubbd_q, ios, nr);
+}
+
+/* dispatch ios offered by siblings, return the number of ios stolen */
+static int q_steal_from_siblings(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	struct ubbd_backend_io *ios[UBBD_QUEUE_STEAL_BATCH];
+	struct ubbd_queue *sibling;
+	uint64_t start_ns = 0;
+	int stolen = 0;
+	int i, nr;
+
+	if (ubbd_q->steal_policy == UBBD_STEAL_POLICY_NONE)
+		return 0;
+
+	for (i = 1; i < ubbd_b->num_queues; i++) {
+		sibling = &ubbd_b->queues[(ubbd_q->index + i) % ubbd_b->num_queues];
+		while ((nr = q_steal_take(sibling, ios, UBBD_QUEUE_STEAL_BATCH))) {
+			if (!start_ns)
+				start_ns = get_ns();
+			q_dispatch_ios(sibling, ios, nr);
+			stolen += nr;
+		}
+	}
+
+	if (stolen) {
+		atomic_add(&ubbd_q->req_stats.stolen_ios, stolen);
+		atomic_add(&ubbd_q->req_stats.busy_time, get_ns() - start_ns);
+	}
+
+	return stolen;
+}
+
+/*
+ * Submit the collected ios to worker pool, offer them to siblings, or
+ * dispatch them by q_dispatch_ios().
+ */
+static void q_submit_batch(struct ubbd_queue *ubbd_q)
 {
-	struct ubbd_sb *sb = ubbd_q->uio_info.map;
-	uint32_t space_available;
-	uint32_t space_max, space_used;
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	int offered;
 
-	/* There is a CMPR_RESERVED we dont use to prevent the ring to be used up */
-	space_max = sb->compr_size - CMPR_RESERVED;
+	if (!ubbd_q->submit_nr)
+		return;
 
-	if (sb->compr_head > sb->compr_tail)
-		space_used = sb->compr_head - sb->compr_tail;
-	else if (sb->compr_head < sb->compr_tail)
-		space_used = sb->compr_head + (sb->compr_size - sb->compr_tail);
-	else
-		space_used = 0;
+	if (ubbd_b->workers) {
+		ubbd_worker_pool_queue(ubbd_b->workers, ubbd_q->submit_ios, ubbd_q->submit_nr);
+	} else if (ubbd_q->steal_policy != UBBD_STEAL_POLICY_NONE) {
+		offered = q_steal_offer(ubbd_q, ubbd_q->submit_ios, ubbd_q->submit_nr);
+		if (ubbd_q->steal.tail - ubbd_q->steal.head >= UBBD_QUEUE_STEAL_BATCH)
+			q_steal_kick(ubbd_q);
+		q_dispatch_ios(ubbd_q, ubbd_q->submit_ios + offered, ubbd_q->submit_nr - offered);
+	} else {
+		q_dispatch_ios(ubbd_q, ubbd_q->submit_ios, ubbd_q->submit_nr);
+	}
 
-	space_available = space_max - space_used;
-	if (space_available < required)
-		return false;
+	atomic_add(&ubbd_q->req_stats.submit_batches, 1);
+	atomic_add(&ubbd_q->req_stats.submit_batched, ubbd_q->submit_nr);
 
-	return true;
+	ubbd_q->submit_nr = 0;
 }
 
-struct ubbd_ce *get_available_ce(struct ubbd_queue *ubbd_q)
+static int q_submit_one(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
 {
-	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	int ret;
 
-	while (!compr_space_enough(ubbd_q, sizeof(struct ubbd_ce))) {
-		pthread_mutex_unlock(&ubbd_q->req_lock);
-		ubbd_err(" compr not enough head: %u, tail: %u\n", sb->compr_head, sb->compr_tail);
-		ubbd_processing_complete(&ubbd_q->uio_info);
-                usleep(50000);
-		pthread_mutex_lock(&ubbd_q->req_lock);
+	if (!ubbd_b->workers && !ubbd_b->backend_ops->submit_batch &&
+			ubbd_q->steal_policy == UBBD_STEAL_POLICY_NONE) {
+		/* io not taken by backend holds a credit, finish it with the error */
+		ret = ubbd_backend_dispatch_io(ubbd_b, io);
+		if (ret)
+			ubbd_backend_io_finish(io, ret);
+		return 0;
 	}
 
-	return compr_head(ubbd_q);
+	ubbd_q->submit_ios[ubbd_q->submit_nr++] = io;
+	if (ubbd_q->submit_nr == UBBD_QUEUE_SUBMIT_BATCH)
+		q_submit_batch(ubbd_q);
+
+	return 0;
 }
 
+/* ios not fitting in backend limits are submitted as their child ios */
+static int q_submit_split(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
+{
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	struct ubbd_backend_io *child, *tmp;
+	LIST_HEAD(children);
+	int ret;
+
+	if (!ubbd_backend_io_need_split(ubbd_b, io))
+		return q_submit_one(ubbd_q, io);
 
-static void wait_for_compr_empty(struct ubbd_queue *ubbd_q)
+	ret = ubbd_backend_io_split(ubbd_b, io, &children);
+	if (ret < 0) {
+		ubbd_backend_io_finish(io, ret);
+		return 0;
+	}
+	if (!ret)
+		return 0;
+
+	atomic_add(&ubbd_q->req_stats.split_ios, 1);
+	atomic_add(&ubbd_q->req_stats.split_children, ret);
+
+	list_for_each_entry_safe(child, tmp, &children, node) {
+		list_del_init(&child->node);
+		ret = q_submit_one(ubbd_q, child);
+		if (ret)
+			ubbd_err("ret of split io: %lu:%u: %d\n", child->offset, child->len, ret);
+	}
+
+	return 0;
+}
+
+/*
+ * Write-back
+ *
+ * With ubbd_b->wbuf, a write is completed once it is copied into the
+ * buffer, or when destager admits it if the buffer is full. Discard and
+ * write-zeros go to backend after the buffered data they cover is
+ * dropped, flush after the data buffered before it is destaged.
+ */
+static void q_wbuf_write_done(struct ubbd_wbuf_req *req, int ret)
 {
-	struct ubbd_sb *sb = ubbd_q->uio_info.map;
- 
-         ubbd_info("waiting for ring to clear\n");
-         while (sb->compr_head != sb->compr_tail) {
-		 ubbd_info("head: %u, tail: %u\n", sb->compr_head, sb->compr_tail);
-                 usleep(50000);
-		 ubbd_processing_complete(&ubbd_q->uio_info);
-		 if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
-			 ubbd_err("ubbd device is stopping\n");
-			 break;
-		 }
-	 }
-         ubbd_info("ring clear\n");
+	struct q_backend_io_ctx_data *data = container_of(req,
+			struct q_backend_io_ctx_data, wbuf_req);
+
+	ubbd_backend_io_finish(data->io, ret);
 }
-static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se);
-void *cmd_process(void *arg)
+
+static void q_wbuf_barrier_done(struct ubbd_wbuf_req *req, int ret)
 {
-	struct ubbd_queue *ubbd_q = arg;
-	struct ubbd_se *se;
-	uint32_t op_len = 0;
-	struct ubbd_sb *sb;
-	struct pollfd pollfds[128];
-	int ret;
+	struct q_backend_io_ctx_data *data = container_of(req,
+			struct q_backend_io_ctx_data, wbuf_req);
 
-	ret = ubbd_open_uio(&ubbd_q->uio_info);
 	if (ret) {
-		ubbd_err("failed to open shm: %d\n", ret);
-		return NULL;
+		ubbd_backend_io_finish(data->io, ret);
+		return;
 	}
 
-	sb = ubbd_q->uio_info.map;
+	/* in destager, not in queue thread */
+	ubbd_backend_submit_io(data->ubbd_q->ubbd_b, data->io);
+}
 
-	if (ubbd_processing_complete(&ubbd_q->uio_info))
-		goto out;
+static int q_wbuf_submit(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
+{
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	struct ubbd_wbuf *wbuf = ubbd_q->ubbd_b->wbuf;
+	struct ubbd_wbuf_req *req = &data->wbuf_req;
+	int ret;
 
-	wait_for_compr_empty(ubbd_q);
+	req->off = io->offset;
+	req->len = io->len;
+	req->iov = io->iov;
+	req->iov_cnt = io->iov_cnt;
 
-	ubbd_q->se_to_handle = sb->cmd_tail;
-	ubbd_dbg("cmd_tail: %u, cmd_head: %u\n", sb->cmd_tail, sb->cmd_head);
+	if (io->io_type == UBBD_BACKEND_IO_WRITE) {
+		req->type = UBBD_WBUF_REQ_WRITE;
+		req->done = q_wbuf_write_done;
+		ret = ubbd_wbuf_write(wbuf, req);
+		if (ret == 1) {
+			atomic_add(&ubbd_q->req_stats.wbuf_throttled, 1);
+			return 0;
+		}
 
-	pthread_mutex_lock(&ubbd_q->lock);
-	if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
-		pthread_mutex_unlock(&ubbd_q->lock);
-		goto out;
+		if (!ret)
+			atomic_add(&ubbd_q->req_stats.wbuf_writes, 1);
+		ubbd_backend_io_finish(io, ret);
+		return 0;
 	}
-	ubbd_q->status = UBBD_QUEUE_USTATUS_RUNNING;
-	pthread_mutex_unlock(&ubbd_q->lock);
 
-	while (1) {
-		while (1) {
-			if (ubbd_processing_start(&ubbd_q->uio_info)) {
-				ubbd_err("failed to start processing\n");
-				goto out;
-			}
+	req->type = UBBD_WBUF_REQ_BARRIER;
+	req->done = q_wbuf_barrier_done;
+	ret = ubbd_wbuf_barrier(wbuf, req);
+	if (ret == 1)
+		return 0;
 
-			se = ubbd_cmd_to_handle(ubbd_q);
-			if (se == ubbd_cmd_head(&ubbd_q->uio_info)) {
-				break;
-			}
-			op_len = ubbd_se_hdr_get_len(se->header.len_op);
-			ubbd_dbg("len_op: %x\n", se->header.len_op);
-			ubbd_dbg("op: %d, length: %u\n", ubbd_se_hdr_get_op(se->header.len_op), ubbd_se_hdr_get_len(se->header.len_op));
-			if (ubbd_se_hdr_get_op(se->header.len_op) != UBBD_OP_PAD)
-				ubbd_dbg("se id: %llu\n", se->priv_data);
-			handle_cmd(ubbd_q, se);
-			UBBD_UPDATE_QUEUE_TO_HANDLE(ubbd_q, sb, op_len);
-			ubbd_dbg("finish handle_cmd\n");
-		}
+	if (ret) {
+		ubbd_backend_io_finish(io, ret);
+		return 0;
+	}
 
-poll:
-		pollfds[0].fd = ubbd_q->uio_info.fd;
-		pollfds[0].events = POLLIN;
-		pollfds[0].revents = 0;
+	return q_submit_split(ubbd_q, io);
+}
 
-		ret = poll(pollfds, 1, 60);
-		if (ret == -1) {
-			ubbd_err("poll() returned %d, exiting\n", ret);
-			goto out;
-		}
+/*
+ * Zero detect
+ *
+ * With ubbd_b->zero_block, runs of all-zero blocks in a write go to
+ * backend as write-zeros, so thin backends free the space instead of
+ * storing zeros. A write of zeros only is turned into a write-zeros, a
+ * mixed one is split into write and write-zeros children. Mixed writes
+ * are not split with write-back, children would bypass the buffer.
+ * Return true if io is submitted as its children.
+ */
+static bool q_zero_detect(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
+{
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
+	struct ubbd_backend_io *child, *tmp;
+	LIST_HEAD(children);
+	uint64_t zero_bytes;
+	int ret;
 
-		if (ubbd_q->status == UBBD_QUEUE_USTATUS_STOPPING) {
-			ubbd_err("queue%d exit cmd_process\n", ubbd_q->index);
-			goto out;
-		}
+	ret = ubbd_backend_io_zero_split(ubbd_b, io, ubbd_b->zero_block,
+			!ubbd_b->wbuf, &children, &zero_bytes);
+	if (ret < 0)
+		ubbd_err("failed to split zero blocks of %lu:%u: %d\n", io->offset, io->len, ret);
 
-		ubbd_dbg("poll cmd: %d\n", ret);
-		if (!pollfds[0].revents) {
-			goto poll;
-		}
+	if (zero_bytes) {
+		atomic_add(&ubbd_q->req_stats.zero_writes, 1);
+		atomic_add(&ubbd_q->req_stats.zero_bytes, zero_bytes);
+	}
+
+	if (ret <= 0)
+		return false;
 
+	list_for_each_entry_safe(child, tmp, &children, node) {
+		list_del_init(&child->node);
+		ret = q_submit_split(ubbd_q, child);
+		if (ret)
+			ubbd_err("ret of zero split io: %lu:%u: %d\n", child->offset, child->len, ret);
 	}
 
-out:
-	ubbd_close_uio(&ubbd_q->uio_info);
-	return NULL;
+	return true;
 }
 
-void ubbd_queue_stop(struct ubbd_queue *ubbd_q)
+static int q_submit_io(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
 {
-	if (!ubbd_q)
-		return;
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
 
-	pthread_mutex_lock(&ubbd_q->lock);
-	ubbd_q->status = UBBD_QUEUE_USTATUS_STOPPING;
-	pthread_mutex_unlock(&ubbd_q->lock);
+	/* invalidated before write goes to backend, no read after it hits old data */
+	if (ubbd_b->rcache && io->io_type != UBBD_BACKEND_IO_READ &&
+			io->io_type != UBBD_BACKEND_IO_FLUSH)
+		ubbd_rcache_invalidate(ubbd_b->rcache, io->offset, io->len);
+
+	if (ubbd_b->zero_block && io->io_type == UBBD_BACKEND_IO_WRITE &&
+			q_zero_detect(ubbd_q, io))
+		return 0;
+
+	if (ubbd_b->wbuf && io->io_type != UBBD_BACKEND_IO_READ &&
+			io->io_type != UBBD_BACKEND_IO_FLUSH)
+		return q_wbuf_submit(ubbd_q, io);
+
+	return q_submit_split(ubbd_q, io);
 }
 
-struct q_backend_io_ctx_data {
-	struct ubbd_queue *ubbd_q;
-	struct ubbd_backend_io *io;
-	struct ubbd_se *se;
-};
+/*
+ * Flush
+ *
+ * Flush does not go through the queue, it joins the device wide flush
+ * tracker. It waits only for the writes completed before it, and one
+ * backend flush finishes all flushes waiting for it. Reads and writes
+ * are not held behind a flush. With write-back, it joins the tracker
+ * after the writes buffered before it are destaged.
+ */
+static void q_flush_done(struct ubbd_flush_req *req, int ret)
+{
+	struct q_backend_io_ctx_data *data = container_of(req,
+			struct q_backend_io_ctx_data, flush_req);
 
-static int q_backend_io_finish(struct context *ctx, int ret)
+	ubbd_backend_io_finish(data->io, ret);
+}
+
+static void q_flush_begin(struct ubbd_backend *ubbd_b, struct ubbd_backend_io *io)
 {
-	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)ctx->data;
-	struct ubbd_queue *ubbd_q = data->ubbd_q;
-	struct ubbd_backend_io *io = data->io;
-	struct ubbd_se *se = data->se;
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)io->ctx->data;
+
+	data->flush_req.done = q_flush_done;
+	switch (ubbd_flush_begin(&ubbd_b->flush, &data->flush_req)) {
+	case UBBD_FLUSH_DONE:
+		ubbd_backend_io_finish(io, 0);
+		break;
+	case UBBD_FLUSH_WAIT:
+		break;
+	case UBBD_FLUSH_ISSUE:
+		ubbd_backend_flush_start(ubbd_b);
+		break;
+	}
+}
+
+static void q_wbuf_flush_done(struct ubbd_wbuf_req *req, int ret)
+{
+	struct q_backend_io_ctx_data *data = container_of(req,
+			struct q_backend_io_ctx_data, wbuf_req);
 
 	if (ret) {
-		ubbd_err("ret of backend_io: %llu(type %d, %lu:%u): %s\n",
-				se->priv_data, io->io_type, io->offset, io->len, strerror(-ret));
+		ubbd_backend_io_finish(data->io, ret);
+		return;
 	}
 
-	ubbd_queue_add_ce(ubbd_q, se->priv_data, ret);
+	q_flush_begin(data->ubbd_q->ubbd_b, data->io);
+}
+
+static int q_queue_flush(struct ubbd_queue *ubbd_q, struct ubbd_backend_io *io)
+{
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
 
-	free(io);
+	if (ubbd_b->wbuf) {
+		data->wbuf_req.type = UBBD_WBUF_REQ_FLUSH;
+		data->wbuf_req.done = q_wbuf_flush_done;
+		if (ubbd_wbuf_flush(ubbd_b->wbuf, &data->wbuf_req))
+			return 0;
+	}
+
+	q_flush_begin(ubbd_b, io);
 
 	return 0;
 }
 
-static struct ubbd_backend_io *q_prepare_backend_io(struct ubbd_queue *ubbd_q,
-		struct ubbd_se *se,  enum ubbd_backend_io_type type)
+/*
+ * Merge
+ *
+ * A read or write io is held in ubbd_q->merge_io, following se of the
+ * same op contiguous to it are merged into it, as long as it is not
+ * larger than merge_max_bytes and the iovs fit in the io. Any other se
+ * or the end of drain pass submits the merged io.
+ */
+static bool q_can_merge(struct ubbd_queue *ubbd_q, struct ubbd_se *se,
+		enum ubbd_backend_io_type type)
 {
-	struct ubbd_backend_io *io;
-	struct context *ctx;
+	struct ubbd_backend_io *io = ubbd_q->merge_io;
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	struct ubbd_io_limits *limits = &ubbd_q->ubbd_b->limits;
+
+	return (io->io_type == type &&
+		io->offset + io->len == se->offset &&
+		io->len + se->len <= ubbd_q->merge_max_bytes &&
+		io->iov_cnt + se->iov_cnt <= data->iov_max &&
+		(!limits->max_io_size || io->len + se->len <= limits->max_io_size) &&
+		data->nr_priv < UBBD_QUEUE_MERGE_MAX);
+}
+
+static void q_merge_se(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
+{
+	struct ubbd_backend_io *io = ubbd_q->merge_io;
+	struct q_backend_io_ctx_data *data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	int i;
+
+	for (i = 0; i < se->iov_cnt; i++) {
+		io->iov[io->iov_cnt + i].iov_base = (void*)ubbd_q->uio_info.map + (size_t)se->iov[i].iov_base;
+		io->iov[io->iov_cnt + i].iov_len = se->iov[i].iov_len;
+	}
+	io->iov_cnt += se->iov_cnt;
+	io->len += se->len;
+	data->priv_data[data->nr_priv++] = se->priv_data;
+}
+
+static void q_merge_flush(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_backend_io *io = ubbd_q->merge_io;
 	struct q_backend_io_ctx_data *data;
+	int ret;
+
+	if (!io)
+		return;
+
+	ubbd_q->merge_io = NULL;
+
+	data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	if (data->nr_priv > 1) {
+		atomic_add(&ubbd_q->req_stats.merged_ios, 1);
+		atomic_add(&ubbd_q->req_stats.merged_reqs, data->nr_priv);
+	}
+
+	ret = q_submit_io(ubbd_q, io);
+	if (ret)
+		ubbd_err("ret of backend_io: %lu:%u: %d\n", io->offset, io->len, ret);
+}
+
+/* complete read from read cache without backend io, false on miss */
+static bool q_rcache_read(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
+{
+	struct iovec iov[se->iov_cnt];
 	int i;
 
-	io = calloc(1, sizeof(struct ubbd_backend_io) + sizeof(struct iovec) * se->iov_cnt);
-	if (!io) {
-		ubbd_err("failed to calloc for backend io\n");
-		return NULL;
+	for (i = 0; i < se->iov_cnt; i++) {
+		iov[i].iov_base = (void*)ubbd_q->uio_info.map + (size_t)se->iov[i].iov_base;
+		iov[i].iov_len = se->iov[i].iov_len;
 	}
 
-	ctx = context_alloc(sizeof(struct q_backend_io_ctx_data));
-	if (!ctx) {
-		ubbd_err("failed to calloc for backend_io_ctx\n");
-		free(io);
-		return NULL;
+	if (!ubbd_rcache_read(ubbd_q->ubbd_b->rcache, se->offset, se->len, iov, se->iov_cnt)) {
+		atomic_add(&ubbd_q->req_stats.rcache_misses, 1);
+		return false;
 	}
 
-	data = (struct q_backend_io_ctx_data *)ctx->data;
-	data->ubbd_q = ubbd_q;
-	data->io = io;
-	data->se = se;
+	atomic_add(&ubbd_q->req_stats.rcache_hits, 1);
+	ubbd_queue_add_ce(ubbd_q, se->priv_data, 0);
+	ubbd_lat_hist_add(&ubbd_q->lat_hist[UBBD_BACKEND_IO_READ], get_ns() - ubbd_q->pickup_ns);
 
-	ctx->parent = NULL;
-	ctx->finish = q_backend_io_finish;
+	return true;
+}
+
+/* read with data in write-back buffer, false if none of it is there */
+static bool q_wbuf_read(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
+{
+	struct ubbd_wbuf_overlay *overlay;
+	struct q_backend_io_ctx_data *data;
+	struct ubbd_backend_io *io;
+	struct iovec iov[se->iov_cnt];
+	int ret;
+	int i;
 
-	io->ctx = ctx;
-	io->io_type = type;
-	io->offset = se->offset;
-	io->len = se->len;
-	io->iov_cnt = se->iov_cnt;
 	for (i = 0; i < se->iov_cnt; i++) {
-		ubbd_dbg("iov_base: %lu\n", (size_t)se->iov[i].iov_base);
-		io->iov[i].iov_base = (void*)ubbd_q->uio_info.map + (size_t)se->iov[i].iov_base;
-		io->iov[i].iov_len = se->iov[i].iov_len;
+		iov[i].iov_base = (void*)ubbd_q->uio_info.map + (size_t)se->iov[i].iov_base;
+		iov[i].iov_len = se->iov[i].iov_len;
 	}
 
-	return io;
+	ret = ubbd_wbuf_read(ubbd_q->ubbd_b->wbuf, se->offset, se->len, iov, se->iov_cnt, &overlay);
+	switch (ret) {
+	case UBBD_WBUF_READ_MISS:
+		return false;
+	case UBBD_WBUF_READ_HIT:
+		atomic_add(&ubbd_q->req_stats.wbuf_read_hits, 1);
+		ubbd_queue_add_ce(ubbd_q, se->priv_data, 0);
+		ubbd_lat_hist_add(&ubbd_q->lat_hist[UBBD_BACKEND_IO_READ], get_ns() - ubbd_q->pickup_ns);
+		return true;
+	case UBBD_WBUF_READ_PARTIAL:
+		break;
+	default:
+		ubbd_queue_add_ce(ubbd_q, se->priv_data, ret);
+		return true;
+	}
+
+	/* not merged, overlay is of this se only */
+	io = q_prepare_backend_io(ubbd_q, se, UBBD_BACKEND_IO_READ);
+	if (!io) {
+		free(overlay);
+		ubbd_queue_add_ce(ubbd_q, se->priv_data, -ENOMEM);
+		return true;
+	}
+
+	data = (struct q_backend_io_ctx_data *)io->ctx->data;
+	data->overlay = overlay;
+	ret = q_submit_io(ubbd_q, io);
+	if (ret)
+		ubbd_err("ret of backend_io: %lu:%u: %d\n", io->offset, io->len, ret);
+
+	return true;
+}
+
+static int q_queue_rw(struct ubbd_queue *ubbd_q, struct ubbd_se *se,
+		enum ubbd_backend_io_type type)
+{
+	struct ubbd_backend_io *io;
+
+	/* buffered data is newer than read cache and backend */
+	if (type == UBBD_BACKEND_IO_READ && ubbd_q->ubbd_b->wbuf &&
+			q_wbuf_read(ubbd_q, se))
+		return 0;
+
+	if (type == UBBD_BACKEND_IO_READ && ubbd_q->ubbd_b->rcache &&
+			q_rcache_read(ubbd_q, se))
+		return 0;
+
+	if (ubbd_q->merge_io) {
+		if (q_can_merge(ubbd_q, se, type)) {
+			q_merge_se(ubbd_q, se);
+			return 0;
+		}
+		q_merge_flush(ubbd_q);
+	}
+
+	io = q_prepare_backend_io(ubbd_q, se, type);
+	if (!io) {
+		ubbd_err("failed to prepare backend io\n");
+		return -ENOMEM;
+	}
+
+	if (io->len < ubbd_q->merge_max_bytes) {
+		ubbd_q->merge_io = io;
+		return 0;
+	}
+
+	return q_submit_io(ubbd_q, io);
 }
 
 static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
 {
 	struct ubbd_backend *ubbd_b = ubbd_q->ubbd_b;
 	struct ubbd_se_hdr *header = &se->header;
-#ifdef	UBBD_REQUEST_STATS
-	uint64_t start_ns = get_ns();
-#endif
 	int ret;
 	struct ubbd_backend_io *io;
 
 	ubbd_dbg("handle_cmd: se: %p\n", se);
 
-	if (ubbd_b->status == UBBD_BACKEND_STATUS_ERROR) {
-		ubbd_queue_add_ce(ubbd_q, se->priv_data, -EIO);
+	if (ubbd_se_hdr_flags_test(se, UBBD_SE_HDR_DONE)) {
+		ubbd_dbg("flags is done\n");
 		return;
 	}
 
-	if (ubbd_se_hdr_flags_test(se, UBBD_SE_HDR_DONE)) {
-		ubbd_dbg("flags is done\n");
+	if (ubbd_b->status == UBBD_BACKEND_STATUS_ERROR &&
+			ubbd_se_hdr_get_op(header->len_op) != UBBD_OP_PAD) {
+		ubbd_queue_add_ce(ubbd_q, se->priv_data, -EIO);
 		return;
 	}
 
@@ -253,30 +1587,19 @@ static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
 		ubbd_dbg("set pad op to done\n");
 		ubbd_se_hdr_flags_set(se, UBBD_SE_HDR_DONE);
 		ret = 0;
-		ubbd_processing_complete(&ubbd_q->uio_info);
+		queue_doorbell(ubbd_q);
 		break;
 	case UBBD_OP_WRITE:
 		ubbd_dbg("UBBD_OP_WRITE\n");
-		io = q_prepare_backend_io(ubbd_q, se, UBBD_BACKEND_IO_WRITE);
-		if (!io) {
-			ubbd_err("failed to prepare backend io\n");
-			ret = -ENOMEM;
-			goto out;
-		}
-		ret = ubbd_b->backend_ops->writev(ubbd_b, io);
+		ret = q_queue_rw(ubbd_q, se, UBBD_BACKEND_IO_WRITE);
 		break;
 	case UBBD_OP_READ:
 		ubbd_dbg("UBBD_OP_READ\n");
-		io = q_prepare_backend_io(ubbd_q, se, UBBD_BACKEND_IO_READ);
-		if (!io) {
-			ubbd_err("failed to prepare backend io\n");
-			ret = -ENOMEM;
-			goto out;
-		}
-		ret = ubbd_b->backend_ops->readv(ubbd_b, io);
+		ret = q_queue_rw(ubbd_q, se, UBBD_BACKEND_IO_READ);
 		break;
 	case UBBD_OP_FLUSH:
 		ubbd_dbg("UBBD_OP_FLUSH\n");
+		q_merge_flush(ubbd_q);
 		if (!ubbd_b->backend_ops->flush) {
 			ret = -EOPNOTSUPP;
 			ubbd_err("flush is not supportted.\n");
@@ -288,10 +1611,11 @@ static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = ubbd_b->backend_ops->flush(ubbd_b, io);
+		ret = q_queue_flush(ubbd_q, io);
 		break;
 	case UBBD_OP_DISCARD:
 		ubbd_dbg("UBBD_OP_DISCARD\n");
+		q_merge_flush(ubbd_q);
 		if (!ubbd_b->backend_ops->discard) {
 			ret = -EOPNOTSUPP;
 			ubbd_err("discard is not supportted.\n");
@@ -303,10 +1627,11 @@ static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = ubbd_b->backend_ops->discard(ubbd_b, io);
+		ret = q_submit_io(ubbd_q, io);
 		break;
 	case UBBD_OP_WRITE_ZEROS:
 		ubbd_dbg("UBBD_OP_WRITE_ZEROS\n");
+		q_merge_flush(ubbd_q);
 		if (!ubbd_b->backend_ops->write_zeros) {
 			ret = -EOPNOTSUPP;
 			ubbd_err("write_zeros is not supportted.\n");
@@ -318,22 +1643,18 @@ static void handle_cmd(struct ubbd_queue *ubbd_q, struct ubbd_se *se)
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = ubbd_b->backend_ops->write_zeros(ubbd_b, io);
+		ret = q_submit_io(ubbd_q, io);
 		break;
 	default:
 		ubbd_err("error handle_cmd\n");
+		ret = -EINVAL;
 	}
 
 out:
+	/* se without backend io still took a credit, complete it with the error */
 	if (ret) {
 		ubbd_err("ret of se: %llu: %d\n", se->priv_data, ret);
-#ifdef	UBBD_REQUEST_STATS
-	} else {
-		pthread_mutex_lock(&ubbd_q->req_stats_lock);
-		ubbd_q->req_stats.reqs++;
-		ubbd_q->req_stats.handle_time += (get_ns() - start_ns);
-		pthread_mutex_unlock(&ubbd_q->req_stats_lock);
-#endif
+		ubbd_queue_add_ce(ubbd_q, se->priv_data, ret);
 	}
 
 	return;
@@ -362,26 +1683,64 @@ int ubbd_queue_wait_stopped(struct ubbd_queue *ubbd_q)
 void ubbd_queue_init(struct ubbd_queue *ubbd_q)
 {
 	pthread_mutex_init(&ubbd_q->lock, NULL);
-	pthread_mutex_init(&ubbd_q->req_lock, NULL);
-	pthread_mutex_init(&ubbd_q->req_stats_lock, NULL);
 	CPU_ZERO(&ubbd_q->cpuset);
 }
 
+void ubbd_queue_get_stats(struct ubbd_queue *ubbd_q, struct ubbd_req_stats *stats)
+{
+	int i;
+
+	memcpy(stats, &ubbd_q->req_stats, sizeof(struct ubbd_req_stats));
+	for (i = 0; i < UBBD_REQ_STATS_OP_MAX; i++)
+		ubbd_lat_hist_to_stats(&ubbd_q->lat_hist[i], &stats->lat[i]);
+}
+
+void ubbd_queue_reset_stats(struct ubbd_queue *ubbd_q)
+{
+	int i;
+
+	memset(&ubbd_q->req_stats, 0, sizeof(struct ubbd_req_stats));
+	for (i = 0; i < UBBD_REQ_STATS_OP_MAX; i++)
+		ubbd_lat_hist_reset(&ubbd_q->lat_hist[i]);
+}
+
 void ubbd_queue_add_ce(struct ubbd_queue *ubbd_q, uint64_t priv_data,
 		int result)
 {
 	struct ubbd_ce *ce;
-	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	uint64_t seq;
+	bool opened, credit_waiting;
+
+	seq = __atomic_fetch_add(&ubbd_q->ce_reserve_seq, 1, __ATOMIC_RELAXED);
+	/* credits should prevent this, kick kernel to consume ce and retry */
+	while (!ce_slot_free(ubbd_q, seq)) {
+		ce_kick(ubbd_q);
+		usleep(UBBD_QUEUE_CREDIT_WAIT_NS / 1000);
+	}
 
-	pthread_mutex_lock(&ubbd_q->req_lock);
-	ce = get_available_ce(ubbd_q);
+	ce = ce_seq_to_ce(ubbd_q, seq);
 	memset(ce, 0, sizeof(*ce));
 	ce->priv_data = priv_data;
 	ce->flags = 0;
-
 	ce->result = result;
 	ubbd_dbg("append ce: %llu, result: %d\n", ce->priv_data, ce->result);
-	UBBD_UPDATE_COMPR_HEAD(ubbd_q, sb, ce);
-	pthread_mutex_unlock(&ubbd_q->req_lock);
-	ubbd_processing_complete(&ubbd_q->uio_info);
+
+	__atomic_store_n(&ubbd_q->ce_ready[seq % ubbd_q->ce_nr], seq + 1, __ATOMIC_RELEASE);
+	opened = ce_publish(ubbd_q);
+
+	/*
+	 * cmdproc_thread closes the batch at the end of drain pass or on
+	 * deadline, wake it up if we opened a batch from other thread.
+	 *
+	 * If cmdproc_thread is waiting for credit, let kernel consume the ce
+	 * now and wake it up.
+	 */
+	credit_waiting = __atomic_load_n(&ubbd_q->ce_credit_waiting, __ATOMIC_SEQ_CST);
+	if (credit_waiting || ce_batch_full(ubbd_q))
+		ce_kick(ubbd_q);
+	else if (opened && current_queue != ubbd_q)
+		ubbd_queue_wakeup(ubbd_q);
+
+	if (credit_waiting && current_queue != ubbd_q)
+		ubbd_queue_wakeup(ubbd_q);
 }
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ubbd_rcache.h"
+#include "ubbd_split.h"
+
+#define RCACHE_NIL	UINT32_MAX
+
+static inline uint64_t rcache_hash(uint64_t blk)
+{
+	return blk * 0x9E3779B97F4A7C15ULL;
+}
+
+/* top bits pick the shard, so neighbour blocks go to different shards */
+static inline struct ubbd_rcache_shard *rcache_shard(struct ubbd_rcache *rc, uint64_t blk)
+{
+	return &rc->shards[rcache_hash(blk) >> 60];
+}
+
+static inline uint32_t *rcache_bucket(struct ubbd_rcache_shard *shard, uint64_t blk)
+{
+	return &shard->buckets[(uint32_t)rcache_hash(blk) % shard->nr_buckets];
+}
+
+static uint32_t rcache_find(struct ubbd_rcache_shard *shard, uint64_t blk)
+{
+	uint32_t idx;
+
+	for (idx = *rcache_bucket(shard, blk); idx != RCACHE_NIL; idx = shard->slots[idx].next) {
+		if (shard->slots[idx].blk == blk)
+			return idx;
+	}
+
+	return RCACHE_NIL;
+}
+
+static void rcache_remove(struct ubbd_rcache_shard *shard, uint32_t idx)
+{
+	struct ubbd_rcache_slot *slot = &shard->slots[idx];
+	uint32_t *link = rcache_bucket(shard, slot->blk);
+
+	while (*link != idx)
+		link = &shard->slots[*link].next;
+	*link = slot->next;
+
+	slot->used = false;
+	slot->ref = false;
+}
+
+/* CLOCK, a slot referenced since the hand passed it gets one more round */
+static uint32_t rcache_evict(struct ubbd_rcache_shard *shard)
+{
+	struct ubbd_rcache_slot *slot;
+	uint32_t idx;
+
+	while (1) {
+		idx = shard->hand;
+		shard->hand = (shard->hand + 1) % shard->nr_slots;
+		slot = &shard->slots[idx];
+
+		if (!slot->used)
+			return idx;
+
+		if (slot->ref) {
+			slot->ref = false;
+			continue;
+		}
+
+		rcache_remove(shard, idx);
+		return idx;
+	}
+}
+
+static void rcache_shard_free(struct ubbd_rcache_shard *shard)
+{
+	free(shard->buckets);
+	free(shard->slots);
+	free(shard->data);
+	pthread_mutex_destroy(&shard->lock);
+}
+
+/* budget is bytes of cached data, split evenly over shards */
+int ubbd_rcache_init(struct ubbd_rcache *rc, uint64_t budget)
+{
+	struct ubbd_rcache_shard *shard;
+	uint64_t nr_slots = (budget >> UBBD_RCACHE_BLOCK_SHIFT) / UBBD_RCACHE_SHARDS;
+	uint32_t i;
+	int s;
+
+	if (!nr_slots || nr_slots >= RCACHE_NIL)
+		return -EINVAL;
+
+	memset(rc, 0, sizeof(*rc));
+	for (s = 0; s < UBBD_RCACHE_SHARDS; s++) {
+		shard = &rc->shards[s];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->nr_slots = nr_slots;
+		shard->nr_buckets = nr_slots;
+		shard->buckets = malloc(sizeof(uint32_t) * shard->nr_buckets);
+		shard->slots = calloc(shard->nr_slots, sizeof(struct ubbd_rcache_slot));
+		shard->data = malloc((size_t)shard->nr_slots * UBBD_RCACHE_BLOCK_SIZE);
+		if (!shard->buckets || !shard->slots || !shard->data) {
+			rcache_shard_free(shard);
+			goto free_shards;
+		}
+
+		for (i = 0; i < shard->nr_buckets; i++)
+			shard->buckets[i] = RCACHE_NIL;
+	}
+
+	return 0;
+
+free_shards:
+	while (--s >= 0)
+		rcache_shard_free(&rc->shards[s]);
+	return -ENOMEM;
+}
+
+void ubbd_rcache_exit(struct ubbd_rcache *rc)
+{
+	int s;
+
+	for (s = 0; s < UBBD_RCACHE_SHARDS; s++)
+		rcache_shard_free(&rc->shards[s]);
+}
+
+/*
+ * Copy the blocks of a block aligned read into iov, return false if any
+ * of them is missing, the iov may be partly filled then.
+ */
+bool ubbd_rcache_read(struct ubbd_rcache *rc, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt)
+{
+	struct ubbd_rcache_shard *shard;
+	uint64_t blk, skip;
+	uint32_t idx;
+
+	if (!len || (off | len) & (UBBD_RCACHE_BLOCK_SIZE - 1))
+		return false;
+
+	blk = off >> UBBD_RCACHE_BLOCK_SHIFT;
+	for (skip = 0; skip < len; skip += UBBD_RCACHE_BLOCK_SIZE, blk++) {
+		shard = rcache_shard(rc, blk);
+
+		pthread_mutex_lock(&shard->lock);
+		idx = rcache_find(shard, blk);
+		if (idx == RCACHE_NIL) {
+			pthread_mutex_unlock(&shard->lock);
+			return false;
+		}
+
+		shard->slots[idx].ref = true;
+		ubbd_buf_to_iov(shard->data + (size_t)idx * UBBD_RCACHE_BLOCK_SIZE,
+				UBBD_RCACHE_BLOCK_SIZE, iov, iov_cnt, skip);
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return true;
+}
+
+/*
+ * Cache the whole blocks of data read from backend, seq is
+ * ubbd_rcache_seq() before the read was submitted.
+ */
+void ubbd_rcache_fill(struct ubbd_rcache *rc, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, uint64_t seq)
+{
+	struct ubbd_rcache_shard *shard;
+	struct ubbd_rcache_slot *slot;
+	uint64_t blk, end_blk;
+	uint32_t *bucket;
+	uint32_t idx;
+
+	blk = (off + UBBD_RCACHE_BLOCK_SIZE - 1) >> UBBD_RCACHE_BLOCK_SHIFT;
+	end_blk = (off + len) >> UBBD_RCACHE_BLOCK_SHIFT;
+
+	for (; blk < end_blk; blk++) {
+		shard = rcache_shard(rc, blk);
+
+		pthread_mutex_lock(&shard->lock);
+		/* checked under lock, invalidation bumps seq before removing blocks */
+		if (ubbd_rcache_seq(rc) != seq) {
+			pthread_mutex_unlock(&shard->lock);
+			return;
+		}
+
+		idx = rcache_find(shard, blk);
+		if (idx == RCACHE_NIL) {
+			idx = rcache_evict(shard);
+			slot = &shard->slots[idx];
+			slot->blk = blk;
+			slot->used = true;
+			bucket = rcache_bucket(shard, blk);
+			slot->next = *bucket;
+			*bucket = idx;
+		}
+
+		ubbd_iov_to_buf(iov, iov_cnt, (blk << UBBD_RCACHE_BLOCK_SHIFT) - off,
+				shard->data + (size_t)idx * UBBD_RCACHE_BLOCK_SIZE,
+				UBBD_RCACHE_BLOCK_SIZE);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void ubbd_rcache_invalidate(struct ubbd_rcache *rc, uint64_t off, uint32_t len)
+{
+	struct ubbd_rcache_shard *shard;
+	uint64_t blk, end_blk;
+	uint32_t idx;
+	int s;
+
+	if (!len)
+		return;
+
+	__atomic_add_fetch(&rc->inval_seq, 1, __ATOMIC_ACQ_REL);
+
+	blk = off >> UBBD_RCACHE_BLOCK_SHIFT;
+	end_blk = (off + len - 1) >> UBBD_RCACHE_BLOCK_SHIFT;
+
+	/* large discard, scanning slots is cheaper than looking up blocks */
+	if (end_blk - blk >= (uint64_t)rc->shards[0].nr_slots * UBBD_RCACHE_SHARDS) {
+		for (s = 0; s < UBBD_RCACHE_SHARDS; s++) {
+			shard = &rc->shards[s];
+			pthread_mutex_lock(&shard->lock);
+			for (idx = 0; idx < shard->nr_slots; idx++) {
+				if (shard->slots[idx].used &&
+						shard->slots[idx].blk >= blk &&
+						shard->slots[idx].blk <= end_blk)
+					rcache_remove(shard, idx);
+			}
+			pthread_mutex_unlock(&shard->lock);
+		}
+		return;
+	}
+
+	for (; blk <= end_blk; blk++) {
+		shard = rcache_shard(rc, blk);
+
+		pthread_mutex_lock(&shard->lock);
+		idx = rcache_find(shard, blk);
+		if (idx != RCACHE_NIL)
+			rcache_remove(shard, idx);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "ubbd_split.h"
+
+#define SPLIT_MIN(a, b)	((a) < (b) ? (a) : (b))
+
+/* length of the piece of io at off fitting in max_io_size and io_boundary */
+uint32_t ubbd_split_len(const struct ubbd_io_limits *limits, uint64_t off, uint32_t len)
+{
+	uint64_t boundary_end;
+
+	if (limits->max_io_size && len > limits->max_io_size)
+		len = limits->max_io_size;
+
+	/* io_boundary is not always power of 2, object size of s3 is any */
+	if (limits->io_boundary) {
+		boundary_end = (off / limits->io_boundary + 1) * limits->io_boundary;
+		if (off + len > boundary_end)
+			len = boundary_end - off;
+	}
+
+	return len;
+}
+
+/* bytes after skip in iov covered by at most max_iov iovs, at most len */
+uint32_t ubbd_iov_span(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, uint32_t max_iov)
+{
+	uint64_t span = 0;
+	uint32_t used = 0;
+	int i;
+
+	for (i = 0; i < iov_cnt && span < len && used < max_iov; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		span += iov[i].iov_len - skip;
+		skip = 0;
+		used++;
+	}
+
+	return SPLIT_MIN(span, len);
+}
+
+/*
+ * Fill dst with the iovs of len bytes after skip in iov, return the
+ * number of them. dst can be NULL to count them only.
+ */
+int ubbd_iov_slice(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, struct iovec *dst)
+{
+	uint64_t seg;
+	int nr = 0;
+	int i;
+
+	for (i = 0; i < iov_cnt && len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		seg = SPLIT_MIN(iov[i].iov_len - skip, len);
+		if (dst) {
+			dst[nr].iov_base = (char *)iov[i].iov_base + skip;
+			dst[nr].iov_len = seg;
+		}
+		nr++;
+		len -= seg;
+		skip = 0;
+	}
+
+	return nr;
+}
+
+bool ubbd_iov_aligned(const struct iovec *iov, int iov_cnt, uint32_t align)
+{
+	int i;
+
+	if (!align)
+		return true;
+
+	for (i = 0; i < iov_cnt; i++) {
+		if ((uintptr_t)iov[i].iov_base % align || iov[i].iov_len % align)
+			return false;
+	}
+
+	return true;
+}
+
+void ubbd_iov_to_buf(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		void *buf, uint32_t len)
+{
+	uint64_t seg;
+	int i;
+
+	for (i = 0; i < iov_cnt && len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		seg = SPLIT_MIN(iov[i].iov_len - skip, len);
+		memcpy(buf, (char *)iov[i].iov_base + skip, seg);
+		buf = (char *)buf + seg;
+		len -= seg;
+		skip = 0;
+	}
+}
+
+void ubbd_buf_to_iov(const void *buf, uint32_t len, const struct iovec *iov,
+		int iov_cnt, uint64_t skip)
+{
+	uint64_t seg;
+	int i;
+
+	for (i = 0; i < iov_cnt && len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		seg = SPLIT_MIN(iov[i].iov_len - skip, len);
+		memcpy((char *)iov[i].iov_base + skip, buf, seg);
+		buf = (const char *)buf + seg;
+		len -= seg;
+		skip = 0;
+	}
+}
+
+/*
+ * Discard is a hint, drop the head and tail not covering a whole
+ * granule, len is 0 if nothing is left.
+ */
+void ubbd_discard_align(const struct ubbd_io_limits *limits, uint64_t *off, uint32_t *len)
+{
+	uint32_t gran = limits->discard_granularity;
+	uint64_t start, end;
+
+	if (!gran)
+		return;
+
+	start = (*off + gran - 1) / gran * gran;
+	end = (*off + *len) / gran * gran;
+	if (end <= start) {
+		*len = 0;
+		return;
+	}
+
+	*off = start;
+	*len = end - start;
+}
@@ -0,0 +1,82 @@
+#include <string.h>
+
+#include "ubbd_stats.h"
+
+/* smallest value mapped to bucket of index */
+uint64_t ubbd_lat_hist_bucket_min(int index)
+{
+	int shift;
+
+	if (index < UBBD_LAT_HIST_SUB)
+		return index;
+
+	shift = index / UBBD_LAT_HIST_SUB + UBBD_LAT_HIST_SUB_SHIFT - 1;
+
+	return (uint64_t)(UBBD_LAT_HIST_SUB + index % UBBD_LAT_HIST_SUB) << (shift - UBBD_LAT_HIST_SUB_SHIFT);
+}
+
+void ubbd_lat_hist_snapshot(struct ubbd_lat_hist *hist, struct ubbd_lat_hist *snap)
+{
+	int i;
+
+	snap->count = 0;
+	snap->total_ns = __atomic_load_n(&hist->total_ns, __ATOMIC_RELAXED);
+	for (i = 0; i < UBBD_LAT_HIST_BUCKETS; i++) {
+		snap->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		/* count from buckets, so percentiles match the snapshot */
+		snap->count += snap->buckets[i];
+	}
+}
+
+void ubbd_lat_hist_reset(struct ubbd_lat_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < UBBD_LAT_HIST_BUCKETS; i++)
+		__atomic_store_n(&hist->buckets[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->total_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, 0, __ATOMIC_RELAXED);
+}
+
+/* value at permille of hist, the middle of the bucket it falls into */
+uint64_t ubbd_lat_hist_percentile(struct ubbd_lat_hist *hist, uint32_t permille)
+{
+	uint64_t target, seen = 0;
+	uint64_t min, max;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	/* rank of the value, rounded up */
+	target = (hist->count * permille + 999) / 1000;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < UBBD_LAT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i >= UBBD_LAT_HIST_BUCKETS - 1)
+		return ubbd_lat_hist_bucket_min(UBBD_LAT_HIST_BUCKETS - 1);
+
+	min = ubbd_lat_hist_bucket_min(i);
+	max = ubbd_lat_hist_bucket_min(i + 1) - 1;
+
+	return min + (max - min) / 2;
+}
+
+void ubbd_lat_hist_to_stats(struct ubbd_lat_hist *hist, struct ubbd_req_lat_stats *stats)
+{
+	struct ubbd_lat_hist snap;
+
+	ubbd_lat_hist_snapshot(hist, &snap);
+
+	stats->reqs = snap.count;
+	stats->total_ns = snap.total_ns;
+	stats->p50 = ubbd_lat_hist_percentile(&snap, 500);
+	stats->p99 = ubbd_lat_hist_percentile(&snap, 990);
+	stats->p999 = ubbd_lat_hist_percentile(&snap, 999);
+}
@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "ubbd_uring.h"
+#include "ubbd_queue.h"
+#include "utils.h"
+
+#ifdef HAVE_LIBURING
+
+#define UBBD_URING_ENTRIES	256
+
+/* user_data of internal sqe, backend sqe carry a struct ubbd_uring_cb * */
+#define UBBD_URING_UIO_POLL	((void *)1)
+#define UBBD_URING_WAKEUP_POLL	((void *)2)
+#define UBBD_URING_DOORBELL	((void *)3)
+
+/* ring of the queue handled by current cmdproc_thread */
+static __thread struct ubbd_uring *current_uring;
+
+/* doorbell payload, kernel ignores it */
+static uint32_t ubbd_uring_doorbell_buf;
+
+static struct io_uring_sqe *uring_get_sqe(struct ubbd_uring *uring)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&uring->ring);
+	if (sqe)
+		return sqe;
+
+	/* sq is full, push it to kernel and retry */
+	io_uring_submit(&uring->ring);
+
+	return io_uring_get_sqe(&uring->ring);
+}
+
+static int uring_arm_poll(struct ubbd_uring *uring, int fd, void *tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(uring);
+	if (!sqe)
+		return -EBUSY;
+
+	if (uring->multishot)
+		io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+	else
+		io_uring_prep_poll_add(sqe, fd, POLLIN);
+	io_uring_sqe_set_data(sqe, tag);
+
+	return 0;
+}
+
+/*
+ * uio reports POLLIN until the event is read, read it before arming,
+ * otherwise the poll fires at once. The read may eat an event of se
+ * coming after caller checked cmd ring, so report an uio event to make
+ * caller check it again.
+ */
+static void uring_arm_uio(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+
+	ubbd_processing_start(&ubbd_q->uio_info);
+	if (!uring_arm_poll(uring, ubbd_q->uio_info.fd, UBBD_URING_UIO_POLL))
+		uring->uio_armed = true;
+	uring->uio_event = true;
+}
+
+static void uring_arm_wakeup(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+
+	if (!uring_arm_poll(uring, ubbd_q->wakeup_fd, UBBD_URING_WAKEUP_POLL))
+		uring->wakeup_armed = true;
+}
+
+static void uring_handle_poll(struct ubbd_queue *ubbd_q, struct io_uring_cqe *cqe,
+		bool *armed)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	*armed = false;
+
+	/* kernel without multishot poll, use oneshot poll from now on */
+	if (cqe->res == -EINVAL && uring->multishot) {
+		ubbd_info("queue%d: multishot poll not supported, use oneshot poll\n",
+				ubbd_q->index);
+		uring->multishot = false;
+	}
+}
+
+static void uring_handle_cqe(struct ubbd_queue *ubbd_q, struct io_uring_cqe *cqe)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+	void *data = io_uring_cqe_get_data(cqe);
+	struct ubbd_uring_cb *cb;
+	eventfd_t cnt;
+
+	if (data == UBBD_URING_UIO_POLL) {
+		uring->uio_event = true;
+		uring_handle_poll(ubbd_q, cqe, &uring->uio_armed);
+	} else if (data == UBBD_URING_WAKEUP_POLL) {
+		eventfd_read(ubbd_q->wakeup_fd, &cnt);
+		uring_handle_poll(ubbd_q, cqe, &uring->wakeup_armed);
+	} else if (data == UBBD_URING_DOORBELL) {
+		if (cqe->res < 0)
+			ubbd_err("queue%d: doorbell failed: %d\n", ubbd_q->index, cqe->res);
+	} else {
+		uring->inflight--;
+		cb = data;
+		cb->complete(cb, cqe->res);
+	}
+}
+
+int ubbd_uring_init(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring;
+	struct iovec iov;
+	int ret;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return -ENOMEM;
+
+	ret = io_uring_queue_init(UBBD_URING_ENTRIES, &uring->ring, 0);
+	if (ret) {
+		free(uring);
+		return ret;
+	}
+
+	uring->multishot = true;
+	uring->fixed_fd = -1;
+	ubbd_q->uring = uring;
+	current_uring = uring;
+
+	/* uio memory may not be pinnable, backends use plain buffers then */
+	uring->buf_base = (char *)ubbd_q->uio_info.map;
+	uring->buf_size = ubbd_q->uio_info.uio_map_size;
+	iov.iov_base = uring->buf_base;
+	iov.iov_len = uring->buf_size;
+	ret = io_uring_register_buffers(&uring->ring, &iov, 1);
+	if (ret)
+		ubbd_info("queue%d: uio map is not registered to io_uring: %d\n",
+				ubbd_q->index, ret);
+	else
+		uring->fixed_buf = true;
+
+	uring_arm_uio(ubbd_q);
+	uring_arm_wakeup(ubbd_q);
+	io_uring_submit(&uring->ring);
+
+	return 0;
+}
+
+void ubbd_uring_exit(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+
+	if (!uring)
+		return;
+
+	current_uring = NULL;
+	ubbd_q->uring = NULL;
+	io_uring_queue_exit(&uring->ring);
+	free(uring);
+}
+
+/* doorbell is sent with the next submit, together with backend sqe */
+void ubbd_uring_doorbell(struct ubbd_queue *ubbd_q)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ubbd_q->uring);
+	if (!sqe) {
+		ubbd_processing_complete(&ubbd_q->uio_info);
+		return;
+	}
+
+	io_uring_prep_write(sqe, ubbd_q->uio_info.fd, &ubbd_uring_doorbell_buf,
+			sizeof(ubbd_uring_doorbell_buf), 0);
+	io_uring_sqe_set_data(sqe, UBBD_URING_DOORBELL);
+}
+
+void ubbd_uring_submit(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+	int ret;
+
+	if (!io_uring_sq_ready(&uring->ring))
+		return;
+
+	ret = io_uring_submit(&uring->ring);
+	if (ret < 0)
+		ubbd_err("queue%d: failed to submit sqe: %d\n", ubbd_q->index, ret);
+}
+
+/* handle all cqe without waiting, return the number of cqe */
+int ubbd_uring_reap(struct ubbd_queue *ubbd_q)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+	struct io_uring_cqe *cqe;
+	int nr = 0;
+
+	while (!io_uring_peek_cqe(&uring->ring, &cqe)) {
+		uring_handle_cqe(ubbd_q, cqe);
+		io_uring_cqe_seen(&uring->ring, cqe);
+		nr++;
+	}
+
+	if (!uring->uio_armed)
+		uring_arm_uio(ubbd_q);
+	if (!uring->wakeup_armed)
+		uring_arm_wakeup(ubbd_q);
+
+	return nr;
+}
+
+/*
+ * Submit pending sqe and wait for any cqe for at most timeout_ns,
+ * uio_event tells whether kernel notified new se.
+ */
+int ubbd_uring_wait(struct ubbd_queue *ubbd_q, int64_t timeout_ns, bool *uio_event)
+{
+	struct ubbd_uring *uring = ubbd_q->uring;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	uring->uio_event = false;
+
+	/* dont sleep if there are cqe to handle */
+	if (!ubbd_uring_reap(ubbd_q)) {
+		/*
+		 * kernel with IORING_FEAT_EXT_ARG does not submit in the wait,
+		 * push doorbells and rearmed polls before sleeping on them.
+		 */
+		ubbd_uring_submit(ubbd_q);
+		ts.tv_sec = timeout_ns / 1000000000;
+		ts.tv_nsec = timeout_ns % 1000000000;
+		ret = io_uring_wait_cqe_timeout(&uring->ring, &cqe, &ts);
+		if (ret && ret != -ETIME && ret != -EINTR) {
+			ubbd_err("queue%d: failed to wait cqe: %d\n", ubbd_q->index, ret);
+			return ret;
+		}
+		ubbd_uring_reap(ubbd_q);
+	}
+
+	/* rearmed polls and doorbells rung by completions */
+	ubbd_uring_submit(ubbd_q);
+
+	if (uio_event)
+		*uio_event = uring->uio_event;
+
+	return 0;
+}
+
+/*
+ * Backend sqe may be io of a sibling queue stolen by this thread, the
+ * ring is not exited until they complete.
+ */
+bool ubbd_uring_idle(struct ubbd_queue *ubbd_q)
+{
+	return !ubbd_q->uring || !ubbd_q->uring->inflight;
+}
+
+struct io_uring_sqe *ubbd_uring_get_sqe(struct ubbd_uring_cb *cb)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!current_uring)
+		return NULL;
+
+	sqe = uring_get_sqe(current_uring);
+	if (sqe) {
+		io_uring_sqe_set_data(sqe, cb);
+		current_uring->inflight++;
+	}
+
+	return sqe;
+}
+
+/* fd is registered by the first call in each ring, and stays open until ring exits */
+int ubbd_uring_fixed_file(int fd)
+{
+	struct ubbd_uring *uring = current_uring;
+	int ret;
+
+	if (!uring)
+		return -ENODEV;
+
+	if (uring->fixed_fd >= 0)
+		return uring->fixed_fd == fd ? 0 : -EBUSY;
+
+	if (uring->fixed_file_failed)
+		return -EOPNOTSUPP;
+
+	ret = io_uring_register_files(&uring->ring, &fd, 1);
+	if (ret) {
+		ubbd_info("failed to register fd %d to io_uring: %d\n", fd, ret);
+		uring->fixed_file_failed = true;
+		return ret;
+	}
+	uring->fixed_fd = fd;
+
+	return 0;
+}
+
+int ubbd_uring_fixed_buf(const void *buf, uint32_t len)
+{
+	struct ubbd_uring *uring = current_uring;
+
+	if (!uring || !uring->fixed_buf)
+		return -ENODEV;
+
+	if ((const char *)buf < uring->buf_base ||
+			(const char *)buf + len > uring->buf_base + uring->buf_size)
+		return -ERANGE;
+
+	return 0;
+}
+
+#else /* HAVE_LIBURING */
+
+int ubbd_uring_init(struct ubbd_queue *ubbd_q)
+{
+	return -EOPNOTSUPP;
+}
+
+void ubbd_uring_exit(struct ubbd_queue *ubbd_q)
+{
+}
+
+void ubbd_uring_doorbell(struct ubbd_queue *ubbd_q)
+{
+	ubbd_processing_complete(&ubbd_q->uio_info);
+}
+
+void ubbd_uring_submit(struct ubbd_queue *ubbd_q)
+{
+}
+
+int ubbd_uring_reap(struct ubbd_queue *ubbd_q)
+{
+	return 0;
+}
+
+int ubbd_uring_wait(struct ubbd_queue *ubbd_q, int64_t timeout_ns, bool *uio_event)
+{
+	return -EOPNOTSUPP;
+}
+
+bool ubbd_uring_idle(struct ubbd_queue *ubbd_q)
+{
+	return true;
+}
+
+struct io_uring_sqe *ubbd_uring_get_sqe(struct ubbd_uring_cb *cb)
+{
+	return NULL;
+}
+
+int ubbd_uring_fixed_file(int fd)
+{
+	return -EOPNOTSUPP;
+}
+
+int ubbd_uring_fixed_buf(const void *buf, uint32_t len)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* HAVE_LIBURING */
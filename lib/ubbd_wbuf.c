@@ -0,0 +1,753 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ubbd_wbuf.h"
+#include "ubbd_split.h"
+
+#define WBUF_JOURNAL_MAGIC	0x6675627764626275ULL	/* "ubbdwbuf" */
+#define WBUF_JOURNAL_PUNCH	(1 << 0)
+
+struct wbuf_journal_rec {
+	uint64_t	magic;
+	uint64_t	off;
+	uint32_t	len;
+	uint32_t	flags;
+};
+
+static uint64_t wbuf_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ubbd_wbuf_extent *wbuf_extent_alloc(uint64_t off, uint32_t len,
+		char *buf, uint64_t seq)
+{
+	struct ubbd_wbuf_extent *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->off = off;
+	e->len = len;
+	e->buf = buf;
+	e->data = buf;
+	e->buf_len = len;
+	e->seq = seq;
+	INIT_LIST_HEAD(&e->pass_node);
+
+	return e;
+}
+
+static void wbuf_extent_free(struct ubbd_wbuf *wb, struct ubbd_wbuf_extent *e)
+{
+	wb->dirty_bytes -= e->buf_len;
+	free(e->buf);
+	free(e);
+}
+
+/* add e to index before next */
+static void wbuf_extent_link(struct ubbd_wbuf *wb, struct ubbd_wbuf_extent *e,
+		struct list_head *next)
+{
+	list_add_tail(&e->node, next);
+	wb->dirty_bytes += e->buf_len;
+	if (!wb->nr_dirty++)
+		wb->dirty_since_ns = wbuf_now();
+}
+
+static void wbuf_extent_drop(struct ubbd_wbuf *wb, struct ubbd_wbuf_extent *e)
+{
+	list_del(&e->node);
+	if (e->destaging) {
+		e->orphan = true;
+		return;
+	}
+
+	wb->nr_dirty--;
+	wbuf_extent_free(wb, e);
+}
+
+/*
+ * Last extent ending at or before off, or index head. Extents never
+ * overlap, so their ends are sorted too. Searched from tail, as most
+ * writes are appended after the last one.
+ */
+static struct list_head *wbuf_seek(struct ubbd_wbuf *wb, uint64_t off)
+{
+	struct list_head *pos = wb->index.prev;
+	struct ubbd_wbuf_extent *e;
+
+	while (pos != &wb->index) {
+		e = list_entry(pos, struct ubbd_wbuf_extent, node);
+		if (e->off + e->len <= off)
+			break;
+		pos = pos->prev;
+	}
+
+	return pos;
+}
+
+/*
+ * Drop [off, off + len) from index. *next is where an extent of the
+ * range goes, *seq is lowered to the oldest write dropped.
+ */
+static int wbuf_punch(struct ubbd_wbuf *wb, uint64_t off, uint32_t len,
+		uint64_t *seq, struct list_head **next)
+{
+	struct ubbd_wbuf_extent *e, *tail;
+	struct list_head *pos, *n;
+	uint64_t end = off + len;
+	char *buf;
+
+	*next = &wb->index;
+	pos = wbuf_seek(wb, off)->next;
+	if (pos == &wb->index)
+		return 0;
+
+	/* range in the middle of one extent, the only case allocating */
+	e = list_entry(pos, struct ubbd_wbuf_extent, node);
+	if (e->off < off && e->off + e->len > end) {
+		buf = malloc(e->off + e->len - end);
+		tail = (buf ? wbuf_extent_alloc(end, e->off + e->len - end, buf, e->seq) : NULL);
+		if (!tail) {
+			free(buf);
+			return -ENOMEM;
+		}
+
+		memcpy(buf, e->data + (end - e->off), tail->len);
+		if (e->seq < *seq)
+			*seq = e->seq;
+		e->len = off - e->off;
+		wbuf_extent_link(wb, tail, e->node.next);
+		*next = &tail->node;
+		return 0;
+	}
+
+	for (; pos != &wb->index; pos = n) {
+		n = pos->next;
+		e = list_entry(pos, struct ubbd_wbuf_extent, node);
+		if (e->off >= end) {
+			*next = pos;
+			break;
+		}
+
+		if (e->seq < *seq)
+			*seq = e->seq;
+
+		if (e->off < off) {
+			e->len = off - e->off;
+			continue;
+		}
+
+		if (e->off + e->len > end) {
+			e->data += end - e->off;
+			e->len -= end - e->off;
+			e->off = end;
+			*next = pos;
+			break;
+		}
+
+		wbuf_extent_drop(wb, e);
+	}
+
+	return 0;
+}
+
+/*
+ * Not synced: the journal covers a crash of backend process only, flush
+ * makes writes durable by destaging them to backend.
+ */
+static int wbuf_journal_append(struct ubbd_wbuf *wb, uint64_t off, uint32_t len,
+		char *buf, uint32_t flags)
+{
+	struct wbuf_journal_rec rec = { .magic = WBUF_JOURNAL_MAGIC, .off = off,
+					.len = len, .flags = flags };
+	struct iovec iov[2] = {
+		{ .iov_base = &rec, .iov_len = sizeof(rec) },
+		{ .iov_base = buf, .iov_len = (buf ? len : 0) },
+	};
+	ssize_t ret;
+
+	if (wb->journal_fd < 0)
+		return 0;
+
+	ret = pwritev(wb->journal_fd, iov, 2, wb->journal_off);
+	if (ret != iov[0].iov_len + iov[1].iov_len)
+		return (ret < 0 ? -errno : -EIO);
+
+	wb->journal_off += ret;
+
+	return 0;
+}
+
+static void wbuf_journal_reset(struct ubbd_wbuf *wb)
+{
+	if (wb->journal_fd < 0 || !wb->journal_off)
+		return;
+
+	if (ftruncate(wb->journal_fd, 0))
+		return;
+
+	wb->journal_off = 0;
+}
+
+static bool wbuf_fits(struct ubbd_wbuf *wb, uint32_t len)
+{
+	/* empty buffer takes any write, or a large one never fits */
+	if (!wb->dirty_bytes) {
+		wbuf_journal_reset(wb);
+		return true;
+	}
+
+	if (wb->dirty_bytes + len > wb->dirty_limit)
+		return false;
+
+	if (wb->journal_fd >= 0 &&
+			wb->journal_off + sizeof(struct wbuf_journal_rec) + len > wb->journal_max)
+		return false;
+
+	return true;
+}
+
+static int wbuf_admit_write(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req)
+{
+	struct ubbd_wbuf_extent *e;
+	struct list_head *next;
+	char *buf;
+	int ret;
+
+	buf = malloc(req->len);
+	if (!buf)
+		return -ENOMEM;
+
+	ubbd_iov_to_buf(req->iov, req->iov_cnt, 0, buf, req->len);
+	e = wbuf_extent_alloc(req->off, req->len, buf, wb->seq + 1);
+	if (!e) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	ret = wbuf_journal_append(wb, req->off, req->len, buf, 0);
+	if (ret)
+		goto free;
+
+	ret = wbuf_punch(wb, req->off, req->len, &e->seq, &next);
+	if (ret)
+		goto free;
+
+	wb->seq++;
+	wbuf_extent_link(wb, e, next);
+
+	return 0;
+free:
+	free(buf);
+	free(e);
+	return ret;
+}
+
+static int wbuf_apply_barrier(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req)
+{
+	struct list_head *next;
+	uint64_t seq = UINT64_MAX;
+	int ret;
+
+	/* replay must drop the writes before it too */
+	ret = wbuf_journal_append(wb, req->off, req->len, NULL, WBUF_JOURNAL_PUNCH);
+	if (ret)
+		return ret;
+
+	return wbuf_punch(wb, req->off, req->len, &seq, &next);
+}
+
+/* range overlaps an io of the pass in flight, checked by its original range */
+static bool wbuf_overlap_destaging(struct ubbd_wbuf *wb, uint64_t off, uint32_t len)
+{
+	struct ubbd_wbuf_destage *d;
+
+	if (!wb->pass)
+		return false;
+
+	list_for_each_entry(d, &wb->pass->destages, node) {
+		if (d->off < off + len && off < d->off + d->len)
+			return true;
+	}
+
+	return false;
+}
+
+int ubbd_wbuf_init(struct ubbd_wbuf *wb, uint64_t dirty_limit, uint64_t max_age_ns)
+{
+	pthread_condattr_t attr;
+
+	if (!dirty_limit)
+		return -EINVAL;
+
+	memset(wb, 0, sizeof(*wb));
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	INIT_LIST_HEAD(&wb->index);
+	INIT_LIST_HEAD(&wb->pending);
+	INIT_LIST_HEAD(&wb->flush_waiters);
+	wb->dirty_limit = dirty_limit;
+	wb->max_age_ns = max_age_ns;
+	wb->journal_fd = -1;
+	wb->journal_max = dirty_limit * UBBD_WBUF_JOURNAL_RATIO;
+
+	return 0;
+}
+
+/*
+ * Destager is stopped, nothing is pending or destaging. Data not
+ * destaged is kept in journal for next start.
+ */
+void ubbd_wbuf_exit(struct ubbd_wbuf *wb)
+{
+	struct ubbd_wbuf_extent *e, *tmp;
+
+	if (wb->journal_fd >= 0) {
+		if (!wb->dirty_bytes)
+			wbuf_journal_reset(wb);
+		close(wb->journal_fd);
+	}
+
+	list_for_each_entry_safe(e, tmp, &wb->index, node) {
+		list_del(&e->node);
+		wbuf_extent_free(wb, e);
+	}
+
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+}
+
+/*
+ * Open journal at path, replay the writes in it into buffer and keep
+ * appending after them, return the number of records replayed.
+ */
+int ubbd_wbuf_journal_open(struct ubbd_wbuf *wb, const char *path)
+{
+	struct wbuf_journal_rec rec;
+	struct ubbd_wbuf_extent *e;
+	struct list_head *next;
+	uint64_t seq = UINT64_MAX;
+	uint64_t off = 0;
+	char *buf;
+	int nr = 0;
+	int ret;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	while (pread(fd, &rec, sizeof(rec), off) == sizeof(rec) &&
+			rec.magic == WBUF_JOURNAL_MAGIC) {
+		if (rec.flags & WBUF_JOURNAL_PUNCH) {
+			ret = wbuf_punch(wb, rec.off, rec.len, &seq, &next);
+			if (ret)
+				goto close;
+			off += sizeof(rec);
+			nr++;
+			continue;
+		}
+
+		buf = malloc(rec.len);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto close;
+		}
+
+		/* torn record at tail, write of it was never completed */
+		if (pread(fd, buf, rec.len, off + sizeof(rec)) != rec.len) {
+			free(buf);
+			break;
+		}
+
+		e = wbuf_extent_alloc(rec.off, rec.len, buf, ++wb->seq);
+		if (!e) {
+			free(buf);
+			ret = -ENOMEM;
+			goto close;
+		}
+
+		ret = wbuf_punch(wb, rec.off, rec.len, &e->seq, &next);
+		if (ret) {
+			free(buf);
+			free(e);
+			goto close;
+		}
+		wbuf_extent_link(wb, e, next);
+
+		off += sizeof(rec) + rec.len;
+		nr++;
+	}
+
+	if (ftruncate(fd, off)) {
+		ret = -errno;
+		goto close;
+	}
+
+	wb->journal_fd = fd;
+	wb->journal_off = off;
+
+	return nr;
+close:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Buffer a write, return 0 if it is buffered and can be completed, 1 if
+ * it waits in pending and req->done will be called.
+ */
+int ubbd_wbuf_write(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req)
+{
+	int ret;
+
+	pthread_mutex_lock(&wb->lock);
+	if (list_empty(&wb->pending) && wbuf_fits(wb, req->len)) {
+		ret = wbuf_admit_write(wb, req);
+		/* first dirty extent starts the age timer of destager */
+		if (!ret && (wb->nr_dirty == 1 || wb->dirty_bytes >= wb->dirty_limit / 2))
+			pthread_cond_signal(&wb->cond);
+		pthread_mutex_unlock(&wb->lock);
+		return ret;
+	}
+
+	list_add_tail(&req->node, &wb->pending);
+	pthread_cond_signal(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	return 1;
+}
+
+/*
+ * Drop buffered data in range of a discard or write-zeros, return 0 if
+ * it can go to backend now, 1 if it has to wait in pending and req->done
+ * will be called when it can.
+ */
+int ubbd_wbuf_barrier(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req)
+{
+	int ret;
+
+	pthread_mutex_lock(&wb->lock);
+	if (list_empty(&wb->pending) && !wbuf_overlap_destaging(wb, req->off, req->len)) {
+		ret = wbuf_apply_barrier(wb, req);
+		if (ret != -ENOMEM) {
+			pthread_mutex_unlock(&wb->lock);
+			return ret;
+		}
+	}
+
+	list_add_tail(&req->node, &wb->pending);
+	pthread_cond_signal(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	return 1;
+}
+
+/*
+ * Return 0 if nothing buffered has to be destaged for a flush, 1 if
+ * req->done will be called when all writes buffered before are destaged.
+ */
+int ubbd_wbuf_flush(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req)
+{
+	pthread_mutex_lock(&wb->lock);
+	if (list_empty(&wb->index)) {
+		pthread_mutex_unlock(&wb->lock);
+		return 0;
+	}
+
+	req->seq = wb->seq;
+	list_add_tail(&req->node, &wb->flush_waiters);
+	pthread_cond_signal(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	return 1;
+}
+
+/*
+ * Copy buffered data of a read into iov. On UBBD_WBUF_READ_PARTIAL the
+ * buffered pieces are copied into *overlay, to be applied by
+ * ubbd_wbuf_overlay_apply() after backend read and freed by caller.
+ */
+int ubbd_wbuf_read(struct ubbd_wbuf *wb, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, struct ubbd_wbuf_overlay **overlay)
+{
+	struct ubbd_wbuf_overlay_piece *piece;
+	struct ubbd_wbuf_overlay *ov;
+	struct ubbd_wbuf_extent *e;
+	struct list_head *start, *pos;
+	uint64_t end = off + len;
+	uint64_t covered = 0;
+	uint64_t s, t;
+	char *data = NULL;
+	int nr = 0;
+
+	*overlay = NULL;
+
+	pthread_mutex_lock(&wb->lock);
+	start = wbuf_seek(wb, off);
+	for (pos = start->next; pos != &wb->index; pos = pos->next) {
+		e = list_entry(pos, struct ubbd_wbuf_extent, node);
+		if (e->off >= end)
+			break;
+		s = (e->off > off ? e->off : off);
+		t = (e->off + e->len < end ? e->off + e->len : end);
+		covered += t - s;
+		nr++;
+	}
+
+	if (!nr) {
+		pthread_mutex_unlock(&wb->lock);
+		return UBBD_WBUF_READ_MISS;
+	}
+
+	ov = NULL;
+	if (covered < len) {
+		ov = malloc(sizeof(*ov) + sizeof(*piece) * nr + covered);
+		if (!ov) {
+			pthread_mutex_unlock(&wb->lock);
+			return -ENOMEM;
+		}
+		ov->nr = nr;
+		data = (char *)&ov->pieces[nr];
+	}
+
+	piece = (ov ? ov->pieces : NULL);
+	for (pos = start->next; nr--; pos = pos->next) {
+		e = list_entry(pos, struct ubbd_wbuf_extent, node);
+		s = (e->off > off ? e->off : off);
+		t = (e->off + e->len < end ? e->off + e->len : end);
+		if (!ov) {
+			ubbd_buf_to_iov(e->data + (s - e->off), t - s, iov, iov_cnt, s - off);
+			continue;
+		}
+
+		piece->off = s;
+		piece->len = t - s;
+		piece->data = data;
+		memcpy(data, e->data + (s - e->off), t - s);
+		data += t - s;
+		piece++;
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	if (!ov)
+		return UBBD_WBUF_READ_HIT;
+
+	*overlay = ov;
+
+	return UBBD_WBUF_READ_PARTIAL;
+}
+
+void ubbd_wbuf_overlay_apply(struct ubbd_wbuf_overlay *overlay, uint64_t off,
+		const struct iovec *iov, int iov_cnt)
+{
+	int i;
+
+	for (i = 0; i < overlay->nr; i++)
+		ubbd_buf_to_iov(overlay->pieces[i].data, overlay->pieces[i].len,
+				iov, iov_cnt, overlay->pieces[i].off - off);
+}
+
+static bool wbuf_need_destage(struct ubbd_wbuf *wb, uint64_t now_ns)
+{
+	if (!list_empty(&wb->pending))
+		return true;
+
+	if (!wb->nr_dirty)
+		return false;
+
+	return (wb->stopping || !list_empty(&wb->flush_waiters) ||
+		wb->dirty_bytes >= wb->dirty_limit / 2 ||
+		now_ns - wb->dirty_since_ns >= wb->max_age_ns);
+}
+
+bool ubbd_wbuf_need_destage(struct ubbd_wbuf *wb, uint64_t now_ns)
+{
+	bool need;
+
+	pthread_mutex_lock(&wb->lock);
+	need = wbuf_need_destage(wb, now_ns);
+	pthread_mutex_unlock(&wb->lock);
+
+	return need;
+}
+
+/* wait for a destage pass to do, false if stopping and all destaged */
+bool ubbd_wbuf_wait_work(struct ubbd_wbuf *wb)
+{
+	struct timespec ts;
+	uint64_t deadline;
+	bool work;
+
+	pthread_mutex_lock(&wb->lock);
+	while (1) {
+		if (wbuf_need_destage(wb, wbuf_now())) {
+			work = true;
+			break;
+		}
+
+		if (wb->stopping) {
+			work = false;
+			break;
+		}
+
+		if (!wb->nr_dirty) {
+			pthread_cond_wait(&wb->cond, &wb->lock);
+			continue;
+		}
+
+		deadline = wb->dirty_since_ns + wb->max_age_ns;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		pthread_cond_timedwait(&wb->cond, &wb->lock, &ts);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return work;
+}
+
+/*
+ * Admit pending requests in order, then take all dirty extents into
+ * pass, adjacent ones merged into one destage io. Return the number of
+ * destage ios, caller writes them to backend and calls
+ * ubbd_wbuf_destage_done() when all of them finished.
+ */
+int ubbd_wbuf_destage_prepare(struct ubbd_wbuf *wb, struct ubbd_wbuf_pass *pass)
+{
+	struct ubbd_wbuf_destage *d = NULL;
+	struct ubbd_wbuf_req *req, *tmp;
+	struct ubbd_wbuf_extent *e;
+	LIST_HEAD(done);
+	int nr = 0;
+
+	INIT_LIST_HEAD(&pass->extents);
+	INIT_LIST_HEAD(&pass->destages);
+
+	pthread_mutex_lock(&wb->lock);
+	list_for_each_entry_safe(req, tmp, &wb->pending, node) {
+		if (req->type == UBBD_WBUF_REQ_WRITE) {
+			if (!wbuf_fits(wb, req->len))
+				break;
+			req->ret = wbuf_admit_write(wb, req);
+		} else {
+			req->ret = wbuf_apply_barrier(wb, req);
+			if (req->ret == -ENOMEM)
+				break;
+		}
+		list_move_tail(&req->node, &done);
+	}
+
+	list_for_each_entry(e, &wb->index, node) {
+		if (!d || d->off + d->len != e->off ||
+				d->len + e->len > UBBD_WBUF_DESTAGE_MAX ||
+				d->iov_cnt == UBBD_WBUF_DESTAGE_IOV) {
+			/* the rest is left dirty for next pass */
+			d = calloc(1, sizeof(*d));
+			if (!d)
+				break;
+			d->off = e->off;
+			list_add_tail(&d->node, &pass->destages);
+			nr++;
+		}
+
+		d->iov[d->iov_cnt].iov_base = e->data;
+		d->iov[d->iov_cnt].iov_len = e->len;
+		d->iov_cnt++;
+		d->len += e->len;
+
+		e->destaging = true;
+		wb->nr_dirty--;
+		list_add_tail(&e->pass_node, &pass->extents);
+	}
+	wb->pass = pass;
+	pthread_mutex_unlock(&wb->lock);
+
+	list_for_each_entry_safe(req, tmp, &done, node) {
+		list_del_init(&req->node);
+		req->done(req, req->ret);
+	}
+
+	return nr;
+}
+
+/*
+ * Destaged extents are dropped, or left dirty if pass failed. Flushes
+ * not waiting for any extent left are done, all of them fail with ret.
+ */
+void ubbd_wbuf_destage_done(struct ubbd_wbuf *wb, struct ubbd_wbuf_pass *pass, int ret)
+{
+	struct ubbd_wbuf_extent *e, *e_tmp;
+	struct ubbd_wbuf_destage *d, *d_tmp;
+	struct ubbd_wbuf_req *req, *tmp;
+	uint64_t min_seq = UINT64_MAX;
+	LIST_HEAD(done);
+
+	pthread_mutex_lock(&wb->lock);
+	list_for_each_entry_safe(e, e_tmp, &pass->extents, pass_node) {
+		list_del_init(&e->pass_node);
+		e->destaging = false;
+		if (e->orphan) {
+			wbuf_extent_free(wb, e);
+			continue;
+		}
+
+		if (!ret) {
+			list_del(&e->node);
+			wbuf_extent_free(wb, e);
+			continue;
+		}
+
+		if (!wb->nr_dirty++)
+			wb->dirty_since_ns = wbuf_now();
+	}
+
+	list_for_each_entry_safe(d, d_tmp, &pass->destages, node) {
+		list_del(&d->node);
+		free(d);
+	}
+	wb->pass = NULL;
+
+	list_for_each_entry(e, &wb->index, node) {
+		if (e->seq < min_seq)
+			min_seq = e->seq;
+	}
+
+	list_for_each_entry_safe(req, tmp, &wb->flush_waiters, node) {
+		if (!ret && req->seq >= min_seq)
+			continue;
+		req->ret = ret;
+		list_move_tail(&req->node, &done);
+	}
+
+	if (!wb->dirty_bytes)
+		wbuf_journal_reset(wb);
+	pthread_mutex_unlock(&wb->lock);
+
+	list_for_each_entry_safe(req, tmp, &done, node) {
+		list_del_init(&req->node);
+		req->done(req, req->ret);
+	}
+}
+
+/* destager finishes the pending and dirty data, then ubbd_wbuf_wait_work() returns false */
+void ubbd_wbuf_stop(struct ubbd_wbuf *wb)
+{
+	pthread_mutex_lock(&wb->lock);
+	wb->stopping = true;
+	pthread_cond_signal(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "utils.h"
+#include "list.h"
+#include "ubbd_log.h"
+#include "ubbd_backend.h"
+#include "ubbd_worker.h"
+
+static void *worker_fn(void *arg)
+{
+	struct ubbd_worker_pool *pool = arg;
+	struct ubbd_backend_io *io;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (list_empty(&pool->ios) && !pool->stopping)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		/* finish queued ios before exit, queues are waiting for them */
+		if (list_empty(&pool->ios))
+			break;
+
+		io = list_first_entry(&pool->ios, struct ubbd_backend_io, node);
+		list_del_init(&io->node);
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = ubbd_backend_dispatch_io(pool->ubbd_b, io);
+		if (ret) {
+			ubbd_err("ret of backend_io: %lu:%u: %d\n", io->offset, io->len, ret);
+			ubbd_backend_io_finish(io, ret);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void worker_pool_stop(struct ubbd_worker_pool *pool, int nr_started)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < nr_started; i++)
+		pthread_join(pool->threads[i], NULL);
+}
+
+struct ubbd_worker_pool *ubbd_worker_pool_create(struct ubbd_backend *ubbd_b,
+		int nr_workers, const char *cpulist)
+{
+	struct ubbd_worker_pool *pool;
+	int ret;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		ubbd_err("failed to alloc worker pool\n");
+		return NULL;
+	}
+
+	pool->threads = calloc(nr_workers, sizeof(pthread_t));
+	if (!pool->threads) {
+		ubbd_err("failed to alloc worker threads\n");
+		goto free_pool;
+	}
+
+	if (cpulist && cpulist[0] != '\0') {
+		ret = ubbd_parse_cpulist(cpulist, &pool->cpuset);
+		if (ret) {
+			ubbd_err("invalid worker cpu list: %s\n", cpulist);
+			goto free_threads;
+		}
+		pool->has_cpuset = true;
+	}
+
+	pool->ubbd_b = ubbd_b;
+	pool->nr_workers = nr_workers;
+	INIT_LIST_HEAD(&pool->ios);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < nr_workers; i++) {
+		ret = pthread_create(&pool->threads[i], NULL, worker_fn, pool);
+		if (ret) {
+			ubbd_err("failed to create worker thread: %d\n", ret);
+			goto stop_workers;
+		}
+
+		if (pool->has_cpuset)
+			pthread_setaffinity_np(pool->threads[i], sizeof(cpu_set_t), &pool->cpuset);
+	}
+
+	ubbd_info("started %d workers\n", nr_workers);
+
+	return pool;
+
+stop_workers:
+	worker_pool_stop(pool, i);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+free_threads:
+	free(pool->threads);
+free_pool:
+	free(pool);
+
+	return NULL;
+}
+
+void ubbd_worker_pool_destroy(struct ubbd_worker_pool *pool)
+{
+	if (!pool)
+		return;
+
+	worker_pool_stop(pool, pool->nr_workers);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/* queue ios in one lock, and wake up as many workers as needed */
+void ubbd_worker_pool_queue(struct ubbd_worker_pool *pool,
+		struct ubbd_backend_io **ios, int nr)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < nr; i++)
+		list_add_tail(&ios[i]->node, &pool->ios);
+
+	if (nr == 1)
+		pthread_cond_signal(&pool->cond);
+	else
+		pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
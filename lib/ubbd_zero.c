@@ -0,0 +1,233 @@
+#include <string.h>
+
+#include "ubbd_zero.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_X86
+#endif
+
+#define ZERO_MIN(a, b)	((a) < (b) ? (a) : (b))
+
+typedef uint64_t __attribute__((__may_alias__)) zero_word_t;
+
+static bool zero_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const zero_word_t *w;
+
+	while (len && ((uintptr_t)p & (sizeof(zero_word_t) - 1))) {
+		if (*p)
+			return false;
+		p++;
+		len--;
+	}
+
+	/* or 8 words together, non-zero data is mostly found in the first ones */
+	for (w = (const zero_word_t *)p; len >= 8 * sizeof(zero_word_t);
+			w += 8, len -= 8 * sizeof(zero_word_t)) {
+		if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+			return false;
+	}
+
+	for (; len >= sizeof(zero_word_t); w++, len -= sizeof(zero_word_t)) {
+		if (*w)
+			return false;
+	}
+
+	for (p = (const unsigned char *)w; len; p++, len--) {
+		if (*p)
+			return false;
+	}
+
+	return true;
+}
+
+#ifdef ZERO_X86
+__attribute__((target("sse2")))
+static bool zero_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m128i acc;
+
+	while (len && ((uintptr_t)p & 15)) {
+		if (*p)
+			return false;
+		p++;
+		len--;
+	}
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_load_si128((const __m128i *)p),
+				_mm_load_si128((const __m128i *)(p + 16))),
+			_mm_or_si128(_mm_load_si128((const __m128i *)(p + 32)),
+				_mm_load_si128((const __m128i *)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+
+	return zero_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static bool zero_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i acc;
+
+	while (len && ((uintptr_t)p & 31)) {
+		if (*p)
+			return false;
+		p++;
+		len--;
+	}
+
+	for (; len >= 128; p += 128, len -= 128) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_load_si256((const __m256i *)p),
+				_mm256_load_si256((const __m256i *)(p + 32))),
+			_mm256_or_si256(_mm256_load_si256((const __m256i *)(p + 64)),
+				_mm256_load_si256((const __m256i *)(p + 96))));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+	}
+
+	return zero_scalar(p, len);
+}
+#endif
+
+bool ubbd_zero_impl_supported(int impl)
+{
+	switch (impl) {
+	case UBBD_ZERO_IMPL_SCALAR:
+		return true;
+#ifdef ZERO_X86
+	case UBBD_ZERO_IMPL_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case UBBD_ZERO_IMPL_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+const char *ubbd_zero_impl_name(int impl)
+{
+	switch (impl) {
+	case UBBD_ZERO_IMPL_SCALAR:
+		return "scalar";
+	case UBBD_ZERO_IMPL_SSE2:
+		return "sse2";
+	case UBBD_ZERO_IMPL_AVX2:
+		return "avx2";
+	default:
+		return "unknown";
+	}
+}
+
+/* impl must be supported */
+bool ubbd_buf_is_zero_impl(int impl, const void *buf, size_t len)
+{
+	switch (impl) {
+#ifdef ZERO_X86
+	case UBBD_ZERO_IMPL_SSE2:
+		return zero_sse2(buf, len);
+	case UBBD_ZERO_IMPL_AVX2:
+		return zero_avx2(buf, len);
+#endif
+	default:
+		return zero_scalar(buf, len);
+	}
+}
+
+/* best impl of this cpu, -1 before selected */
+static int zero_impl = -1;
+
+bool ubbd_buf_is_zero(const void *buf, size_t len)
+{
+	int impl = __atomic_load_n(&zero_impl, __ATOMIC_RELAXED);
+
+	if (impl < 0) {
+		for (impl = UBBD_ZERO_IMPL_MAX - 1; impl > UBBD_ZERO_IMPL_SCALAR; impl--) {
+			if (ubbd_zero_impl_supported(impl))
+				break;
+		}
+		__atomic_store_n(&zero_impl, impl, __ATOMIC_RELAXED);
+	}
+
+	return ubbd_buf_is_zero_impl(impl, buf, len);
+}
+
+struct zero_iov_iter {
+	const struct iovec	*iov;
+	int			iov_cnt;
+	int			i;
+	uint64_t		skip;
+};
+
+static void zero_iter_init(struct zero_iov_iter *it, const struct iovec *iov,
+		int iov_cnt, uint64_t skip)
+{
+	it->iov = iov;
+	it->iov_cnt = iov_cnt;
+	for (it->i = 0; it->i < iov_cnt && skip >= iov[it->i].iov_len; it->i++)
+		skip -= iov[it->i].iov_len;
+	it->skip = skip;
+}
+
+/* consume len bytes, return true if all of them are zero */
+static bool zero_iter_consume(struct zero_iov_iter *it, uint32_t len, bool check)
+{
+	bool zero = true;
+	uint64_t seg;
+
+	while (len && it->i < it->iov_cnt) {
+		seg = ZERO_MIN(it->iov[it->i].iov_len - it->skip, len);
+		if (zero && check)
+			zero = ubbd_buf_is_zero((const char *)it->iov[it->i].iov_base + it->skip, seg);
+
+		len -= seg;
+		it->skip += seg;
+		if (it->skip == it->iov[it->i].iov_len) {
+			it->i++;
+			it->skip = 0;
+		}
+	}
+
+	return zero;
+}
+
+/*
+ * Length of the run after skip in iov, at most len, made of either all
+ * zero blocks or of data only, *zero tells which. off is the device
+ * offset of skip, blocks are aligned to block in device. Pieces not
+ * covering a whole block are data.
+ */
+uint32_t ubbd_iov_zero_span(const struct iovec *iov, int iov_cnt, uint64_t skip,
+		uint32_t len, uint64_t off, uint32_t block, bool *zero)
+{
+	struct zero_iov_iter it;
+	uint32_t span = 0;
+	uint32_t piece;
+	bool piece_zero;
+
+	zero_iter_init(&it, iov, iov_cnt, skip);
+
+	while (span < len) {
+		piece = ZERO_MIN(block - (off + span) % block, len - span);
+		piece_zero = (piece == block && zero_iter_consume(&it, piece, true));
+		if (!span)
+			*zero = piece_zero;
+		else if (piece_zero != *zero)
+			break;
+
+		/* partial block is data, skip it without scan */
+		if (piece != block)
+			zero_iter_consume(&it, piece, false);
+		span += piece;
+	}
+
+	return span;
+}
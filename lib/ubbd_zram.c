@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ubbd_zram.h"
+#include "ubbd_split.h"
+
+#define ZRAM_MIN(a, b)	((a) < (b) ? (a) : (b))
+
+/* length of data in front of each chunk */
+#define ZRAM_CHUNK_HDR		sizeof(uint32_t)
+#define ZRAM_HUGE_CLASS		(UBBD_ZPOOL_CLASSES - 1)
+
+/* entry of a same filled page, chunks are aligned so bit 0 is free */
+#define ZRAM_ENTRY_SAME		1UL
+
+static inline bool zram_entry_same(void *entry)
+{
+	return (uintptr_t)entry & ZRAM_ENTRY_SAME;
+}
+
+static inline uint32_t zram_entry_word(void *entry)
+{
+	return (uintptr_t)entry >> 32;
+}
+
+static inline void *zram_same_entry(uint32_t word)
+{
+	return (void *)(((uintptr_t)word << 32) | ZRAM_ENTRY_SAME);
+}
+
+static uint32_t zpool_class(uint32_t size)
+{
+	if (size > UBBD_ZRAM_MAX_COMPR)
+		return ZRAM_HUGE_CLASS;
+
+	return (size - 1) / UBBD_ZPOOL_ALIGN;
+}
+
+int ubbd_zpool_init(struct ubbd_zpool *pool)
+{
+	struct ubbd_zpool_class *class;
+	int i;
+
+	for (i = 0; i < UBBD_ZPOOL_CLASSES; i++) {
+		class = &pool->classes[i];
+
+		pthread_mutex_init(&class->lock, NULL);
+		if (i == ZRAM_HUGE_CLASS)
+			class->size = (UBBD_ZRAM_PAGE_SIZE + ZRAM_CHUNK_HDR + UBBD_ZPOOL_ALIGN - 1) &
+				~(UBBD_ZPOOL_ALIGN - 1);
+		else
+			class->size = (i + 1) * UBBD_ZPOOL_ALIGN;
+		class->nr_chunks = (UBBD_ZPOOL_SLAB_SIZE - sizeof(struct ubbd_zpool_slab)) / class->size;
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->empty = NULL;
+	}
+	pool->nr_slabs = 0;
+
+	return 0;
+}
+
+static void zpool_free_slabs(struct list_head *list)
+{
+	struct ubbd_zpool_slab *slab, *next;
+
+	list_for_each_entry_safe(slab, next, list, node) {
+		list_del(&slab->node);
+		free(slab);
+	}
+}
+
+/* no chunk is used any more */
+void ubbd_zpool_exit(struct ubbd_zpool *pool)
+{
+	struct ubbd_zpool_class *class;
+	int i;
+
+	for (i = 0; i < UBBD_ZPOOL_CLASSES; i++) {
+		class = &pool->classes[i];
+
+		zpool_free_slabs(&class->partial);
+		zpool_free_slabs(&class->full);
+		free(class->empty);
+		pthread_mutex_destroy(&class->lock);
+	}
+}
+
+static struct ubbd_zpool_slab *zpool_slab_alloc(struct ubbd_zpool *pool, uint32_t index)
+{
+	struct ubbd_zpool_class *class = &pool->classes[index];
+	struct ubbd_zpool_slab *slab;
+	char *chunk;
+	uint32_t i;
+
+	if (posix_memalign((void **)&slab, UBBD_ZPOOL_SLAB_SIZE, UBBD_ZPOOL_SLAB_SIZE))
+		return NULL;
+
+	slab->class = index;
+	slab->nr_free = class->nr_chunks;
+	slab->free = NULL;
+
+	/* chained from the last, so chunks are used in address order */
+	chunk = (char *)(slab + 1) + (class->nr_chunks - 1) * class->size;
+	for (i = 0; i < class->nr_chunks; i++, chunk -= class->size) {
+		*(void **)chunk = slab->free;
+		slab->free = chunk;
+	}
+	__atomic_add_fetch(&pool->nr_slabs, 1, __ATOMIC_RELAXED);
+
+	return slab;
+}
+
+void *ubbd_zpool_alloc(struct ubbd_zpool *pool, uint32_t size)
+{
+	uint32_t index = zpool_class(size);
+	struct ubbd_zpool_class *class = &pool->classes[index];
+	struct ubbd_zpool_slab *slab;
+	void *chunk;
+
+	pthread_mutex_lock(&class->lock);
+	slab = list_first_entry_or_null(&class->partial, struct ubbd_zpool_slab, node);
+	if (!slab) {
+		slab = class->empty;
+		class->empty = NULL;
+		if (!slab)
+			slab = zpool_slab_alloc(pool, index);
+		if (!slab) {
+			pthread_mutex_unlock(&class->lock);
+			return NULL;
+		}
+		list_add(&slab->node, &class->partial);
+	}
+
+	chunk = slab->free;
+	slab->free = *(void **)chunk;
+	if (!--slab->nr_free)
+		list_move(&slab->node, &class->full);
+	pthread_mutex_unlock(&class->lock);
+
+	return chunk;
+}
+
+void ubbd_zpool_free(struct ubbd_zpool *pool, void *chunk)
+{
+	struct ubbd_zpool_slab *slab;
+	struct ubbd_zpool_class *class;
+	void *release = NULL;
+
+	slab = (struct ubbd_zpool_slab *)((uintptr_t)chunk & ~((uintptr_t)UBBD_ZPOOL_SLAB_SIZE - 1));
+	class = &pool->classes[slab->class];
+
+	pthread_mutex_lock(&class->lock);
+	*(void **)chunk = slab->free;
+	slab->free = chunk;
+	if (!slab->nr_free++)
+		list_move(&slab->node, &class->partial);
+
+	if (slab->nr_free == class->nr_chunks) {
+		list_del(&slab->node);
+		if (class->empty)
+			release = slab;
+		else
+			class->empty = slab;
+	}
+	pthread_mutex_unlock(&class->lock);
+
+	if (release) {
+		free(release);
+		__atomic_sub_fetch(&pool->nr_slabs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+int ubbd_zram_init(struct ubbd_zram *zram, uint64_t size, const struct ubbd_zram_compressor *comp)
+{
+	int ret;
+	int i;
+
+	zram->comp = comp;
+	zram->size = size;
+	ret = ubbd_blkmap_init(&zram->map,
+			(size + UBBD_ZRAM_PAGE_SIZE - 1) >> UBBD_ZRAM_PAGE_SHIFT);
+	if (ret)
+		return ret;
+
+	ubbd_zpool_init(&zram->pool);
+	for (i = 0; i < UBBD_ZRAM_SHARDS; i++)
+		pthread_mutex_init(&zram->locks[i], NULL);
+
+	zram->compr_pages = 0;
+	zram->huge_pages = 0;
+	zram->same_pages = 0;
+	zram->compr_bytes = 0;
+
+	return 0;
+}
+
+static void zram_entry_noop(void *entry, void *arg)
+{
+	return;
+}
+
+void ubbd_zram_exit(struct ubbd_zram *zram)
+{
+	int i;
+
+	/* chunks go with the slabs of pool */
+	ubbd_blkmap_exit(&zram->map, zram_entry_noop, NULL);
+	ubbd_zpool_exit(&zram->pool);
+	for (i = 0; i < UBBD_ZRAM_SHARDS; i++)
+		pthread_mutex_destroy(&zram->locks[i]);
+}
+
+bool ubbd_zram_page_same(const void *page, uint32_t *word)
+{
+	const uint32_t *p = page;
+	int i;
+
+	for (i = 1; i < UBBD_ZRAM_PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p[i] != p[0])
+			return false;
+	}
+	*word = p[0];
+
+	return true;
+}
+
+static void zram_entry_free(struct ubbd_zram *zram, void *entry)
+{
+	uint32_t len;
+
+	if (!entry)
+		return;
+
+	if (zram_entry_same(entry)) {
+		__atomic_sub_fetch(&zram->same_pages, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	len = *(uint32_t *)entry;
+	if (len == UBBD_ZRAM_PAGE_SIZE)
+		__atomic_sub_fetch(&zram->huge_pages, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&zram->compr_pages, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&zram->compr_bytes, len, __ATOMIC_RELAXED);
+	ubbd_zpool_free(&zram->pool, entry);
+}
+
+/* lock of page is held */
+static int zram_read_page(struct ubbd_zram *zram, uint64_t index, void *page, void *comp_ctx)
+{
+	void **slot = ubbd_blkmap_slot(&zram->map, index, false);
+	void *entry = slot ? *slot : NULL;
+	uint32_t word;
+	uint32_t len;
+	int i;
+
+	if (!entry) {
+		memset(page, 0, UBBD_ZRAM_PAGE_SIZE);
+		return 0;
+	}
+
+	if (zram_entry_same(entry)) {
+		word = zram_entry_word(entry);
+		for (i = 0; i < UBBD_ZRAM_PAGE_SIZE / sizeof(uint32_t); i++)
+			((uint32_t *)page)[i] = word;
+		return 0;
+	}
+
+	len = *(uint32_t *)entry;
+	if (len == UBBD_ZRAM_PAGE_SIZE) {
+		memcpy(page, (char *)entry + ZRAM_CHUNK_HDR, UBBD_ZRAM_PAGE_SIZE);
+		return 0;
+	}
+
+	return zram->comp->decompress(comp_ctx, (char *)entry + ZRAM_CHUNK_HDR, len, page);
+}
+
+/* lock of page is held */
+static int zram_write_page(struct ubbd_zram *zram, uint64_t index, const void *page, void *comp_ctx)
+{
+	char dst[UBBD_ZRAM_MAX_COMPR];
+	const void *data = dst;
+	void **slot;
+	void *entry;
+	uint32_t word;
+	int len;
+
+	slot = ubbd_blkmap_slot(&zram->map, index, true);
+	if (!slot)
+		return -ENOMEM;
+
+	if (ubbd_zram_page_same(page, &word)) {
+		entry = zram_same_entry(word);
+		__atomic_add_fetch(&zram->same_pages, 1, __ATOMIC_RELAXED);
+		goto set;
+	}
+
+	len = zram->comp->compress(comp_ctx, page, dst, UBBD_ZRAM_MAX_COMPR - ZRAM_CHUNK_HDR);
+	if (len <= 0) {
+		data = page;
+		len = UBBD_ZRAM_PAGE_SIZE;
+	}
+
+	entry = ubbd_zpool_alloc(&zram->pool, len + ZRAM_CHUNK_HDR);
+	if (!entry)
+		return -ENOMEM;
+
+	*(uint32_t *)entry = len;
+	memcpy((char *)entry + ZRAM_CHUNK_HDR, data, len);
+	if (len == UBBD_ZRAM_PAGE_SIZE)
+		__atomic_add_fetch(&zram->huge_pages, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&zram->compr_pages, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&zram->compr_bytes, len, __ATOMIC_RELAXED);
+
+set:
+	zram_entry_free(zram, *slot);
+	*slot = entry;
+
+	return 0;
+}
+
+static void zram_drop_page(struct ubbd_zram *zram, uint64_t index)
+{
+	void **slot = ubbd_blkmap_slot(&zram->map, index, false);
+
+	if (!slot)
+		return;
+
+	zram_entry_free(zram, *slot);
+	*slot = NULL;
+}
+
+int ubbd_zram_read(struct ubbd_zram *zram, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, void *comp_ctx)
+{
+	char page[UBBD_ZRAM_PAGE_SIZE] __attribute__((aligned(64)));
+	uint32_t off_in_page, seg, done;
+	pthread_mutex_t *lock;
+	uint64_t index;
+	int ret;
+
+	for (done = 0; done < len; done += seg, off += seg) {
+		index = off >> UBBD_ZRAM_PAGE_SHIFT;
+		off_in_page = off & (UBBD_ZRAM_PAGE_SIZE - 1);
+		seg = ZRAM_MIN(len - done, UBBD_ZRAM_PAGE_SIZE - off_in_page);
+
+		lock = &zram->locks[index % UBBD_ZRAM_SHARDS];
+		pthread_mutex_lock(lock);
+		ret = zram_read_page(zram, index, page, comp_ctx);
+		pthread_mutex_unlock(lock);
+		if (ret)
+			return ret;
+
+		ubbd_buf_to_iov(page + off_in_page, seg, iov, iov_cnt, done);
+	}
+
+	return 0;
+}
+
+int ubbd_zram_write(struct ubbd_zram *zram, uint64_t off, uint32_t len,
+		const struct iovec *iov, int iov_cnt, void *comp_ctx)
+{
+	char page[UBBD_ZRAM_PAGE_SIZE] __attribute__((aligned(64)));
+	uint32_t off_in_page, seg, done;
+	pthread_mutex_t *lock;
+	uint64_t index;
+	int ret = 0;
+
+	for (done = 0; done < len; done += seg, off += seg) {
+		index = off >> UBBD_ZRAM_PAGE_SHIFT;
+		off_in_page = off & (UBBD_ZRAM_PAGE_SIZE - 1);
+		seg = ZRAM_MIN(len - done, UBBD_ZRAM_PAGE_SIZE - off_in_page);
+
+		lock = &zram->locks[index % UBBD_ZRAM_SHARDS];
+		pthread_mutex_lock(lock);
+		if (seg < UBBD_ZRAM_PAGE_SIZE)
+			ret = zram_read_page(zram, index, page, comp_ctx);
+		if (!ret) {
+			ubbd_iov_to_buf(iov, iov_cnt, done, page + off_in_page, seg);
+			ret = zram_write_page(zram, index, page, comp_ctx);
+		}
+		pthread_mutex_unlock(lock);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* whole pages in range are dropped, part of pages at head and tail zeroed */
+int ubbd_zram_discard(struct ubbd_zram *zram, uint64_t off, uint32_t len, void *comp_ctx)
+{
+	char page[UBBD_ZRAM_PAGE_SIZE] __attribute__((aligned(64)));
+	uint32_t off_in_page, seg, done;
+	pthread_mutex_t *lock;
+	uint64_t index;
+	int ret = 0;
+
+	for (done = 0; done < len; done += seg, off += seg) {
+		index = off >> UBBD_ZRAM_PAGE_SHIFT;
+		off_in_page = off & (UBBD_ZRAM_PAGE_SIZE - 1);
+		seg = ZRAM_MIN(len - done, UBBD_ZRAM_PAGE_SIZE - off_in_page);
+
+		lock = &zram->locks[index % UBBD_ZRAM_SHARDS];
+		pthread_mutex_lock(lock);
+		if (seg == UBBD_ZRAM_PAGE_SIZE) {
+			zram_drop_page(zram, index);
+		} else {
+			ret = zram_read_page(zram, index, page, comp_ctx);
+			if (!ret) {
+				memset(page + off_in_page, 0, seg);
+				ret = zram_write_page(zram, index, page, comp_ctx);
+			}
+		}
+		pthread_mutex_unlock(lock);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void ubbd_zram_get_stats(struct ubbd_zram *zram, struct ubbd_zram_stats *stats)
+{
+	stats->compr_pages = __atomic_load_n(&zram->compr_pages, __ATOMIC_RELAXED);
+	stats->huge_pages = __atomic_load_n(&zram->huge_pages, __ATOMIC_RELAXED);
+	stats->same_pages = __atomic_load_n(&zram->same_pages, __ATOMIC_RELAXED);
+	stats->orig_bytes = (stats->compr_pages + stats->huge_pages + stats->same_pages) <<
+		UBBD_ZRAM_PAGE_SHIFT;
+	stats->compr_bytes = __atomic_load_n(&zram->compr_bytes, __ATOMIC_RELAXED);
+	stats->mem_used = __atomic_load_n(&zram->pool.nr_slabs, __ATOMIC_RELAXED) *
+		UBBD_ZPOOL_SLAB_SIZE;
+}
@@ -164,3 +164,46 @@ int ubbd_rmdirs(const char *pathname, const char *remain)
 
 	return ret;
 }
+
+/* parse cpu list in format of "0-3,8,10-11" */
+int ubbd_parse_cpulist(const char *cpulist, cpu_set_t *cpuset)
+{
+	const char *p = cpulist;
+	unsigned long start, end, cpu;
+	char *endp;
+
+	CPU_ZERO(cpuset);
+
+	while (*p) {
+		errno = 0;
+		start = strtoul(p, &endp, 10);
+		if (errno || endp == p)
+			return -EINVAL;
+		end = start;
+		p = endp;
+
+		if (*p == '-') {
+			p++;
+			end = strtoul(p, &endp, 10);
+			if (errno || endp == p || end < start)
+				return -EINVAL;
+			p = endp;
+		}
+
+		if (end >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (cpu = start; cpu <= end; cpu++)
+			CPU_SET(cpu, cpuset);
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -EINVAL;
+	}
+
+	if (!CPU_COUNT(cpuset))
+		return -EINVAL;
+
+	return 0;
+}
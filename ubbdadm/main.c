@@ -47,8 +47,30 @@ static struct option const long_options[] =
 	{"dev-share-memory-size", required_argument, NULL, 0},
 	{"num-queues", required_argument, NULL, 0},
 	{"read-only", no_argument, NULL, 0},
+	{"poll-mode", required_argument, NULL, 0},
+	{"poll-spin-us", required_argument, NULL, 0},
+	{"completion-batch", required_argument, NULL, 0},
+	{"completion-batch-us", required_argument, NULL, 0},
+	{"worker-threads", required_argument, NULL, 0},
+	{"worker-cpus", required_argument, NULL, 0},
+	{"merge-max-kb", required_argument, NULL, 0},
+	{"queue-engine", required_argument, NULL, 0},
+	{"steal-policy", required_argument, NULL, 0},
+	{"read-cache-mb", required_argument, NULL, 0},
+	{"write-back-mb", required_argument, NULL, 0},
+	{"write-back-age-ms", required_argument, NULL, 0},
+	{"write-back-journal", required_argument, NULL, 0},
+	{"zero-detect", no_argument, NULL, 0},
+	{"qos-iops", required_argument, NULL, 0},
+	{"qos-bps", required_argument, NULL, 0},
+	{"qos-read-iops", required_argument, NULL, 0},
+	{"qos-read-bps", required_argument, NULL, 0},
+	{"qos-write-iops", required_argument, NULL, 0},
+	{"qos-write-bps", required_argument, NULL, 0},
+	{"qos-burst-ms", required_argument, NULL, 0},
 
 	UBBD_MAP_OPT(file, filepath)
+	UBBD_MAP_OPT(file, io-engine)
 
 	UBBD_MAP_OPT(rbd, pool)
 	UBBD_MAP_OPT(rbd, ns)
@@ -72,6 +94,13 @@ static struct option const long_options[] =
 	UBBD_MAP_OPT(s3, volume-name)
 	UBBD_MAP_OPT(s3, bucket-name)
 
+	UBBD_MAP_OPT(mem, block-size)
+	UBBD_MAP_OPT(mem, limit-mb)
+	UBBD_MAP_OPT(mem, backing)
+	UBBD_MAP_OPT(mem, numa-node)
+
+	UBBD_MAP_OPT(zram, comp)
+
 	UBBD_MAP_OPT(cache, mode)
 
 	{"help", no_argument, NULL, 'h'},
@@ -98,7 +127,7 @@ static void usage(int status)
 		fprintf(stderr, "Try `ubbdadm --help' for more information.\n");
 	else {
 		printf("Usage:\n");
-		printf("\tubbdadm <map|unmap|list|info|config|req-stats|req-stats-reset|dev-restart> [options]\n\n");
+		printf("\tubbdadm <map|unmap|list|info|config|req-stats|req-stats-reset|dev-restart|set-qos> [options]\n\n");
 
 		/* generic options */
 		printf("\n\t[generic options]:\n");
@@ -123,19 +152,44 @@ static void usage(int status)
 		printf("\n\t[dev-restart options ]\n");
 		print_opt_msg("restart-mode", "mode to restart device: dev, queue, default");
 
+		/* set-qos options, also work for map */
+		printf("\n\t[set-qos options]:\n");
+		print_opt_msg("qos-iops", "max iops of the device, default is 0: no limit");
+		print_opt_msg("qos-bps", "max bytes per second of the device, default is 0: no limit");
+		print_opt_msg("qos-read-iops", "max read iops of the device, default is 0: no limit");
+		print_opt_msg("qos-read-bps", "max read bytes per second of the device, default is 0: no limit");
+		print_opt_msg("qos-write-iops", "max write iops (including discard and write-zeros) of the device, default is 0: no limit");
+		print_opt_msg("qos-write-bps", "max write bytes per second of the device, default is 0: no limit");
+		print_opt_msg("qos-burst-ms", "milliseconds of each limit can be saved up for burst, default is 1000");
+
 		/* map options */
 		printf("\n\t[map options]:\n");
 
-		print_map_opt_msg("type", "device type for mapping: file, rbd, null, mem, ssh (Experimental), cache (Experimental), s3 (Experimental)");
+		print_map_opt_msg("type", "device type for mapping: file, rbd, null, mem, zram, ssh (Experimental), cache (Experimental), s3 (Experimental)");
 		print_map_opt_msg("devsize", "size of device to map, --devsize is required except rbd and file type");
 		print_map_opt_msg("io-timeout", "timeout before IO fail, default as 0 means no timeout.");
 		print_opt_msg("dev-share-memory-size", "share memory for each queue between userspace and kernel space, range is [4194304 (4M) - 1073741824 (1G)].");
 		print_opt_msg("num-queues", "number of queues for block layer multiqueue");
 		print_opt_msg("read-only", "map a read only device");
+		print_opt_msg("poll-mode", "how queue waits for new requests: interrupt (default), busy, hybrid");
+		print_opt_msg("poll-spin-us", "spin budget in microseconds before sleeping in hybrid poll mode, default is 50");
+		print_opt_msg("completion-batch", "max completions published with one doorbell, 1 means no batching, default is 32");
+		print_opt_msg("completion-batch-us", "max microseconds a completion waits for its batch to close, default is 20");
+		print_opt_msg("worker-threads", "threads running io of blocking backends (file, ssh, s3), default is 0: io runs in queue thread");
+		print_opt_msg("worker-cpus", "cpu list of worker threads, e.g. 0-3,8");
+		print_opt_msg("queue-engine", "poll or io_uring, default is poll, io_uring falls back to poll if kernel does not support it");
+		print_opt_msg("merge-max-kb", "max KiB of a backend io merged from contiguous reads or writes, default is 0: no merge");
+		print_opt_msg("steal-policy", "none (default), idle or always: queues dispatch requests of busy sibling queues");
+		print_opt_msg("read-cache-mb", "MiB of memory caching reads in backend, default is 0: no read cache");
+		print_opt_msg("write-back-mb", "MiB of memory buffering writes in backend, default is 0: write through");
+		print_opt_msg("write-back-age-ms", "max age of buffered writes before written to backend, default is 1000");
+		print_opt_msg("write-back-journal", "file to journal buffered writes, replayed when backend starts again");
+		print_opt_msg("zero-detect", "send all-zero blocks of writes to backend as write-zeros");
 
 		printf("\n");
 
 		print_map_opt_msg("file-filepath", "file path for file type mapping");
+		print_map_opt_msg("file-io-engine", "io engine of file type: io_uring, sync or libaio, default is io_uring, which is sync without io_uring queue engine");
 
 		printf("\n");
 
@@ -167,10 +221,45 @@ static void usage(int status)
 
 		printf("\n");
 
+		print_map_opt_msg("mem-block-size", "memory of mem type is allocated in block of this size, power of 2 in [4096, 2097152], default is 1048576");
+		print_map_opt_msg("mem-limit-mb", "MiB of memory for blocks of mem type, writes needing more fail with ENOSPC, default is 0: no limit");
+		print_map_opt_msg("mem-backing", "memory of mem type: heap, shm (kept over backend restart) or hugetlb (2MiB pages), default is heap");
+		print_map_opt_msg("mem-numa-node", "numa node of memory of shm or hugetlb backing, default is any node");
+
+		printf("\n");
+
+		print_map_opt_msg("zram-comp", "compressor of pages of zram type: lz4 or zstd, default is lz4 if ubbd is built with it");
+
+		printf("\n");
+
 		print_opt_msg("cache-mode", "cache mode for cache type mapping: writeback, writethrough");
 	}
 }
 
+static int parse_qos_options(struct ubbd_qos_opts *qos, const char *name, char *optarg)
+{
+	if (!strcmp(name, "iops")) {
+		qos->limits[UBBD_QOS_IOPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "bps")) {
+		qos->limits[UBBD_QOS_BPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "read-iops")) {
+		qos->limits[UBBD_QOS_READ_IOPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "read-bps")) {
+		qos->limits[UBBD_QOS_READ_BPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "write-iops")) {
+		qos->limits[UBBD_QOS_WRITE_IOPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "write-bps")) {
+		qos->limits[UBBD_QOS_WRITE_BPS] = strtoull(optarg, NULL, 10);
+	} else if (!strcmp(name, "burst-ms")) {
+		qos->burst_ms = atoi(optarg);
+	} else {
+		printf("unrecognized qos option: %s\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int parse_map_options(struct __ubbd_map_opts *opts, const char *name, char *optarg)
 {
 	if (!strcmp(name, "type")) {
@@ -181,6 +270,8 @@ static int parse_map_options(struct __ubbd_map_opts *opts, const char *name, cha
 		opts->io_timeout = atoll(optarg);
 	} else if (!strcmp(name, "file-filepath")) {
 		opts->file.filepath = optarg;
+	} else if (!strcmp(name, "file-io-engine")) {
+		opts->file.io_engine = optarg;
 	} else if (!strcmp(name, "rbd-pool")) {
 		opts->rbd.pool = optarg;
 	} else if (!strcmp(name, "rbd-ns")) {
@@ -219,6 +310,16 @@ static int parse_map_options(struct __ubbd_map_opts *opts, const char *name, cha
 		opts->s3.port = atoi(optarg);
 	} else if (!strcmp(name, "s3-block-size")) {
 		opts->s3.block_size = atoi(optarg);
+	} else if (!strcmp(name, "mem-block-size")) {
+		opts->mem.block_size = atoi(optarg);
+	} else if (!strcmp(name, "mem-limit-mb")) {
+		opts->mem.limit_mb = atoi(optarg);
+	} else if (!strcmp(name, "mem-backing")) {
+		opts->mem.backing = optarg;
+	} else if (!strcmp(name, "mem-numa-node")) {
+		opts->mem.numa_node = optarg;
+	} else if (!strcmp(name, "zram-comp")) {
+		opts->zram.comp = optarg;
 	} else {
 		printf("unrecognized option: %s\n", name);
 		return -1;
@@ -238,6 +339,8 @@ static char *type_to_str(enum ubbd_dev_type type)
 		return "null";
 	else if (type == UBBD_DEV_TYPE_MEM)
 		return "mem";
+	else if (type == UBBD_DEV_TYPE_ZRAM)
+		return "zram";
 	else if (type == UBBD_DEV_TYPE_SSH)
 		return "ssh";
 	else if (type == UBBD_DEV_TYPE_CACHE)
@@ -249,12 +352,53 @@ static char *type_to_str(enum ubbd_dev_type type)
 }
 
 
+static void output_qos_info(struct ubbd_qos_opts *qos)
+{
+	int i;
+
+	for (i = 0; i < UBBD_QOS_MAX; i++) {
+		if (qos->limits[i])
+			break;
+	}
+
+	if (i == UBBD_QOS_MAX)
+		return;
+
+	printf("\tqos_iops: %lu\n", qos->limits[UBBD_QOS_IOPS]);
+	printf("\tqos_bps: %lu\n", qos->limits[UBBD_QOS_BPS]);
+	printf("\tqos_read_iops: %lu\n", qos->limits[UBBD_QOS_READ_IOPS]);
+	printf("\tqos_read_bps: %lu\n", qos->limits[UBBD_QOS_READ_BPS]);
+	printf("\tqos_write_iops: %lu\n", qos->limits[UBBD_QOS_WRITE_IOPS]);
+	printf("\tqos_write_bps: %lu\n", qos->limits[UBBD_QOS_WRITE_BPS]);
+	printf("\tqos_burst_ms: %u\n", qos->burst_ms);
+}
+
 static void output_dev_generic_info(struct ubbdd_mgmt_rsp *rsp)
 {
 	printf("UBBD: /dev/ubbd%d:\n", rsp->dev_info.devid);
 	printf("\ttype: %s\n", type_to_str(rsp->dev_info.dev_info.type));
 	printf("\tqueues: %u\n", rsp->dev_info.dev_info.num_queues);
 	printf("\tread_only: %u\n", rsp->dev_info.dev_info.read_only);
+	printf("\tpoll_mode: %s\n", ubbd_poll_mode_to_str(rsp->dev_info.dev_info.queue_opts.poll_mode));
+	if (rsp->dev_info.dev_info.queue_opts.poll_mode == UBBD_POLL_MODE_HYBRID)
+		printf("\tpoll_spin_us: %u\n", rsp->dev_info.dev_info.queue_opts.poll_spin_us);
+	printf("\tcompletion_batch: %u\n", rsp->dev_info.dev_info.queue_opts.ce_batch);
+	printf("\tcompletion_batch_us: %u\n", rsp->dev_info.dev_info.queue_opts.ce_batch_us);
+	printf("\tworker_threads: %u\n", rsp->dev_info.dev_info.queue_opts.worker_threads);
+	if (rsp->dev_info.dev_info.queue_opts.worker_cpus[0] != '\0')
+		printf("\tworker_cpus: %s\n", rsp->dev_info.dev_info.queue_opts.worker_cpus);
+	printf("\tmerge_max_kb: %u\n", rsp->dev_info.dev_info.queue_opts.merge_max_kb);
+	printf("\tqueue_engine: %s\n", ubbd_queue_engine_to_str(rsp->dev_info.dev_info.queue_opts.engine));
+	printf("\tsteal_policy: %s\n", ubbd_steal_policy_to_str(rsp->dev_info.dev_info.queue_opts.steal_policy));
+	printf("\tread_cache_mb: %u\n", rsp->dev_info.dev_info.queue_opts.read_cache_mb);
+	if (rsp->dev_info.dev_info.queue_opts.write_back_mb) {
+		printf("\twrite_back_mb: %u\n", rsp->dev_info.dev_info.queue_opts.write_back_mb);
+		printf("\twrite_back_age_ms: %u\n", rsp->dev_info.dev_info.queue_opts.write_back_age_ms);
+		if (rsp->dev_info.dev_info.queue_opts.write_back_journal[0] != '\0')
+			printf("\twrite_back_journal: %s\n", rsp->dev_info.dev_info.queue_opts.write_back_journal);
+	}
+	printf("\tzero_detect: %u\n", rsp->dev_info.dev_info.queue_opts.zero_detect);
+	output_qos_info(&rsp->dev_info.dev_info.queue_opts.qos);
 	printf("\tsize: %lu\n\n",	rsp->dev_info.dev_info.generic_dev.info.size);
 }
 
@@ -265,6 +409,7 @@ static int __output_dev_info_detail(struct __ubbd_dev_info *dev_info)
 
 	if (dev_type == UBBD_DEV_TYPE_FILE) {
 		printf("\tfilepath: %s\n", dev_info->file.path);
+		printf("\tio_engine: %s\n", ubbd_file_io_engine_to_str(dev_info->file.io_engine));
 	} else if (dev_type == UBBD_DEV_TYPE_RBD) {
 		printf("\tceph_conf: %s\n", dev_info->rbd.ceph_conf);
 		printf("\tpool: %s\n", dev_info->rbd.pool);
@@ -278,6 +423,13 @@ static int __output_dev_info_detail(struct __ubbd_dev_info *dev_info)
 		printf("\tquiesce_hook: %s\n", dev_info->rbd.quiesce_hook);
 	} else if (dev_type == UBBD_DEV_TYPE_NULL) {
 	} else if (dev_type == UBBD_DEV_TYPE_MEM) {
+		printf("\tblock_size: %u\n", dev_info->mem.block_size);
+		printf("\tlimit_mb: %u\n", dev_info->mem.limit_mb);
+		printf("\tbacking: %s\n", ubbd_mem_backing_to_str(dev_info->mem.backing));
+		if (dev_info->mem.backing != UBBD_MEM_BACKING_HEAP)
+			printf("\tnuma_node: %d\n", dev_info->mem.numa_node);
+	} else if (dev_type == UBBD_DEV_TYPE_ZRAM) {
+		printf("\tcomp: %s\n", ubbd_zram_comp_to_str(dev_info->zram.comp));
 	} else if (dev_type == UBBD_DEV_TYPE_SSH) {
 		printf("\thostname: %s\n", dev_info->ssh.hostname);
 		printf("\tpath: %s\n", dev_info->ssh.path);
@@ -299,6 +451,7 @@ static int __output_dev_info_detail(struct __ubbd_dev_info *dev_info)
 
 static int output_dev_info_detail(int dev_type, struct ubbdd_mgmt_rsp_dev_info *mgmt_dev_info)
 {
+	struct ubbd_backend_stats *stats = &mgmt_dev_info->backend_stats;
 	int ret = 0;
 
 	if (dev_type == UBBD_DEV_TYPE_CACHE) {
@@ -314,6 +467,27 @@ static int output_dev_info_detail(int dev_type, struct ubbdd_mgmt_rsp_dev_info *
 		ret = __output_dev_info_detail(&mgmt_dev_info->dev_info.generic_dev.info);
 	}
 
+	if (ret || !mgmt_dev_info->backend_stats.valid)
+		goto out;
+
+	if (dev_type == UBBD_DEV_TYPE_MEM) {
+		printf("\tblocks: %lu\n", stats->mem.nr_blocks);
+		printf("\tresident_bytes: %lu\n", stats->mem.resident_bytes);
+	} else if (dev_type == UBBD_DEV_TYPE_ZRAM) {
+		printf("\tcompr_pages: %lu\n", stats->zram.compr_pages);
+		printf("\tsame_pages: %lu\n", stats->zram.same_pages);
+		printf("\thuge_pages: %lu\n", stats->zram.huge_pages);
+		printf("\torig_bytes: %lu\n", stats->zram.orig_bytes);
+		printf("\tcompr_bytes: %lu\n", stats->zram.compr_bytes);
+		printf("\tmem_used: %lu\n", stats->zram.mem_used);
+		/* same filled pages take no memory, ratio of them alone is infinite */
+		if (stats->zram.mem_used)
+			printf("\tcompr_ratio: %.2f\n",
+					(double)stats->zram.orig_bytes / stats->zram.mem_used);
+		printf("\tsaved_bytes: %lu\n", stats->zram.orig_bytes > stats->zram.mem_used ?
+				stats->zram.orig_bytes - stats->zram.mem_used : 0);
+	}
+
 out:
 	return ret;
 }
@@ -366,6 +540,53 @@ int main(int argc, char **argv)
 			} else if (!strcmp(long_options[longindex].name, "read-only")) {
 				opts.read_only = true;
 				break;
+			} else if (!strcmp(long_options[longindex].name, "poll-mode")) {
+				opts.poll_mode = optarg;
+				break;
+			} else if (!strcmp(long_options[longindex].name, "poll-spin-us")) {
+				opts.poll_spin_us = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "completion-batch")) {
+				opts.ce_batch = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "completion-batch-us")) {
+				opts.ce_batch_us = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "worker-threads")) {
+				opts.worker_threads = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "worker-cpus")) {
+				opts.worker_cpus = optarg;
+				break;
+			} else if (!strcmp(long_options[longindex].name, "merge-max-kb")) {
+				opts.merge_max_kb = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "queue-engine")) {
+				opts.queue_engine = optarg;
+				break;
+			} else if (!strcmp(long_options[longindex].name, "steal-policy")) {
+				opts.steal_policy = optarg;
+				break;
+			} else if (!strcmp(long_options[longindex].name, "read-cache-mb")) {
+				opts.read_cache_mb = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "write-back-mb")) {
+				opts.write_back_mb = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "write-back-age-ms")) {
+				opts.write_back_age_ms = atoi(optarg);
+				break;
+			} else if (!strcmp(long_options[longindex].name, "write-back-journal")) {
+				opts.write_back_journal = optarg;
+				break;
+			} else if (!strcmp(long_options[longindex].name, "zero-detect")) {
+				opts.zero_detect = true;
+				break;
+			} else if (!strncmp(long_options[longindex].name, "qos-", 4)) {
+				ret = parse_qos_options(&opts.qos, long_options[longindex].name + 4, optarg);
+				if (ret)
+					return -1;
+				break;
 			} else if (!strcmp(long_options[longindex].name, "type")) {
 				opts.type = optarg;
 				break;
@@ -461,17 +682,52 @@ int main(int argc, char **argv)
 	} else if (!strcmp("req-stats", command)) {
 		struct ubbd_req_stats_options req_stats_opts = { .ubbdid = ubbdid };
 		struct ubbd_req_stats *req_stats;
-		int i;
+		struct ubbd_req_lat_stats *lat;
+		int i, op;
 
-		ret = ubbd_req_stats(&req_stats_opts, &rsp);
-		if (ret)
-			goto out;
+		/* stats are fetched one queue per request to keep responses small */
+		for (i = 0; i == 0 || i < rsp.req_stats.num_queues; i++) {
+			req_stats_opts.queue_id = i;
+			ret = ubbd_req_stats(&req_stats_opts, &rsp);
+			if (ret)
+				goto out;
 
-		for (i = 0; i < rsp.req_stats.num_queues; i++) {
-			req_stats = &rsp.req_stats.req_stats[i];
+			req_stats = &rsp.req_stats.req_stats;
 			fprintf(stdout, "Queue-%d:\n", i);
-			fprintf(stdout, "\tRequests:%lu\n", req_stats->reqs);
-			fprintf(stdout, "\tHandle_time_avg:%lu\n", req_stats->reqs? req_stats->handle_time / req_stats->reqs : 0);
+			for (op = 0; op < UBBD_REQ_STATS_OP_MAX; op++) {
+				lat = &req_stats->lat[op];
+				if (!lat->reqs)
+					continue;
+				fprintf(stdout, "\tLatency_%s(ns):reqs:%lu avg:%lu p50:%lu p99:%lu p99.9:%lu\n",
+						ubbd_req_stats_op_to_str(op), lat->reqs, lat->total_ns / lat->reqs,
+						lat->p50, lat->p99, lat->p999);
+			}
+			fprintf(stdout, "\tPoll_spin_time:%lu\n", req_stats->poll_spin_time);
+			fprintf(stdout, "\tPoll_spin_hits:%lu\n", req_stats->poll_spin_hits);
+			fprintf(stdout, "\tPoll_sleeps:%lu\n", req_stats->poll_sleeps);
+			fprintf(stdout, "\tCompletion_batches:%lu\n", req_stats->ce_batches);
+			fprintf(stdout, "\tCompletion_batch_avg:%lu\n", req_stats->ce_batches? req_stats->ce_batched / req_stats->ce_batches : 0);
+			fprintf(stdout, "\tCompletion_ring_full:%lu\n", req_stats->ce_ring_full);
+			fprintf(stdout, "\tCompletion_ring_full_time:%lu\n", req_stats->ce_ring_full_time);
+			fprintf(stdout, "\tReq_pool_miss:%lu\n", req_stats->req_pool_miss);
+			fprintf(stdout, "\tSubmit_batches:%lu\n", req_stats->submit_batches);
+			fprintf(stdout, "\tSubmit_batch_avg:%lu\n", req_stats->submit_batches? req_stats->submit_batched / req_stats->submit_batches : 0);
+			fprintf(stdout, "\tMerged_ios:%lu\n", req_stats->merged_ios);
+			fprintf(stdout, "\tMerged_requests:%lu\n", req_stats->merged_reqs);
+			fprintf(stdout, "\tQos_throttled:%lu\n", req_stats->qos_throttled);
+			fprintf(stdout, "\tQos_throttle_time:%lu\n", req_stats->qos_throttle_time);
+			fprintf(stdout, "\tBusy_time:%lu\n", req_stats->busy_time);
+			fprintf(stdout, "\tIdle_time:%lu\n", req_stats->idle_time);
+			fprintf(stdout, "\tStolen_ios:%lu\n", req_stats->stolen_ios);
+			fprintf(stdout, "\tSplit_ios:%lu\n", req_stats->split_ios);
+			fprintf(stdout, "\tSplit_children:%lu\n", req_stats->split_children);
+			fprintf(stdout, "\tRead_cache_hits:%lu\n", req_stats->rcache_hits);
+			fprintf(stdout, "\tRead_cache_misses:%lu\n", req_stats->rcache_misses);
+			fprintf(stdout, "\tWrite_back_writes:%lu\n", req_stats->wbuf_writes);
+			fprintf(stdout, "\tWrite_back_throttled:%lu\n", req_stats->wbuf_throttled);
+			fprintf(stdout, "\tWrite_back_read_hits:%lu\n", req_stats->wbuf_read_hits);
+			fprintf(stdout, "\tZero_detect_writes:%lu\n", req_stats->zero_writes);
+			fprintf(stdout, "\tZero_detect_bytes:%lu\n", req_stats->zero_bytes);
 		}
 	} else if (!strcmp("req-stats-reset", command)) {
 		struct ubbd_req_stats_reset_options req_stats_reset_opts = { .ubbdid = ubbdid };
@@ -490,6 +746,11 @@ int main(int argc, char **argv)
 			goto out;
 
 		ret = output_dev_info(&rsp);
+	} else if (!strcmp("set-qos", command)) {
+		struct ubbd_set_qos_options set_qos_opts = { .ubbdid = ubbdid };
+
+		memcpy(&set_qos_opts.qos, &opts.qos, sizeof(struct ubbd_qos_opts));
+		ret = ubbd_set_qos(&set_qos_opts, &rsp);
 	} else {
 		printf("error command: %s\n", command);
 	}
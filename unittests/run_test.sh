@@ -18,6 +18,51 @@ if [ $? -ne 0 ]; then
 	exit -1
 fi
 
+valgrind --leak-check=full ./ubbd_stats_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_qos_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_flush_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_split_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_rcache_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_wbuf_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_zero_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_blkmap_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
+valgrind --leak-check=full ./ubbd_zram_test
+if [ $? -ne 0 ]; then
+	exit -1
+fi
+
 rm -rf result
 mkdir result
 mv *gcda result/
@@ -0,0 +1,239 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_blkmap.h"
+
+#define TEST_NR_BLOCKS	(3 * UBBD_BLKMAP_LEAF_SIZE + 10)
+#define TEST_THREADS	8
+
+static int test_allocated;
+
+static void *test_alloc(void *arg)
+{
+	uint64_t *entry;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	*entry = *(uint64_t *)arg;
+	__atomic_add_fetch(&test_allocated, 1, __ATOMIC_RELAXED);
+
+	return entry;
+}
+
+static void test_free(void *entry, void *arg)
+{
+	__atomic_sub_fetch(&test_allocated, 1, __ATOMIC_RELAXED);
+	free(entry);
+}
+
+void test_blkmap_get(void **state)
+{
+	struct ubbd_blkmap map;
+	uint64_t blk, *entry;
+
+	assert_int_equal(ubbd_blkmap_init(&map, TEST_NR_BLOCKS), 0);
+	assert_int_equal(map.nr_leaves, 4);
+
+	// nothing inserted
+	assert_null(ubbd_blkmap_lookup(&map, 0));
+	assert_null(ubbd_blkmap_lookup(&map, TEST_NR_BLOCKS - 1));
+
+	// first and last block of leaves, and the last block of map
+	for (blk = 0; blk < TEST_NR_BLOCKS; blk += UBBD_BLKMAP_LEAF_SIZE - 1) {
+		entry = ubbd_blkmap_get(&map, blk, test_alloc, &blk);
+		assert_non_null(entry);
+		assert_int_equal(*entry, blk);
+		assert_ptr_equal(ubbd_blkmap_lookup(&map, blk), entry);
+	}
+	blk = TEST_NR_BLOCKS - 1;
+	entry = ubbd_blkmap_get(&map, blk, test_alloc, &blk);
+	assert_non_null(entry);
+	assert_int_equal(*entry, blk);
+
+	// existing entry is returned, not allocated again
+	blk = 0;
+	entry = ubbd_blkmap_get(&map, blk, test_alloc, &blk);
+	assert_int_equal(*entry, 0);
+	assert_int_equal(test_allocated, 5);
+
+	// neighbours not inserted
+	assert_null(ubbd_blkmap_lookup(&map, 1));
+	assert_null(ubbd_blkmap_lookup(&map, UBBD_BLKMAP_LEAF_SIZE));
+
+	// out of map
+	blk = TEST_NR_BLOCKS;
+	assert_null(ubbd_blkmap_lookup(&map, blk));
+	assert_null(ubbd_blkmap_get(&map, blk, test_alloc, &blk));
+
+	ubbd_blkmap_exit(&map, test_free, NULL);
+	assert_int_equal(test_allocated, 0);
+}
+
+struct test_thread_data {
+	struct ubbd_blkmap *map;
+	uint64_t *entries[TEST_NR_BLOCKS];
+};
+
+static void *test_get_fn(void *arg)
+{
+	struct test_thread_data *data = arg;
+	uint64_t blk;
+
+	for (blk = 0; blk < TEST_NR_BLOCKS; blk++)
+		data->entries[blk] = ubbd_blkmap_get(data->map, blk, test_alloc, &blk);
+
+	return NULL;
+}
+
+void test_blkmap_race(void **state)
+{
+	struct test_thread_data *data;
+	pthread_t threads[TEST_THREADS];
+	struct ubbd_blkmap map;
+	uint64_t blk;
+	int i;
+
+	data = calloc(TEST_THREADS, sizeof(*data));
+	assert_non_null(data);
+	assert_int_equal(ubbd_blkmap_init(&map, TEST_NR_BLOCKS), 0);
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		data[i].map = &map;
+		assert_int_equal(pthread_create(&threads[i], NULL, test_get_fn, &data[i]), 0);
+	}
+
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	// one entry for each block, seen by all threads
+	assert_int_equal(test_allocated, TEST_NR_BLOCKS);
+	for (blk = 0; blk < TEST_NR_BLOCKS; blk++) {
+		assert_non_null(data[0].entries[blk]);
+		assert_int_equal(*data[0].entries[blk], blk);
+		for (i = 1; i < TEST_THREADS; i++)
+			assert_ptr_equal(data[i].entries[blk], data[0].entries[blk]);
+	}
+
+	ubbd_blkmap_exit(&map, test_free, NULL);
+	assert_int_equal(test_allocated, 0);
+	free(data);
+}
+
+void test_blkmap_remove(void **state)
+{
+	struct ubbd_blkmap map;
+	uint64_t blk, *entry;
+	int token;
+
+	assert_int_equal(ubbd_blkmap_init(&map, TEST_NR_BLOCKS), 0);
+
+	// not inserted, or in a leaf not allocated
+	assert_null(ubbd_blkmap_remove(&map, 0));
+	assert_null(ubbd_blkmap_remove(&map, TEST_NR_BLOCKS));
+
+	blk = 1;
+	entry = ubbd_blkmap_get(&map, blk, test_alloc, &blk);
+	assert_non_null(entry);
+	assert_null(ubbd_blkmap_remove(&map, 0));
+
+	// removed entry is still usable by a reader until it unlocks
+	token = ubbd_blkmap_read_lock(&map);
+	assert_ptr_equal(ubbd_blkmap_remove(&map, blk), entry);
+	assert_null(ubbd_blkmap_lookup(&map, blk));
+	assert_null(ubbd_blkmap_remove(&map, blk));
+	assert_int_equal(*entry, 1);
+	ubbd_blkmap_read_unlock(&map, token);
+
+	ubbd_blkmap_synchronize(&map);
+	test_free(entry, NULL);
+
+	// inserted again
+	entry = ubbd_blkmap_get(&map, blk, test_alloc, &blk);
+	assert_non_null(entry);
+	assert_ptr_equal(ubbd_blkmap_lookup(&map, blk), entry);
+
+	ubbd_blkmap_exit(&map, test_free, NULL);
+	assert_int_equal(test_allocated, 0);
+}
+
+static bool test_stop;
+
+static void *test_read_fn(void *arg)
+{
+	struct ubbd_blkmap *map = arg;
+	uint64_t blk, *entry;
+	int token;
+
+	while (!__atomic_load_n(&test_stop, __ATOMIC_RELAXED)) {
+		for (blk = 0; blk < TEST_NR_BLOCKS; blk++) {
+			token = ubbd_blkmap_read_lock(map);
+			entry = ubbd_blkmap_get(map, blk, test_alloc, &blk);
+			if (entry)
+				assert_int_equal(*entry, blk);
+			ubbd_blkmap_read_unlock(map, token);
+		}
+	}
+
+	return NULL;
+}
+
+void test_blkmap_remove_race(void **state)
+{
+	pthread_t threads[TEST_THREADS];
+	struct ubbd_blkmap map;
+	uint64_t *removed[TEST_NR_BLOCKS];
+	uint64_t blk;
+	int i, nr, round;
+
+	assert_int_equal(ubbd_blkmap_init(&map, TEST_NR_BLOCKS), 0);
+
+	test_stop = false;
+	for (i = 0; i < TEST_THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, test_read_fn, &map), 0);
+
+	// freed entries are poisoned, a reader using one after free would see it
+	for (round = 0; round < 200; round++) {
+		nr = 0;
+		for (blk = round % 2; blk < TEST_NR_BLOCKS; blk += 2) {
+			removed[nr] = ubbd_blkmap_remove(&map, blk);
+			if (removed[nr])
+				nr++;
+		}
+
+		ubbd_blkmap_synchronize(&map);
+		for (i = 0; i < nr; i++) {
+			*removed[i] = UINT64_MAX;
+			test_free(removed[i], NULL);
+		}
+	}
+
+	__atomic_store_n(&test_stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	ubbd_blkmap_exit(&map, test_free, NULL);
+	assert_int_equal(test_allocated, 0);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_blkmap_get),
+		cmocka_unit_test(test_blkmap_race),
+		cmocka_unit_test(test_blkmap_remove),
+		cmocka_unit_test(test_blkmap_remove_race),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
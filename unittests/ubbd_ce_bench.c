@@ -0,0 +1,230 @@
+/*
+ * Contention benchmark for completion ring.
+ *
+ * N completer threads push ce into a fake compr ring, while a consumer
+ * thread plays the kernel and moves compr_tail. Compare the old mutex
+ * protected path with the lock-free ubbd_queue_add_ce().
+ *
+ * usage: ubbd_ce_bench [ce_per_thread]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "utils.h"
+#include "ubbd_queue.h"
+#include "ubbd_uio.h"
+#include "ubbd.h"
+
+#define BENCH_COMPR_SIZE	((1 << 20) * sizeof(struct ubbd_ce))
+#define BENCH_DEFAULT_CE	(100 * 1000)
+#define BENCH_MAX_THREADS	16
+
+enum bench_mode {
+	BENCH_MODE_MUTEX,
+	BENCH_MODE_LOCKFREE,
+	BENCH_MODE_LOCKFREE_BATCH,
+};
+
+static struct ubbd_queue bench_q;
+static pthread_mutex_t bench_req_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t bench_ce_per_thread = BENCH_DEFAULT_CE;
+static enum bench_mode bench_mode;
+static volatile bool bench_stop;
+
+/* ce of each completer must be consumed in order and exactly once */
+static uint64_t bench_next[BENCH_MAX_THREADS];
+static uint64_t bench_errors;
+
+/* the completion path before lock-free ring, one doorbell per ce */
+static void mutex_add_ce(struct ubbd_queue *ubbd_q, uint64_t priv_data, int result)
+{
+	struct ubbd_sb *sb = ubbd_q->uio_info.map;
+	struct ubbd_ce *ce;
+	uint32_t used;
+
+	pthread_mutex_lock(&bench_req_lock);
+	while (1) {
+		used = (sb->compr_head + sb->compr_size - atomic_read(&sb->compr_tail)) % sb->compr_size;
+		if (sb->compr_size - CMPR_RESERVED - used >= sizeof(struct ubbd_ce))
+			break;
+		pthread_mutex_unlock(&bench_req_lock);
+		ubbd_processing_complete(&ubbd_q->uio_info);
+		usleep(50);
+		pthread_mutex_lock(&bench_req_lock);
+	}
+
+	ce = (struct ubbd_ce *)((char *)sb + sb->compr_off + sb->compr_head);
+	memset(ce, 0, sizeof(*ce));
+	ce->priv_data = priv_data;
+	ce->result = result;
+	ubbd_smp_wmb();
+	sb->compr_head = (sb->compr_head + sizeof(struct ubbd_ce)) % sb->compr_size;
+	pthread_mutex_unlock(&bench_req_lock);
+
+	ubbd_processing_complete(&ubbd_q->uio_info);
+}
+
+static void *completer_fn(void *arg)
+{
+	uint64_t id = (uint64_t)arg;
+	uint64_t i;
+
+	for (i = 0; i < bench_ce_per_thread; i++) {
+		if (bench_mode == BENCH_MODE_MUTEX)
+			mutex_add_ce(&bench_q, (id << 32) | i, 0);
+		else
+			ubbd_queue_add_ce(&bench_q, (id << 32) | i, 0);
+	}
+
+	return NULL;
+}
+
+static void consume_ce(struct ubbd_sb *sb)
+{
+	uint32_t head, tail;
+	struct ubbd_ce *ce;
+	uint64_t id;
+
+	head = atomic_read(&sb->compr_head);
+	ubbd_smp_rmb();
+	for (tail = sb->compr_tail; tail != head;
+			tail = (tail + sizeof(struct ubbd_ce)) % sb->compr_size) {
+		ce = (struct ubbd_ce *)((char *)sb + sb->compr_off + tail);
+		id = ce->priv_data >> 32;
+		if (id >= BENCH_MAX_THREADS ||
+				(ce->priv_data & 0xFFFFFFFF) != bench_next[id]++)
+			bench_errors++;
+	}
+	atomic_set(&sb->compr_tail, head);
+}
+
+/* play the kernel, consume every published ce */
+static void *consumer_fn(void *arg)
+{
+	struct ubbd_sb *sb = bench_q.uio_info.map;
+
+	while (!bench_stop) {
+		consume_ce(sb);
+		ubbd_cpu_relax();
+	}
+	consume_ce(sb);
+
+	return NULL;
+}
+
+static int bench_queue_init(struct ubbd_sb *sb)
+{
+	memset(sb, 0, sizeof(*sb) + BENCH_COMPR_SIZE);
+	sb->compr_off = sizeof(*sb);
+	sb->compr_size = BENCH_COMPR_SIZE;
+
+	memset(&bench_q, 0, sizeof(bench_q));
+	bench_q.uio_info.map = sb;
+	bench_q.uio_info.fd = open("/dev/null", O_WRONLY);
+	if (bench_q.uio_info.fd < 0)
+		return -errno;
+
+	bench_q.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bench_q.wakeup_fd < 0) {
+		close(bench_q.uio_info.fd);
+		return -errno;
+	}
+
+	bench_q.ce_batch_max = (bench_mode == BENCH_MODE_LOCKFREE_BATCH ? 32 : 1);
+	bench_q.ce_batch_ns = 20 * 1000;
+
+	return ubbd_queue_ce_init(&bench_q);
+}
+
+static void bench_queue_exit(void)
+{
+	ubbd_queue_ce_exit(&bench_q);
+	close(bench_q.wakeup_fd);
+	close(bench_q.uio_info.fd);
+}
+
+static int run_bench(struct ubbd_sb *sb, int nr_threads)
+{
+	pthread_t consumer, completers[nr_threads];
+	uint64_t start_ns, elapsed_ns, total;
+	int ret;
+	int i;
+
+	ret = bench_queue_init(sb);
+	if (ret)
+		return ret;
+
+	memset(bench_next, 0, sizeof(bench_next));
+	bench_errors = 0;
+	bench_stop = false;
+	pthread_create(&consumer, NULL, consumer_fn, NULL);
+
+	start_ns = get_ns();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&completers[i], NULL, completer_fn, (void *)(uint64_t)i);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(completers[i], NULL);
+	elapsed_ns = get_ns() - start_ns;
+
+	bench_stop = true;
+	pthread_join(consumer, NULL);
+
+	total = bench_ce_per_thread * nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		if (bench_next[i] != bench_ce_per_thread)
+			bench_errors++;
+	}
+	printf("%-16s threads: %-4d ce: %-10lu %8.2f Mce/s %8.1f ns/ce",
+			bench_mode == BENCH_MODE_MUTEX ? "mutex" :
+			(bench_mode == BENCH_MODE_LOCKFREE ? "lockfree" : "lockfree-batch"),
+			nr_threads, total, (double)total * 1000 / elapsed_ns,
+			(double)elapsed_ns / total);
+	if (bench_mode != BENCH_MODE_MUTEX)
+		printf(" doorbells: %lu", bench_q.req_stats.ce_batches);
+	printf("\n");
+
+	bench_queue_exit();
+
+	if (bench_errors) {
+		fprintf(stderr, "%lu ce are lost or out of order\n", bench_errors);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int threads[] = { 1, 4, 16 };
+	enum bench_mode modes[] = { BENCH_MODE_MUTEX, BENCH_MODE_LOCKFREE, BENCH_MODE_LOCKFREE_BATCH };
+	struct ubbd_sb *sb;
+	int i, j;
+	int ret = 0;
+
+	if (argc > 1)
+		bench_ce_per_thread = atoll(argv[1]);
+
+	sb = malloc(sizeof(*sb) + BENCH_COMPR_SIZE);
+	if (!sb)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		for (j = 0; j < ARRAY_SIZE(modes); j++) {
+			bench_mode = modes[j];
+			ret = run_bench(sb, threads[i]);
+			if (ret) {
+				fprintf(stderr, "failed to run bench: %d\n", ret);
+				goto out;
+			}
+		}
+	}
+
+out:
+	free(sb);
+	return ret;
+}
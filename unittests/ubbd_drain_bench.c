@@ -0,0 +1,255 @@
+/*
+ * Benchmark for the drain pass of cmd ring.
+ *
+ * Fill a fake cmd ring with read se, drain it by ubbd_queue_drain() to
+ * the null backend, and report the framework overhead per se. A consumer
+ * thread plays the kernel and consumes ce. The per se work done by the
+ * old drain loop, clearing the uio event and looking up the se and
+ * cmd_head, is measured separately for comparison.
+ *
+ * usage: ubbd_drain_bench [passes]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "utils.h"
+#include "ubbd_queue.h"
+#include "ubbd_backend.h"
+#include "ubbd_uio.h"
+#include "ubbd.h"
+
+#define BENCH_CMDR_SIZE		(4 << 20)
+#define BENCH_COMPR_SIZE	((1 << 16) * sizeof(struct ubbd_ce))
+#define BENCH_DEFAULT_PASSES	1000
+#define BENCH_IO_SIZE		4096
+
+extern struct ubbd_backend_ops null_backend_ops;
+
+static struct ubbd_null_backend bench_b;
+static struct ubbd_queue bench_q;
+static uint64_t bench_passes = BENCH_DEFAULT_PASSES;
+static volatile bool bench_stop;
+static char bench_buf[BENCH_IO_SIZE];
+
+static uint32_t bench_se_len(void)
+{
+	return round_up(sizeof(struct ubbd_se) + sizeof(struct iovec), 8);
+}
+
+static int bench_set_len_op(struct ubbd_se *se, uint32_t len, uint32_t op)
+{
+	se->header.len_op = (len << 8) | op;
+
+	/* the layout of len_op is defined by kernel */
+	if (ubbd_se_hdr_get_len(se->header.len_op) != len ||
+			ubbd_se_hdr_get_op(se->header.len_op) != op)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* fill cmd ring from cmd_head with nr read se */
+static int bench_fill_cmdr(struct ubbd_sb *sb, uint32_t nr)
+{
+	uint32_t se_len = bench_se_len();
+	uint32_t head = sb->cmd_head;
+	struct ubbd_se *se;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		se = (struct ubbd_se *)((char *)sb + sb->cmdr_off + head);
+		memset(se, 0, se_len);
+		ret = bench_set_len_op(se, se_len, UBBD_OP_READ);
+		if (ret)
+			return ret;
+		se->priv_data = i;
+		se->offset = (uint64_t)i * BENCH_IO_SIZE;
+		se->len = BENCH_IO_SIZE;
+		se->iov_cnt = 1;
+		se->iov[0].iov_base = bench_buf;
+		se->iov[0].iov_len = BENCH_IO_SIZE;
+		head = (head + se_len) % sb->cmdr_size;
+	}
+
+	ubbd_smp_wmb();
+	atomic_set(&sb->cmd_head, head);
+
+	return 0;
+}
+
+static void *consumer_fn(void *arg)
+{
+	struct ubbd_sb *sb = bench_q.uio_info.map;
+
+	while (!bench_stop) {
+		atomic_set(&sb->compr_tail, atomic_read(&sb->compr_head));
+		ubbd_cpu_relax();
+	}
+
+	return NULL;
+}
+
+static int bench_queue_init(struct ubbd_sb *sb)
+{
+	int ret;
+
+	memset(sb, 0, sizeof(*sb) + BENCH_CMDR_SIZE + BENCH_COMPR_SIZE);
+	sb->cmdr_off = sizeof(*sb);
+	/* no se across the end of ring, so no pad se is needed */
+	sb->cmdr_size = BENCH_CMDR_SIZE / bench_se_len() * bench_se_len();
+	sb->compr_off = sb->cmdr_off + BENCH_CMDR_SIZE;
+	sb->compr_size = BENCH_COMPR_SIZE;
+
+	bench_b.ubbd_b.backend_ops = &null_backend_ops;
+	ubbd_flush_tracker_init(&bench_b.ubbd_b.flush);
+
+	memset(&bench_q, 0, sizeof(bench_q));
+	bench_q.ubbd_b = &bench_b.ubbd_b;
+	bench_q.uio_info.map = sb;
+	/* read() of /dev/null costs a syscall like clearing the uio event */
+	bench_q.uio_info.fd = open("/dev/null", O_RDWR);
+	if (bench_q.uio_info.fd < 0)
+		return -errno;
+
+	bench_q.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bench_q.wakeup_fd < 0) {
+		ret = -errno;
+		goto close_uio;
+	}
+
+	INIT_LIST_HEAD(&bench_q.pollers);
+	bench_q.ce_batch_max = 32;
+	bench_q.ce_batch_ns = 20 * 1000;
+
+	ret = ubbd_queue_ce_init(&bench_q);
+	if (ret)
+		goto close_wakeup;
+
+	ret = ubbd_queue_req_pool_init(&bench_q);
+	if (ret)
+		goto ce_exit;
+
+	return 0;
+
+ce_exit:
+	ubbd_queue_ce_exit(&bench_q);
+close_wakeup:
+	close(bench_q.wakeup_fd);
+close_uio:
+	close(bench_q.uio_info.fd);
+	return ret;
+}
+
+static void bench_queue_exit(void)
+{
+	ubbd_queue_req_pool_exit(&bench_q);
+	ubbd_queue_ce_exit(&bench_q);
+	close(bench_q.wakeup_fd);
+	close(bench_q.uio_info.fd);
+}
+
+static int run_drain(struct ubbd_sb *sb, uint32_t se_per_pass)
+{
+	uint64_t start_ns, elapsed_ns = 0, total = 0;
+	uint64_t throttle_ns;
+	pthread_t consumer;
+	uint64_t i;
+	int ret;
+
+	ret = bench_queue_init(sb);
+	if (ret)
+		return ret;
+
+	bench_stop = false;
+	pthread_create(&consumer, NULL, consumer_fn, NULL);
+
+	for (i = 0; i < bench_passes; i++) {
+		ret = bench_fill_cmdr(sb, se_per_pass);
+		if (ret)
+			goto out;
+
+		start_ns = get_ns();
+		ret = ubbd_queue_drain(&bench_q, &throttle_ns);
+		elapsed_ns += get_ns() - start_ns;
+		if (ret != se_per_pass) {
+			fprintf(stderr, "drained %d se, expected %u\n", ret, se_per_pass);
+			ret = -EIO;
+			goto out;
+		}
+		total += ret;
+	}
+	ret = 0;
+
+	printf("%-16s se/pass: %-6u se: %-10lu %8.1f ns/se\n", "drain",
+			se_per_pass, total, (double)elapsed_ns / total);
+out:
+	bench_stop = true;
+	pthread_join(consumer, NULL);
+	bench_queue_exit();
+
+	return ret;
+}
+
+/* work done per se by the old drain loop and per pass by now */
+static int run_per_se_work(struct ubbd_sb *sb)
+{
+	uint64_t start_ns, elapsed_ns, total;
+	uint64_t i;
+	int ret;
+
+	ret = bench_queue_init(sb);
+	if (ret)
+		return ret;
+
+	total = bench_passes * 256;
+	start_ns = get_ns();
+	for (i = 0; i < total; i++) {
+		ubbd_processing_start(&bench_q.uio_info);
+		if (ubbd_cmd_to_handle(&bench_q) == ubbd_cmd_head(&bench_q.uio_info))
+			ubbd_barrier();
+	}
+	elapsed_ns = get_ns() - start_ns;
+
+	printf("%-16s calls: %-10lu %8.1f ns/se\n", "old per se work",
+			total, (double)elapsed_ns / total);
+
+	bench_queue_exit();
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t se_per_pass[] = { 1, 16, 256, 4096 };
+	struct ubbd_sb *sb;
+	int ret = 0;
+	int i;
+
+	if (argc > 1)
+		bench_passes = atoll(argv[1]);
+
+	sb = malloc(sizeof(*sb) + BENCH_CMDR_SIZE + BENCH_COMPR_SIZE);
+	if (!sb)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(se_per_pass); i++) {
+		ret = run_drain(sb, se_per_pass[i]);
+		if (ret) {
+			fprintf(stderr, "failed to run drain bench: %d\n", ret);
+			goto out;
+		}
+	}
+
+	ret = run_per_se_work(sb);
+	if (ret)
+		fprintf(stderr, "failed to run per se bench: %d\n", ret);
+out:
+	free(sb);
+	return ret;
+}
@@ -0,0 +1,269 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_flush.h"
+
+#define TEST_NR_WRITES	64
+#define TEST_NR_FLUSHES	16
+
+/*
+ * A fake device: writes complete in any order, a backend flush persists
+ * the writes completed before it started.
+ */
+struct test_dev {
+	struct ubbd_flush_tracker tracker;
+	bool completed[TEST_NR_WRITES];
+	bool persisted[TEST_NR_WRITES];
+	/* writes completed when the backend flush in flight started */
+	bool snapshot[TEST_NR_WRITES];
+	int backend_flushes;
+};
+
+struct test_flush {
+	struct ubbd_flush_req req;
+	/* writes completed when flush arrived, must be persisted when done */
+	bool covers[TEST_NR_WRITES];
+	bool done;
+	int ret;
+	struct test_dev *dev;
+};
+
+static void test_flush_done(struct ubbd_flush_req *req, int ret)
+{
+	struct test_flush *flush = list_container_of(req, struct test_flush, req);
+	int i;
+
+	assert_false(flush->done);
+	flush->done = true;
+	flush->ret = ret;
+
+	if (ret)
+		return;
+
+	for (i = 0; i < TEST_NR_WRITES; i++) {
+		if (flush->covers[i])
+			assert_true(flush->dev->persisted[i]);
+	}
+}
+
+static void dev_init(struct test_dev *dev)
+{
+	memset(dev, 0, sizeof(*dev));
+	ubbd_flush_tracker_init(&dev->tracker);
+}
+
+static void dev_complete_write(struct test_dev *dev, int i)
+{
+	dev->completed[i] = true;
+	ubbd_flush_write_done(&dev->tracker);
+}
+
+static void dev_start_backend_flush(struct test_dev *dev)
+{
+	memcpy(dev->snapshot, dev->completed, sizeof(dev->snapshot));
+	dev->backend_flushes++;
+}
+
+/* finish backend flush in flight, return true if another one started */
+static bool dev_end_backend_flush(struct test_dev *dev, int ret)
+{
+	struct ubbd_flush_req *req, *tmp;
+	LIST_HEAD(done);
+	bool reissue;
+	int i;
+
+	if (!ret) {
+		for (i = 0; i < TEST_NR_WRITES; i++)
+			dev->persisted[i] |= dev->snapshot[i];
+	}
+
+	reissue = ubbd_flush_end(&dev->tracker, ret, &done);
+	list_for_each_entry_safe(req, tmp, &done, node) {
+		list_del_init(&req->node);
+		req->done(req, ret);
+	}
+
+	if (reissue)
+		dev_start_backend_flush(dev);
+
+	return reissue;
+}
+
+static enum ubbd_flush_action dev_flush(struct test_dev *dev, struct test_flush *flush)
+{
+	enum ubbd_flush_action action;
+
+	memset(flush, 0, sizeof(*flush));
+	flush->dev = dev;
+	flush->req.done = test_flush_done;
+	memcpy(flush->covers, dev->completed, sizeof(flush->covers));
+
+	action = ubbd_flush_begin(&dev->tracker, &flush->req);
+	if (action == UBBD_FLUSH_DONE)
+		flush->req.done(&flush->req, 0);
+	else if (action == UBBD_FLUSH_ISSUE)
+		dev_start_backend_flush(dev);
+
+	return action;
+}
+
+void test_flush_first(void **state)
+{
+	struct test_dev dev;
+	struct test_flush flush;
+
+	dev_init(&dev);
+
+	// first flush goes to backend even without any write
+	assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_ISSUE);
+	assert_false(flush.done);
+	assert_false(dev_end_backend_flush(&dev, 0));
+	assert_true(flush.done);
+	assert_int_equal(flush.ret, 0);
+	assert_int_equal(dev.backend_flushes, 1);
+}
+
+void test_flush_no_write(void **state)
+{
+	struct test_dev dev;
+	struct test_flush flush;
+	int i;
+
+	dev_init(&dev);
+	dev_complete_write(&dev, 0);
+	assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_ISSUE);
+	assert_false(dev_end_backend_flush(&dev, 0));
+	assert_true(flush.done);
+
+	// nothing written since, flushes are done at once
+	for (i = 0; i < 10; i++) {
+		assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_DONE);
+		assert_true(flush.done);
+	}
+	assert_int_equal(dev.backend_flushes, 1);
+
+	// a new write needs a backend flush again
+	dev_complete_write(&dev, 1);
+	assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_ISSUE);
+	assert_false(dev_end_backend_flush(&dev, 0));
+	assert_true(flush.done);
+	assert_int_equal(dev.backend_flushes, 2);
+}
+
+void test_flush_coalesce(void **state)
+{
+	struct test_dev dev;
+	struct test_flush flushes[4];
+	int i;
+
+	dev_init(&dev);
+	dev_complete_write(&dev, 0);
+	assert_int_equal(dev_flush(&dev, &flushes[0]), UBBD_FLUSH_ISSUE);
+
+	// flushes arriving during the backend flush wait for the next one
+	dev_complete_write(&dev, 1);
+	for (i = 1; i < 4; i++)
+		assert_int_equal(dev_flush(&dev, &flushes[i]), UBBD_FLUSH_WAIT);
+
+	assert_true(dev_end_backend_flush(&dev, 0));
+	assert_true(flushes[0].done);
+	for (i = 1; i < 4; i++)
+		assert_false(flushes[i].done);
+
+	// one more backend flush finishes all of them
+	assert_false(dev_end_backend_flush(&dev, 0));
+	for (i = 1; i < 4; i++)
+		assert_true(flushes[i].done);
+	assert_int_equal(dev.backend_flushes, 2);
+}
+
+void test_flush_error(void **state)
+{
+	struct test_dev dev;
+	struct test_flush flush;
+
+	dev_init(&dev);
+	dev_complete_write(&dev, 0);
+	assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_ISSUE);
+	assert_false(dev_end_backend_flush(&dev, -EIO));
+	assert_true(flush.done);
+	assert_int_equal(flush.ret, -EIO);
+
+	// failed flush persisted nothing, next flush goes to backend
+	assert_int_equal(dev_flush(&dev, &flush), UBBD_FLUSH_ISSUE);
+	assert_false(dev_end_backend_flush(&dev, 0));
+	assert_true(flush.done);
+	assert_int_equal(flush.ret, 0);
+	assert_true(dev.persisted[0]);
+}
+
+void test_flush_out_of_order(void **state)
+{
+	struct test_dev dev;
+	struct test_flush flushes[TEST_NR_FLUSHES];
+	int order[TEST_NR_WRITES];
+	bool backend_flushing = false;
+	int nr_flushes = 0;
+	int i, j, tmp;
+
+	dev_init(&dev);
+	srand(1234);
+
+	// writes complete in random order
+	for (i = 0; i < TEST_NR_WRITES; i++)
+		order[i] = i;
+	for (i = TEST_NR_WRITES - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	// interleave write completions, flush arrivals and backend flush ends
+	for (i = 0; i < TEST_NR_WRITES; i++) {
+		dev_complete_write(&dev, order[i]);
+
+		if (i % 4 == 3 && nr_flushes < TEST_NR_FLUSHES) {
+			if (dev_flush(&dev, &flushes[nr_flushes++]) == UBBD_FLUSH_ISSUE) {
+				assert_false(backend_flushing);
+				backend_flushing = true;
+			}
+		}
+
+		if (i % 7 == 6 && backend_flushing)
+			backend_flushing = dev_end_backend_flush(&dev, 0);
+	}
+
+	while (backend_flushing)
+		backend_flushing = dev_end_backend_flush(&dev, 0);
+
+	// every flush is done and saw its writes persisted in test_flush_done()
+	for (i = 0; i < nr_flushes; i++) {
+		assert_true(flushes[i].done);
+		assert_int_equal(flushes[i].ret, 0);
+	}
+
+	// flushes were coalesced
+	assert_true(dev.backend_flushes < nr_flushes);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_flush_first),
+		cmocka_unit_test(test_flush_no_write),
+		cmocka_unit_test(test_flush_coalesce),
+		cmocka_unit_test(test_flush_error),
+		cmocka_unit_test(test_flush_out_of_order),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,231 @@
+/*
+ * Benchmark for memory of mem backend.
+ *
+ * Copy a device of the given size sequentially in ios of 1MiB through
+ * a block map, as mem backend does, with blocks from each backing:
+ * heap:    calloc() of each 1MiB block
+ * shm:     one mapping of a memfd, blocks allocated by fallocate()
+ * hugetlb: the same with 2MiB huge pages, skipped if none is reserved
+ *
+ * First write allocates blocks, then overwrite and read of allocated
+ * blocks show the copy bandwidth.
+ *
+ * usage: ubbd_mem_bench [MiB]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <linux/memfd.h>
+
+#include "ubbd_blkmap.h"
+
+#define BENCH_DEFAULT_MB	1024
+#define BENCH_IO_SIZE		(1024 * 1024)
+#define BENCH_PASSES		4
+
+struct bench_mem {
+	const char *name;
+	uint32_t block_size;
+	uint32_t block_shift;
+	struct ubbd_blkmap map;
+	/* NULL for heap */
+	char *base;
+	int fd;
+	uint64_t size;
+	uint64_t blk;
+};
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *bench_block_alloc(void *arg)
+{
+	struct bench_mem *mem = arg;
+	uint64_t off = mem->blk << mem->block_shift;
+
+	if (!mem->base)
+		return calloc(1, mem->block_size);
+
+	if (fallocate(mem->fd, 0, off, mem->block_size))
+		return NULL;
+
+	return mem->base + off;
+}
+
+static void bench_block_free(void *block, void *arg)
+{
+	struct bench_mem *mem = arg;
+
+	if (!mem->base)
+		free(block);
+}
+
+/* copy size bytes from or to buf, return -1 if a block failed to allocate */
+static int bench_copy(struct bench_mem *mem, char *buf, bool write)
+{
+	uint64_t off, len, io_off;
+	uint32_t off_in_blk;
+	char *block;
+	int token;
+
+	for (io_off = 0; io_off < mem->size; io_off += BENCH_IO_SIZE) {
+		token = ubbd_blkmap_read_lock(&mem->map);
+		for (off = io_off; off < io_off + BENCH_IO_SIZE; off += len) {
+			off_in_blk = off & (mem->block_size - 1);
+			len = mem->block_size - off_in_blk;
+			if (len > io_off + BENCH_IO_SIZE - off)
+				len = io_off + BENCH_IO_SIZE - off;
+
+			mem->blk = off >> mem->block_shift;
+			if (write) {
+				block = ubbd_blkmap_get(&mem->map, mem->blk, bench_block_alloc, mem);
+				if (!block) {
+					ubbd_blkmap_read_unlock(&mem->map, token);
+					return -1;
+				}
+				memcpy(block + off_in_blk, buf + off - io_off, len);
+			} else {
+				block = ubbd_blkmap_lookup(&mem->map, mem->blk);
+				memcpy(buf + off - io_off, block + off_in_blk, len);
+			}
+		}
+		ubbd_blkmap_read_unlock(&mem->map, token);
+	}
+
+	return 0;
+}
+
+static double bench_gbps(uint64_t bytes, uint64_t ns)
+{
+	return (double)bytes / ns * 1000000000 / (1 << 30);
+}
+
+static int bench_run(struct bench_mem *mem, char *buf)
+{
+	uint64_t start, first_ns, write_ns = 0, read_ns = 0;
+	int i;
+
+	if (ubbd_blkmap_init(&mem->map, mem->size >> mem->block_shift)) {
+		printf("%-8s failed to init block map\n", mem->name);
+		return -1;
+	}
+
+	start = bench_ns();
+	if (bench_copy(mem, buf, true)) {
+		printf("%-8s failed to allocate blocks\n", mem->name);
+		ubbd_blkmap_exit(&mem->map, bench_block_free, mem);
+		return -1;
+	}
+	first_ns = bench_ns() - start;
+
+	for (i = 0; i < BENCH_PASSES; i++) {
+		start = bench_ns();
+		bench_copy(mem, buf, true);
+		write_ns += bench_ns() - start;
+
+		start = bench_ns();
+		bench_copy(mem, buf, false);
+		read_ns += bench_ns() - start;
+	}
+
+	printf("%-8s first write: %5.2f GiB/s, overwrite: %5.2f GiB/s, read: %5.2f GiB/s\n",
+			mem->name, bench_gbps(mem->size, first_ns),
+			bench_gbps(mem->size * BENCH_PASSES, write_ns),
+			bench_gbps(mem->size * BENCH_PASSES, read_ns));
+
+	ubbd_blkmap_exit(&mem->map, bench_block_free, mem);
+
+	return 0;
+}
+
+static int bench_map(struct bench_mem *mem, unsigned int flags)
+{
+	mem->fd = memfd_create(mem->name, MFD_CLOEXEC | flags);
+	if (mem->fd < 0)
+		return -errno;
+
+	if (ftruncate(mem->fd, mem->size)) {
+		close(mem->fd);
+		return -errno;
+	}
+
+	mem->base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, mem->fd, 0);
+	if (mem->base == MAP_FAILED) {
+		close(mem->fd);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void bench_unmap(struct bench_mem *mem)
+{
+	munmap(mem->base, mem->size);
+	close(mem->fd);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t size = (uint64_t)BENCH_DEFAULT_MB << 20;
+	struct bench_mem mem;
+	char *buf;
+
+	if (argc > 1)
+		size = (uint64_t)atoi(argv[1]) << 20;
+
+	/* whole huge pages */
+	size &= ~((2ULL << 20) - 1);
+	if (!size) {
+		fprintf(stderr, "usage: %s [MiB], at least 2\n", argv[0]);
+		return 1;
+	}
+
+	if (posix_memalign((void **)&buf, 4096, BENCH_IO_SIZE)) {
+		fprintf(stderr, "failed to alloc io buffer\n");
+		return 1;
+	}
+	memset(buf, 0x5a, BENCH_IO_SIZE);
+
+	printf("device: %lu MiB, io: %d KiB, passes: %d\n", size >> 20, BENCH_IO_SIZE >> 10, BENCH_PASSES);
+
+	memset(&mem, 0, sizeof(mem));
+	mem.name = "heap";
+	mem.size = size;
+	mem.block_size = 1 << 20;
+	mem.block_shift = 20;
+	bench_run(&mem, buf);
+
+	mem.name = "shm";
+	if (bench_map(&mem, 0)) {
+		printf("%-8s failed to map memfd\n", mem.name);
+	} else {
+		madvise(mem.base, mem.size, MADV_HUGEPAGE);
+		bench_run(&mem, buf);
+		bench_unmap(&mem);
+	}
+
+	mem.name = "hugetlb";
+	mem.block_size = 2 << 20;
+	mem.block_shift = 21;
+	if (bench_map(&mem, MFD_HUGETLB | MFD_HUGE_2MB)) {
+		printf("%-8s not supported\n", mem.name);
+	} else {
+		bench_run(&mem, buf);
+		bench_unmap(&mem);
+	}
+
+	free(buf);
+
+	return 0;
+}
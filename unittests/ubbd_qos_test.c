@@ -0,0 +1,119 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_qos.h"
+
+#define NS_PER_SEC	1000000000ULL
+
+void test_qos_disabled(void **state)
+{
+	struct ubbd_qos_opts opts = { 0 };
+	struct ubbd_qos qos;
+	int i;
+
+	opts.burst_ms = 1000;
+	assert_int_equal(ubbd_qos_init(&qos, &opts, 0), 0);
+	assert_false(ubbd_qos_enabled(&qos));
+
+	for (i = 0; i < 100000; i++)
+		assert_int_equal(ubbd_qos_throttle(&qos, i % 2, 1 << 20, 0), 0);
+}
+
+void test_qos_iops(void **state)
+{
+	struct ubbd_qos_opts opts = { 0 };
+	struct ubbd_qos qos;
+	uint64_t now = NS_PER_SEC;
+	uint64_t wait_ns;
+	int i, admitted = 0;
+
+	opts.limits[UBBD_QOS_IOPS] = 1000;
+	opts.burst_ms = 100;
+	assert_int_equal(ubbd_qos_init(&qos, &opts, now), 0);
+	assert_true(ubbd_qos_enabled(&qos));
+
+	// the burst goes at once
+	for (i = 0; i < 100; i++)
+		assert_int_equal(ubbd_qos_throttle(&qos, false, 4096, now), 0);
+
+	// then one request per ms
+	wait_ns = ubbd_qos_throttle(&qos, true, 4096, now);
+	assert_true(wait_ns > 0 && wait_ns <= NS_PER_SEC / 1000);
+
+	// rate holds over a second
+	for (i = 0; i < 1000; i++) {
+		now += NS_PER_SEC / 1000;
+		if (!ubbd_qos_throttle(&qos, i % 2, 4096, now))
+			admitted++;
+	}
+	assert_int_equal(admitted, 1000);
+	assert_true(ubbd_qos_throttle(&qos, false, 4096, now) > 0);
+
+	// idle refills at most the burst
+	now += 10 * NS_PER_SEC;
+	for (i = 0; i < 100; i++)
+		assert_int_equal(ubbd_qos_throttle(&qos, false, 4096, now), 0);
+	assert_true(ubbd_qos_throttle(&qos, false, 4096, now) > 0);
+}
+
+void test_qos_bps_debt(void **state)
+{
+	struct ubbd_qos_opts opts = { 0 };
+	struct ubbd_qos qos;
+	uint64_t now = 0;
+	uint64_t wait_ns;
+
+	// 1MiB/s with a 64KiB burst
+	opts.limits[UBBD_QOS_WRITE_BPS] = 1 << 20;
+	opts.burst_ms = 62;
+	assert_int_equal(ubbd_qos_init(&qos, &opts, now), 0);
+
+	// reads are not limited by write bps
+	assert_int_equal(ubbd_qos_throttle(&qos, false, 4 << 20, now), 0);
+
+	// a write larger than the burst goes, its debt delays the next one
+	assert_int_equal(ubbd_qos_throttle(&qos, true, 1 << 20, now), 0);
+	wait_ns = ubbd_qos_throttle(&qos, true, 4096, now);
+	assert_true(wait_ns > NS_PER_SEC * 9 / 10);
+	assert_true(wait_ns <= NS_PER_SEC);
+
+	// nothing is taken by a throttled request
+	assert_int_equal(ubbd_qos_throttle(&qos, true, 4096, now + wait_ns), 0);
+}
+
+void test_qos_set(void **state)
+{
+	struct ubbd_qos_opts opts = { 0 };
+	struct ubbd_qos qos;
+
+	opts.limits[UBBD_QOS_READ_IOPS] = 1;
+	opts.burst_ms = 1000;
+	assert_int_equal(ubbd_qos_init(&qos, &opts, 0), 0);
+	assert_int_equal(ubbd_qos_throttle(&qos, false, 0, 0), 0);
+	assert_true(ubbd_qos_throttle(&qos, false, 0, 0) > 0);
+
+	// removing limits lets everything through
+	opts.limits[UBBD_QOS_READ_IOPS] = 0;
+	ubbd_qos_set(&qos, &opts, 0);
+	assert_false(ubbd_qos_enabled(&qos));
+	assert_int_equal(ubbd_qos_throttle(&qos, false, 0, 0), 0);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_qos_disabled),
+		cmocka_unit_test(test_qos_iops),
+		cmocka_unit_test(test_qos_bps_debt),
+		cmocka_unit_test(test_qos_set),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
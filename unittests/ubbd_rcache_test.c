@@ -0,0 +1,228 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_rcache.h"
+
+#define TEST_BS		UBBD_RCACHE_BLOCK_SIZE
+/* 4 slots per shard */
+#define TEST_BUDGET	(TEST_BS * UBBD_RCACHE_SHARDS * 4)
+
+static char test_buf[8 * TEST_BS];
+
+static void fill_pattern(char *buf, uint64_t blk, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		memset(buf + i * TEST_BS, (int)(blk + i) & 0xff, TEST_BS);
+}
+
+static bool check_pattern(char *buf, uint64_t blk, int nr)
+{
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < TEST_BS; j++) {
+			if (buf[i * TEST_BS + j] != (char)((blk + i) & 0xff))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void cache_fill(struct ubbd_rcache *rc, uint64_t blk, int nr)
+{
+	struct iovec iov = { .iov_base = test_buf, .iov_len = nr * TEST_BS };
+
+	fill_pattern(test_buf, blk, nr);
+	ubbd_rcache_fill(rc, blk * TEST_BS, nr * TEST_BS, &iov, 1, ubbd_rcache_seq(rc));
+}
+
+static bool cache_read(struct ubbd_rcache *rc, uint64_t blk, int nr)
+{
+	struct iovec iov = { .iov_base = test_buf, .iov_len = nr * TEST_BS };
+
+	memset(test_buf, 0xee, sizeof(test_buf));
+	if (!ubbd_rcache_read(rc, blk * TEST_BS, nr * TEST_BS, &iov, 1))
+		return false;
+
+	return check_pattern(test_buf, blk, nr);
+}
+
+void test_rcache_budget(void **state)
+{
+	struct ubbd_rcache rc;
+
+	// less than one block per shard
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BS), -EINVAL);
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+	assert_int_equal(rc.shards[0].nr_slots, 4);
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_hit(void **state)
+{
+	struct ubbd_rcache rc;
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	assert_false(cache_read(&rc, 10, 1));
+	cache_fill(&rc, 10, 4);
+	assert_true(cache_read(&rc, 10, 4));
+	assert_true(cache_read(&rc, 11, 2));
+
+	// any missing block is a miss
+	assert_false(cache_read(&rc, 9, 2));
+	assert_false(cache_read(&rc, 13, 2));
+
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_iov(void **state)
+{
+	struct ubbd_rcache rc;
+	char a[TEST_BS / 2], b[TEST_BS + TEST_BS / 2];
+	struct iovec iov[2] = {
+		{ .iov_base = a, .iov_len = sizeof(a) },
+		{ .iov_base = b, .iov_len = sizeof(b) },
+	};
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	cache_fill(&rc, 0, 2);
+
+	// blocks across iovs
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	assert_true(ubbd_rcache_read(&rc, 0, 2 * TEST_BS, iov, 2));
+	assert_int_equal(a[0], 0);
+	assert_int_equal(b[TEST_BS / 2 - 1], 0);
+	assert_int_equal(b[TEST_BS / 2], 1);
+	assert_int_equal(b[sizeof(b) - 1], 1);
+
+	// not block aligned, never served from cache
+	assert_false(ubbd_rcache_read(&rc, 512, TEST_BS, iov, 2));
+
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_partial_fill(void **state)
+{
+	struct ubbd_rcache rc;
+	struct iovec iov = { .iov_base = test_buf, .iov_len = 2 * TEST_BS };
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	// only the whole block in the middle is cached
+	fill_pattern(test_buf, 0, 2);
+	ubbd_rcache_fill(&rc, 20 * TEST_BS + 512, TEST_BS * 2 - 1024, &iov, 1, ubbd_rcache_seq(&rc));
+	assert_false(cache_read(&rc, 20, 1));
+	assert_false(cache_read(&rc, 21, 1));
+
+	fill_pattern(test_buf, 0, 2);
+	ubbd_rcache_fill(&rc, 20 * TEST_BS + 512, TEST_BS * 2, &iov, 1, ubbd_rcache_seq(&rc));
+	assert_false(cache_read(&rc, 20, 1));
+	memset(test_buf, 0xee, sizeof(test_buf));
+	iov.iov_len = TEST_BS;
+	assert_true(ubbd_rcache_read(&rc, 21 * TEST_BS, TEST_BS, &iov, 1));
+	// block 21 starts at 512 bytes before the end of the first pattern block
+	assert_int_equal(test_buf[0], 0);
+	assert_int_equal(test_buf[TEST_BS - 512], 1);
+
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_invalidate(void **state)
+{
+	struct ubbd_rcache rc;
+	struct iovec iov = { .iov_base = test_buf, .iov_len = TEST_BS };
+	uint64_t seq;
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	cache_fill(&rc, 0, 4);
+	ubbd_rcache_invalidate(&rc, TEST_BS + 512, 512);
+	assert_true(cache_read(&rc, 0, 1));
+	assert_false(cache_read(&rc, 1, 1));
+	assert_true(cache_read(&rc, 2, 2));
+
+	// large range drops everything in it
+	ubbd_rcache_invalidate(&rc, 0, UINT32_MAX & ~(TEST_BS - 1));
+	assert_false(cache_read(&rc, 0, 1));
+	assert_false(cache_read(&rc, 3, 1));
+
+	// read submitted before a write does not fill after it
+	seq = ubbd_rcache_seq(&rc);
+	ubbd_rcache_invalidate(&rc, 5 * TEST_BS, TEST_BS);
+	fill_pattern(test_buf, 5, 1);
+	ubbd_rcache_fill(&rc, 5 * TEST_BS, TEST_BS, &iov, 1, seq);
+	assert_false(cache_read(&rc, 5, 1));
+
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_evict(void **state)
+{
+	struct ubbd_rcache rc;
+	uint64_t blk;
+	int cached = 0;
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	// many more blocks than slots, cache never holds more than budget
+	for (blk = 0; blk < 1024; blk++)
+		cache_fill(&rc, blk, 1);
+
+	for (blk = 0; blk < 1024; blk++) {
+		if (cache_read(&rc, blk, 1))
+			cached++;
+	}
+	assert_true(cached > 0);
+	assert_true(cached <= 4 * UBBD_RCACHE_SHARDS);
+
+	ubbd_rcache_exit(&rc);
+}
+
+void test_rcache_clock(void **state)
+{
+	struct ubbd_rcache rc;
+	uint64_t hot = 7;
+	uint64_t blk;
+
+	assert_int_equal(ubbd_rcache_init(&rc, TEST_BUDGET), 0);
+
+	// a block hit between fills survives a scan of cold blocks
+	cache_fill(&rc, hot, 1);
+	for (blk = 1000; blk < 1000 + 64 * UBBD_RCACHE_SHARDS; blk++) {
+		assert_true(cache_read(&rc, hot, 1));
+		cache_fill(&rc, blk, 1);
+	}
+	assert_true(cache_read(&rc, hot, 1));
+
+	ubbd_rcache_exit(&rc);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_rcache_budget),
+		cmocka_unit_test(test_rcache_hit),
+		cmocka_unit_test(test_rcache_iov),
+		cmocka_unit_test(test_rcache_partial_fill),
+		cmocka_unit_test(test_rcache_invalidate),
+		cmocka_unit_test(test_rcache_evict),
+		cmocka_unit_test(test_rcache_clock),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
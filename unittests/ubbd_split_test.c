@@ -0,0 +1,226 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_split.h"
+
+#define TEST_SECTOR	512
+
+void test_split_len(void **state)
+{
+	struct ubbd_io_limits limits = { 0 };
+
+	// no limit
+	assert_int_equal(ubbd_split_len(&limits, 4096, 1 << 20), 1 << 20);
+
+	limits.max_io_size = 128 * 1024;
+	assert_int_equal(ubbd_split_len(&limits, 0, 1 << 20), 128 * 1024);
+	assert_int_equal(ubbd_split_len(&limits, 0, 4096), 4096);
+
+	// boundary not power of 2, like s3 object size
+	limits.max_io_size = 0;
+	limits.io_boundary = 3 * 4096;
+	assert_int_equal(ubbd_split_len(&limits, 0, 8192), 8192);
+	assert_int_equal(ubbd_split_len(&limits, 8192, 8192), 4096);
+	assert_int_equal(ubbd_split_len(&limits, 3 * 4096, 8192), 8192);
+	assert_int_equal(ubbd_split_len(&limits, 5 * 4096 + TEST_SECTOR, 8192), 4096 - TEST_SECTOR);
+
+	// the smaller one wins
+	limits.max_io_size = 4096;
+	assert_int_equal(ubbd_split_len(&limits, 0, 8192), 4096);
+	assert_int_equal(ubbd_split_len(&limits, 2 * 4096 + TEST_SECTOR, 8192), 4096 - TEST_SECTOR);
+}
+
+void test_split_cover(void **state)
+{
+	struct ubbd_io_limits limits = { .max_io_size = 5 * TEST_SECTOR, .io_boundary = 8 * TEST_SECTOR };
+	uint64_t off = 3 * TEST_SECTOR;
+	uint32_t remain = 40 * TEST_SECTOR;
+	uint64_t next = off;
+	uint32_t len;
+	int nr = 0;
+
+	// pieces are contiguous, cover the io, and fit in limits
+	while (remain) {
+		len = ubbd_split_len(&limits, off, remain);
+		assert_true(len > 0 && len <= limits.max_io_size);
+		assert_int_equal(off, next);
+		assert_int_equal(off / limits.io_boundary, (off + len - 1) / limits.io_boundary);
+		next = off + len;
+		off += len;
+		remain -= len;
+		nr++;
+	}
+	assert_int_equal(next, 43 * TEST_SECTOR);
+	assert_true(nr >= 8);
+}
+
+void test_iov_slice(void **state)
+{
+	char buf[4][4096];
+	struct iovec iov[4];
+	struct iovec dst[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = 4096;
+	}
+
+	// whole io
+	assert_int_equal(ubbd_iov_slice(iov, 4, 0, 4 * 4096, NULL), 4);
+
+	// a slice in the middle of two iovs
+	assert_int_equal(ubbd_iov_slice(iov, 4, 4096 + 1024, 4096, NULL), 2);
+	assert_int_equal(ubbd_iov_slice(iov, 4, 4096 + 1024, 4096, dst), 2);
+	assert_ptr_equal(dst[0].iov_base, buf[1] + 1024);
+	assert_int_equal(dst[0].iov_len, 3072);
+	assert_ptr_equal(dst[1].iov_base, buf[2]);
+	assert_int_equal(dst[1].iov_len, 1024);
+
+	// a slice in one iov
+	assert_int_equal(ubbd_iov_slice(iov, 4, 3 * 4096 + 512, 512, dst), 1);
+	assert_ptr_equal(dst[0].iov_base, buf[3] + 512);
+	assert_int_equal(dst[0].iov_len, 512);
+}
+
+void test_iov_span(void **state)
+{
+	char buf[4][4096];
+	struct iovec iov[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = 4096;
+	}
+
+	assert_int_equal(ubbd_iov_span(iov, 4, 0, 4 * 4096, 2), 2 * 4096);
+	assert_int_equal(ubbd_iov_span(iov, 4, 1024, 4 * 4096, 2), 2 * 4096 - 1024);
+	assert_int_equal(ubbd_iov_span(iov, 4, 0, 4096 + 512, 2), 4096 + 512);
+	assert_int_equal(ubbd_iov_span(iov, 4, 3 * 4096, 4096, 2), 4096);
+	assert_int_equal(ubbd_iov_span(iov, 4, 0, 4 * 4096, 8), 4 * 4096);
+}
+
+void test_iov_aligned(void **state)
+{
+	char *buf;
+	struct iovec iov[2];
+
+	assert_int_equal(posix_memalign((void **)&buf, 4096, 3 * 4096), 0);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 4096;
+	iov[1].iov_base = buf + 4096;
+	iov[1].iov_len = 2 * 4096;
+	assert_true(ubbd_iov_aligned(iov, 2, TEST_SECTOR));
+	assert_true(ubbd_iov_aligned(iov, 2, 0));
+
+	iov[1].iov_base = buf + 4096 + 8;
+	iov[1].iov_len = 4096;
+	assert_false(ubbd_iov_aligned(iov, 2, TEST_SECTOR));
+	assert_true(ubbd_iov_aligned(iov, 2, 8));
+
+	iov[1].iov_base = buf + 4096;
+	iov[1].iov_len = 100;
+	assert_false(ubbd_iov_aligned(iov, 2, TEST_SECTOR));
+
+	free(buf);
+}
+
+void test_bounce_copy(void **state)
+{
+	char src[3][1000];
+	char dst[3][1000];
+	char bounce[1500];
+	struct iovec src_iov[3], dst_iov[3];
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		memset(src[i], 'a' + i, sizeof(src[i]));
+		memset(dst[i], 0, sizeof(dst[i]));
+		src_iov[i].iov_base = src[i];
+		src_iov[i].iov_len = sizeof(src[i]);
+		dst_iov[i].iov_base = dst[i];
+		dst_iov[i].iov_len = sizeof(dst[i]);
+	}
+
+	// write side: iov into bounce buffer
+	ubbd_iov_to_buf(src_iov, 3, 700, bounce, sizeof(bounce));
+	for (i = 0; i < 300; i++)
+		assert_int_equal(bounce[i], 'a');
+	for (i = 300; i < 1300; i++)
+		assert_int_equal(bounce[i], 'b');
+	for (i = 1300; i < 1500; i++)
+		assert_int_equal(bounce[i], 'c');
+
+	// read side: bounce buffer back to the same place
+	ubbd_buf_to_iov(bounce, sizeof(bounce), dst_iov, 3, 700);
+	for (i = 0; i < 700; i++)
+		assert_int_equal(dst[0][i], 0);
+	for (i = 700; i < 1000; i++)
+		assert_int_equal(dst[0][i], 'a');
+	assert_memory_equal(dst[1], src[1], sizeof(dst[1]));
+	for (i = 0; i < 200; i++)
+		assert_int_equal(dst[2][i], 'c');
+	for (i = 200; i < 1000; i++)
+		assert_int_equal(dst[2][i], 0);
+}
+
+void test_discard_align(void **state)
+{
+	struct ubbd_io_limits limits = { 0 };
+	uint64_t off;
+	uint32_t len;
+
+	// no granularity, untouched
+	off = 512;
+	len = 1024;
+	ubbd_discard_align(&limits, &off, &len);
+	assert_int_equal(off, 512);
+	assert_int_equal(len, 1024);
+
+	limits.discard_granularity = 4096;
+
+	// head and tail trimmed
+	off = 512;
+	len = 3 * 4096;
+	ubbd_discard_align(&limits, &off, &len);
+	assert_int_equal(off, 4096);
+	assert_int_equal(len, 2 * 4096);
+
+	// aligned
+	off = 4096;
+	len = 4096;
+	ubbd_discard_align(&limits, &off, &len);
+	assert_int_equal(off, 4096);
+	assert_int_equal(len, 4096);
+
+	// not a whole granule
+	off = 512;
+	len = 4096;
+	ubbd_discard_align(&limits, &off, &len);
+	assert_int_equal(len, 0);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_split_len),
+		cmocka_unit_test(test_split_cover),
+		cmocka_unit_test(test_iov_slice),
+		cmocka_unit_test(test_iov_span),
+		cmocka_unit_test(test_iov_aligned),
+		cmocka_unit_test(test_bounce_copy),
+		cmocka_unit_test(test_discard_align),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,97 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_stats.h"
+
+void test_lat_hist_index(void **state)
+{
+	uint64_t ns;
+	int index, last = 0;
+
+	// small values have their own buckets
+	for (ns = 0; ns < UBBD_LAT_HIST_SUB; ns++) {
+		assert_int_equal(ubbd_lat_hist_index(ns), ns);
+		assert_int_equal(ubbd_lat_hist_bucket_min(ns), ns);
+	}
+
+	// index is monotonic and value is in [min, next min)
+	for (ns = 1; ns < (1ULL << UBBD_LAT_HIST_MAX_SHIFT); ns += ns / 7 + 1) {
+		index = ubbd_lat_hist_index(ns);
+		assert_true(index >= last);
+		assert_true(index < UBBD_LAT_HIST_BUCKETS - 1);
+		assert_true(ubbd_lat_hist_bucket_min(index) <= ns);
+		assert_true(ubbd_lat_hist_bucket_min(index + 1) > ns);
+		last = index;
+	}
+
+	// huge values go to the last bucket
+	assert_int_equal(ubbd_lat_hist_index(1ULL << 40), UBBD_LAT_HIST_BUCKETS - 1);
+	assert_int_equal(ubbd_lat_hist_index(UINT64_MAX), UBBD_LAT_HIST_BUCKETS - 1);
+}
+
+static void assert_near(uint64_t value, uint64_t expected)
+{
+	// bucket is at most 12.5% wide
+	assert_true(value >= expected - expected / 8);
+	assert_true(value <= expected + expected / 8);
+}
+
+void test_lat_hist_percentile(void **state)
+{
+	struct ubbd_lat_hist *hist, snap;
+	struct ubbd_req_lat_stats stats;
+	uint64_t i;
+
+	hist = calloc(1, sizeof(*hist));
+	assert_non_null(hist);
+
+	ubbd_lat_hist_snapshot(hist, &snap);
+	assert_int_equal(snap.count, 0);
+	assert_int_equal(ubbd_lat_hist_percentile(&snap, 500), 0);
+
+	// 1us ... 10000us
+	for (i = 1; i <= 10000; i++)
+		ubbd_lat_hist_add(hist, i * 1000);
+
+	ubbd_lat_hist_to_stats(hist, &stats);
+	assert_int_equal(stats.reqs, 10000);
+	assert_int_equal(stats.total_ns, 10000ULL * 10001 / 2 * 1000);
+	assert_near(stats.p50, 5000 * 1000);
+	assert_near(stats.p99, 9900 * 1000);
+	assert_near(stats.p999, 9990 * 1000);
+
+	// one slow request in 1000 shows in p99.9 only
+	ubbd_lat_hist_reset(hist);
+	for (i = 0; i < 999; i++)
+		ubbd_lat_hist_add(hist, 2000);
+	ubbd_lat_hist_add(hist, 1000 * 1000 * 1000);
+
+	ubbd_lat_hist_to_stats(hist, &stats);
+	assert_int_equal(stats.reqs, 1000);
+	assert_near(stats.p50, 2000);
+	assert_near(stats.p99, 2000);
+	assert_near(stats.p999, 2000);
+
+	ubbd_lat_hist_add(hist, 1000 * 1000 * 1000);
+	ubbd_lat_hist_to_stats(hist, &stats);
+	assert_near(stats.p999, 1000 * 1000 * 1000);
+
+	free(hist);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_lat_hist_index),
+		cmocka_unit_test(test_lat_hist_percentile),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
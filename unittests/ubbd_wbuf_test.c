@@ -0,0 +1,349 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_wbuf.h"
+
+#define TEST_BS		4096
+#define TEST_LIMIT	(64 * TEST_BS)
+#define TEST_AGE_NS	(1000ULL * 1000 * 1000 * 1000)
+
+static char test_buf[16 * TEST_BS];
+static int test_done;
+static int test_done_ret;
+
+static void test_req_done(struct ubbd_wbuf_req *req, int ret)
+{
+	test_done++;
+	test_done_ret = ret;
+}
+
+static int wbuf_write(struct ubbd_wbuf *wb, struct ubbd_wbuf_req *req,
+		uint64_t off, uint32_t len, char c)
+{
+	static struct iovec iov;
+
+	memset(test_buf, c, len);
+	iov.iov_base = test_buf;
+	iov.iov_len = len;
+
+	memset(req, 0, sizeof(*req));
+	req->type = UBBD_WBUF_REQ_WRITE;
+	req->off = off;
+	req->len = len;
+	req->iov = &iov;
+	req->iov_cnt = 1;
+	req->done = test_req_done;
+
+	return ubbd_wbuf_write(wb, req);
+}
+
+static int wbuf_read(struct ubbd_wbuf *wb, uint64_t off, uint32_t len,
+		struct ubbd_wbuf_overlay **ov)
+{
+	struct iovec iov = { .iov_base = test_buf, .iov_len = len };
+
+	memset(test_buf, 0, len);
+	return ubbd_wbuf_read(wb, off, len, &iov, 1, ov);
+}
+
+static int count_extents(struct ubbd_wbuf *wb)
+{
+	struct ubbd_wbuf_extent *e;
+	int nr = 0;
+
+	list_for_each_entry(e, &wb->index, node)
+		nr++;
+
+	return nr;
+}
+
+void test_wbuf_overwrite(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req;
+	struct ubbd_wbuf_extent *e;
+	struct ubbd_wbuf_overlay *ov;
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+
+	assert_int_equal(wbuf_write(&wb, &req, 0, 4 * TEST_BS, 'a'), 0);
+	// in the middle, split into three
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS, TEST_BS, 'b'), 0);
+	assert_int_equal(count_extents(&wb), 3);
+	// over the tail of one and head of another
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS + 512, TEST_BS, 'c'), 0);
+	assert_int_equal(count_extents(&wb), 4);
+
+	assert_int_equal(wbuf_read(&wb, 0, 4 * TEST_BS, &ov), UBBD_WBUF_READ_HIT);
+	assert_int_equal(test_buf[TEST_BS - 1], 'a');
+	assert_int_equal(test_buf[TEST_BS], 'b');
+	assert_int_equal(test_buf[TEST_BS + 511], 'b');
+	assert_int_equal(test_buf[TEST_BS + 512], 'c');
+	assert_int_equal(test_buf[2 * TEST_BS + 511], 'c');
+	assert_int_equal(test_buf[2 * TEST_BS + 512], 'a');
+	assert_int_equal(test_buf[4 * TEST_BS - 1], 'a');
+
+	// extents stay sorted and never overlap
+	e = list_first_entry(&wb.index, struct ubbd_wbuf_extent, node);
+	assert_int_equal(e->off, 0);
+	assert_int_equal(e->len, TEST_BS);
+
+	// covering all of them
+	assert_int_equal(wbuf_write(&wb, &req, 0, 8 * TEST_BS, 'd'), 0);
+	assert_int_equal(count_extents(&wb), 1);
+	assert_int_equal(wb.dirty_bytes, 8 * TEST_BS);
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_read_partial(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req;
+	struct ubbd_wbuf_overlay *ov;
+	struct iovec iov = { .iov_base = test_buf, .iov_len = 4 * TEST_BS };
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+
+	assert_int_equal(wbuf_read(&wb, 0, TEST_BS, &ov), UBBD_WBUF_READ_MISS);
+
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS, TEST_BS, 'a'), 0);
+	assert_int_equal(wbuf_write(&wb, &req, 3 * TEST_BS, 512, 'b'), 0);
+
+	assert_int_equal(wbuf_read(&wb, 0, 4 * TEST_BS, &ov), UBBD_WBUF_READ_PARTIAL);
+	assert_non_null(ov);
+	assert_int_equal(ov->nr, 2);
+
+	// backend read fills all, then dirty pieces go over it
+	memset(test_buf, 'z', 4 * TEST_BS);
+	ubbd_wbuf_overlay_apply(ov, 0, &iov, 1);
+	free(ov);
+	assert_int_equal(test_buf[TEST_BS - 1], 'z');
+	assert_int_equal(test_buf[TEST_BS], 'a');
+	assert_int_equal(test_buf[2 * TEST_BS - 1], 'a');
+	assert_int_equal(test_buf[2 * TEST_BS], 'z');
+	assert_int_equal(test_buf[3 * TEST_BS + 511], 'b');
+	assert_int_equal(test_buf[3 * TEST_BS + 512], 'z');
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_destage(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req;
+	struct ubbd_wbuf_pass pass;
+	struct ubbd_wbuf_destage *d;
+	struct ubbd_wbuf_overlay *ov;
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+	assert_false(ubbd_wbuf_need_destage(&wb, 0));
+
+	// adjacent ones go in one io, the separate one in another
+	assert_int_equal(wbuf_write(&wb, &req, 0, TEST_BS, 'a'), 0);
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS, TEST_BS, 'b'), 0);
+	assert_int_equal(wbuf_write(&wb, &req, 10 * TEST_BS, TEST_BS, 'c'), 0);
+
+	// not old enough, not too much dirty
+	assert_false(ubbd_wbuf_need_destage(&wb, wb.dirty_since_ns));
+	assert_true(ubbd_wbuf_need_destage(&wb, wb.dirty_since_ns + TEST_AGE_NS));
+
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 2);
+	d = list_first_entry(&pass.destages, struct ubbd_wbuf_destage, node);
+	assert_int_equal(d->off, 0);
+	assert_int_equal(d->len, 2 * TEST_BS);
+	assert_int_equal(d->iov_cnt, 2);
+	assert_int_equal(wb.nr_dirty, 0);
+
+	// still readable while destaging
+	assert_int_equal(wbuf_read(&wb, 0, TEST_BS, &ov), UBBD_WBUF_READ_HIT);
+	assert_int_equal(test_buf[0], 'a');
+
+	// a write into destaging extent, kept after pass
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS + 512, 512, 'd'), 0);
+	assert_int_equal(wb.nr_dirty, 2);
+
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(count_extents(&wb), 2);
+	assert_int_equal(wbuf_read(&wb, TEST_BS + 512, 512, &ov), UBBD_WBUF_READ_HIT);
+	assert_int_equal(test_buf[0], 'd');
+	assert_int_equal(wbuf_read(&wb, 0, TEST_BS, &ov), UBBD_WBUF_READ_MISS);
+
+	// failed pass leaves data dirty
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, -EIO);
+	assert_int_equal(wb.nr_dirty, 2);
+
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(count_extents(&wb), 0);
+	assert_int_equal(wb.dirty_bytes, 0);
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_dirty_limit(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req[3];
+	struct ubbd_wbuf_pass pass;
+
+	assert_int_equal(ubbd_wbuf_init(&wb, 4 * TEST_BS, TEST_AGE_NS), 0);
+
+	// larger than limit, taken by empty buffer
+	assert_int_equal(wbuf_write(&wb, &req[0], 0, 8 * TEST_BS, 'a'), 0);
+	assert_true(ubbd_wbuf_need_destage(&wb, 0));
+
+	// waits, and the one behind it too even though it fits later
+	test_done = 0;
+	assert_int_equal(wbuf_write(&wb, &req[1], 16 * TEST_BS, TEST_BS, 'b'), 1);
+	assert_int_equal(wbuf_write(&wb, &req[2], 32 * TEST_BS, TEST_BS, 'c'), 1);
+
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	assert_int_equal(test_done, 0);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+
+	// admitted in order by next pass
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 2);
+	assert_int_equal(test_done, 2);
+	assert_int_equal(test_done_ret, 0);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_false(ubbd_wbuf_need_destage(&wb, 0));
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_flush(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req, flush_req = { .done = test_req_done };
+	struct ubbd_wbuf_pass pass;
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+
+	// nothing buffered
+	assert_int_equal(ubbd_wbuf_flush(&wb, &flush_req), 0);
+
+	assert_int_equal(wbuf_write(&wb, &req, 0, TEST_BS, 'a'), 0);
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+
+	test_done = 0;
+	assert_int_equal(ubbd_wbuf_flush(&wb, &flush_req), 1);
+	// written after flush over the destaging one, flush waits for it too
+	assert_int_equal(wbuf_write(&wb, &req, 0, 512, 'b'), 0);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(test_done, 0);
+
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(test_done, 1);
+	assert_int_equal(test_done_ret, 0);
+
+	// failed destage fails flush
+	assert_int_equal(wbuf_write(&wb, &req, 0, 512, 'c'), 0);
+	assert_int_equal(ubbd_wbuf_flush(&wb, &flush_req), 1);
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, -EIO);
+	assert_int_equal(test_done, 2);
+	assert_int_equal(test_done_ret, -EIO);
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_barrier(void **state)
+{
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req;
+	struct ubbd_wbuf_req barrier = { .type = UBBD_WBUF_REQ_BARRIER, .done = test_req_done };
+	struct ubbd_wbuf_pass pass;
+	struct ubbd_wbuf_overlay *ov;
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+
+	// dirty data under discard is dropped at once
+	assert_int_equal(wbuf_write(&wb, &req, 0, 4 * TEST_BS, 'a'), 0);
+	barrier.off = TEST_BS;
+	barrier.len = TEST_BS;
+	assert_int_equal(ubbd_wbuf_barrier(&wb, &barrier), 0);
+	assert_int_equal(count_extents(&wb), 2);
+	assert_int_equal(wbuf_read(&wb, TEST_BS, TEST_BS, &ov), UBBD_WBUF_READ_MISS);
+
+	// overlapping an io in flight, waits for the pass
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 2);
+	barrier.off = 3 * TEST_BS;
+	test_done = 0;
+	assert_int_equal(ubbd_wbuf_barrier(&wb, &barrier), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(test_done, 0);
+
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 0);
+	assert_int_equal(test_done, 1);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+
+	ubbd_wbuf_exit(&wb);
+}
+
+void test_wbuf_journal(void **state)
+{
+	char path[] = "/tmp/ubbd_wbuf_test_XXXXXX";
+	struct ubbd_wbuf wb;
+	struct ubbd_wbuf_req req;
+	struct ubbd_wbuf_req barrier = { .type = UBBD_WBUF_REQ_BARRIER, .done = test_req_done };
+	struct ubbd_wbuf_overlay *ov;
+	struct ubbd_wbuf_pass pass;
+	int fd;
+
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	close(fd);
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+	assert_int_equal(ubbd_wbuf_journal_open(&wb, path), 0);
+	assert_int_equal(wbuf_write(&wb, &req, 0, 2 * TEST_BS, 'a'), 0);
+	assert_int_equal(wbuf_write(&wb, &req, TEST_BS, TEST_BS, 'b'), 0);
+	barrier.off = 0;
+	barrier.len = 512;
+	assert_int_equal(ubbd_wbuf_barrier(&wb, &barrier), 0);
+
+	// stopped before anything destaged
+	ubbd_wbuf_exit(&wb);
+
+	assert_int_equal(ubbd_wbuf_init(&wb, TEST_LIMIT, TEST_AGE_NS), 0);
+	assert_int_equal(ubbd_wbuf_journal_open(&wb, path), 3);
+	assert_int_equal(wbuf_read(&wb, 0, 512, &ov), UBBD_WBUF_READ_MISS);
+	assert_int_equal(wbuf_read(&wb, 512, 2 * TEST_BS - 512, &ov), UBBD_WBUF_READ_HIT);
+	assert_int_equal(test_buf[0], 'a');
+	assert_int_equal(test_buf[TEST_BS - 512], 'b');
+	assert_int_equal(test_buf[2 * TEST_BS - 513], 'b');
+
+	// empty buffer empties journal
+	assert_int_equal(ubbd_wbuf_destage_prepare(&wb, &pass), 1);
+	ubbd_wbuf_destage_done(&wb, &pass, 0);
+	assert_int_equal(wb.journal_off, 0);
+	ubbd_wbuf_exit(&wb);
+
+	unlink(path);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_wbuf_overwrite),
+		cmocka_unit_test(test_wbuf_read_partial),
+		cmocka_unit_test(test_wbuf_destage),
+		cmocka_unit_test(test_wbuf_dirty_limit),
+		cmocka_unit_test(test_wbuf_flush),
+		cmocka_unit_test(test_wbuf_barrier),
+		cmocka_unit_test(test_wbuf_journal),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
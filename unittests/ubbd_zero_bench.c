@@ -0,0 +1,97 @@
+/*
+ * Benchmark for zero detection.
+ *
+ * Scan a buffer of zeros, the worst case as every byte is read, in
+ * blocks of 4KiB by each implementation supported by this cpu, and
+ * report the cost per GiB. A buffer with data in each block is scanned
+ * too, it shows the cost of non-zero writes, which stop at the first
+ * word.
+ *
+ * usage: ubbd_zero_bench [MiB]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ubbd_zero.h"
+
+#define BENCH_DEFAULT_MB	64
+#define BENCH_TOTAL_GB		8
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* return ns spent per GiB scanned */
+static double bench_scan(int impl, const char *buf, size_t size)
+{
+	uint64_t passes = ((uint64_t)BENCH_TOTAL_GB << 30) / size;
+	uint64_t start, i;
+	size_t off;
+	int zero = 0;
+
+	start = bench_ns();
+	for (i = 0; i < passes; i++) {
+		for (off = 0; off < size; off += UBBD_ZERO_BLOCK)
+			zero += ubbd_buf_is_zero_impl(impl, buf + off, UBBD_ZERO_BLOCK);
+	}
+
+	/* keep the scan from being optimized out */
+	if (zero == -1)
+		printf("\n");
+
+	return (double)(bench_ns() - start) / (passes * size) * (1 << 30);
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = (size_t)BENCH_DEFAULT_MB << 20;
+	char *zero_buf, *data_buf;
+	double ns;
+	size_t off;
+	int impl;
+
+	if (argc > 1)
+		size = (size_t)atoi(argv[1]) << 20;
+
+	if (!size) {
+		fprintf(stderr, "usage: %s [MiB]\n", argv[0]);
+		return 1;
+	}
+
+	if (posix_memalign((void **)&zero_buf, 4096, size) ||
+			posix_memalign((void **)&data_buf, 4096, size)) {
+		fprintf(stderr, "failed to alloc %lu bytes\n", size);
+		return 1;
+	}
+
+	memset(zero_buf, 0, size);
+	memset(data_buf, 0, size);
+	for (off = 0; off < size; off += UBBD_ZERO_BLOCK)
+		data_buf[off + 8] = 1;
+
+	printf("buffer: %lu MiB, block: %d\n", size >> 20, UBBD_ZERO_BLOCK);
+	for (impl = 0; impl < UBBD_ZERO_IMPL_MAX; impl++) {
+		if (!ubbd_zero_impl_supported(impl)) {
+			printf("%-8s not supported\n", ubbd_zero_impl_name(impl));
+			continue;
+		}
+
+		ns = bench_scan(impl, zero_buf, size);
+		printf("%-8s zero: %.0f us/GiB (%.1f GiB/s)", ubbd_zero_impl_name(impl),
+				ns / 1000, 1000000000 / ns);
+		ns = bench_scan(impl, data_buf, size);
+		printf(", data: %.0f us/GiB\n", ns / 1000);
+	}
+
+	free(zero_buf);
+	free(data_buf);
+
+	return 0;
+}
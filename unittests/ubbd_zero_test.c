@@ -0,0 +1,134 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_zero.h"
+
+#define TEST_BLOCK	4096
+#define TEST_BUF_SIZE	(4 * TEST_BLOCK)
+
+void test_buf_is_zero(void **state)
+{
+	char *buf;
+	int impl;
+	int off, len;
+
+	buf = calloc(1, TEST_BUF_SIZE + 64);
+	assert_non_null(buf);
+
+	for (impl = 0; impl < UBBD_ZERO_IMPL_MAX; impl++) {
+		if (!ubbd_zero_impl_supported(impl))
+			continue;
+
+		// unaligned head, tail and lengths shorter than a vector
+		for (off = 0; off < 64; off += 7) {
+			for (len = 0; len < 300; len += 13)
+				assert_true(ubbd_buf_is_zero_impl(impl, buf + off, len));
+			assert_true(ubbd_buf_is_zero_impl(impl, buf + off, TEST_BUF_SIZE));
+		}
+
+		// one byte set anywhere is found
+		for (off = 0; off < TEST_BUF_SIZE; off += 509) {
+			buf[off] = 1;
+			assert_false(ubbd_buf_is_zero_impl(impl, buf, TEST_BUF_SIZE));
+			assert_false(ubbd_buf_is_zero_impl(impl, buf + off, 1));
+			buf[off] = 0;
+		}
+
+		// last byte
+		buf[TEST_BUF_SIZE - 1] = 0x80;
+		assert_false(ubbd_buf_is_zero_impl(impl, buf + 3, TEST_BUF_SIZE - 3));
+		assert_true(ubbd_buf_is_zero_impl(impl, buf + 3, TEST_BUF_SIZE - 4));
+		buf[TEST_BUF_SIZE - 1] = 0;
+	}
+
+	assert_true(ubbd_buf_is_zero(buf, TEST_BUF_SIZE));
+	buf[100] = 1;
+	assert_false(ubbd_buf_is_zero(buf, TEST_BUF_SIZE));
+
+	free(buf);
+}
+
+void test_zero_span(void **state)
+{
+	struct iovec iov[3];
+	char *buf;
+	uint32_t span;
+	bool zero;
+
+	buf = calloc(1, TEST_BUF_SIZE);
+	assert_non_null(buf);
+
+	// all zero
+	iov[0].iov_base = buf;
+	iov[0].iov_len = TEST_BUF_SIZE;
+	span = ubbd_iov_zero_span(iov, 1, 0, TEST_BUF_SIZE, 0, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BUF_SIZE);
+	assert_true(zero);
+
+	// data in the 2nd block: zero, data, zero
+	buf[TEST_BLOCK + 10] = 1;
+	span = ubbd_iov_zero_span(iov, 1, 0, TEST_BUF_SIZE, 0, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BLOCK);
+	assert_true(zero);
+	span = ubbd_iov_zero_span(iov, 1, TEST_BLOCK, 3 * TEST_BLOCK, TEST_BLOCK, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BLOCK);
+	assert_false(zero);
+	span = ubbd_iov_zero_span(iov, 1, 2 * TEST_BLOCK, 2 * TEST_BLOCK, 2 * TEST_BLOCK, TEST_BLOCK, &zero);
+	assert_int_equal(span, 2 * TEST_BLOCK);
+	assert_true(zero);
+
+	// not block aligned in device, head and tail are data
+	span = ubbd_iov_zero_span(iov, 1, 2 * TEST_BLOCK, 2 * TEST_BLOCK, 512, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BLOCK - 512);
+	assert_false(zero);
+	span = ubbd_iov_zero_span(iov, 1, 2 * TEST_BLOCK + TEST_BLOCK - 512, TEST_BLOCK + 512,
+			TEST_BLOCK, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BLOCK);
+	assert_true(zero);
+
+	// shorter than a block
+	span = ubbd_iov_zero_span(iov, 1, 2 * TEST_BLOCK, 512, 0, TEST_BLOCK, &zero);
+	assert_int_equal(span, 512);
+	assert_false(zero);
+
+	// blocks crossing iovs
+	buf[TEST_BLOCK + 10] = 0;
+	buf[3 * TEST_BLOCK + 100] = 1;
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 1000;
+	iov[1].iov_base = buf + 1000;
+	iov[1].iov_len = 2 * TEST_BLOCK;
+	iov[2].iov_base = buf + 1000 + 2 * TEST_BLOCK;
+	iov[2].iov_len = TEST_BUF_SIZE - 1000 - 2 * TEST_BLOCK;
+	span = ubbd_iov_zero_span(iov, 3, 0, TEST_BUF_SIZE, 0, TEST_BLOCK, &zero);
+	assert_int_equal(span, 3 * TEST_BLOCK);
+	assert_true(zero);
+	span = ubbd_iov_zero_span(iov, 3, 3 * TEST_BLOCK, TEST_BLOCK, 3 * TEST_BLOCK, TEST_BLOCK, &zero);
+	assert_int_equal(span, TEST_BLOCK);
+	assert_false(zero);
+
+	// block larger than io, like s3 object
+	span = ubbd_iov_zero_span(iov, 3, 0, TEST_BUF_SIZE, 0, 2 * TEST_BUF_SIZE, &zero);
+	assert_int_equal(span, TEST_BUF_SIZE);
+	assert_false(zero);
+
+	free(buf);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_buf_is_zero),
+		cmocka_unit_test(test_zero_span),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
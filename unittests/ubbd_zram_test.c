@@ -0,0 +1,323 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<pthread.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ubbd_zram.h"
+
+#define TEST_PAGES	64
+#define TEST_SIZE	(TEST_PAGES * UBBD_ZRAM_PAGE_SIZE)
+#define TEST_THREADS	8
+
+/* run length of bytes, pairs of count and byte */
+static int test_compress(void *ctx, const void *src, void *dst, int dst_len)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	int i = 0, len = 0, n;
+
+	(*(int *)ctx)++;
+	while (i < UBBD_ZRAM_PAGE_SIZE) {
+		for (n = 1; n < 255 && i + n < UBBD_ZRAM_PAGE_SIZE && s[i + n] == s[i]; n++)
+			;
+		if (len + 2 > dst_len)
+			return 0;
+		d[len++] = n;
+		d[len++] = s[i];
+		i += n;
+	}
+
+	return len;
+}
+
+static int test_decompress(void *ctx, const void *src, int src_len, void *dst)
+{
+	const unsigned char *s = src;
+	unsigned char *d = dst;
+	int i, len = 0;
+
+	for (i = 0; i + 1 < src_len; i += 2) {
+		if (len + s[i] > UBBD_ZRAM_PAGE_SIZE)
+			return -EIO;
+		memset(d + len, s[i + 1], s[i]);
+		len += s[i];
+	}
+
+	return len == UBBD_ZRAM_PAGE_SIZE ? 0 : -EIO;
+}
+
+static const struct ubbd_zram_compressor test_comp = {
+	.compress = test_compress,
+	.decompress = test_decompress,
+};
+
+static int test_write(struct ubbd_zram *zram, uint64_t off, void *buf, uint32_t len, int *ctx)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return ubbd_zram_write(zram, off, len, &iov, 1, ctx);
+}
+
+static int test_read(struct ubbd_zram *zram, uint64_t off, void *buf, uint32_t len, int *ctx)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return ubbd_zram_read(zram, off, len, &iov, 1, ctx);
+}
+
+static void test_fill_random(char *buf, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+void test_zram_page_same(void **state)
+{
+	uint32_t page[UBBD_ZRAM_PAGE_SIZE / sizeof(uint32_t)];
+	uint32_t word;
+	int i;
+
+	memset(page, 0, sizeof(page));
+	assert_true(ubbd_zram_page_same(page, &word));
+	assert_int_equal(word, 0);
+
+	for (i = 0; i < UBBD_ZRAM_PAGE_SIZE / sizeof(uint32_t); i++)
+		page[i] = 0xdeadbeef;
+	assert_true(ubbd_zram_page_same(page, &word));
+	assert_int_equal(word, 0xdeadbeef);
+
+	// differs in the last byte
+	((char *)page)[UBBD_ZRAM_PAGE_SIZE - 1] = 0;
+	assert_false(ubbd_zram_page_same(page, &word));
+}
+
+void test_zram_rw(void **state)
+{
+	struct ubbd_zram_stats stats;
+	struct ubbd_zram zram;
+	char *buf, *out;
+	int ctx = 0;
+	int i;
+
+	buf = malloc(4 * UBBD_ZRAM_PAGE_SIZE);
+	out = malloc(4 * UBBD_ZRAM_PAGE_SIZE);
+	assert_non_null(buf);
+	assert_non_null(out);
+	assert_int_equal(ubbd_zram_init(&zram, TEST_SIZE, &test_comp), 0);
+
+	// nothing written reads zeros
+	memset(out, 0xff, UBBD_ZRAM_PAGE_SIZE);
+	assert_int_equal(test_read(&zram, 0, out, UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	for (i = 0; i < UBBD_ZRAM_PAGE_SIZE; i++)
+		assert_int_equal(out[i], 0);
+
+	// page 0 same filled, 1 compressed, 2 not compressible, 3 zeros
+	for (i = 0; i < UBBD_ZRAM_PAGE_SIZE / sizeof(uint32_t); i++)
+		((uint32_t *)buf)[i] = 0x01020304;
+	memset(buf + UBBD_ZRAM_PAGE_SIZE, 'a', UBBD_ZRAM_PAGE_SIZE / 2);
+	memset(buf + UBBD_ZRAM_PAGE_SIZE * 3 / 2, 'b', UBBD_ZRAM_PAGE_SIZE / 2);
+	test_fill_random(buf + 2 * UBBD_ZRAM_PAGE_SIZE, UBBD_ZRAM_PAGE_SIZE);
+	memset(buf + 3 * UBBD_ZRAM_PAGE_SIZE, 0, UBBD_ZRAM_PAGE_SIZE);
+	assert_int_equal(test_write(&zram, 0, buf, 4 * UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+
+	// same filled pages are not compressed
+	assert_int_equal(ctx, 2);
+
+	memset(out, 0, 4 * UBBD_ZRAM_PAGE_SIZE);
+	assert_int_equal(test_read(&zram, 0, out, 4 * UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	assert_memory_equal(out, buf, 4 * UBBD_ZRAM_PAGE_SIZE);
+
+	ubbd_zram_get_stats(&zram, &stats);
+	assert_int_equal(stats.same_pages, 2);
+	assert_int_equal(stats.compr_pages, 1);
+	assert_int_equal(stats.huge_pages, 1);
+	assert_int_equal(stats.orig_bytes, 4 * UBBD_ZRAM_PAGE_SIZE);
+	assert_int_equal(stats.compr_bytes, 2 * 18 + UBBD_ZRAM_PAGE_SIZE);
+	assert_int_equal(stats.mem_used, 2 * UBBD_ZPOOL_SLAB_SIZE);
+
+	// overwritten page is compressed again, not in huge class any more
+	memset(buf + 2 * UBBD_ZRAM_PAGE_SIZE, 'c', UBBD_ZRAM_PAGE_SIZE);
+	buf[2 * UBBD_ZRAM_PAGE_SIZE] = 'd';
+	assert_int_equal(test_write(&zram, 2 * UBBD_ZRAM_PAGE_SIZE,
+				buf + 2 * UBBD_ZRAM_PAGE_SIZE, UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	ubbd_zram_get_stats(&zram, &stats);
+	assert_int_equal(stats.compr_pages, 2);
+	assert_int_equal(stats.huge_pages, 0);
+	assert_int_equal(stats.mem_used, 2 * UBBD_ZPOOL_SLAB_SIZE);
+
+	assert_int_equal(test_read(&zram, 0, out, 4 * UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	assert_memory_equal(out, buf, 4 * UBBD_ZRAM_PAGE_SIZE);
+
+	ubbd_zram_exit(&zram);
+	free(buf);
+	free(out);
+}
+
+void test_zram_partial(void **state)
+{
+	struct ubbd_zram_stats stats;
+	struct ubbd_zram zram;
+	char *buf, *out;
+	int ctx = 0;
+
+	buf = calloc(3, UBBD_ZRAM_PAGE_SIZE);
+	out = malloc(3 * UBBD_ZRAM_PAGE_SIZE);
+	assert_non_null(buf);
+	assert_non_null(out);
+	assert_int_equal(ubbd_zram_init(&zram, TEST_SIZE, &test_comp), 0);
+
+	// crossing pages, not aligned to sector
+	memset(buf + 1000, 'x', 5000);
+	assert_int_equal(test_write(&zram, 1000, buf + 1000, 5000, &ctx), 0);
+	memset(buf + 8000, 'y', 100);
+	assert_int_equal(test_write(&zram, 8000, buf + 8000, 100, &ctx), 0);
+
+	assert_int_equal(test_read(&zram, 0, out, 3 * UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	assert_memory_equal(out, buf, 3 * UBBD_ZRAM_PAGE_SIZE);
+
+	// read of part of a page
+	assert_int_equal(test_read(&zram, 4090, out, 20, &ctx), 0);
+	assert_memory_equal(out, buf + 4090, 20);
+
+	// discard of whole page 1, and parts of page 0 and 2
+	assert_int_equal(ubbd_zram_discard(&zram, 2000, 7000, &ctx), 0);
+	memset(buf + 2000, 0, 7000);
+	assert_int_equal(test_read(&zram, 0, out, 3 * UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+	assert_memory_equal(out, buf, 3 * UBBD_ZRAM_PAGE_SIZE);
+
+	// page 2 is all zeros now
+	ubbd_zram_get_stats(&zram, &stats);
+	assert_int_equal(stats.compr_pages, 1);
+	assert_int_equal(stats.same_pages, 1);
+
+	// discard of everything drops all pages
+	assert_int_equal(ubbd_zram_discard(&zram, 0, TEST_SIZE, &ctx), 0);
+	ubbd_zram_get_stats(&zram, &stats);
+	assert_int_equal(stats.compr_pages + stats.same_pages + stats.huge_pages, 0);
+	assert_int_equal(stats.compr_bytes, 0);
+	assert_int_equal(stats.orig_bytes, 0);
+
+	ubbd_zram_exit(&zram);
+	free(buf);
+	free(out);
+}
+
+void test_zpool(void **state)
+{
+	struct ubbd_zpool pool;
+	void **chunks;
+	int i, nr;
+
+	assert_int_equal(ubbd_zpool_init(&pool), 0);
+
+	// fill more than one slab of the smallest class
+	nr = 3 * pool.classes[0].nr_chunks;
+	chunks = calloc(nr, sizeof(void *));
+	assert_non_null(chunks);
+	for (i = 0; i < nr; i++) {
+		chunks[i] = ubbd_zpool_alloc(&pool, 1);
+		assert_non_null(chunks[i]);
+		assert_int_equal((uintptr_t)chunks[i] % UBBD_ZPOOL_ALIGN, 0);
+		memset(chunks[i], i, UBBD_ZPOOL_ALIGN);
+	}
+	assert_int_equal(pool.nr_slabs, 3);
+
+	// chunks of other classes are not in these slabs
+	ubbd_zpool_free(&pool, chunks[0]);
+	chunks[0] = ubbd_zpool_alloc(&pool, UBBD_ZPOOL_ALIGN + 1);
+	assert_int_equal(pool.nr_slabs, 4);
+	ubbd_zpool_free(&pool, chunks[0]);
+
+	// freed chunk is used again
+	chunks[0] = ubbd_zpool_alloc(&pool, UBBD_ZPOOL_ALIGN);
+	assert_int_equal(pool.nr_slabs, 4);
+
+	// empty slabs are freed, one kept for each class
+	for (i = 0; i < nr; i++)
+		ubbd_zpool_free(&pool, chunks[i]);
+	assert_int_equal(pool.nr_slabs, 2);
+
+	ubbd_zpool_exit(&pool);
+	free(chunks);
+}
+
+struct test_thread_data {
+	struct ubbd_zram *zram;
+	int id;
+};
+
+/* each thread owns the bytes at its id in every page, writes race on pages */
+static void *test_rw_fn(void *arg)
+{
+	struct test_thread_data *data = arg;
+	uint64_t page, round;
+	char c, out;
+	int ctx = 0;
+
+	for (round = 0; round < 20; round++) {
+		for (page = 0; page < TEST_PAGES; page++) {
+			c = round + page;
+			assert_int_equal(test_write(data->zram, page * UBBD_ZRAM_PAGE_SIZE + data->id,
+						&c, 1, &ctx), 0);
+			assert_int_equal(test_read(data->zram, page * UBBD_ZRAM_PAGE_SIZE + data->id,
+						&out, 1, &ctx), 0);
+			assert_int_equal(out, c);
+		}
+	}
+
+	return NULL;
+}
+
+void test_zram_race(void **state)
+{
+	struct test_thread_data data[TEST_THREADS];
+	pthread_t threads[TEST_THREADS];
+	struct ubbd_zram zram;
+	char page[UBBD_ZRAM_PAGE_SIZE];
+	uint64_t i;
+	int ctx = 0;
+	int j;
+
+	assert_int_equal(ubbd_zram_init(&zram, TEST_SIZE, &test_comp), 0);
+
+	for (j = 0; j < TEST_THREADS; j++) {
+		data[j].zram = &zram;
+		data[j].id = j;
+		assert_int_equal(pthread_create(&threads[j], NULL, test_rw_fn, &data[j]), 0);
+	}
+
+	for (j = 0; j < TEST_THREADS; j++)
+		pthread_join(threads[j], NULL);
+
+	// no write lost in read-modify-write of pages
+	for (i = 0; i < TEST_PAGES; i++) {
+		assert_int_equal(test_read(&zram, i * UBBD_ZRAM_PAGE_SIZE, page,
+					UBBD_ZRAM_PAGE_SIZE, &ctx), 0);
+		for (j = 0; j < TEST_THREADS; j++)
+			assert_int_equal(page[j], (char)(19 + i));
+	}
+
+	ubbd_zram_exit(&zram);
+}
+
+int main(int argc, char **argv){
+
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_zram_page_same),
+		cmocka_unit_test(test_zram_rw),
+		cmocka_unit_test(test_zram_partial),
+		cmocka_unit_test(test_zpool),
+		cmocka_unit_test(test_zram_race),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}